@@ -0,0 +1,272 @@
+#ifndef FILTERSTATS_H
+#define FILTERSTATS_H           1
+
+/**@addtogroup Common
+ * @{@file
+ *
+ * This declares the layout of the statistics the filter DLL shares with the
+ * monitor and other readers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The filter has always reported what it's doing via OutputDebugString (),
+ * which is fine for diagnosing problems with DbgView but leaves the monitor
+ * with no idea of what's going on. So, the filter also publishes its figures
+ * in a small block of named shared memory, which anything that knows the
+ * Steam process ID can map and read as often as it likes without making any
+ * system calls after the first.
+ *
+ * The layout is fixed, using only types whose size is the same everywhere, and
+ * arranged so that the 64-bit fields are naturally aligned whatever the
+ * compiler's packing rules; it's versioned so that readers can check they
+ * understand it. Later versions may add to the end, but never move anything.
+ *
+ * The counters are only ever updated with single atomic increments, so they
+ * can be read directly. The meter and latency figures are several fields
+ * updated as one every so often, so they're guarded with a sequence lock; the
+ * writer makes the sequence number odd while it updates them, and a reader
+ * retries if it sees an odd number or the number changes under it. A reader
+ * only retries so many times before giving up, since a process which dies
+ * part way through an update leaves the number odd for good.
+ *
+ * Nothing here depends on Windows, so a reader can be built anywhere the block
+ * can be mapped, such as with shm_open () for testing.
+ */
+
+/**
+ * Name of the shared memory, formatted with the process ID of the process the
+ * filter is loaded into.
+ */
+
+#define FILTER_STATS_NAME       "SteamFilterStats.%lu"
+
+/**
+ * Value identifying the block, and the version of its layout.
+ */
+
+#define FILTER_STATS_MAGIC      0x53465453UL
+#define FILTER_STATS_VERSION    2
+
+/**
+ * Number of event counters, and of rules which get their own hit counter.
+ */
+
+#define FILTER_STATS_COUNTERS   16
+#define FILTER_STATS_RULES      64
+
+/**
+ * Number of hooks which can have their latency measured.
+ */
+
+#define FILTER_STATS_HOOKS      8
+
+/**
+ * The event counters.
+ */
+
+enum FilterStatsCounter {
+        STAT_CONNECTS,
+        STAT_CONNECT_REWRITES,
+        STAT_CONNECT_BLOCKS,
+        STAT_LOOKUPS,
+        STAT_LOOKUP_REWRITES,
+        STAT_LOOKUP_BLOCKS,
+        STAT_SYNTHETIC,
+        STAT_DATAGRAM_REWRITES,
+        STAT_DATAGRAM_BLOCKS
+};
+
+/**
+ * The hooks whose latency is measured.
+ */
+
+enum FilterStatsHook {
+        HOOK_CONNECT,
+        HOOK_SEND,
+        HOOK_WSASEND,
+        HOOK_RECV,
+        HOOK_WSARECV,
+        HOOK_SENDTO,
+        HOOK_WSASENDTO,
+
+        HOOK_COUNT
+};
+
+/**
+ * Most attempts a reader makes at a consistent read of the figures under the
+ * sequence lock; an update takes well under a microsecond, so this many only
+ * fail if the writer has gone.
+ */
+
+#define FILTER_STATS_RETRIES    10000
+
+/**
+ * Barrier for the sequence lock.
+ *
+ * On x86 stores aren't reordered with other stores or loads with other loads,
+ * so all that's needed is to stop the compiler moving things around.
+ */
+
+#if     defined (_MSC_VER)
+extern "C" void _ReadWriteBarrier (void);
+#pragma intrinsic (_ReadWriteBarrier)
+#define FILTER_STATS_BARRIER()  _ReadWriteBarrier ()
+#else
+#define FILTER_STATS_BARRIER()  __sync_synchronize ()
+#endif
+
+/**
+ * The meter figures; the rates are in bytes per second.
+ */
+
+struct FilterStatsMeter {
+        unsigned long long m_total;
+        unsigned int    m_rate1;
+        unsigned int    m_rate10;
+        unsigned int    m_rate60;
+        unsigned int    m_updated;
+};
+
+/**
+ * The latency figures for one hook, in nanoseconds.
+ *
+ * The time added by the filter is the time spent in the hook other than in
+ * the underlying function it calls; the call time is just that underlying
+ * function, for those invocations which called it.
+ */
+
+struct FilterStatsLatency {
+        unsigned int    m_calls;
+        unsigned int    m_addedP50;
+        unsigned int    m_addedP99;
+        unsigned int    m_addedMax;
+        unsigned int    m_callP50;
+        unsigned int    m_callP99;
+        unsigned int    m_callMax;
+        unsigned int    m_reserved;
+};
+
+/**
+ * The whole shared block.
+ */
+
+struct FilterStats {
+        unsigned int    m_magic;
+        unsigned int    m_version;
+        unsigned int    m_size;
+        unsigned int    m_rules;
+        volatile unsigned int m_sequence;
+        unsigned int    m_reserved;
+
+        FilterStatsMeter m_meter;
+
+        volatile unsigned int m_counters [FILTER_STATS_COUNTERS];
+        volatile unsigned int m_ruleHits [FILTER_STATS_RULES];
+
+        FilterStatsLatency m_latency [FILTER_STATS_HOOKS];
+};
+
+/**
+ * Check that a mapped block is one a reader understands.
+ *
+ * Since later versions only ever add to the end, a block from a later version
+ * is fine as long as it's at least as big as the reader expects.
+ */
+
+inline bool filterStatsValid (const volatile FilterStats * stats) {
+        return stats->m_magic == FILTER_STATS_MAGIC &&
+               stats->m_version >= FILTER_STATS_VERSION &&
+               stats->m_size >= sizeof (FilterStats);
+}
+
+/**
+ * Read the meter figures consistently, returning false if that couldn't be
+ * done.
+ */
+
+inline bool filterStatsMeter (const volatile FilterStats * stats,
+                              FilterStatsMeter & meter) {
+        for (unsigned int tries = 0 ; tries < FILTER_STATS_RETRIES ; ++ tries) {
+                unsigned int    sequence = stats->m_sequence;
+                FILTER_STATS_BARRIER ();
+
+                if ((sequence & 1) != 0)
+                        continue;
+
+                meter.m_total = stats->m_meter.m_total;
+                meter.m_rate1 = stats->m_meter.m_rate1;
+                meter.m_rate10 = stats->m_meter.m_rate10;
+                meter.m_rate60 = stats->m_meter.m_rate60;
+                meter.m_updated = stats->m_meter.m_updated;
+
+                FILTER_STATS_BARRIER ();
+                if (stats->m_sequence == sequence)
+                        return true;
+        }
+
+        return false;
+}
+
+/**
+ * Read the latency figures for a hook consistently, returning false if that
+ * couldn't be done.
+ */
+
+inline bool filterStatsLatency (const volatile FilterStats * stats,
+                                FilterStatsHook hook,
+                                FilterStatsLatency & latency) {
+        const volatile FilterStatsLatency * from = stats->m_latency + hook;
+
+        for (unsigned int tries = 0 ; tries < FILTER_STATS_RETRIES ; ++ tries) {
+                unsigned int    sequence = stats->m_sequence;
+                FILTER_STATS_BARRIER ();
+
+                if ((sequence & 1) != 0)
+                        continue;
+
+                latency.m_calls = from->m_calls;
+                latency.m_addedP50 = from->m_addedP50;
+                latency.m_addedP99 = from->m_addedP99;
+                latency.m_addedMax = from->m_addedMax;
+                latency.m_callP50 = from->m_callP50;
+                latency.m_callP99 = from->m_callP99;
+                latency.m_callMax = from->m_callMax;
+                latency.m_reserved = 0;
+
+                FILTER_STATS_BARRIER ();
+                if (stats->m_sequence == sequence)
+                        return true;
+        }
+
+        return false;
+}
+
+/**@}*/
+#endif  /* ! defined (FILTERSTATS_H) */
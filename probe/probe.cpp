@@ -513,6 +513,134 @@ int pings (wchar_t * host, wchar_t * other, HANDLE err) {
         return pingTime (host, err) <= pingTime (other, err) ? 0 : 1;
 }
 
+#include "../filterstats.h"
+
+/**
+ * Names for the filter's event counters and measured hooks, for printing.
+ */
+
+static  const char    * counterNames [] = {
+        "connects", "connects redirected", "connects blocked",
+        "lookups", "lookups rewritten", "lookups blocked",
+        "synthetic responses", "datagrams redirected", "datagrams blocked"
+};
+
+static  const char    * hookNames [HOOK_COUNT] = {
+        "connect", "send", "WSASend", "recv", "WSARecv", "sendto", "WSASendTo"
+};
+
+/**
+ * Write some text to an output handle.
+ */
+
+void show (HANDLE out, const char * text) {
+        unsigned long   written = 0;
+        WriteFile (out, text, strlen (text), & written, 0);
+}
+
+/**
+ * Print the statistics the filter publishes in the given process, or in the
+ * Steam client if no process ID is given.
+ *
+ * This reads the shared block just as the monitor does, so it can be used to
+ * check what the filter is doing without the monitor or DbgView.
+ */
+
+int stats (wchar_t * process, HANDLE out) {
+        unsigned long   processId = 0;
+        if (process != 0) {
+                wchar_t         ch;
+                while ((ch = * process ++) >= '0' && ch <= '9')
+                        processId = processId * 10 + ch - '0';
+        } else {
+                /*
+                 * Find the Steam client's main window the way the monitor
+                 * does, by its title and the prefix of its class name.
+                 */
+
+                HWND            steam = 0;
+                while ((steam = FindWindowExW (0, steam, 0, L"Steam")) != 0) {
+                        wchar_t         name [80];
+                        GetClassNameW (steam, name, ARRAY_LENGTH (name));
+                        if (wcsncmp (name, L"USurface", 8) == 0) {
+                                GetWindowThreadProcessId (steam, & processId);
+                                break;
+                        }
+                }
+        }
+
+        char            text [160];
+        wsprintfA (text, FILTER_STATS_NAME, processId);
+
+        HANDLE          mapping = OpenFileMappingA (FILE_MAP_READ, FALSE, text);
+        if (mapping == 0) {
+                show (out, "No filter statistics found\r\n");
+                return 1;
+        }
+
+        const volatile FilterStats * block;
+        block = (const volatile FilterStats *) MapViewOfFile (mapping,
+                                                              FILE_MAP_READ,
+                                                              0, 0, 0);
+        CloseHandle (mapping);
+        if (block == 0 || ! filterStatsValid (block)) {
+                if (block != 0)
+                        UnmapViewOfFile ((void *) block);
+
+                show (out, "Filter statistics not understood\r\n");
+                return 1;
+        }
+
+        FilterStatsMeter meter;
+        if (filterStatsMeter (block, meter)) {
+                wsprintfA (text, "received %lu KB, now %lu KB/s, "
+                           "%lu KB/s over 10s, %lu KB/s over 60s\r\n",
+                           (unsigned long) (meter.m_total / 1024),
+                           (unsigned long) meter.m_rate1 / 1024,
+                           (unsigned long) meter.m_rate10 / 1024,
+                           (unsigned long) meter.m_rate60 / 1024);
+                show (out, text);
+        }
+
+        unsigned long   i;
+        for (i = 0 ; i < ARRAY_LENGTH (counterNames) ; ++ i) {
+                wsprintfA (text, "%s: %lu\r\n", counterNames [i],
+                           (unsigned long) block->m_counters [i]);
+                show (out, text);
+        }
+
+        for (i = 0 ; i < block->m_rules && i < FILTER_STATS_RULES ; ++ i) {
+                unsigned long   hits = block->m_ruleHits [i];
+                if (hits == 0)
+                        continue;
+
+                wsprintfA (text, "rule %lu: %lu hits\r\n", i, hits);
+                show (out, text);
+        }
+
+        for (i = 0 ; i < HOOK_COUNT ; ++ i) {
+                FilterStatsHook hook = (FilterStatsHook) i;
+                FilterStatsLatency latency;
+                if (! filterStatsLatency (block, hook, latency) ||
+                    latency.m_calls == 0)
+                        continue;
+
+                wsprintfA (text, "%s: %lu calls, adds %lu/%lu/%lu ns, "
+                           "calls %lu/%lu/%lu ns (p50/p99/max)\r\n",
+                           hookNames [i], (unsigned long) latency.m_calls,
+                           (unsigned long) latency.m_addedP50,
+                           (unsigned long) latency.m_addedP99,
+                           (unsigned long) latency.m_addedMax,
+                           (unsigned long) latency.m_callP50,
+                           (unsigned long) latency.m_callP99,
+                           (unsigned long) latency.m_callMax);
+                show (out, text);
+        }
+
+        UnmapViewOfFile ((void *) block);
+        return 0;
+}
+
 /**
  * This is intended as a "naked" WinMain without the Visual C++ run-time
  * at all (not just avoiding the broken locale machinery).
@@ -535,6 +663,13 @@ int CALLBACK myWinMain (void) {
         wchar_t       * find = split (port);
         wchar_t       * extra = split (find);
 
+        /*
+         * Print the filter's statistics, as "probe stats [process-id]".
+         */
+
+        if (name != 0 && wcscmp (name, L"stats") == 0)
+                ExitProcess (stats (port, GetStdHandle (STD_OUTPUT_HANDLE)));
+
         if (port == 0)
                 return 2;
 
@@ -0,0 +1,267 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements a simple token bucket for pacing data transfer.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bucket.h"
+
+/**
+ * Simple default constructor; the bucket does nothing until configured.
+ */
+
+TokenBucket :: TokenBucket () : m_rate (0), m_burst (0), m_tokens (0),
+                m_last (0), m_carry (0) {
+}
+
+/**
+ * Set the rate in bytes per second, and the burst allowance in bytes.
+ *
+ * The bucket starts full, so a transfer can get going straight away.
+ */
+
+void TokenBucket :: configure (unsigned long rate, unsigned long burst,
+                               unsigned long now) {
+        if (burst == 0)
+                burst = 1;
+
+        m_rate = rate;
+        m_burst = burst;
+        m_tokens = (long) burst;
+        m_last = now;
+        m_carry = 0;
+}
+
+/**
+ * Add the tokens that have accumulated since the last call.
+ *
+ * The remainder of the division is carried over so that frequent calls don't
+ * steadily lose a little of the rate to rounding.
+ */
+
+void TokenBucket :: refill (unsigned long now) {
+        unsigned long   elapsed = now - m_last;
+        if (elapsed == 0)
+                return;
+
+        m_last = now;
+
+        unsigned long long fill = m_rate;
+        fill = fill * elapsed + m_carry;
+        m_carry = (unsigned long) (fill % 1000);
+        fill /= 1000;
+
+        long long       tokens = m_tokens + (long long) fill;
+        if (tokens >= (long long) m_burst) {
+                tokens = m_burst;
+                m_carry = 0;
+        }
+
+        m_tokens = (long) tokens;
+}
+
+/**
+ * Return how many bytes can be taken out now.
+ */
+
+unsigned long TokenBucket :: available (unsigned long now) {
+        if (m_rate == 0)
+                return ~ 0UL;
+
+        refill (now);
+        return m_tokens > 0 ? (unsigned long) m_tokens : 0;
+}
+
+/**
+ * Return how long to wait, in milliseconds, until the given number of bytes
+ * can be taken out.
+ *
+ * Asking for more than the burst allowance would mean waiting forever, so the
+ * need is capped at that.
+ */
+
+unsigned long TokenBucket :: wait (unsigned long now, unsigned long need) {
+        if (m_rate == 0)
+                return 0;
+
+        refill (now);
+
+        if (need > m_burst)
+                need = m_burst;
+        if (m_tokens >= (long) need)
+                return 0;
+
+        unsigned long long missing;
+        missing = (unsigned long long) ((long long) need - m_tokens);
+        missing = (missing * 1000 - m_carry + m_rate - 1) / m_rate;
+        return missing > 0 ? (unsigned long) missing : 1;
+}
+
+/**
+ * Take out the bytes actually transferred; this can put the bucket in debt.
+ */
+
+void TokenBucket :: consume (unsigned long bytes) {
+        if (m_rate == 0)
+                return;
+
+        long long       tokens = (long long) m_tokens - bytes;
+        if (tokens < - (long long) 0x40000000)
+                tokens = - (long long) 0x40000000;
+
+        m_tokens = (long) tokens;
+}
+
+/**
+ * Put back bytes which were taken out in advance but turned out not to be
+ * transferred, without going over the burst allowance.
+ */
+
+void TokenBucket :: refund (unsigned long bytes) {
+        if (m_rate == 0)
+                return;
+
+        long long       tokens = (long long) m_tokens + bytes;
+        if (tokens > (long long) m_burst)
+                tokens = m_burst;
+
+        m_tokens = (long) tokens;
+}
+
+/**
+ * Simple default constructor.
+ */
+
+FairShare :: FairShare () : m_virtual (0), m_last (0), m_epoch (1),
+                m_epochStart (0), m_active (0), m_touching (0) {
+}
+
+/**
+ * Bring the running total of credit up to date.
+ *
+ * The total is kept in thousandths of a byte, which is what the rate in bytes
+ * per second gives over a number of milliseconds, so there's little loss to
+ * rounding. When a new epoch starts, the weight of the connections seen in the
+ * last one becomes the weight the rate is divided by.
+ */
+
+void FairShare :: advance (unsigned long now, unsigned long rate) {
+        if (now - m_epochStart >= SHARE_EPOCH) {
+                m_active = now - m_epochStart >= 2 * SHARE_EPOCH ? 0 :
+                           m_touching;
+                m_touching = 0;
+                m_epochStart = now;
+                ++ m_epoch;
+        }
+
+        unsigned long   elapsed = now - m_last;
+        m_last = now;
+
+        unsigned long   weight = active ();
+        if (weight == 0)
+                weight = 1;
+
+        unsigned long long fill = rate;
+        m_virtual += fill * elapsed / weight;
+}
+
+/**
+ * Credit a connection with its share since it last asked, returning how much
+ * it may receive; the saved-up credit is limited to the given cap.
+ *
+ * A connection's first request is credited with a full cap, so that it can
+ * get going without waiting a round.
+ */
+
+unsigned long FairShare :: credit (ShareState & flow, unsigned long cap) {
+        if (flow.m_epoch != m_epoch) {
+                flow.m_epoch = m_epoch;
+                m_touching += flow.m_weight;
+        }
+
+        if (! flow.m_started) {
+                flow.m_started = true;
+                flow.m_seen = m_virtual;
+                flow.m_deficit = (long) cap;
+        }
+
+        unsigned long long gain = (m_virtual - flow.m_seen) * flow.m_weight;
+        flow.m_seen = m_virtual;
+        gain /= 1000;
+
+        long long       deficit = flow.m_deficit + (long long) gain;
+        if (deficit > (long long) cap)
+                deficit = cap;
+
+        flow.m_deficit = (long) deficit;
+        return deficit > 0 ? (unsigned long) deficit : 0;
+}
+
+/**
+ * Return how long a connection has to wait, in milliseconds, until it has
+ * been credited with the given amount.
+ */
+
+unsigned long FairShare :: wait (const ShareState & flow, unsigned long need,
+                                 unsigned long rate) const {
+        if (flow.m_deficit >= (long) need || rate == 0)
+                return 0;
+
+        unsigned long   weight = active ();
+        if (weight == 0)
+                weight = 1;
+
+        unsigned long long missing;
+        missing = (unsigned long long) ((long long) need - flow.m_deficit);
+        missing = (missing * 1000 * weight / flow.m_weight + rate - 1) / rate;
+        return missing > 0 ? (unsigned long) missing : 1;
+}
+
+/**
+ * Take what a connection actually received out of its credit.
+ */
+
+void FairShare :: consume (ShareState & flow, unsigned long bytes) {
+        long long       deficit = (long long) flow.m_deficit - bytes;
+        if (deficit < - (long long) 0x40000000)
+                deficit = - (long long) 0x40000000;
+
+        flow.m_deficit = (long) deficit;
+}
+
+/**
+ * Put back credit taken in advance that turned out not to be used.
+ */
+
+void FairShare :: refund (ShareState & flow, unsigned long bytes) {
+        flow.m_deficit = (long) ((long long) flow.m_deficit + bytes);
+}
+
+/**@}*/
@@ -0,0 +1,149 @@
+#ifndef BUCKET_H
+#define BUCKET_H                1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares a simple token bucket for pacing data transfer.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * A token bucket, for pacing received data to a given rate.
+ *
+ * Tokens accumulate at the configured rate up to a limit, which is the burst
+ * allowance; receiving data takes tokens out, and the bucket is allowed to go
+ * into debt since we only find out how much was received after the fact. A
+ * receive then waits until the debt is paid off and there's enough for the
+ * next read.
+ *
+ * This has no dependency on Windows at all; the caller passes in the time in
+ * milliseconds on every call rather than the bucket reading a clock, so the
+ * pacing can be exercised against a simulated clock. The caller also provides
+ * any locking that's needed.
+ */
+
+class TokenBucket {
+private:
+        unsigned long   m_rate;
+        unsigned long   m_burst;
+        long            m_tokens;
+        unsigned long   m_last;
+        unsigned long   m_carry;
+
+        void            refill (unsigned long now);
+
+public:
+                        TokenBucket ();
+
+        void            configure (unsigned long rate, unsigned long burst,
+                                   unsigned long now);
+
+        bool            active (void) const { return m_rate != 0; }
+        unsigned long   rate (void) const { return m_rate; }
+        unsigned long   burst (void) const { return m_burst; }
+
+        unsigned long   available (unsigned long now);
+        unsigned long   wait (unsigned long now, unsigned long need);
+        void            consume (unsigned long bytes);
+        void            refund (unsigned long bytes);
+};
+
+/**
+ * How long the set of connections sharing a rate is measured over, in
+ * milliseconds.
+ */
+
+#define SHARE_EPOCH             500
+
+/**
+ * The state of one connection's share of a rate.
+ */
+
+struct ShareState {
+        bool            m_started;
+        unsigned long   m_weight;
+        unsigned long   m_epoch;
+        unsigned long long m_seen;
+        long            m_deficit;
+
+                        ShareState () : m_started (false), m_weight (1),
+                                        m_epoch (0), m_seen (0),
+                                        m_deficit (0) {
+        }
+};
+
+/**
+ * Fair sharing of a rate between the connections receiving under it.
+ *
+ * A token bucket on its own hands out tokens to whichever connection asks
+ * first, so under a limit one connection can take most of the rate while the
+ * others starve. This is a form of deficit round-robin; each connection is
+ * credited with its weighted share of the rate as time passes, and may only
+ * receive as much as it has been credited with, so the bucket decides how
+ * much can be received overall and the shares decide who gets it.
+ *
+ * Rather than visiting each connection in turn, the credit is kept as a
+ * running total of what a connection of unit weight would have been credited
+ * with, which each connection catches up on when it next asks. The number of
+ * connections sharing is counted over an epoch, so a connection that has
+ * stopped receiving stops diluting the others' shares soon afterwards; the
+ * credit a connection can save up is limited, so one that has been idle can't
+ * then take more than its share.
+ *
+ * As for the bucket, there's no dependency on Windows, the time is passed in
+ * by the caller and so is any locking.
+ */
+
+class FairShare {
+private:
+        unsigned long long m_virtual;
+        unsigned long   m_last;
+        unsigned long   m_epoch;
+        unsigned long   m_epochStart;
+        unsigned long   m_active;
+        unsigned long   m_touching;
+
+public:
+                        FairShare ();
+
+        void            advance (unsigned long now, unsigned long rate);
+        unsigned long   credit (ShareState & flow, unsigned long cap);
+        unsigned long   wait (const ShareState & flow, unsigned long need,
+                              unsigned long rate) const;
+        void            consume (ShareState & flow, unsigned long bytes);
+        void            refund (ShareState & flow, unsigned long bytes);
+
+        unsigned long   active (void) const {
+                return m_active > m_touching ? m_active : m_touching;
+        }
+};
+
+/**@}*/
+#endif  /* ! defined (BUCKET_H) */
@@ -0,0 +1,199 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the redirection of datagram flows.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "datagram.h"
+
+/**
+ * The table and its lock; both are set up before the hooks are attached.
+ */
+
+static  FlowTable       l_flows;
+static  CRITICAL_SECTION l_lock;
+static  bool            l_ready;
+
+/**
+ * Whether anything has been kept since the table was last emptied, so that
+ * closing sockets which never sent a datagram doesn't mean going through the
+ * whole table.
+ */
+
+static  bool            l_used;
+
+/**
+ * Simple counter, for reporting.
+ */
+
+static  unsigned long   l_reversed;
+
+volatile LONG           g_datagramReversing;
+volatile LONG           g_datagramRules;
+
+/**
+ * Set up the lock around the table.
+ */
+
+void g_datagramInit (void) {
+        if (l_ready)
+                return;
+
+        InitializeCriticalSection (& l_lock);
+        l_ready = true;
+}
+
+/**
+ * Release the lock; the hooks must have been removed.
+ */
+
+void g_datagramUnload (void) {
+        if (! l_ready)
+                return;
+
+        l_ready = false;
+        g_datagramReversing = 0;
+        g_datagramRules = 0;
+        DeleteCriticalSection (& l_lock);
+}
+
+/**
+ * Forget every decision, since the rules they came from have changed, and note
+ * whether the new rules have any for datagrams at all.
+ */
+
+void g_datagramFlush (bool rules) {
+        if (! l_ready)
+                return;
+
+        EnterCriticalSection (& l_lock);
+        l_flows.flush ();
+        l_used = false;
+        g_datagramReversing = 0;
+        g_datagramRules = rules;
+        LeaveCriticalSection (& l_lock);
+}
+
+/**
+ * Look for the decision made for a flow.
+ */
+
+bool g_datagramFind (SOCKET handle, const sockaddr_in & to,
+                     FlowRoute & route) {
+        if (! l_ready)
+                return false;
+
+        EnterCriticalSection (& l_lock);
+        bool            found;
+        found = l_flows.lookup (handle, to.sin_addr.S_un.S_addr, to.sin_port,
+                                GetTickCount (), route);
+        LeaveCriticalSection (& l_lock);
+        return found;
+}
+
+/**
+ * Keep the decision made for a flow.
+ */
+
+void g_datagramStore (SOCKET handle, const sockaddr_in & to,
+                      const FlowRoute & route) {
+        if (! l_ready)
+                return;
+
+        EnterCriticalSection (& l_lock);
+        l_flows.store (handle, to.sin_addr.S_un.S_addr, to.sin_port, route,
+                       GetTickCount ());
+        l_used = true;
+        g_datagramReversing = l_flows.reversing ();
+        LeaveCriticalSection (& l_lock);
+}
+
+/**
+ * Put back the source of a datagram which came in on a redirected flow.
+ */
+
+void g_datagramReceived (SOCKET handle, sockaddr * from,
+                         const int * fromLength) {
+        if (from == 0 || fromLength == 0 || from->sa_family != AF_INET ||
+            * fromLength < (int) sizeof (sockaddr_in) || ! l_ready)
+                return;
+
+        sockaddr_in   * source = (sockaddr_in *) from;
+        unsigned long   addr = source->sin_addr.S_un.S_addr;
+        unsigned short  port = source->sin_port;
+
+        EnterCriticalSection (& l_lock);
+        bool            found;
+        found = l_flows.reverse (handle, addr, port, GetTickCount ());
+        if (found)
+                ++ l_reversed;
+        LeaveCriticalSection (& l_lock);
+
+        if (! found)
+                return;
+
+        source->sin_addr.S_un.S_addr = addr;
+        source->sin_port = port;
+}
+
+/**
+ * Forget the flows of a socket which is being closed.
+ */
+
+void g_datagramClose (SOCKET handle) {
+        if (! l_ready || ! l_used)
+                return;
+
+        EnterCriticalSection (& l_lock);
+        l_flows.close (handle);
+        g_datagramReversing = l_flows.reversing ();
+        LeaveCriticalSection (& l_lock);
+}
+
+/**
+ * Write the counters out for the benefit of DbgView.
+ */
+
+void g_datagramReport (void) {
+        if (! l_ready || ! l_used)
+                return;
+
+        char            show [120];
+        wsprintfA (show, "datagram: %lu hits, %lu misses, %lu evicted, "
+                   "%lu replies put back\r\n", l_flows.hits (),
+                   l_flows.misses (), l_flows.evictions (), l_reversed);
+        OutputDebugStringA (show);
+}
+
+/**@}*/
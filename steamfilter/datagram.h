@@ -0,0 +1,96 @@
+#ifndef DATAGRAM_H
+#define DATAGRAM_H              1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the redirection of datagram flows.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Rules which carry the "udp" option apply to datagrams rather than to
+ * connections; the send hooks apply them to the first datagram a socket sends
+ * to each destination, and a decision to drop or redirect the flow is kept in
+ * a flow table so the rest of the flow costs only a lookup. Flows the rules
+ * let pass aren't kept, since ordinary game and voice traffic would otherwise
+ * fill the table and push out the flows that matter; and when the rules have
+ * none for datagrams at all, the send hooks don't look at datagrams.
+ *
+ * Datagrams coming back on a redirected flow have their source put back to the
+ * destination the application sent to, so that applications which check where
+ * replies came from still accept them.
+ *
+ * Only receives which complete at once have their source put back; a receive
+ * which is still pending fills in the source when it completes, by which time
+ * we're no longer around to see it.
+ */
+
+#include <winsock2.h>
+
+#include "flowtable.h"
+
+/**
+ * Count of flows whose replies need their source put back, which the receive
+ * hooks check before looking for one.
+ */
+
+extern  volatile LONG   g_datagramReversing;
+
+inline  bool            g_anyDatagram (void) {
+        return g_datagramReversing != 0;
+}
+
+/**
+ * Nonzero when the rules have any which apply to datagrams, which the send
+ * hooks check before doing anything further.
+ */
+
+extern  volatile LONG   g_datagramRules;
+
+inline  bool            g_anyDatagramRule (void) {
+        return g_datagramRules != 0;
+}
+
+void            g_datagramInit (void);
+void            g_datagramUnload (void);
+void            g_datagramFlush (bool rules);
+
+bool            g_datagramFind (SOCKET handle, const sockaddr_in & to,
+                                FlowRoute & route);
+void            g_datagramStore (SOCKET handle, const sockaddr_in & to,
+                                 const FlowRoute & route);
+void            g_datagramReceived (SOCKET handle, sockaddr * from,
+                                    const int * fromLength);
+void            g_datagramClose (SOCKET handle);
+
+void            g_datagramReport (void);
+
+/**@}*/
+#endif  /* ! defined (DATAGRAM_H) */
@@ -0,0 +1,574 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the on-disk store for Steam depot chunks used by the "=$"
+ * URL rules.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The index is a fixed-size open-addressed hash table held in a file and
+ * mapped into memory, so that it survives restarts without any parsing and
+ * lookups cost nothing more than touching a page or two. Chunk IDs are SHA-1
+ * hashes and thus already uniformly distributed, so the first word of the ID
+ * serves directly as the hash.
+ *
+ * Only one Steam client runs at a time, so the index is only protected by a
+ * lock within this process.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+
+#include "depot.h"
+#include "document.h"
+#include "header.h"
+#include "pool.h"
+
+/**
+ * Cliche for measuring array lengths, to avoid mistakes with sizeof ().
+ */
+
+#define ARRAY_LENGTH(x) (sizeof (x) / sizeof (* (x)))
+
+/**
+ * Index file identification and size.
+ */
+
+#define DEPOT_MAGIC             0x31435044
+#define DEPOT_VERSION           1
+#define DEPOT_INDEX_SLOTS       65536
+
+/**
+ * Fixed header at the start of the index file.
+ */
+
+struct DepotHeader {
+        unsigned long   m_magic;
+        unsigned long   m_version;
+        unsigned long   m_capacity;
+        unsigned long   m_count;
+        ULONGLONG       m_bytes;
+        unsigned long   m_reserved [10];
+};
+
+/**
+ * States for index slots.
+ */
+
+enum {
+        SLOT_EMPTY,
+        SLOT_LIVE,
+        SLOT_DELETED
+};
+
+/**
+ * One index slot.
+ */
+
+struct DepotSlot {
+        unsigned char   m_id [20];
+        unsigned long   m_size;
+        unsigned long   m_used;
+        unsigned long   m_state;
+};
+
+/**
+ * The mapped index, the store's directory and the lock over both.
+ */
+
+CRITICAL_SECTION        l_lock [1];
+bool                    l_init;
+
+HANDLE                  l_indexFile = INVALID_HANDLE_VALUE;
+HANDLE                  l_indexMap;
+DepotHeader           * l_header;
+DepotSlot             * l_slots;
+
+wchar_t                 l_root [MAX_PATH];
+size_t                  l_rootLength;
+
+/**
+ * Serial number for naming partial chunk files.
+ */
+
+volatile LONG           l_serial;
+
+/**
+ * Decode a chunk ID into binary.
+ */
+
+static bool l_decode (const char * key, unsigned char * id) {
+        for (unsigned long i = 0 ; i < 20 ; ++ i) {
+                unsigned long   value = 0;
+                for (unsigned long j = 0 ; j < 2 ; ++ j) {
+                        char            ch = * key ++;
+                        value <<= 4;
+                        if (ch >= '0' && ch <= '9') {
+                                value += ch - '0';
+                        } else if (ch >= 'a' && ch <= 'f') {
+                                value += ch - 'a' + 10;
+                        } else
+                                return false;
+                }
+
+                id [i] = (unsigned char) value;
+        }
+
+        return true;
+}
+
+/**
+ * Form the path of a chunk in the store, optionally with a suffix.
+ */
+
+static bool l_path (wchar_t * path, const char * key, const wchar_t * suffix) {
+        size_t          suffixLength = suffix == 0 ? 0 : wcslen (suffix);
+        if (l_rootLength + 4 + DEPOT_KEY_LENGTH + suffixLength > MAX_PATH)
+                return false;
+
+        memcpy (path, l_root, l_rootLength * sizeof (wchar_t));
+        wchar_t       * dest = path + l_rootLength;
+        * dest ++ = '\\';
+        * dest ++ = key [0];
+        * dest ++ = key [1];
+        * dest ++ = '\\';
+
+        for (const char * scan = key ; * scan != 0 ; ++ scan)
+                * dest ++ = * scan;
+
+        if (suffixLength > 0) {
+                memcpy (dest, suffix, suffixLength * sizeof (wchar_t));
+                dest += suffixLength;
+        }
+
+        * dest = 0;
+        return true;
+}
+
+/**
+ * Format the chunk ID held in an index slot, for forming its path.
+ */
+
+static void l_encode (const unsigned char * id, char * key) {
+static  const char      digits [] = "0123456789abcdef";
+
+        for (unsigned long i = 0 ; i < 20 ; ++ i) {
+                * key ++ = digits [id [i] >> 4];
+                * key ++ = digits [id [i] & 15];
+        }
+
+        * key = 0;
+}
+
+/**
+ * Find the slot holding a chunk, or failing that where it would go; the
+ * caller holds the lock.
+ */
+
+static DepotSlot * l_find (const unsigned char * id, bool insert) {
+        unsigned long   capacity = l_header->m_capacity;
+        unsigned long   index = * (const unsigned long *) id % capacity;
+        DepotSlot     * free = 0;
+
+        for (unsigned long probe = 0 ; probe < capacity ; ++ probe) {
+                DepotSlot     * slot = l_slots + index;
+                if (slot->m_state == SLOT_EMPTY)
+                        return insert ? (free != 0 ? free : slot) : 0;
+
+                if (slot->m_state == SLOT_DELETED) {
+                        if (free == 0)
+                                free = slot;
+                } else if (memcmp (slot->m_id, id, sizeof (slot->m_id)) == 0)
+                        return slot;
+
+                if (++ index == capacity)
+                        index = 0;
+        }
+
+        return insert ? free : 0;
+}
+
+/**
+ * Drop a chunk from the index, and optionally its file; the caller holds the
+ * lock.
+ */
+
+static void l_remove (DepotSlot * slot, bool deleteFile) {
+        if (deleteFile) {
+                char            key [DEPOT_KEY_LENGTH];
+                wchar_t         path [MAX_PATH];
+                l_encode (slot->m_id, key);
+                if (l_path (path, key, 0))
+                        DeleteFileW (path);
+        }
+
+        slot->m_state = SLOT_DELETED;
+        l_header->m_bytes -= slot->m_size;
+        -- l_header->m_count;
+}
+
+/**
+ * Remove the least recently used chunks until there's room for a new one of
+ * the given size; the caller holds the lock.
+ *
+ * This is a linear scan of the index, but it only happens as chunks are added
+ * to a full store, which is dominated by the cost of the download anyway.
+ */
+
+static void l_evict (ULONGLONG limit, unsigned long size) {
+        unsigned long   now = g_currentSecond ();
+
+        while (l_header->m_count > 0 && l_header->m_bytes + size > limit) {
+                DepotSlot     * oldest = 0;
+                unsigned long   oldestAge = 0;
+
+                DepotSlot     * slot = l_slots;
+                DepotSlot     * end = slot + l_header->m_capacity;
+                for (; slot != end ; ++ slot) {
+                        if (slot->m_state != SLOT_LIVE)
+                                continue;
+
+                        unsigned long   age = now - slot->m_used;
+                        if (oldest == 0 || age > oldestAge) {
+                                oldest = slot;
+                                oldestAge = age;
+                        }
+                }
+
+                if (oldest == 0)
+                        break;
+
+                l_remove (oldest, true);
+        }
+}
+
+/**
+ * Release the index mapping.
+ */
+
+static void l_close (void) {
+        if (l_header != 0)
+                UnmapViewOfFile (l_header);
+        if (l_indexMap != 0)
+                CloseHandle (l_indexMap);
+        if (l_indexFile != INVALID_HANDLE_VALUE)
+                CloseHandle (l_indexFile);
+
+        l_header = 0;
+        l_slots = 0;
+        l_indexMap = 0;
+        l_indexFile = INVALID_HANDLE_VALUE;
+}
+
+/**
+ * Open the store under the given root directory, creating it if need be.
+ *
+ * If the index is missing or doesn't look like ours, it's started afresh; any
+ * chunk files it had described are orphaned but harmless.
+ */
+
+void g_depotInit (const wchar_t * rootDir) {
+        if (! l_init) {
+                InitializeCriticalSection (l_lock);
+                l_init = true;
+        }
+
+        if (rootDir == 0 || rootDir [0] == 0)
+                return;
+
+        EnterCriticalSection (l_lock);
+        l_close ();
+
+        size_t          length = wcslen (rootDir);
+        if (length + 48 + DEPOT_KEY_LENGTH > MAX_PATH) {
+                LeaveCriticalSection (l_lock);
+                return;
+        }
+
+        memcpy (l_root, rootDir, length * sizeof (wchar_t));
+        if (length > 0 && l_root [length - 1] != '\\')
+                l_root [length ++] = '\\';
+
+        memcpy (l_root + length, L"depot", 6 * sizeof (wchar_t));
+        l_rootLength = length + 5;
+        CreateDirectoryW (l_root, 0);
+
+        wchar_t         path [MAX_PATH];
+        memcpy (path, l_root, l_rootLength * sizeof (wchar_t));
+        memcpy (path + l_rootLength, L"\\index", 7 * sizeof (wchar_t));
+
+        unsigned long   size = sizeof (DepotHeader) +
+                               DEPOT_INDEX_SLOTS * sizeof (DepotSlot);
+
+        l_indexFile = CreateFileW (path, GENERIC_READ | GENERIC_WRITE,
+                                   FILE_SHARE_READ, 0, OPEN_ALWAYS,
+                                   FILE_ATTRIBUTE_NORMAL, 0);
+        if (l_indexFile != INVALID_HANDLE_VALUE)
+                l_indexMap = CreateFileMappingW (l_indexFile, 0, PAGE_READWRITE,
+                                                 0, size, 0);
+        if (l_indexMap != 0)
+                l_header = (DepotHeader *) MapViewOfFile (l_indexMap,
+                                                          FILE_MAP_WRITE,
+                                                          0, 0, size);
+        if (l_header == 0) {
+                OutputDebugStringA ("Depot store unavailable\r\n");
+                l_close ();
+                LeaveCriticalSection (l_lock);
+                return;
+        }
+
+        l_slots = (DepotSlot *) (l_header + 1);
+
+        if (l_header->m_magic != DEPOT_MAGIC ||
+            l_header->m_version != DEPOT_VERSION ||
+            l_header->m_capacity != DEPOT_INDEX_SLOTS) {
+                memset (l_header, 0, size);
+                l_header->m_magic = DEPOT_MAGIC;
+                l_header->m_version = DEPOT_VERSION;
+                l_header->m_capacity = DEPOT_INDEX_SLOTS;
+        }
+
+        LeaveCriticalSection (l_lock);
+}
+
+/**
+ * Close the store at unload time.
+ */
+
+void g_depotUnload (void) {
+        if (! l_init)
+                return;
+
+        EnterCriticalSection (l_lock);
+        if (l_header != 0)
+                FlushViewOfFile (l_header, 0);
+        l_close ();
+        LeaveCriticalSection (l_lock);
+
+        DeleteCriticalSection (l_lock);
+        l_init = false;
+}
+
+/**
+ * Extract the chunk ID from a depot URL, of the form .../chunk/<sha1>.
+ *
+ * The ID is returned in lowercase, as that's what the store files are named
+ * with.
+ */
+
+bool g_depotKey (const char * url, char * key) {
+        const char    * chunk = strstr (url, "/chunk/");
+        if (chunk == 0)
+                return false;
+
+        chunk += 7;
+        for (unsigned long i = 0 ; i < DEPOT_KEY_LENGTH - 1 ; ++ i) {
+                char            ch = chunk [i];
+                if (ch >= 'A' && ch <= 'F')
+                        ch += 32;
+
+                if ((ch < '0' || ch > '9') && (ch < 'a' || ch > 'f'))
+                        return false;
+
+                key [i] = ch;
+        }
+
+        char            end = chunk [DEPOT_KEY_LENGTH - 1];
+        if (end != 0 && end != '?' && end != ' ' && end != '/')
+                return false;
+
+        key [DEPOT_KEY_LENGTH - 1] = 0;
+        return true;
+}
+
+/**
+ * Look for a chunk in the store, returning it as a document to serve.
+ *
+ * The result holds a reference which the caller must release.
+ */
+
+Document * g_depotLookup (const char * key) {
+        unsigned char   id [20];
+        if (! l_init || ! l_decode (key, id))
+                return 0;
+
+        Document      * doc = 0;
+
+        EnterCriticalSection (l_lock);
+
+        DepotSlot     * slot = l_header == 0 ? 0 : l_find (id, false);
+        wchar_t         path [MAX_PATH];
+        if (slot != 0 && l_path (path, key, 0)) {
+                doc = g_mapDocument (path, "application/octet-stream");
+
+                /*
+                 * If the file has gone, or isn't what the index says it should
+                 * be, forget about it.
+                 */
+
+                if (doc != 0 && doc->m_bodyLength != slot->m_size) {
+                        g_documentRelease (doc);
+                        doc = 0;
+                }
+
+                if (doc == 0) {
+                        l_remove (slot, true);
+                } else
+                        slot->m_used = g_currentSecond ();
+        }
+
+        LeaveCriticalSection (l_lock);
+        return doc;
+}
+
+/**
+ * Start writing a chunk into the store.
+ */
+
+DepotFile * g_depotBegin (const char * key) {
+        if (! l_init || l_header == 0)
+                return 0;
+
+        DepotFile     * file = (DepotFile *) g_poolAlloc (sizeof (DepotFile));
+        if (file == 0)
+                return 0;
+
+        wchar_t         suffix [32];
+        wsprintfW (suffix, L".%lx.%lx.part", GetCurrentProcessId (),
+                   InterlockedIncrement (& l_serial));
+
+        if (! l_path (file->m_path, key, suffix)) {
+                g_poolFree (file);
+                return 0;
+        }
+
+        /*
+         * Make sure the shard directory exists; the separator after it is
+         * temporarily cut off to name it.
+         */
+
+        wchar_t       * split = file->m_path + l_rootLength + 3;
+        * split = 0;
+        CreateDirectoryW (file->m_path, 0);
+        * split = '\\';
+
+        file->m_handle = CreateFileW (file->m_path, GENERIC_WRITE, 0, 0,
+                                      CREATE_ALWAYS,
+                                      FILE_ATTRIBUTE_NORMAL |
+                                      FILE_FLAG_SEQUENTIAL_SCAN, 0);
+        if (file->m_handle == INVALID_HANDLE_VALUE) {
+                g_poolFree (file);
+                return 0;
+        }
+
+        return file;
+}
+
+/**
+ * Append part of a chunk being written.
+ */
+
+bool g_depotWrite (DepotFile * file, const char * buf, unsigned long length) {
+        unsigned long   written = 0;
+        return WriteFile (file->m_handle, buf, length, & written, 0) &&
+               written == length;
+}
+
+/**
+ * Discard a partially written chunk.
+ */
+
+void g_depotAbandon (DepotFile * file) {
+        if (file == 0)
+                return;
+
+        CloseHandle (file->m_handle);
+        DeleteFileW (file->m_path);
+        g_poolFree (file);
+}
+
+/**
+ * Move a completely written chunk into place and add it to the index.
+ *
+ * Since chunks are named by their content, if another download of the same
+ * chunk finished first then either copy is as good as the other.
+ */
+
+bool g_depotCommit (const char * key, DepotFile * file, unsigned long length,
+                    unsigned long limit) {
+        unsigned char   id [20];
+        wchar_t         path [MAX_PATH];
+        if (file == 0 || ! l_decode (key, id) || ! l_path (path, key, 0)) {
+                g_depotAbandon (file);
+                return false;
+        }
+
+        CloseHandle (file->m_handle);
+        file->m_handle = INVALID_HANDLE_VALUE;
+
+        bool            result = false;
+
+        EnterCriticalSection (l_lock);
+
+        if (l_header != 0) {
+                DepotSlot     * slot = l_find (id, false);
+                if (slot != 0)
+                        l_remove (slot, false);
+
+                l_evict ((ULONGLONG) limit * 1024 * 1024, length);
+
+                slot = l_find (id, true);
+                if (slot != 0 && MoveFileExW (file->m_path, path,
+                                              MOVEFILE_REPLACE_EXISTING)) {
+                        memcpy (slot->m_id, id, sizeof (slot->m_id));
+                        slot->m_size = length;
+                        slot->m_used = g_currentSecond ();
+                        slot->m_state = SLOT_LIVE;
+
+                        l_header->m_bytes += length;
+                        ++ l_header->m_count;
+                        result = true;
+                }
+        }
+
+        LeaveCriticalSection (l_lock);
+
+        if (! result)
+                DeleteFileW (file->m_path);
+
+        g_poolFree (file);
+
+        if (result)
+                OutputDebugStringA ("Stored depot chunk\r\n");
+
+        return result;
+}
+
+/**@}*/
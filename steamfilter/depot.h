@@ -0,0 +1,101 @@
+#ifndef DEPOT_H
+#define DEPOT_H                 1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the on-disk store for Steam depot chunks.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <winsock2.h>
+
+/**
+ * Steam depot content is fetched as chunks named by their SHA-1, and since a
+ * chunk's name is derived from its content it never changes. A URL rule of
+ * the form "=$" (optionally "=$size", with the size limit in megabytes) keeps
+ * downloaded chunks in a store under the install directory, so that once one
+ * Steam client on a machine has fetched a chunk, later downloads of it are
+ * served from disk.
+ *
+ * The store is a set of directories sharded on the first byte of the chunk ID,
+ * with a fixed-size index file mapped into memory to track what's held, how
+ * big it is and when it was last used; when the store grows past its limit,
+ * the least recently used chunks are removed.
+ */
+
+struct Document;
+
+/**
+ * A chunk being written into the store.
+ *
+ * Chunks are written under a temporary name which is unique to the download,
+ * and only renamed into place once complete, so a partial chunk can never be
+ * served and two concurrent downloads of the same chunk don't collide.
+ */
+
+struct DepotFile {
+        HANDLE          m_handle;
+        wchar_t         m_path [MAX_PATH];
+};
+
+/**
+ * Length of a chunk ID in hex digits, plus a terminator.
+ */
+
+#define DEPOT_KEY_LENGTH        41
+
+/**
+ * Largest chunk body we'll store; real chunks are at most a megabyte or so,
+ * and anything much bigger than that isn't what we think it is.
+ */
+
+#define DEPOT_CHUNK_MAX         (16 * 1024 * 1024)
+
+/**
+ * Default limit on the store size, in megabytes.
+ */
+
+#define DEPOT_DEFAULT_LIMIT     2048
+
+void            g_depotInit (const wchar_t * rootDir);
+void            g_depotUnload (void);
+
+bool            g_depotKey (const char * url, char * key);
+Document      * g_depotLookup (const char * key);
+
+DepotFile     * g_depotBegin (const char * key);
+bool            g_depotWrite (DepotFile * file, const char * buf,
+                              unsigned long length);
+bool            g_depotCommit (const char * key, DepotFile * file,
+                               unsigned long length, unsigned long limit);
+void            g_depotAbandon (DepotFile * file);
+
+/**@}*/
+#endif  /* ! defined (DEPOT_H) */
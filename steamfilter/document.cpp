@@ -0,0 +1,793 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the cache of prepared replacement documents, and the store
+ * which loads them from the registry.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Replacement documents used to be read from the registry, converted to UTF-8
+ * and wrapped in a freshly formatted set of HTTP headers each time a rule for
+ * them fired. Since the documents only change when someone edits them, it's
+ * much cheaper to do all that once and keep the result; serving a document is
+ * then just a matter of taking a reference to it.
+ *
+ * The cache itself is deliberately simple; there are only ever a handful of
+ * replacement documents in a rule set, so a short list searched under a lock
+ * is plenty. What matters is that the lock is only taken when a replacement
+ * rule actually fires, which is rare compared to the traffic going past.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "document.h"
+#include "header.h"
+#include "pool.h"
+
+/**
+ * Cliche for measuring array lengths, to avoid mistakes with sizeof ().
+ */
+
+#define ARRAY_LENGTH(x) (sizeof (x) / sizeof (* (x)))
+
+/**
+ * Limit on how many documents the cache will hold; beyond this, documents are
+ * still built on demand but not kept.
+ */
+
+#define DOCUMENT_CACHE_MAX      32
+
+/**
+ * How often, in milliseconds, to poll the registry change notification.
+ */
+
+#define STORE_POLL_INTERVAL     1000
+
+/**
+ * Largest file we're prepared to map as a document, 64Mb.
+ */
+
+#define FILE_DOCUMENT_MAX       (64 * 1024 * 1024)
+
+/**
+ * Entry in the document cache.
+ *
+ * Named documents from the store have a status of 0; documents generated from
+ * a '#' status rule are keyed by the status code and the rule's text.
+ */
+
+struct CacheEntry {
+        CacheEntry    * m_next;
+        int             m_status;
+        Document      * m_doc;
+        char            m_key [1];
+};
+
+/**
+ * Lock for the document cache and the current store.
+ */
+
+static  CRITICAL_SECTION l_cacheLock [1];
+static  bool            l_cacheInit;
+
+/**
+ * The cache contents.
+ */
+
+static  CacheEntry    * l_cache;
+static  unsigned long   l_cacheCount;
+
+/**
+ * Where named documents come from.
+ */
+
+static  DocumentStore * l_store;
+static  DocumentStore * l_files;
+
+/**
+ * Append the headers for a document, returning the length of the status line.
+ */
+
+static unsigned long l_buildHead (HeaderBuilder & build, int status,
+                                  const char * statusText, unsigned long length,
+                                  const char * location, const char * type) {
+        build.appendStatus (status, statusText);
+        unsigned long   split = build.length ();
+
+        build.append ("Content-Type: ");
+        build.append (type != 0 ? type : "text/html; charset=UTF8");
+        build.append ("\r\nContent-Length: ");
+        build.appendDecimal (length);
+        build.append ("\r\nConnection: Keep-Alive\r\n");
+
+        if (location != 0) {
+                unsigned long   size = strlen (location);
+                build.append ("Location: ");
+                build.append (location, size < 480 ? size : 480);
+                build.append ("\r\n");
+        }
+
+        build.append ("\r\n");
+        return split;
+}
+
+/**
+ * Allocate a document with room for its headers and the given amount of body
+ * space following them, for the caller to fill in.
+ */
+
+Document * g_newDocument (unsigned long headLength, unsigned long split,
+                          unsigned long bodyLength, unsigned long bodySpace) {
+        unsigned long   size = sizeof (Document) + headLength + bodySpace;
+
+        Document      * doc = (Document *) g_poolAlloc (size);
+        if (doc == 0)
+                return 0;
+
+        unsigned char * head = (unsigned char *) (doc + 1);
+
+        doc->m_refs = 1;
+        doc->m_head = head;
+        doc->m_headLength = headLength;
+        doc->m_split = split;
+        doc->m_body = head + headLength;
+        doc->m_bodyLength = bodyLength;
+        doc->m_view = 0;
+
+        return doc;
+}
+
+/**
+ * Allocate a document and build its headers, leaving room after them for the
+ * body if the caller wants it held inline.
+ *
+ * The status line and the fixed headers are measured first, noting where the
+ * status line ends since that's where the per-response Date header will be
+ * spliced in, so they can be built straight into the block holding the
+ * document.
+ */
+
+static Document * l_allocDocument (int status, const char * statusText,
+                                   const char * location, const char * type,
+                                   unsigned long bodyLength,
+                                   unsigned long bodySpace) {
+        HeaderBuilder   measure;
+        unsigned long   split = l_buildHead (measure, status, statusText,
+                                             bodyLength, location, type);
+
+        Document      * doc;
+        doc = g_newDocument (measure.length (), split, bodyLength, bodySpace);
+        if (doc == 0)
+                return 0;
+
+        HeaderBuilder   build ((char *) doc->m_head);
+        l_buildHead (build, status, statusText, bodyLength, location, type);
+        return doc;
+}
+
+/**
+ * Build a serialized document for a status code and optional body.
+ *
+ * The body either comes from a wide-character string (as for documents held in
+ * the registry) or from the text of a '#' rule, where '~' is used as an escape
+ * for a newline.
+ */
+
+Document * g_makeDocument (int status, const char * extraText,
+                           const wchar_t * replacement) {
+        /*
+         * Compute the space required to hold a UTF-8 version of the input, and
+         * any template-type substitution needed (not that we support that as
+         * yet).
+         */
+
+        int             utf8 = 0;
+        if (replacement != 0) {
+                utf8 = WideCharToMultiByte (CP_UTF8, 0, replacement, - 1, 0, 0, 0, 0);
+                if (utf8 == 0)
+                        return 0;
+
+                -- utf8;
+        }
+
+        const char    * location = 0;
+        const char    * statusText = extraText;
+        switch (status) {
+        case 200:
+                if (replacement == 0 && extraText != 0)
+                        utf8 = strlen (extraText);
+                break;
+
+        case 302:
+                if (extraText == 0)
+                        return 0;
+
+                location = extraText;
+                break;
+
+        default:
+                break;
+        }
+
+        Document      * doc = l_allocDocument (status, statusText, location,
+                                               0, utf8, utf8 + 1);
+        if (doc == 0)
+                return 0;
+
+        unsigned char * body = (unsigned char *) doc->m_body;
+
+        if (replacement != 0) {
+                utf8 = WideCharToMultiByte (CP_UTF8, 0, replacement, - 1,
+                                            (LPSTR) body, utf8 + 1, 0, 0);
+                if (utf8 == 0) {
+                        g_poolFree (doc);
+                        return 0;
+                }
+        } else if (utf8 > 0) {
+                /*
+                 * An alternative way to supply content via a #200 rule. In
+                 * this mode, we use ~ as an escape for '\n';
+                 */
+
+                unsigned char * dest = body;
+                unsigned long   count = utf8;
+                while (count > 0) {
+                        unsigned char   ch = * extraText;
+                        ++ extraText;
+
+                        if (ch == '~')
+                                ch = '\n';
+
+                        * dest = ch;
+
+                        ++ dest;
+                        -- count;
+                }
+        }
+
+        return doc;
+}
+
+/**
+ * Build a document whose body is a read-only mapping of a file.
+ *
+ * The file and mapping handles can be closed as soon as the view exists, since
+ * the view keeps the section alive; the view itself is released along with
+ * the last reference to the document. The file is opened with full sharing so
+ * that it can still be replaced while being served, although what's already
+ * mapped is what gets sent.
+ *
+ * The content type defaults to HTML, as for the other replacement documents.
+ */
+
+Document * g_mapDocument (const wchar_t * path, const char * type) {
+        HANDLE          file;
+        file = CreateFileW (path, GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE |
+                            FILE_SHARE_DELETE, 0, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, 0);
+        if (file == INVALID_HANDLE_VALUE) {
+                OutputDebugStringA ("HTTP replacement file not found\r\n");
+                return 0;
+        }
+
+        /*
+         * Anything big enough to need the high part of the size is not
+         * something we want to be serving; it'd not fit in our address space.
+         */
+
+        unsigned long   high = 0;
+        unsigned long   length = GetFileSize (file, & high);
+        if (length == INVALID_FILE_SIZE || high != 0 ||
+            length > FILE_DOCUMENT_MAX) {
+                CloseHandle (file);
+                return 0;
+        }
+
+        /*
+         * An empty file can't be mapped, but it's a perfectly good document.
+         */
+
+        const void    * view = 0;
+        if (length > 0) {
+                HANDLE          mapping;
+                mapping = CreateFileMappingW (file, 0, PAGE_READONLY, 0, 0, 0);
+                if (mapping != 0) {
+                        view = MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+                        CloseHandle (mapping);
+                }
+        }
+
+        CloseHandle (file);
+        if (length > 0 && view == 0)
+                return 0;
+
+        Document      * doc = l_allocDocument (200, 0, 0, type, length, 0);
+        if (doc == 0) {
+                if (view != 0)
+                        UnmapViewOfFile (view);
+                return 0;
+        }
+
+        doc->m_body = (const unsigned char *) view;
+        doc->m_view = view;
+        return doc;
+}
+
+/**
+ * Take an additional reference to a document.
+ */
+
+void g_documentAddRef (Document * doc) {
+        InterlockedIncrement (& doc->m_refs);
+}
+
+/**
+ * Release a reference to a document, freeing it with the last one.
+ */
+
+void g_documentRelease (Document * doc) {
+        if (doc == 0 || InterlockedDecrement (& doc->m_refs) > 0)
+                return;
+
+        if (doc->m_view != 0)
+                UnmapViewOfFile (doc->m_view);
+
+        g_poolFree (doc);
+}
+
+/**
+ * Discard everything in the cache; the caller holds the lock.
+ *
+ * Documents still being served keep their own references, so this only drops
+ * the cache's hold on them.
+ */
+
+static void l_flush (void) {
+        CacheEntry    * scan = l_cache;
+        l_cache = 0;
+        l_cacheCount = 0;
+
+        while (scan != 0) {
+                CacheEntry    * next = scan->m_next;
+                g_documentRelease (scan->m_doc);
+                g_poolFree (scan);
+                scan = next;
+        }
+}
+
+/**
+ * Look for a cached document; the caller holds the lock.
+ */
+
+static Document * l_lookup (int status, const char * key) {
+        bool            changed = false;
+        if (l_store != 0 && l_store->changed ())
+                changed = true;
+        if (l_files != 0 && l_files->changed ())
+                changed = true;
+
+        if (changed) {
+                OutputDebugStringA ("Replacement documents changed\r\n");
+                l_flush ();
+        }
+
+        CacheEntry    * scan = l_cache;
+        for (; scan != 0 ; scan = scan->m_next) {
+                if (scan->m_status != status || strcmp (scan->m_key, key) != 0)
+                        continue;
+
+                g_documentAddRef (scan->m_doc);
+                return scan->m_doc;
+        }
+
+        return 0;
+}
+
+/**
+ * Add a newly built document to the cache, if there is room; the caller holds
+ * the lock.
+ */
+
+static void l_insert (int status, const char * key, Document * doc) {
+        if (l_cacheCount >= DOCUMENT_CACHE_MAX)
+                return;
+
+        size_t          length = strlen (key);
+        CacheEntry    * entry;
+        entry = (CacheEntry *) g_poolAlloc (sizeof (CacheEntry) + length);
+        if (entry == 0)
+                return;
+
+        memcpy (entry->m_key, key, length + 1);
+        entry->m_status = status;
+        entry->m_doc = doc;
+        g_documentAddRef (doc);
+
+        entry->m_next = l_cache;
+        l_cache = entry;
+        ++ l_cacheCount;
+}
+
+/**
+ * Set up the store that named documents are loaded from, replacing (and
+ * deleting) any previous one.
+ */
+
+static void l_replaceStore (DocumentStore * & slot, DocumentStore * store) {
+        if (! l_cacheInit) {
+                InitializeCriticalSection (l_cacheLock);
+                l_cacheInit = true;
+        }
+
+        EnterCriticalSection (l_cacheLock);
+
+        DocumentStore * old = slot;
+        slot = store;
+        l_flush ();
+
+        LeaveCriticalSection (l_cacheLock);
+
+        delete old;
+}
+
+void g_setDocumentStore (DocumentStore * store) {
+        l_replaceStore (l_store, store);
+}
+
+/**
+ * Set up the store that documents named with the file prefix are loaded from.
+ */
+
+void g_setFileStore (DocumentStore * store) {
+        l_replaceStore (l_files, store);
+}
+
+/**
+ * Find a named document, loading it from the store on first use.
+ *
+ * The result holds a reference which the caller must release.
+ */
+
+Document * g_findDocument (const char * name) {
+        if (! l_cacheInit || name == 0)
+                return 0;
+
+        EnterCriticalSection (l_cacheLock);
+
+        DocumentStore * store = l_store;
+        const char    * local = name;
+        size_t          prefix = strlen (FILE_DOCUMENT_PREFIX);
+        if (strncmp (name, FILE_DOCUMENT_PREFIX, prefix) == 0) {
+                store = l_files;
+                local = name + prefix;
+        }
+
+        Document      * doc = l_lookup (0, name);
+        if (doc == 0 && store != 0) {
+                doc = store->load (local);
+                if (doc != 0)
+                        l_insert (0, name, doc);
+        }
+
+        LeaveCriticalSection (l_cacheLock);
+        return doc;
+}
+
+/**
+ * Find the document for a status rule, building it on first use.
+ *
+ * The result holds a reference which the caller must release.
+ */
+
+Document * g_findDocument (int status, const char * extraText) {
+        if (! l_cacheInit)
+                return g_makeDocument (status, extraText, 0);
+
+        const char    * key = extraText == 0 ? "" : extraText;
+
+        EnterCriticalSection (l_cacheLock);
+
+        Document      * doc = l_lookup (status, key);
+        if (doc == 0) {
+                doc = g_makeDocument (status, extraText, 0);
+                if (doc != 0)
+                        l_insert (status, key, doc);
+        }
+
+        LeaveCriticalSection (l_cacheLock);
+        return doc;
+}
+
+/**
+ * Discard all the cached documents, such as when the rules change.
+ */
+
+void g_flushDocuments (void) {
+        if (! l_cacheInit)
+                return;
+
+        EnterCriticalSection (l_cacheLock);
+        l_flush ();
+        LeaveCriticalSection (l_cacheLock);
+}
+
+/**
+ * Create a store for documents in the given registry key.
+ *
+ * The store takes ownership of the key, and asks for notification of changes
+ * to it so the cache can be invalidated when someone edits a document.
+ */
+
+RegistryStore :: RegistryStore (HKEY key) : m_key (key), m_event (0),
+                m_lastCheck (GetTickCount ()) {
+        m_event = CreateEventW (0, TRUE, FALSE, 0);
+        watch ();
+}
+
+/**
+ * Release the registry key and the notification event.
+ */
+
+RegistryStore :: ~ RegistryStore () {
+        if (m_key != 0)
+                RegCloseKey (m_key);
+        if (m_event != 0)
+                CloseHandle (m_event);
+}
+
+/**
+ * Arm the registry change notification.
+ *
+ * The notification is tied to the thread that asks for it, so if that thread
+ * exits the event is signalled; that just means a spurious flush of the cache,
+ * after which the notification is re-armed from whichever thread notices.
+ */
+
+void RegistryStore :: watch (void) {
+        if (m_event == 0)
+                return;
+
+        ResetEvent (m_event);
+        RegNotifyChangeKeyValue (m_key, TRUE,
+                                 REG_NOTIFY_CHANGE_NAME |
+                                 REG_NOTIFY_CHANGE_LAST_SET,
+                                 m_event, TRUE);
+}
+
+/**
+ * Poll for changes to the key.
+ *
+ * This is only called with the cache lock held, so the check interval doesn't
+ * need any further protection.
+ */
+
+bool RegistryStore :: changed (void) {
+        if (m_event == 0)
+                return false;
+
+        unsigned long   now = GetTickCount ();
+        if (now - m_lastCheck < STORE_POLL_INTERVAL)
+                return false;
+
+        m_lastCheck = now;
+        if (WaitForSingleObject (m_event, 0) != WAIT_OBJECT_0)
+                return false;
+
+        watch ();
+        return true;
+}
+
+/**
+ * Load a named document from a registry value.
+ */
+
+Document * RegistryStore :: load (const char * name) {
+        wchar_t         tempName [80];
+        int             result;
+        result = MultiByteToWideChar (CP_UTF8, 0, name, - 1,
+                                      tempName, ARRAY_LENGTH (tempName));
+        if (result == 0)
+                return 0;
+
+        /*
+         * Determine whether the named item exists, and what its size in UTF-16
+         * characters is.
+         */
+
+        LSTATUS         status;
+        unsigned long   length = 0;
+        status = RegQueryValueExW (m_key, tempName, 0, 0, 0, & length);
+        if (status != ERROR_SUCCESS) {
+                OutputDebugStringA ("HTTP replacement not found\r\n");
+                return 0;
+        }
+
+        wchar_t       * replacement;
+        replacement = (wchar_t *) g_poolAlloc (length + sizeof (wchar_t));
+        if (replacement == 0)
+                return 0;
+
+        unsigned long   type;
+        status = RegQueryValueExW (m_key, tempName, 0, & type,
+                                   (LPBYTE) replacement, & length);
+        if (status != ERROR_SUCCESS) {
+                g_poolFree (replacement);
+                return 0;
+        }
+
+        if (type == REG_MULTI_SZ) {
+                /*
+                 * For MULTI_SZ just join all the component strings by changing
+                 * the interior terminator bytes into newlines.
+                 */
+
+                length = length / sizeof (wchar_t);
+                wchar_t       * scan = replacement;
+                wchar_t       * end = scan + length - 1;
+                for (; scan != end ; ++ scan)
+                        if (* scan == 0)
+                                * scan = '\n';
+        } else if (type == REG_SZ || type == REG_EXPAND_SZ) {
+                length = length / sizeof (wchar_t);
+        } else {
+                g_poolFree (replacement);
+                return 0;
+        }
+
+        /*
+         * Since a registry value has the potential to not be terminated,
+         * ensure that a terminator is present.
+         */
+
+        if (length == 0 || replacement [length - 1] != 0)
+                replacement [length] = 0;
+
+        Document      * doc = g_makeDocument (200, 0, replacement);
+        g_poolFree (replacement);
+        return doc;
+}
+
+/**
+ * Create a store for documents held as files under a root directory.
+ *
+ * The directory is watched for changes so that edited files are remapped the
+ * next time they're asked for; as with the registry store, the watch is only
+ * polled when a document is being looked up.
+ */
+
+FileStore :: FileStore (const wchar_t * root) : m_root (0),
+                m_change (INVALID_HANDLE_VALUE),
+                m_lastCheck (GetTickCount ()) {
+        size_t          length = wcslen (root);
+        m_root = (wchar_t *) g_poolAlloc ((length + 1) * sizeof (wchar_t));
+        if (m_root == 0)
+                return;
+
+        memcpy (m_root, root, (length + 1) * sizeof (wchar_t));
+        m_change = FindFirstChangeNotificationW (root, TRUE,
+                                                 FILE_NOTIFY_CHANGE_FILE_NAME |
+                                                 FILE_NOTIFY_CHANGE_SIZE |
+                                                 FILE_NOTIFY_CHANGE_LAST_WRITE);
+}
+
+/**
+ * Release the root path and the change notification.
+ */
+
+FileStore :: ~ FileStore () {
+        if (m_change != INVALID_HANDLE_VALUE)
+                FindCloseChangeNotification (m_change);
+
+        g_poolFree (m_root);
+}
+
+/**
+ * Poll for changes to the files under the root.
+ *
+ * This is only called with the cache lock held, as for the registry store.
+ */
+
+bool FileStore :: changed (void) {
+        if (m_change == INVALID_HANDLE_VALUE)
+                return false;
+
+        unsigned long   now = GetTickCount ();
+        if (now - m_lastCheck < STORE_POLL_INTERVAL)
+                return false;
+
+        m_lastCheck = now;
+        if (WaitForSingleObject (m_change, 0) != WAIT_OBJECT_0)
+                return false;
+
+        FindNextChangeNotification (m_change);
+        return true;
+}
+
+/**
+ * Load a document by mapping the named file.
+ *
+ * The name comes from the rule text, so it's checked to make sure it stays
+ * within the root; absolute paths, drive letters, streams and any ".." path
+ * component are all refused.
+ */
+
+Document * FileStore :: load (const char * name) {
+        if (m_root == 0)
+                return 0;
+
+        wchar_t         tempName [MAX_PATH];
+        int             result;
+        result = MultiByteToWideChar (CP_UTF8, 0, name, - 1,
+                                      tempName, ARRAY_LENGTH (tempName));
+        if (result == 0 || tempName [0] == 0)
+                return 0;
+
+        const wchar_t * scan = tempName;
+        if (* scan == '\\' || * scan == '/')
+                return 0;
+
+        bool            start = true;
+        for (; * scan != 0 ; ++ scan) {
+                wchar_t         ch = * scan;
+                if (ch == ':')
+                        return 0;
+
+                if (ch == '\\' || ch == '/') {
+                        start = true;
+                        continue;
+                }
+
+                if (start && ch == '.' && scan [1] == '.' &&
+                    (scan [2] == 0 || scan [2] == '\\' || scan [2] == '/'))
+                        return 0;
+
+                start = false;
+        }
+
+        size_t          rootLength = wcslen (m_root);
+        size_t          nameLength = scan - tempName;
+        if (rootLength + nameLength + 2 > MAX_PATH)
+                return 0;
+
+        wchar_t         path [MAX_PATH];
+        memcpy (path, m_root, rootLength * sizeof (wchar_t));
+        if (rootLength > 0 && path [rootLength - 1] != '\\')
+                path [rootLength ++] = '\\';
+
+        memcpy (path + rootLength, tempName,
+                (nameLength + 1) * sizeof (wchar_t));
+
+        return g_mapDocument (path);
+}
+
+/**@}*/
@@ -0,0 +1,149 @@
+#ifndef DOCUMENT_H
+#define DOCUMENT_H              1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the cache of prepared replacement documents, and the interface
+ * to the stores they are loaded from.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <winsock2.h>
+
+/**
+ * A replacement document, serialized and ready to send.
+ *
+ * The response is held as the fixed part of the headers and the body; the
+ * only thing that varies per response is the Date header, which is inserted
+ * after the status line (at m_split) by whoever is serving it. Documents are
+ * reference-counted, so once built a document can be handed to any number of
+ * sockets at once without copying.
+ *
+ * For documents served from a file, the body is a read-only view of the file
+ * (held in m_view) rather than being part of the document's own allocation,
+ * so however many sockets are being sent it, the only per-socket state is the
+ * position each has reached.
+ */
+
+struct Document {
+        volatile LONG   m_refs;
+
+        const unsigned char * m_head;
+        unsigned long   m_headLength;
+        unsigned long   m_split;
+
+        const unsigned char * m_body;
+        unsigned long   m_bodyLength;
+
+        const void    * m_view;
+};
+
+Document      * g_newDocument (unsigned long headLength, unsigned long split,
+                               unsigned long bodyLength,
+                               unsigned long bodySpace);
+Document      * g_makeDocument (int status, const char * extraText,
+                                const wchar_t * replacement);
+Document      * g_mapDocument (const wchar_t * path, const char * type = 0);
+void            g_documentAddRef (Document * doc);
+void            g_documentRelease (Document * doc);
+
+/**
+ * Interface to a source of named replacement documents.
+ *
+ * The cache asks the store for a document the first time a name is used, and
+ * polls changed () to find out when everything it holds should be discarded.
+ * The normal store is the registry, but keeping it behind an interface means
+ * other sources can be plugged in without the cache having to know.
+ */
+
+class DocumentStore {
+public:
+virtual               ~ DocumentStore () { }
+
+virtual bool            changed (void) = 0;
+virtual Document      * load (const char * name) = 0;
+};
+
+/**
+ * Store for documents held as string values under a registry key.
+ */
+
+class RegistryStore : public DocumentStore {
+private:
+        HKEY            m_key;
+        HANDLE          m_event;
+        unsigned long   m_lastCheck;
+
+        void            watch (void);
+
+public:
+                        RegistryStore (HKEY key);
+                      ~ RegistryStore ();
+
+        bool            changed (void);
+        Document      * load (const char * name);
+};
+
+/**
+ * Store for documents held as files under a directory.
+ *
+ * Names used with this store are relative to the root directory, and are not
+ * permitted to climb out of it.
+ */
+
+class FileStore : public DocumentStore {
+private:
+        wchar_t       * m_root;
+        HANDLE          m_change;
+        unsigned long   m_lastCheck;
+
+public:
+                        FileStore (const wchar_t * root);
+                      ~ FileStore ();
+
+        bool            changed (void);
+        Document      * load (const char * name);
+};
+
+/**
+ * Prefix for document names which are to be loaded from the file store.
+ */
+
+#define FILE_DOCUMENT_PREFIX    "file:"
+
+void            g_setDocumentStore (DocumentStore * store);
+void            g_setFileStore (DocumentStore * store);
+
+Document      * g_findDocument (const char * name);
+Document      * g_findDocument (int status, const char * extraText);
+void            g_flushDocuments (void);
+
+/**@}*/
+#endif  /* ! defined (DOCUMENT_H) */
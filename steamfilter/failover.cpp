@@ -0,0 +1,611 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements connect failover between the targets of a rule.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * A race is only ever stepped along, never waited on as a whole, so the same
+ * code serves both the blocking case (where the connect hook steps it along
+ * with a short wait in each step) and the non-blocking case (where the
+ * background thread steps each race along without waiting at all).
+ *
+ * If every target fails or the overall deadline passes, the client's socket
+ * is connected to the target the rule originally chose, so that the client
+ * sees whatever error that gives in the normal way rather than something
+ * synthetic.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "failover.h"
+#include "filterrule.h"
+#include "health.h"
+#include "mirror.h"
+#include "netapi.h"
+#include "race.h"
+#include "replace.h"
+#include "socktrack.h"
+#include "ticker.h"
+#include "warm.h"
+
+/**
+ * Simple equivalent to ntohs, as elsewhere.
+ */
+
+#define ntohs(x)        ((unsigned char) ((x) >> 8) + \
+                         ((unsigned char) (x) << 8))
+
+/**
+ * State of a race between the targets of a rule.
+ *
+ * The first candidate is always the target the rule chose, and the rest follow
+ * in the order the rule lists them; the schedule decides which of them gets
+ * tried when, ranking them by how fast they have been connecting if the rule
+ * asked for that.
+ */
+
+struct Race {
+        ConnectRace     m_plan;
+        bool            m_ranked;
+        sockaddr_in     m_addr [RACE_CANDIDATES_MAX];
+        SOCKET          m_probe [RACE_CANDIDATES_MAX];
+};
+
+/**
+ * A non-blocking connect that is waiting on a race.
+ */
+
+struct Pending {
+        SOCKET          m_handle;
+        bool            m_mirror;
+        Race            m_race;
+};
+
+/**
+ * Count of non-blocking connects in progress.
+ */
+
+volatile LONG           g_failoverPending;
+
+/**
+ * The non-blocking connects in progress.
+ */
+
+static  Pending         l_pending [FAILOVER_PENDING_MAX];
+static  CRITICAL_SECTION l_failoverLock;
+static  bool            l_lockInit;
+static  bool            l_ready;
+
+/**
+ * The sockets the client has made non-blocking.
+ *
+ * There's no way to ask Winsock whether a socket is in blocking mode, so the
+ * ioctlsocket () hook keeps track; sockets registered with WSAEventSelect ()
+ * are non-blocking as well, and those are known to the replacement code.
+ */
+
+static  SocketList<SocketTrack> l_nonBlocking;
+
+/**
+ * Simple counters, for reporting.
+ */
+
+static  volatile LONG   l_attempts;
+static  volatile LONG   l_rescued;
+static  volatile LONG   l_ranked;
+static  volatile LONG   l_warm;
+static  volatile LONG   l_failed;
+
+/**
+ * Add a candidate to a race.
+ *
+ * For a ranked race, candidates are ranked by the average connect time the
+ * health checker has seen for them.
+ */
+
+static void l_raceAdd (Race & race, const sockaddr_in & addr) {
+        unsigned long   index = race.m_plan.count ();
+        unsigned long   expected = 0;
+        if (race.m_ranked)
+                expected = g_healthRtt (addr.sin_addr.S_un.S_addr,
+                                        addr.sin_port);
+
+        if (! race.m_plan.add (expected))
+                return;
+
+        race.m_addr [index] = addr;
+        race.m_probe [index] = INVALID_SOCKET;
+}
+
+/**
+ * Set up a race, putting the chosen target first.
+ *
+ * Targets which the health checker thinks are down are left out, other than
+ * the chosen one; that was picked knowing the state of the others.
+ *
+ * Plain failover tries the targets one at a time, each given the full connect
+ * deadline before the next is started as well; a rule which asks for racing
+ * only tries its fastest few, with a much shorter stagger between them.
+ */
+
+static void l_raceInit (Race & race, const sockaddr_in & original,
+                        const sockaddr_in & chosen,
+                        const RuleTargets & targets) {
+        unsigned long   deadline = targets.m_options.m_failover;
+        if (deadline == 0)
+                deadline = RULE_FAILOVER_DEFAULT;
+
+        race.m_ranked = targets.m_options.m_race != 0;
+        if (race.m_ranked)
+                race.m_plan.reset (GetTickCount (), RACE_STAGGER, deadline,
+                                   targets.m_options.m_race);
+        else
+                race.m_plan.reset (GetTickCount (), deadline, deadline);
+
+        l_raceAdd (race, chosen);
+
+        unsigned long   i;
+        for (i = 0 ; i < targets.m_count ; ++ i) {
+                sockaddr_in     addr = original;
+                if (targets.m_addr [i] != 0)
+                        addr.sin_addr.S_un.S_addr = targets.m_addr [i];
+                if (targets.m_port [i] != 0)
+                        addr.sin_port = targets.m_port [i];
+
+                if (addr.sin_addr.S_un.S_addr == chosen.sin_addr.S_un.S_addr &&
+                    addr.sin_port == chosen.sin_port)
+                        continue;
+
+                if (g_healthDown (addr.sin_addr.S_un.S_addr, addr.sin_port))
+                        continue;
+
+                l_raceAdd (race, addr);
+        }
+
+        if (race.m_ranked)
+                race.m_plan.rank ();
+}
+
+/**
+ * Close any probe connections still open in a race.
+ */
+
+static void l_raceAbandon (Race & race) {
+        unsigned long   i;
+        for (i = 0 ; i < race.m_plan.count () ; ++ i) {
+                if (race.m_probe [i] == INVALID_SOCKET)
+                        continue;
+
+                (* g_net.m_closesocket) (race.m_probe [i]);
+                race.m_probe [i] = INVALID_SOCKET;
+        }
+}
+
+/**
+ * Finish with a race once it's decided.
+ *
+ * The client's socket has to make its own connection to the winner, since
+ * there's no way to put the probe in its place, so the probe is handed to the
+ * pool of ready connections for the filter's own use; the others are closed.
+ */
+
+static void l_raceFinish (Race & race, int result) {
+        if (result >= 0) {
+                g_warmGive (race.m_addr [result], race.m_probe [result]);
+                race.m_probe [result] = INVALID_SOCKET;
+        }
+
+        l_raceAbandon (race);
+}
+
+/**
+ * Step a race along, waiting up to the given time for something to happen.
+ *
+ * The result is the index of the winning candidate, or one of RACE_PENDING or
+ * RACE_FAILED.
+ */
+
+static int l_raceStep (Race & race, unsigned long now, unsigned long wait) {
+        /*
+         * Start whichever candidates the schedule says are due.
+         */
+
+        int             index;
+        while ((index = race.m_plan.start (now)) >= 0) {
+                /*
+                 * A target with a connection ready in the pool is known to
+                 * be up right now, so it wins without being probed.
+                 */
+
+                if (g_warmReady (race.m_addr [index])) {
+                        InterlockedIncrement (& l_warm);
+                        race.m_plan.won (index);
+                        break;
+                }
+
+                SOCKET          probe = g_netConnect (race.m_addr [index]);
+                race.m_probe [index] = probe;
+                if (probe == INVALID_SOCKET)
+                        race.m_plan.failed (index);
+        }
+
+        int             result = race.m_plan.result (now);
+        if (result != RACE_PENDING) {
+                l_raceFinish (race, result);
+                return result;
+        }
+
+        unsigned long   due = race.m_plan.wait (now);
+        if (wait > due)
+                wait = due;
+
+        fd_set          write;
+        fd_set          error;
+        FD_ZERO (& write);
+        FD_ZERO (& error);
+
+        unsigned long   i;
+        for (i = 0 ; i < race.m_plan.count () ; ++ i) {
+                if (! race.m_plan.live (i))
+                        continue;
+
+                FD_SET (race.m_probe [i], & write);
+                FD_SET (race.m_probe [i], & error);
+        }
+
+        timeval         timeout = { 0, (long) wait * 1000 };
+        int             ready;
+        ready = (* g_net.m_select) (0, 0, & write, & error, & timeout);
+        if (ready <= 0)
+                return RACE_PENDING;
+
+        for (i = 0 ; i < race.m_plan.count () ; ++ i) {
+                if (! race.m_plan.live (i))
+                        continue;
+
+                SOCKET          probe = race.m_probe [i];
+                bool            failed = g_netIsSet (probe, error);
+                if (! failed && ! g_netIsSet (probe, write))
+                        continue;
+
+                if (! failed && g_netConnected (probe)) {
+                        race.m_plan.won (i);
+                        break;
+                }
+
+                (* g_net.m_closesocket) (probe);
+                race.m_probe [i] = INVALID_SOCKET;
+                race.m_plan.failed (i);
+        }
+
+        result = race.m_plan.result (now);
+        if (result != RACE_PENDING)
+                l_raceFinish (race, result);
+
+        return result;
+}
+
+/**
+ * Describe the outcome of a race for the benefit of DbgView, and count it.
+ */
+
+static const sockaddr_in & l_raceResult (Race & race, int result) {
+        InterlockedIncrement (& l_attempts);
+
+        if (result < 0) {
+                InterlockedIncrement (& l_failed);
+                OutputDebugStringA ("Connect failover: no target answered\r\n");
+                return race.m_addr [0];
+        }
+
+        /*
+         * A ranked race doesn't expect the chosen target to win, so there's
+         * nothing to remark on.
+         */
+
+        if (race.m_ranked) {
+                InterlockedIncrement (& l_ranked);
+                return race.m_addr [result];
+        }
+
+        if (result == 0)
+                return race.m_addr [0];
+
+        InterlockedIncrement (& l_rescued);
+
+        const sockaddr_in & addr = race.m_addr [result];
+        const unsigned char * bytes = & addr.sin_addr.S_un.S_un_b.s_b1;
+
+        char            show [80];
+        wsprintfA (show, "Connect failed over to %d.%d.%d.%d:%d\r\n",
+                   bytes [0], bytes [1], bytes [2], bytes [3],
+                   ntohs (addr.sin_port));
+        OutputDebugStringA (show);
+
+        return addr;
+}
+
+/**
+ * Step along the races for the non-blocking connects, from the background
+ * thread.
+ *
+ * The client's socket is connected from here with the lock held, so that it
+ * can't be closed out from under us in the meantime.
+ */
+
+static void l_failoverTick (unsigned long now) {
+        if (! g_anyFailover ())
+                return;
+
+        EnterCriticalSection (& l_failoverLock);
+
+        unsigned long   i;
+        for (i = 0 ; i < FAILOVER_PENDING_MAX ; ++ i) {
+                Pending       & item = l_pending [i];
+                if (item.m_handle == INVALID_SOCKET)
+                        continue;
+
+                int             result = l_raceStep (item.m_race, now, 0);
+                if (result == RACE_PENDING)
+                        continue;
+
+                const sockaddr_in & addr = l_raceResult (item.m_race, result);
+                (* g_net.m_connect) (item.m_handle, (const sockaddr *) & addr,
+                                     sizeof (addr));
+                if (item.m_mirror)
+                        g_mirrorConnect (item.m_handle,
+                                         addr.sin_addr.S_un.S_addr,
+                                         addr.sin_port);
+
+                item.m_handle = INVALID_SOCKET;
+                InterlockedDecrement (& g_failoverPending);
+        }
+
+        LeaveCriticalSection (& l_failoverLock);
+}
+
+/**
+ * Start up; this needs the network functions to be available.
+ */
+
+bool g_failoverInit (void) {
+        if (! l_lockInit) {
+                InitializeCriticalSection (& l_failoverLock);
+                l_lockInit = true;
+        }
+
+        unsigned long   i;
+        for (i = 0 ; i < FAILOVER_PENDING_MAX ; ++ i)
+                l_pending [i].m_handle = INVALID_SOCKET;
+
+        l_ready = g_tickerAdd (l_failoverTick, FAILOVER_INTERVAL);
+        return l_ready;
+}
+
+/**
+ * Shut down; the background thread must already have been stopped.
+ *
+ * Any connects still waiting on a race are left unconnected; we're being
+ * unloaded, so there is little else that can be done.
+ */
+
+void g_failoverUnload (void) {
+        l_ready = false;
+        l_nonBlocking.free ();
+
+        if (! l_lockInit)
+                return;
+
+        EnterCriticalSection (& l_failoverLock);
+
+        unsigned long   i;
+        for (i = 0 ; i < FAILOVER_PENDING_MAX ; ++ i) {
+                Pending       & item = l_pending [i];
+                if (item.m_handle == INVALID_SOCKET)
+                        continue;
+
+                l_raceAbandon (item.m_race);
+                item.m_handle = INVALID_SOCKET;
+        }
+
+        g_failoverPending = 0;
+
+        LeaveCriticalSection (& l_failoverLock);
+}
+
+/**
+ * Note a change to the blocking mode of a socket.
+ */
+
+void g_failoverMode (SOCKET handle, bool nonBlocking) {
+        SocketTrack   * item = l_nonBlocking.find (handle);
+        if (nonBlocking) {
+                if (item == 0 && (item = new SocketTrack (handle)) != 0)
+                        l_nonBlocking.add (* item);
+        } else if (item != 0)
+                l_nonBlocking.remove (item, true);
+}
+
+/**
+ * Check whether the client has made a socket non-blocking, either directly or
+ * by registering it with WSAEventSelect ().
+ */
+
+bool g_failoverNonBlocking (SOCKET handle) {
+        return g_findEventHandle (handle) != 0 ||
+               l_nonBlocking.find (handle) != 0;
+}
+
+/**
+ * Check whether a socket is waiting on a race, in which case a further connect
+ * call on it should be told the connect is already in progress.
+ */
+
+bool g_failoverBusy (SOCKET handle) {
+        if (! g_anyFailover ())
+                return false;
+
+        EnterCriticalSection (& l_failoverLock);
+
+        bool            found = false;
+        unsigned long   i;
+        for (i = 0 ; i < FAILOVER_PENDING_MAX && ! found ; ++ i)
+                found = l_pending [i].m_handle == handle;
+
+        LeaveCriticalSection (& l_failoverLock);
+        return found;
+}
+
+/**
+ * Connect a client socket with failover between the targets of a rule.
+ *
+ * This returns as connect () does, with the error in the thread's last error
+ * where there is one.
+ */
+
+int g_failoverConnect (SOCKET handle, const sockaddr_in & original,
+                       const sockaddr_in & chosen,
+                       const RuleTargets & targets) {
+        bool            mirror = targets.m_count > 1;
+        if (! l_ready || (targets.m_options.m_failover == 0 &&
+                          targets.m_options.m_race == 0)) {
+                if (mirror)
+                        g_mirrorConnect (handle, chosen.sin_addr.S_un.S_addr,
+                                         chosen.sin_port);
+
+                return (* g_net.m_connect) (handle, (const sockaddr *) & chosen,
+                                            sizeof (chosen));
+        }
+
+        if (g_failoverNonBlocking (handle)) {
+                EnterCriticalSection (& l_failoverLock);
+
+                Pending       * item = 0;
+                unsigned long   i;
+                for (i = 0 ; i < FAILOVER_PENDING_MAX ; ++ i) {
+                        if (l_pending [i].m_handle == INVALID_SOCKET) {
+                                item = l_pending + i;
+                                break;
+                        }
+                }
+
+                if (item != 0) {
+                        l_raceInit (item->m_race, original, chosen, targets);
+                        item->m_mirror = mirror;
+                        item->m_handle = handle;
+                        InterlockedIncrement (& g_failoverPending);
+                }
+
+                LeaveCriticalSection (& l_failoverLock);
+
+                if (item != 0) {
+                        SetLastError (WSAEWOULDBLOCK);
+                        return SOCKET_ERROR;
+                }
+
+                /*
+                 * With too many connects in progress, just carry on to the
+                 * chosen target without any failover.
+                 */
+
+                if (mirror)
+                        g_mirrorConnect (handle, chosen.sin_addr.S_un.S_addr,
+                                         chosen.sin_port);
+
+                return (* g_net.m_connect) (handle, (const sockaddr *) & chosen,
+                                            sizeof (chosen));
+        }
+
+        Race            race;
+        l_raceInit (race, original, chosen, targets);
+
+        int             result;
+        for (;;) {
+                result = l_raceStep (race, GetTickCount (), FAILOVER_INTERVAL);
+                if (result != RACE_PENDING)
+                        break;
+        }
+
+        const sockaddr_in & addr = l_raceResult (race, result);
+        if (mirror)
+                g_mirrorConnect (handle, addr.sin_addr.S_un.S_addr,
+                                 addr.sin_port);
+
+        return (* g_net.m_connect) (handle, (const sockaddr *) & addr,
+                                    sizeof (addr));
+}
+
+/**
+ * Forget about a socket, when it's closed.
+ */
+
+void g_failoverClose (SOCKET handle) {
+        l_nonBlocking.remove (handle);
+
+        if (! g_anyFailover ())
+                return;
+
+        EnterCriticalSection (& l_failoverLock);
+
+        unsigned long   i;
+        for (i = 0 ; i < FAILOVER_PENDING_MAX ; ++ i) {
+                Pending       & item = l_pending [i];
+                if (item.m_handle != handle)
+                        continue;
+
+                l_raceAbandon (item.m_race);
+                item.m_handle = INVALID_SOCKET;
+                InterlockedDecrement (& g_failoverPending);
+        }
+
+        LeaveCriticalSection (& l_failoverLock);
+}
+
+/**
+ * Write the counters out for the benefit of DbgView.
+ */
+
+void g_failoverReport (void) {
+        if (l_attempts == 0)
+                return;
+
+        char            show [160];
+        wsprintfA (show, "failover: %lu connects raced, %lu failed over, "
+                   "%lu ranked, %lu without probing, %lu with no answer\r\n",
+                   (unsigned long) l_attempts, (unsigned long) l_rescued,
+                   (unsigned long) l_ranked, (unsigned long) l_warm,
+                   (unsigned long) l_failed);
+        OutputDebugStringA (show);
+}
+
+/**@}*/
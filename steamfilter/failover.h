@@ -0,0 +1,110 @@
+#ifndef FAILOVER_H
+#define FAILOVER_H              1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the connect failover between the targets of a rule.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Where a rule lists several equivalent servers, a connection sent to one that
+ * has gone away shouldn't have to wait for the client application to notice
+ * and try again, since Steam in particular can take a long time to give up on
+ * a server and then tends to go somewhere else entirely. The health checker
+ * catches servers which stay down, but it can take a while to notice.
+ *
+ * So, a rule can ask for its connections to be failed over, giving a connect
+ * deadline for each of its targets. Since a connect that's still in progress
+ * can't be abandoned and the socket reused, the targets are raced using
+ * connections of our own; the first target is tried alone, and each time the
+ * deadline passes without an answer the next is started as well. The client's
+ * socket is then connected to whichever answered first; that costs a second
+ * handshake, since the winning connection can't be put in place of the
+ * client's socket, so the race only picks the target and the winner is kept
+ * in the pool of ready connections for the filter's own use. A target with a
+ * connection ready in that pool is known to be up, so it wins a later race
+ * straight away, saving the probe's handshake at least.
+ *
+ * A rule can instead ask for its connections to be raced, where only the few
+ * targets which have been connecting fastest are tried, each started a short
+ * stagger after the last rather than a whole deadline; that trims the tail of
+ * connect times when all the targets are working, rather than waiting for one
+ * to fail before trying the others.
+ *
+ * For a blocking socket all this happens inside the connect call. For a socket
+ * the client has made non-blocking, the connect returns straight away as usual
+ * and the race is run from the background thread, after which the client's
+ * socket is connected and the client sees that complete in the normal way.
+ */
+
+#include <winsock2.h>
+
+struct RuleTargets;
+
+/**
+ * Most non-blocking connects that can be in progress at once.
+ */
+
+#define FAILOVER_PENDING_MAX    32
+
+/**
+ * How often the background thread checks non-blocking connects, in
+ * milliseconds.
+ */
+
+#define FAILOVER_INTERVAL       50
+
+/**
+ * Count of non-blocking connects in progress, which the connect and close
+ * hooks check before looking for one.
+ */
+
+extern  volatile LONG   g_failoverPending;
+
+inline  bool            g_anyFailover (void) {
+        return g_failoverPending != 0;
+}
+
+bool            g_failoverInit (void);
+void            g_failoverUnload (void);
+
+void            g_failoverMode (SOCKET handle, bool nonBlocking);
+bool            g_failoverNonBlocking (SOCKET handle);
+bool            g_failoverBusy (SOCKET handle);
+int             g_failoverConnect (SOCKET handle, const sockaddr_in & original,
+                                   const sockaddr_in & chosen,
+                                   const RuleTargets & targets);
+void            g_failoverClose (SOCKET handle);
+
+void            g_failoverReport (void);
+
+/**@}*/
+#endif  /* ! defined (FAILOVER_H) */
@@ -43,10 +43,31 @@
 #include "../limitver.h"
 
 #include <winsock2.h>
+#include <ws2tcpip.h>
 
 #include "glob.h"
 #include "filterrule.h"
 #include "replace.h"
+#include "document.h"
+#include "httpcache.h"
+#include "depot.h"
+#include "segment.h"
+#include "netapi.h"
+#include "health.h"
+#include "mirror.h"
+#include "failover.h"
+#include "warm.h"
+#include "tune.h"
+#include "datagram.h"
+#include "limit.h"
+#include "meter.h"
+#include "stats.h"
+#include "trace.h"
+#include "latency.h"
+#include "resolve.h"
+#include "hostinfo.h"
+#include "ticker.h"
+#include "perthread.h"
 
 /**
  * For declaring exported callable functions from the injection shim.
@@ -80,11 +101,46 @@ typedef int (WSAAPI * ConnectFunc) (SOCKET s, const sockaddr * name, int namelen
  * the BSD socket APIs) and Microsoft have their own wide-character version for
  * applications which want to explicitly use Unicode or UTF-8 encodings. Older
  * applications written before IPv6 still tend to use gethostbyname (), so this
- * is normally the one to filter.
+ * is normally the one to filter, but newer code uses the others.
  */
 
 typedef struct hostent * (WSAAPI * GetHostFunc) (const char * name);
 
+/**
+ * Prototypes of getaddrinfo () and its wide-character equivalent, along with
+ * the functions that free the answers they return.
+ */
+
+typedef int   (WSAAPI * GetAddrInfoFunc) (const char * node,
+                                          const char * service,
+                                          const addrinfo * hints,
+                                          addrinfo ** result);
+typedef void  (WSAAPI * FreeAddrInfoFunc) (addrinfo * info);
+
+typedef int   (WSAAPI * GetAddrInfoWFunc) (const wchar_t * node,
+                                           const wchar_t * service,
+                                           const ADDRINFOW * hints,
+                                           ADDRINFOW ** result);
+typedef void  (WSAAPI * FreeAddrInfoWFunc) (ADDRINFOW * info);
+
+/**
+ * Prototype of GetAddrInfoExW (), which from Vista on can also look names up
+ * asynchronously, and its companion to free what it returns.
+ */
+
+typedef int   (WSAAPI * GetAddrInfoExWFunc) (const wchar_t * name,
+                                             const wchar_t * service,
+                                             unsigned long space,
+                                             GUID * provider,
+                                             const ADDRINFOEXW * hints,
+                                             ADDRINFOEXW ** result,
+                                             timeval * timeout,
+                                             OVERLAPPED * overlapped,
+                                             LPLOOKUPSERVICE_COMPLETION_ROUTINE
+                                                     completion,
+                                             HANDLE * cancel);
+typedef void  (WSAAPI * FreeAddrInfoExWFunc) (ADDRINFOEXW * info);
+
 /**
  * Prototype of the legacy sockets recv () function.
  */
@@ -98,6 +154,33 @@ typedef int   (WSAAPI * RecvFunc) (SOCKET s, char * buf, int len, int flags);
 typedef int   (WSAAPI * RecvFromFunc) (SOCKET s, char * buf, int len, int flags,
                                        sockaddr * from, int * fromLen);
 
+/**
+ * Prototypes of the legacy sockets sendto () function and its asynchronous
+ * equivalent, and of WSARecvFrom ().
+ */
+
+typedef int   (WSAAPI * SendToFunc) (SOCKET s, const char * buf, int len,
+                                     int flags, const sockaddr * to,
+                                     int toLength);
+
+typedef int   (WSAAPI * WSASendToFunc) (SOCKET s, LPWSABUF buffers,
+                                        unsigned long count,
+                                        unsigned long * sent,
+                                        unsigned long flags,
+                                        const sockaddr * to, int toLength,
+                                        OVERLAPPED * overlapped,
+                                        LPWSAOVERLAPPED_COMPLETION_ROUTINE
+                                                handler);
+
+typedef int   (WSAAPI * WSARecvFromFunc) (SOCKET s, LPWSABUF buffers,
+                                          unsigned long count,
+                                          unsigned long * received,
+                                          unsigned long * flags,
+                                          sockaddr * from, int * fromLength,
+                                          OVERLAPPED * overlapped,
+                                          LPWSAOVERLAPPED_COMPLETION_ROUTINE
+                                                  handler);
+
 /**
  * Prototype of the modern asynchronous WSARecv () function.
  */
@@ -180,12 +263,26 @@ typedef int   (WSAAPI * WSAEventSelectFunc) (SOCKET s, WSAEVENT event,
 typedef int   (WSAAPI * WSAEnumNetworkEventsFunc) (SOCKET s, WSAEVENT event,
                                                    WSANETWORKEVENTS * events);
 
+/**
+ * Prototype of ioctlsocket (), to track which sockets are non-blocking.
+ */
+
+typedef int   (WSAAPI * ioctlsocketFunc) (SOCKET s, long command,
+                                          unsigned long * arg);
+
 /**
  * Prototype for getpeername (), which we don't hook but do want to call.
  */
 
 typedef int   (WSAAPI * getpeernameFunc) (SOCKET s, sockaddr * addr, int * length);
 
+/**
+ * Prototype for getservbyname (), for lookups which give a service by name.
+ */
+
+typedef servent * (WSAAPI * getservbynameFunc) (const char * name,
+                                                const char * proto);
+
 /**
  * Prototype for closesocket (), to detect when to release tracking data.
  */
@@ -251,8 +348,17 @@ struct Hook : public ApiHook {
 
 Hook<ConnectFunc>       g_connectHook;
 Hook<GetHostFunc>       g_gethostHook;
+Hook<GetAddrInfoFunc>   g_getaddrinfoHook;
+Hook<FreeAddrInfoFunc>  g_freeaddrinfoHook;
+Hook<GetAddrInfoWFunc>  g_getAddrInfoWHook;
+Hook<FreeAddrInfoWFunc> g_freeAddrInfoWHook;
+Hook<GetAddrInfoExWFunc> g_getAddrInfoExWHook;
+Hook<FreeAddrInfoExWFunc> g_freeAddrInfoExWHook;
 Hook<RecvFunc>          g_recvHook;
 Hook<RecvFromFunc>      g_recvfromHook;
+Hook<WSARecvFromFunc>   g_wsaRecvFromHook;
+Hook<SendToFunc>        g_sendtoHook;
+Hook<WSASendToFunc>     g_wsaSendToHook;
 Hook<WSARecvFunc>       g_wsaRecvHook;
 Hook<selectFunc>        g_select_Hook;
 Hook<SendFunc>          g_sendHook;
@@ -261,25 +367,75 @@ Hook<WSAEventSelectFunc> g_wsaEventSelectHook;
 Hook<WSAEnumNetworkEventsFunc> g_wsaEnumNetworkEventsHook;
 Hook<WSASendFunc>       g_wsaSendHook;
 Hook<closesocketFunc>   g_closesocket_Hook;
+Hook<ioctlsocketFunc>   g_ioctlsocketHook;
 
 getpeernameFunc         g_getpeername;
+getservbynameFunc       g_getservbyname;
 
 /**@}*/
 
 /**
- * As a safety thing to prevent crashes on unload, set a global counter when
+ * As a safety thing to prevent crashes on unload, count when a thread is
  * inside a hooked function - particularly the emulation of select (), since
  * that has a timeout; because of the timeout we could be inside the wrapped
  * version of the function in one thread while another thread is trying to
  * unload all the hook functions.
+ *
+ * Each thread counts in its own per-thread block, so that the hooks don't all
+ * bounce the same cache line between processors; the global counter is only
+ * for a thread which couldn't get a block.
  */
 
 class InHook {
+private:
+        ThreadData    * m_data;
+
 public:
 static  LONG            g_hookCount;
 
-                        InHook () { InterlockedIncrement (& g_hookCount); }
-                      ~ InHook () { InterlockedDecrement (& g_hookCount); }
+                        InHook () : m_data (g_threadData ()) {
+                                if (m_data != 0)
+                                        ++ m_data->m_inHook;
+                                else
+                                        InterlockedIncrement (& g_hookCount);
+                        }
+                      ~ InHook () {
+                                if (m_data != 0)
+                                        -- m_data->m_inHook;
+                                else
+                                        InterlockedDecrement (& g_hookCount);
+                        }
+};
+
+/**
+ * Mark a thread as being inside one of the lookup hooks.
+ *
+ * Winsock can build some of its lookup functions on top of others, so a name
+ * the filter passes on to the real function can come back into another of the
+ * hooks on the same thread. Only the outermost hook applies the rules and
+ * counts the lookup; the inner ones go straight to the real functions.
+ */
+
+class InLookup {
+private:
+        ThreadData    * m_data;
+        bool            m_nested;
+
+public:
+                        InLookup () : m_data (g_threadData ()),
+                                      m_nested (false) {
+                                if (m_data == 0)
+                                        return;
+
+                                m_nested = m_data->m_inLookup != 0;
+                                ++ m_data->m_inLookup;
+                        }
+                      ~ InLookup () {
+                                if (m_data != 0)
+                                        -- m_data->m_inLookup;
+                        }
+
+        bool            nested (void) const { return m_nested; }
 };
 
 /**
@@ -324,6 +480,7 @@ bool            g_passthrough = true;
 
 int WSAAPI connectHook (SOCKET s, const sockaddr * name, int namelen) {
         InHook          hooking;
+        HookTimer       timer (HOOK_CONNECT);
 
         /*
          * Capture the caller's return address so we can map it to a module and
@@ -345,11 +502,25 @@ int WSAAPI connectHook (SOCKET s, const sockaddr * name, int namelen) {
                             (LPCWSTR) addr, & module);
 #endif
 
+        /*
+         * A socket whose connect is being failed over has a connect still in
+         * progress as far as the caller should be concerned.
+         */
+
+        if (g_anyFailover () && g_failoverBusy (s)) {
+                SetLastError (WSAEALREADY);
+                return SOCKET_ERROR;
+        }
+
+        g_statsCount (STAT_CONNECTS);
+
         const sockaddr_in * old = (const sockaddr_in *) name;
         sockaddr_in   * replace = 0;
+        RuleTargets     targets;
+        targets.m_count = 0;
         
         if (g_passthrough || name->sa_family != AF_INET ||
-            ! g_rules.matchIp (old, module, & replace)) {
+            ! g_rules.matchIp (old, module, & replace, & targets)) {
                 /*
                  * Just forward on to the original. The 'passthrough' case is
                  * for when Steam starts up and does an auth interchange over
@@ -365,8 +536,9 @@ int WSAAPI connectHook (SOCKET s, const sockaddr * name, int namelen) {
                  */
 
                 if (g_passthrough)
-                        OutputDebugStringA ("passthrough\r\n");
+                        g_trace (TRACE_CONNECT_PASSED);
 
+                timer.under ();
                 return (* g_connectHook) (s, name, namelen);
         }
 
@@ -377,7 +549,8 @@ int WSAAPI connectHook (SOCKET s, const sockaddr * name, int namelen) {
          */
 
         if (replace == 0 || replace->sin_addr.S_un.S_addr == INADDR_NONE) {
-                OutputDebugStringA ("Connect refused\r\n");
+                g_traceConnect (TRACE_CONNECT_REFUSED, old);
+                g_statsCount (STAT_CONNECT_BLOCKS);
                 SetLastError (WSAECONNREFUSED);
                 return SOCKET_ERROR;
         }
@@ -396,47 +569,227 @@ int WSAAPI connectHook (SOCKET s, const sockaddr * name, int namelen) {
         temp.sin_addr = replace->sin_addr.S_un.S_addr != 0 ?
                         replace->sin_addr : base->sin_addr;
 
+        g_traceConnect (TRACE_CONNECT_REDIRECT, old, & temp, targets.m_index);
+        g_statsCount (STAT_CONNECT_REWRITES);
+
+        g_limitConnect (s, targets.m_index, targets.m_options.m_limit,
+                        targets.m_options.m_weight);
+        g_tuneConnect (s, targets.m_options);
+
         /*
-         * Describe the redirection for the benefit of DbgView
+         * If the rule has several targets, remember them all in case a URL
+         * rule wants to split a download on this connection across them, and
+         * fail over between them or race them if the rule asks for that.
          */
 
-        char            show [128];
-        unsigned char * bytes = & temp.sin_addr.S_un.S_un_b.s_b1;
-        const unsigned char * prev = & old->sin_addr.S_un.S_un_b.s_b1;
-        wsprintfA (show, "Connect redirected %d.%d.%d.%d to %d.%d.%d.%d:%d\r\n",
-                   prev [0], prev [1], prev [2], prev [3],
-                   bytes [0], bytes [1], bytes [2], bytes [3],
-                   ntohs (temp.sin_port));
+        if (targets.m_count > 1) {
+                g_addRedirect (s, * old, targets);
 
-        OutputDebugStringA (show);
-                
+                if (targets.m_options.m_failover != 0 ||
+                    targets.m_options.m_race != 0) {
+                        timer.under ();
+                        return g_failoverConnect (s, * old, temp, targets);
+                }
+
+                g_mirrorConnect (s, temp.sin_addr.S_un.S_addr, temp.sin_port);
+        }
+
+        timer.under ();
         return (* g_connectHook) (s, (sockaddr *) & temp, sizeof (temp));
 }
 
 /**
- * Hook for the gethostbyname () Sockets address-resolution function.
+ * Work out what to do with a datagram being sent, filling in where it should
+ * go instead if it's being redirected.
+ *
+ * Rules only apply to datagrams if they ask to, so that connect rules with a
+ * port in common don't catch datagrams by accident; if none ask to, there's
+ * nothing to do here at all. Otherwise the rules are only applied to the first
+ * datagram a socket sends to each destination, and a decision to drop or
+ * redirect the flow is kept in the flow table, so the rest of the flow costs a
+ * single lookup. Flows which the rules let pass aren't kept, so that the rest
+ * of the process's traffic doesn't push the real decisions out of the table.
  */
 
-struct hostent * WSAAPI gethostHook (const char * name) {
-        InHook          hooking;
+FlowAction datagramRoute (SOCKET s, const sockaddr * to, int toLength,
+                          sockaddr_in & temp) {
+        if (! g_anyDatagramRule () || to == 0 || to->sa_family != AF_INET ||
+            toLength < (int) sizeof (sockaddr_in))
+                return FLOW_PASS;
+
+        const sockaddr_in * old = (const sockaddr_in *) to;
+        FlowRoute       route;
+        RuleTargets     targets;
+        bool            decided = false;
+        if (! g_datagramFind (s, * old, route)) {
+                sockaddr_in   * replace = 0;
+                targets.m_count = 0;
+
+                route.m_addr = 0;
+                route.m_port = 0;
+
+                if (! g_rules.matchIp (old, 0, & replace, & targets, true))
+                        return FLOW_PASS;
+
+                if (replace == 0 ||
+                    replace->sin_addr.S_un.S_addr == INADDR_NONE) {
+                        route.m_action = FLOW_DROP;
+
+                        g_traceConnect (TRACE_DATAGRAM_DROPPED, old);
+                        g_statsCount (STAT_DATAGRAM_BLOCKS);
+                } else {
+                        route.m_action = FLOW_REDIRECT;
+                        route.m_addr = replace->sin_addr.S_un.S_addr != 0 ?
+                                       replace->sin_addr.S_un.S_addr :
+                                       old->sin_addr.S_un.S_addr;
+                        route.m_port = replace->sin_port != 0 ?
+                                       replace->sin_port : old->sin_port;
+                        decided = true;
+
+                        g_statsCount (STAT_DATAGRAM_REWRITES);
+                }
+
+                g_datagramStore (s, * old, route);
+        }
+
+        if (route.m_action != FLOW_REDIRECT)
+                return (FlowAction) route.m_action;
+
+        temp = * old;
+        temp.sin_addr.S_un.S_addr = route.m_addr;
+        temp.sin_port = route.m_port;
 
+        /*
+         * Only the decision is traced, not every datagram that follows it;
+         * the first rule has index zero, so the index can't stand in for
+         * whether a decision was just made.
+         */
+
+        if (decided)
+                g_traceConnect (TRACE_DATAGRAM_REDIRECT, old, & temp,
+                                targets.m_index);
+
+        return FLOW_REDIRECT;
+}
+
+/**
+ * Order the addresses for the answer to a host lookup from the targets of a
+ * rule.
+ *
+ * The address the rule chose comes first, followed by the rule's other
+ * targets in the order the rule would rotate through them, so that a client
+ * which tries each address in turn fails over in the same order the filter
+ * itself would. Targets which keep the original address are left out, since
+ * there isn't one.
+ */
+
+unsigned long lookupOrder (unsigned long chosen, const RuleTargets & targets,
+                           unsigned long * addrs) {
+        unsigned long   count = 0;
+        addrs [count ++] = chosen;
+
+        unsigned long   start = 0;
+        unsigned long   i;
+        for (i = 0 ; i < targets.m_count ; ++ i) {
+                if (targets.m_addr [i] == chosen) {
+                        start = i + 1;
+                        break;
+                }
+        }
+
+        for (i = 0 ; i < targets.m_count ; ++ i) {
+                unsigned long   addr;
+                addr = targets.m_addr [(start + i) % targets.m_count];
+                if (addr == INADDR_ANY)
+                        continue;
+
+                unsigned long   seen = 0;
+                while (seen < count && addrs [seen] != addr)
+                        ++ seen;
+
+                if (seen == count && count < RULE_TARGETS_MAX)
+                        addrs [count ++] = addr;
+        }
+
+        return count;
+}
+
+/**
+ * What the rules say to do with a name being looked up.
+ */
+
+enum LookupAction {
+        LOOKUP_NONE,
+        LOOKUP_KEEP,
+        LOOKUP_BLOCK,
+        LOOKUP_REWRITE
+};
+
+/**
+ * Apply the rules to a name being looked up through any of the lookup hooks.
+ *
+ * For a rewrite, the addresses for the answer are filled in, in the order
+ * given by lookupOrder (); there's room needed for RULE_TARGETS_MAX of them.
+ */
+
+LookupAction lookupRule (const char * name, unsigned long * addrs,
+                         unsigned long & count) {
         /*
          * Disable the temporary pass-through mode once we see a DNS query.
          */
 
         g_passthrough = false;
+        g_statsCount (STAT_LOOKUPS);
 
         sockaddr_in   * replace = 0;
+        RuleTargets     targets;
+        targets.m_count = 0;
+        count = 0;
 
-        if (! g_rules.matchDns (name, & replace)) {
+        if (! g_rules.matchDns (name, & replace, & targets))
+                return LOOKUP_NONE;
+
+        if (replace == 0 || replace->sin_addr.S_un.S_addr == INADDR_NONE) {
+                g_traceLookup (TRACE_LOOKUP_REFUSED, name);
+                g_statsCount (STAT_LOOKUP_BLOCKS);
+                return LOOKUP_BLOCK;
+        }
+
+        unsigned long   chosen = replace->sin_addr.S_un.S_addr;
+        if (chosen == INADDR_ANY)
+                return LOOKUP_KEEP;
+
+        count = lookupOrder (chosen, targets, addrs);
+        g_statsCount (STAT_LOOKUP_REWRITES);
+        g_traceLookup (TRACE_LOOKUP, name, chosen);
+        return LOOKUP_REWRITE;
+}
+
+/**
+ * Hook for the gethostbyname () Sockets address-resolution function.
+ */
+
+struct hostent * WSAAPI gethostHook (const char * name) {
+        InHook          hooking;
+        InLookup        lookup;
+
+        if (lookup.nested ())
+                return (* g_gethostHook) (name);
+
+        unsigned long   addrs [RULE_TARGETS_MAX];
+        unsigned long   count;
+        hostent       * result = 0;
+
+        switch (lookupRule (name, addrs, count)) {
+        case LOOKUP_NONE:
                 /*
-                 * No matching rule, silently forward onward.
+                 * No matching rule, silently forward onward, by way of the
+                 * lookup cache.
                  */
 
-                return (* g_gethostHook) (name);
-        }
+                return g_resolveHost (* g_gethostHook, name);
 
-        if (replace == 0 || replace->sin_addr.S_un.S_addr == INADDR_NONE) {
+        case LOOKUP_BLOCK:
                 /*
                  * On Windows, WSAGetLastError () and WSASetLastError () are
                  * just thin wrappers around GetLastError ()/SetLastError (),
@@ -448,131 +801,301 @@ struct hostent * WSAAPI gethostHook (const char * name) {
                  * see what went wrong.
                  */
 
-                char            show [128];
-                wsprintfA (show, "lookup %.50s refused\r\n", name);
-                OutputDebugStringA (show);
                 SetLastError (WSAHOST_NOT_FOUND);
                 return 0;
+
+        case LOOKUP_KEEP:
+                /*
+                 * If the matching rule is a passthrough, then wrap it but do
+                 * still log the result.
+                 */
+
+                result = g_resolveHost (* g_gethostHook, name);
+                if (result == 0) {
+                        g_traceLookup (TRACE_LOOKUP_FAILED, name);
+                        return 0;
+                }
+
+                g_traceLookup (TRACE_LOOKUP, name,
+                               * (unsigned long *) * result->h_addr_list);
+                return result;
+
+        default:
+                break;
         }
 
         /*
          * Replacing a DNS result raises the question of storage, which for
-         * base Windows sockets is per-thread; we could also choose to use a
-         * non-thread-safe global like most UNIX implementations.
+         * base Windows sockets is per-thread; so, the answer goes in this
+         * thread's data block, copying the addresses rather than pointing at
+         * the rule's replacements.
          *
          * One obvious trick would be to let the underlying call return the
          * structure which we modify, but the tradeoff there is that if it
          * fails we don't have a pointer.
-         *
-         * So for now, cheese out and use a global; also, copy the address
-         * rather than point at the replacement.
          */
 
-        hostent       * result = 0;
-        if (replace != 0 && replace->sin_addr.S_un.S_addr == INADDR_ANY) {
-                /*
-                 * If the matching rule is a passthrough, then wrap it but do
-                 * still log the result.
-                 */
-
-                result = (* g_gethostHook) (name);
-        } else {
-static  hostent         storage;
-static  unsigned long   addr;
-static  unsigned long * addrList [2] = { & addr };
-
-                addr = replace->sin_addr.S_un.S_addr;
-                storage.h_addrtype = AF_INET;
-                storage.h_addr_list = (char **) addrList;
-                storage.h_aliases = 0;
-                storage.h_length = sizeof (addr);
-                storage.h_name = "remapped.local";
-                result = & storage;
-        }
-
-        char            show [128];
-        if (result == 0) {
-                wsprintfA (show, "lookup %.50s failed\r\n", name);
-                OutputDebugStringA (show);
+        ThreadData    * data = g_threadData ();
+        if (data == 0) {
+                SetLastError (WSANO_RECOVERY);
                 return 0;
         }
 
-        unsigned char * bytes = (unsigned char *) * result->h_addr_list;
-        wsprintfA (show, "lookup %.50s as %d.%d.%d.%d\r\n",
-                   name, bytes [0], bytes [1], bytes [2], bytes [3]);
-        OutputDebugStringA (show);
+        return g_hostFill (data->m_host, addrs, count, "remapped.local");
+}
 
-        return result;
+/**
+ * Work out the port for the answer to a lookup, in network order, from the
+ * service that was asked for.
+ */
+
+template <class Char>
+bool lookupPort (const Char * service, const HostInfoRequest & request,
+                 unsigned short & port) {
+        if (hostInfoPort (service, port)) {
+                port = ntohs (port);            /* which swaps either way */
+                return true;
+        }
+
+        char            name [80];
+        if (g_getservbyname == 0 ||
+            ! hostInfoNarrow (service, name, sizeof (name)))
+                return false;
+
+        const char    * proto = "tcp";
+        if (request.m_socktype == SOCK_DGRAM)
+                proto = "udp";
+
+        servent       * found = g_getservbyname (name, proto);
+        if (found == 0)
+                return false;
+
+        port = found->s_port;
+        return true;
 }
 
 /**
- * For measuring bandwidth.
+ * Answer one of the getaddrinfo () family of lookups from the rules, or from
+ * the lookup cache, if it can be; if not, the hook calls the real function.
+ *
+ * Rewritten answers are made up from the rule's targets without going near
+ * the resolver at all. Names with no rule are answered from the cache when
+ * the caller only wants IPv4 addresses, since that's all the cache holds; the
+ * rest of the time the system's answer may have IPv6 addresses as well. The
+ * canonical name of a made-up answer is the name asked for.
+ *
+ * The memory for the answer is the filter's own, and the hooks on the
+ * functions which free answers give it back.
  */
 
-class Meter {
-public:
-typedef CRITICAL_SECTION        Mutex;
+template <class Info, class Char>
+bool lookupAnswer (const Char * node, const Char * service,
+                   const Info * hints, Info ** result, int & error) {
+        HostInfoRequest request;
+        hostInfoRequest (hints, request);
 
-private:
-        Mutex           m_lock;
-        unsigned long   m_now;
-        unsigned long   m_currentBytes;
+        char            name [HOST_CACHE_NAME_MAX];
+        if (node == 0 || result == 0 || (request.m_flags & AI_NUMERICHOST) ||
+            ! hostInfoNarrow (node, name, sizeof (name)))
+                return false;
 
-        unsigned long   m_last;
-        long long       m_total;
+        unsigned long   addrs [RULE_TARGETS_MAX];
+        unsigned long   count;
+        const unsigned long * list = addrs;
+        HostAnswer      answer;
 
-        void            newTick (unsigned long now);
+        switch (lookupRule (name, addrs, count)) {
+        case LOOKUP_BLOCK:
+                error = WSAHOST_NOT_FOUND;
+                break;
 
-public:
-                        Meter ();
+        case LOOKUP_REWRITE:
+                error = 0;
+                if (request.m_family != AF_UNSPEC &&
+                    request.m_family != AF_INET)
+                        error = WSANO_DATA;
+                break;
 
-        void            operator += (int bytes);
-};
+        default:
+                if (request.m_family != AF_INET ||
+                    ! g_resolveFind (name, answer))
+                        return false;
+
+                error = answer.m_error;
+                list = answer.m_addrs;
+                count = answer.m_count;
+                break;
+        }
+
+        if (error == 0 && ! lookupPort (service, request, request.m_port))
+                error = WSATYPE_NOT_FOUND;
+
+        if (error == 0) {
+                const Char    * canonical = 0;
+                if ((request.m_flags & AI_CANONNAME) != 0)
+                        canonical = node;
+
+                void          * mem;
+                mem = g_resolveAlloc (hostInfoSize<Info> (count, canonical));
+                if (mem != 0)
+                        * result = hostInfoBuild<Info> (mem, list, count,
+                                                        request, canonical);
+                else
+                        error = WSA_NOT_ENOUGH_MEMORY;
+        }
 
-Meter :: Meter () : m_now (GetTickCount ()), m_currentBytes (0),
-                m_last (0), m_total (0) {
-        InitializeCriticalSection (& m_lock);
+        SetLastError (error);
+        return true;
 }
 
-void Meter :: newTick (unsigned long now) {
-        unsigned long   delta = now - m_now;
-        if (delta < 1)
+/**
+ * Keep the system's answer to one of the getaddrinfo () family of lookups in
+ * the cache, where it's one that lookupAnswer () could use later.
+ */
+
+template <class Info, class Char>
+void lookupStore (const Char * node, const Info * hints, Info ** result,
+                  int error) {
+        char            name [HOST_CACHE_NAME_MAX];
+        if (node == 0 || hints == 0 || hints->ai_family != AF_INET ||
+            (hints->ai_flags & AI_NUMERICHOST) != 0 ||
+            ! hostInfoNarrow (node, name, sizeof (name)))
                 return;
 
-        unsigned long   bytes = m_currentBytes;
-        m_currentBytes = 0;
+        HostAnswer      answer;
+        answer.m_error = error;
+        answer.m_count = 0;
+        answer.m_name [0] = 0;
 
-        m_total += bytes;
+        if (error == 0)
+                answer.m_count = hostInfoAddrs (* result, answer.m_addrs,
+                                                HOST_CACHE_ADDRS);
 
-        unsigned long   delta2 = m_now - m_last;
+        g_resolveStore (name, answer);
+}
 
-#if     0
-        char            buf [80];
-        wsprintfA (buf, "%d %d %d %X\r\n",
-                   delta, bytes, delta2,
-                   (unsigned long) m_total);
-        OutputDebugStringA (buf);
-#endif
+/**
+ * Hook for the getaddrinfo () lookup function.
+ */
 
-        m_last = m_now;
-        m_now = now;
+int WSAAPI getaddrinfoHook (const char * node, const char * service,
+                            const addrinfo * hints, addrinfo ** result) {
+        InHook          hooking;
+        InLookup        lookup;
+
+        int             error;
+        if (lookup.nested ())
+                return (* g_getaddrinfoHook) (node, service, hints, result);
+
+        if (lookupAnswer (node, service, hints, result, error))
+                return error;
+
+        error = (* g_getaddrinfoHook) (node, service, hints, result);
+        lookupStore (node, hints, result, error);
+        return error;
 }
 
-void Meter :: operator += (int bytes) {
-        if (bytes == SOCKET_ERROR)
-                bytes = 0;
+/**
+ * Hook for the GetAddrInfoW () lookup function.
+ */
 
-        EnterCriticalSection (& m_lock);
+int WSAAPI getAddrInfoWHook (const wchar_t * node, const wchar_t * service,
+                             const ADDRINFOW * hints, ADDRINFOW ** result) {
+        InHook          hooking;
+        InLookup        lookup;
 
-        unsigned long   now = GetTickCount ();
-        newTick (now);
+        int             error;
+        if (lookup.nested ())
+                return (* g_getAddrInfoWHook) (node, service, hints, result);
 
-        m_currentBytes += bytes;
+        if (lookupAnswer (node, service, hints, result, error))
+                return error;
 
-        LeaveCriticalSection (& m_lock);
+        error = (* g_getAddrInfoWHook) (node, service, hints, result);
+        lookupStore (node, hints, result, error);
+        return error;
 }
 
-Meter           g_meter;
+/**
+ * Hook for the GetAddrInfoExW () lookup function.
+ *
+ * Only lookups in the DNS namespace, or in all of them, are for the rules;
+ * asking a particular provider is left alone. An asynchronous lookup which
+ * can be answered straight away is, with the answer delivered as though the
+ * lookup had gone off to the network and come back at once.
+ */
+
+int WSAAPI getAddrInfoExWHook (const wchar_t * name, const wchar_t * service,
+                               unsigned long space, GUID * provider,
+                               const ADDRINFOEXW * hints,
+                               ADDRINFOEXW ** result, timeval * timeout,
+                               OVERLAPPED * overlapped,
+                               LPLOOKUPSERVICE_COMPLETION_ROUTINE completion,
+                               HANDLE * cancel) {
+        InHook          hooking;
+        InLookup        lookup;
+
+        bool            rules = ! lookup.nested () && provider == 0 &&
+                                (space == NS_ALL || space == NS_DNS);
+
+        int             error;
+        if (! rules || ! lookupAnswer (name, service, hints, result, error)) {
+                error = (* g_getAddrInfoExWHook) (name, service, space,
+                                                  provider, hints, result,
+                                                  timeout, overlapped,
+                                                  completion, cancel);
+                if (rules && overlapped == 0)
+                        lookupStore (name, hints, result, error);
+
+                return error;
+        }
+
+        if (overlapped == 0)
+                return error;
+
+        if (cancel != 0)
+                * cancel = 0;
+
+        return g_resolveComplete (overlapped, (ResolveDone) completion, error);
+}
+
+/**
+ * Hooks for the functions which free lookup answers, which look out for the
+ * answers the filter made up itself.
+ *
+ * Strictly each answer should go back to the function matching the one that
+ * made it, but all three hooks check for all of the filter's answers anyway.
+ * @{
+ */
+
+void WSAAPI freeaddrinfoHook (addrinfo * info) {
+        InHook          hooking;
+
+        if (info != 0 && g_anyResolved () && g_resolveRelease (info))
+                return;
+
+        (* g_freeaddrinfoHook) (info);
+}
+
+void WSAAPI freeAddrInfoWHook (ADDRINFOW * info) {
+        InHook          hooking;
+
+        if (info != 0 && g_anyResolved () && g_resolveRelease (info))
+                return;
+
+        (* g_freeAddrInfoWHook) (info);
+}
+
+void WSAAPI freeAddrInfoExWHook (ADDRINFOEXW * info) {
+        InHook          hooking;
+
+        if (info != 0 && g_anyResolved () && g_resolveRelease (info))
+                return;
+
+        (* g_freeAddrInfoExWHook) (info);
+}
+
+/**@}*/
 
 /**
  * Hook the recv () API, to measure received bandwidth.
@@ -584,11 +1107,12 @@ Meter           g_meter;
 
 int WSAAPI recvHook (SOCKET s, char * buf, int len, int flags) {
         InHook          hooking;
+        HookTimer       timer (HOOK_RECV);
 
         Replacement   * replace;
-        replace = g_findReplacement (s);
+        replace = g_anyReplacement () ? g_findReplacement (s) : 0;
         if (replace != 0) {
-                OutputDebugStringA ("Substituting HTTP response\r\n");
+                g_trace (TRACE_RESPONSE_REPLACED);
 
                 unsigned long   count = 0;
                 bool            ok;
@@ -599,20 +1123,177 @@ int WSAAPI recvHook (SOCKET s, char * buf, int len, int flags) {
                 return ok ? count : - 1;
         }
 
+        /*
+         * Under a bandwidth limit, a blocking receive is held up until the
+         * limit allows it; a non-blocking one is told to try again later.
+         */
+
+        bool            limit = g_anyLimit () && (flags & MSG_PEEK) == 0;
+        if (limit && len > 0) {
+                LimitWait       wait;
+                wait = g_failoverNonBlocking (s) ? LIMIT_REFUSE : LIMIT_BLOCK;
+                len = (int) g_limitAllow (s, (unsigned long) len, wait);
+                if (len == 0) {
+                        SetLastError (WSAEWOULDBLOCK);
+                        return SOCKET_ERROR;
+                }
+        }
+
+        Segmented     * segment;
+        segment = g_anySegmented () ? g_findSegmented (s) : 0;
+        if (segment != 0) {
+                unsigned long   count = 0;
+                unsigned long   error;
+                error = g_segmentRead (segment, buf, len, false, & count);
+                SetLastError (error);
+                if (error != ERROR_SUCCESS)
+                        return SOCKET_ERROR;
+
+                g_meter += count;
+                if (limit)
+                        g_limitReceived (s, count);
+                return count;
+        }
+
         int             result;
+        timer.under ();
         result = (* g_recvHook) (s, buf, len, flags);
+        timer.back ();
         g_meter += result;
+
+        if (result > 0 && limit)
+                g_limitReceived (s, result);
+
+        if (result > 0 && g_anyFlow ())
+                g_mirrorReceived (s, result);
+
+        if (result > 0 && g_anyCapture () && (flags & MSG_PEEK) == 0) {
+                WSABUF          data;
+                data.buf = buf;
+                data.len = result;
+                g_captureData (g_findCapture (s), & data, 1, result);
+        }
+
         return result;
 }
 
+/**
+ * Hook the recvfrom () API, to measure received bandwidth and to put back the
+ * source of datagrams on flows which have been redirected.
+ */
+
 int WSAAPI recvfromHook (SOCKET s, char * buf, int len, int flags,
                          sockaddr * from, int * fromLen) {
         InHook          hooking;
 
-        int             result;
-        result = (* g_recvfromHook) (s, buf, len, flags, from, fromLen);
-        g_meter += result;
-        return result;
+        int             result;
+        result = (* g_recvfromHook) (s, buf, len, flags, from, fromLen);
+        g_meter += result;
+
+        if (result != SOCKET_ERROR && g_anyDatagram ())
+                g_datagramReceived (s, from, fromLen);
+
+        return result;
+}
+
+/**
+ * Hook the WSARecvFrom () API, for the same reasons.
+ *
+ * Where the receive is left pending, the source is only filled in when it
+ * completes, so only receives which complete straight away can be fixed up.
+ */
+
+int WSAAPI wsaRecvFromHook (SOCKET s, LPWSABUF buffers, unsigned long count,
+                            unsigned long * received, unsigned long * flags,
+                            sockaddr * from, int * fromLength,
+                            OVERLAPPED * overlapped,
+                            LPWSAOVERLAPPED_COMPLETION_ROUTINE handler) {
+        InHook          hooking;
+
+        int             result;
+        result = (* g_wsaRecvFromHook) (s, buffers, count, received, flags,
+                                        from, fromLength, overlapped, handler);
+        if (result != 0)
+                return result;
+
+        if (received != 0)
+                g_meter += * received;
+
+        if (g_anyDatagram ())
+                g_datagramReceived (s, from, fromLength);
+
+        return result;
+}
+
+/**
+ * Complete a receive that we've satisfied ourselves, as the underlying API
+ * would have if the data had been there immediately.
+ */
+
+void completeRecv (OVERLAPPED * overlapped,
+                   LPWSAOVERLAPPED_COMPLETION_ROUTINE handler,
+                   unsigned long * received, unsigned long result,
+                   unsigned long count) {
+        if (overlapped != 0) {
+                overlapped->Internal = result;
+                overlapped->InternalHigh = count;
+
+                HANDLE          event = overlapped->hEvent;
+                event = (HANDLE) ((unsigned long) event & ~ 1);
+                if (event != 0)
+                        SetEvent (event);
+        }
+
+        if (received != 0)
+                * received = count;
+
+        if (handler != 0)
+                (* handler) (result, count, overlapped, 0);
+}
+
+/**
+ * Most buffers of a receive that are kept when it's sliced.
+ */
+
+#define SLICE_BUFFERS_MAX       8
+
+/**
+ * Shorten a receive's buffers to what the bandwidth limits allow, returning
+ * the length of the slice; if the receive can't go ahead without waiting and
+ * it may only be refused, no buffers are left at all.
+ *
+ * The caller's array is left alone and a copy is made where need be; Winsock
+ * captures the buffer descriptions when a receive is issued, so a copy on the
+ * stack does fine even for an overlapped receive.
+ */
+
+unsigned long sliceBuffers (SOCKET s, LPWSABUF & buffers,
+                            unsigned long & count, WSABUF * sliced,
+                            LimitWait wait) {
+        unsigned long   total = 0;
+        unsigned long   i;
+        for (i = 0 ; i < count ; ++ i)
+                total += buffers [i].len;
+
+        if (total == 0)
+                return 0;
+
+        unsigned long   allow = g_limitAllow (s, total, wait);
+        if (allow >= total)
+                return total;
+
+        unsigned long   remaining = allow;
+        for (i = 0 ; i < count && i < SLICE_BUFFERS_MAX && remaining > 0 ; ++ i) {
+                sliced [i] = buffers [i];
+                if (sliced [i].len > remaining)
+                        sliced [i].len = remaining;
+
+                remaining -= sliced [i].len;
+        }
+
+        buffers = sliced;
+        count = i;
+        return allow - remaining;
 }
 
 /**
@@ -636,11 +1317,12 @@ int WSAAPI wsaRecvHook (SOCKET s, LPWSABUF buffers, unsigned long bytes,
                         OVERLAPPED * overlapped,
                         LPWSAOVERLAPPED_COMPLETION_ROUTINE handler) {
         InHook          hooking;
+        HookTimer       timer (HOOK_WSARECV);
 
         Replacement   * replace;
-        replace = g_findReplacement (s);
+        replace = g_anyReplacement () ? g_findReplacement (s) : 0;
         if (replace != 0) {
-                OutputDebugStringA ("Substituting HTTP response\r\n");
+                g_trace (TRACE_RESPONSE_REPLACED);
 
                 unsigned long   count = 0;
                 bool            ok;
@@ -649,21 +1331,7 @@ int WSAAPI wsaRecvHook (SOCKET s, LPWSABUF buffers, unsigned long bytes,
                 unsigned long   result = ok ? ERROR_SUCCESS : WSAEINVAL;
                 SetLastError (result);
 
-                if (overlapped != 0) {
-                        overlapped->Internal = result;
-                        overlapped->InternalHigh = count;
-
-                        HANDLE          event = overlapped->hEvent;
-                        event = (HANDLE) ((unsigned long) event & ~ 1);
-                        if (event != 0)
-                                SetEvent (event);
-                }
-
-                if (received != 0)
-                        * received = count;
-
-                if (handler != 0)
-                        (* handler) (result, count, overlapped, 0);
+                completeRecv (overlapped, handler, received, result, count);
 
                 /*
                  * For now I don't support MSG_PEEK or MSG_WAITALL in the flags.
@@ -672,10 +1340,86 @@ int WSAAPI wsaRecvHook (SOCKET s, LPWSABUF buffers, unsigned long bytes,
                 return result;
         }
 
+        /*
+         * Only a blocking receive can be held up by a bandwidth limit, and
+         * only one on a non-blocking socket refused by it; failing an
+         * overlapped receive with WSAEWOULDBLOCK would tell the client it has
+         * too many outstanding, so that is always posted, if only for a slice.
+         */
+
+        LimitWait       wait = LIMIT_BLOCK;
+        if (overlapped != 0 || handler != 0) {
+                wait = LIMIT_SLICE;
+        } else if (g_failoverNonBlocking (s))
+                wait = LIMIT_REFUSE;
+
+        /*
+         * Reads from a segmented download are always completed immediately,
+         * waiting for the data first if need be.
+         */
+
+        Segmented     * segment;
+        segment = g_anySegmented () ? g_findSegmented (s) : 0;
+        if (segment != 0) {
+                unsigned long   count = 0;
+                unsigned long   error;
+                unsigned long   length = buffers->len;
+                if (g_anyLimit () && length > 0) {
+                        length = g_limitAllow (s, length, wait);
+                        if (length == 0) {
+                                SetLastError (WSAEWOULDBLOCK);
+                                return SOCKET_ERROR;
+                        }
+                }
+
+                error = g_segmentRead (segment, buffers->buf, length,
+                                       overlapped != 0 || handler != 0,
+                                       & count);
+                SetLastError (error);
+                if (error != ERROR_SUCCESS)
+                        return SOCKET_ERROR;
+
+                g_meter += count;
+                if (g_anyLimit ())
+                        g_limitReceived (s, count);
+                completeRecv (overlapped, handler, received, error, count);
+                return 0;
+        }
+
+        bool            ignore;
+        ignore = flags != 0 && (* flags & MSG_PEEK) != 0;
+
+        Capture       * capture = 0;
+        if (g_anyCapture () && ! ignore)
+                capture = g_findCapture (s);
+
+        /*
+         * Under a bandwidth limit, the receive is held up until the limit
+         * allows it and then sliced to what it allows; a receive on a
+         * non-blocking socket is told to try again later instead of being held
+         * up, and an overlapped one is cut to the smallest slice.
+         */
+
+        bool            limit = g_anyLimit () && ! ignore;
+        LPWSABUF        slice = buffers;
+        unsigned long   sliceCount = bytes;
+        WSABUF          sliced [SLICE_BUFFERS_MAX];
+        unsigned long   sliceLength = 0;
+        if (limit) {
+                sliceLength = sliceBuffers (s, slice, sliceCount, sliced,
+                                            wait);
+                if (sliceCount == 0 && bytes != 0) {
+                        SetLastError (WSAEWOULDBLOCK);
+                        return SOCKET_ERROR;
+                }
+        }
+
         if (overlapped != 0 || handler != 0) {
                 int             result;
-                result = (* g_wsaRecvHook) (s, buffers, bytes, received, flags,
-                                              overlapped, handler);
+                timer.under ();
+                result = (* g_wsaRecvHook) (s, slice, sliceCount, received,
+                                            flags, overlapped, handler);
+                timer.back ();
 
                 if (result == 0 && overlapped != 0) {
                         /**
@@ -683,18 +1427,61 @@ int WSAAPI wsaRecvHook (SOCKET s, LPWSABUF buffers, unsigned long bytes,
                          */
 
                         g_meter += overlapped->InternalHigh;
+
+                        if (g_anyFlow ())
+                                g_mirrorReceived (s, overlapped->InternalHigh);
+                        if (limit)
+                                g_limitReceived (s, overlapped->InternalHigh);
+                } else if (result != 0 && (g_anyFlow () || limit) &&
+                           GetLastError () == WSA_IO_PENDING) {
+                        if (g_anyFlow ())
+                                g_mirrorDeferred (s, overlapped);
+                        if (limit)
+                                g_limitDeferred (s, overlapped, sliceLength);
+                        SetLastError (WSA_IO_PENDING);
                 }
+
+                /*
+                 * If we're capturing the response on this socket, we need to
+                 * see the data when it arrives; completion routines deliver it
+                 * somewhere we can't see, so those just abandon the capture.
+                 */
+
+                if (capture == 0)
+                        return result;
+
+                if (handler != 0) {
+                        g_abandonCapture (capture);
+                } else if (result == 0) {
+                        g_captureData (capture, buffers, bytes,
+                                       overlapped->InternalHigh);
+                } else if (GetLastError () == WSA_IO_PENDING) {
+                        g_captureDeferred (capture, overlapped, buffers, bytes);
+                        SetLastError (WSA_IO_PENDING);
+                } else
+                        g_abandonCapture (capture);
+
                 return result;
         }
 
-        bool            ignore;
-        ignore = flags != 0 && (* flags & MSG_PEEK) != 0;
-
         int             result;
-        result = (* g_wsaRecvHook) (s, buffers, bytes, received, flags,
+        timer.under ();
+        result = (* g_wsaRecvHook) (s, slice, sliceCount, received, flags,
                                     overlapped, handler);
-        if (result != SOCKET_ERROR && ! ignore)
+        timer.back ();
+        if (result != SOCKET_ERROR && ! ignore) {
                 g_meter += * received;
+
+                if (limit)
+                        g_limitReceived (s, * received);
+
+                if (g_anyFlow ())
+                        g_mirrorReceived (s, * received);
+
+                if (capture != 0)
+                        g_captureData (capture, buffers, bytes, * received);
+        }
+
         return result;
 }
 
@@ -719,10 +1506,30 @@ int WSAAPI closesocket_Hook (SOCKET s) {
         InHook          hooking;
 
         g_removeTracking (s);
+        g_removeSegmented (s);
+        g_mirrorClose (s);
+        g_failoverClose (s);
+        g_limitClose (s);
+        g_datagramClose (s);
 
         return (* g_closesocket_Hook) (s);
 }
 
+/**
+ * Hook for ioctlsocket (), to keep track of which sockets are non-blocking.
+ */
+
+int WSAAPI ioctlsocketHook (SOCKET s, long command, unsigned long * arg) {
+        InHook          hooking;
+
+        int             result;
+        result = (* g_ioctlsocketHook) (s, command, arg);
+        if (result == 0 && command == FIONBIO)
+                g_failoverMode (s, * arg != 0);
+
+        return result;
+}
+
 /**
  * Hook for event processing.
  *
@@ -735,14 +1542,82 @@ int WSAAPI wsaEnumNetworkEventsHook (SOCKET s, HANDLE event, WSANETWORKEVENTS *
         int             result;
         result = (* g_wsaEnumNetworkEventsHook) (s, event, events);
 
+        if (! g_anyReplacement () && ! g_anySegmented ())
+                return result;
+
         Replacement   * replace;
         replace = g_findReplacement (s);
-        if (replace != 0)
+
+        Segmented     * segment;
+        segment = replace == 0 ? g_findSegmented (s) : 0;
+
+        if (replace != 0 || (segment != 0 && g_segmentReady (segment)))
                 events->lNetworkEvents |= FD_READ;
 
         return result;
 }
 
+/**
+ * Emulate select () where a socket in the read set is waiting for data from a
+ * segmented download, which the underlying implementation knows nothing of.
+ *
+ * This is done by calling the underlying select () in short slices, checking
+ * in between whether any of the downloads has something for the caller.
+ */
+
+int selectSegmented (int count, fd_set * read, fd_set * write,
+                     fd_set * error, const struct timeval * timeout) {
+        fd_set          saveRead = * read;
+        fd_set          saveWrite;
+        fd_set          saveError;
+        if (write != 0)
+                saveWrite = * write;
+        if (error != 0)
+                saveError = * error;
+
+        unsigned long   limit = INFINITE;
+        if (timeout != 0)
+                limit = timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+
+        unsigned long   start = GetTickCount ();
+        for (;;) {
+                unsigned long   elapsed = GetTickCount () - start;
+                unsigned long   slice = 50;
+                if (limit != INFINITE && limit - elapsed < slice)
+                        slice = elapsed < limit ? limit - elapsed : 0;
+
+                timeval         wait = { 0, slice * 1000 };
+                int             result;
+                result = (* g_select_Hook) (count, read, write, error, & wait);
+                if (result == SOCKET_ERROR)
+                        return result;
+
+                unsigned long   i;
+                for (i = 0 ; i < saveRead.fd_count ; ++ i) {
+                        SOCKET          s = saveRead.fd_array [i];
+                        Segmented     * segment = g_findSegmented (s);
+                        if (segment == 0 || ! g_segmentReady (segment) ||
+                            g_netIsSet (s, * read))
+                                continue;
+
+                        FD_SET (s, read);
+                        ++ result;
+                }
+
+                if (result > 0)
+                        return result;
+
+                if (limit != INFINITE && GetTickCount () - start >= limit)
+                        return 0;
+
+                * read = saveRead;
+                if (write != 0)
+                        * write = saveWrite;
+                if (error != 0)
+                        * error = saveError;
+        }
+}
+
 /**
  * Hook for event process, obsolete style.
  *
@@ -760,19 +1635,37 @@ int WSAAPI select_Hook (int count, fd_set * read, fd_set * write,
          * Look in the read set to see if there's something there we want to
          * trigger an event on. If there is, synthesize one immediately and
          * don't pass on to the inner Win32 implementation at all.
+         *
+         * In the common case there's nothing pending for any socket, so skip
+         * the scan entirely.
          */
 
         fd_set          result [1];
         FD_ZERO (result);
 
         int             readCount = read == 0 ? 0 : read->fd_count;
+        if (! g_anyReplacement () && ! g_anySegmented ())
+                readCount = 0;
+
+        bool            waiting = false;
         int             i;
         for (i = 0 ; i < readCount ; ++ i) {
                 SOCKET          s = read->fd_array [i];
                 Replacement   * replace = g_findReplacement (s);
 
-                if (replace != 0)
+                if (replace != 0) {
+                        FD_SET (s, result);
+                        continue;
+                }
+
+                Segmented     * segment = g_findSegmented (s);
+                if (segment == 0)
+                        continue;
+
+                if (g_segmentReady (segment)) {
                         FD_SET (s, result);
+                } else
+                        waiting = true;
         }
 
         if (result->fd_count > 0) {
@@ -784,6 +1677,9 @@ int WSAAPI select_Hook (int count, fd_set * read, fd_set * write,
                 return result->fd_count;
         }
 
+        if (waiting)
+                return selectSegmented (count, read, write, error, timeout);
+
         /*
          * Pass through to the underlying implementation.
          *
@@ -804,6 +1700,9 @@ int WSAAPI select_Hook (int count, fd_set * read, fd_set * write,
 /**
  * Experimental hook for WSAGetOverlapped () in case we find a client doing
  * high-performance I/O through it.
+ *
+ * This is also where the data from a deferred overlapped receive turns up, so
+ * if we're capturing a response it's collected here.
  */
 
 BOOL WSAAPI wsaGetOverlappedHook (SOCKET s, OVERLAPPED * overlapped,
@@ -814,6 +1713,15 @@ BOOL WSAAPI wsaGetOverlappedHook (SOCKET s, OVERLAPPED * overlapped,
         BOOL            result;
         result = (* g_wsaGetOverlappedHook) (s, overlapped, length, wait, flags);
 
+        if (result && g_anyCapture ())
+                g_captureCompleted (s, overlapped, * length);
+
+        if (result && g_anyFlow ())
+                g_mirrorCompleted (s, overlapped, * length);
+
+        if (result && g_anyLimit ())
+                g_limitCompleted (s, overlapped, * length);
+
         return result;
 }
 
@@ -889,7 +1797,7 @@ char * splice (const char * base, const char * from, const char * to,
         size_t          subst2 = concat == 0 ? 0 : strlen (concat);
         size_t          rest = base + length - to;
         size_t          total = first + subst + subst2 + rest;
-        char          * copy = (char *) HeapAlloc (GetProcessHeap (), 0, total + 1);
+        char          * copy = (char *) g_poolAlloc (total + 1);
 
         char          * out = copy;
         if (first > 0) {
@@ -1048,12 +1956,14 @@ const char * filterHttpUrl (SOCKET s, const char * buf, size_t & length) {
          */
 
         size_t          avail = temp + sizeof (temp) - dest;
+        bool            truncated = false;
 
         if (tempLen + hostLength + 3 > avail) {
                 if (hostLength + 3 > avail)
                         return buf;
 
                 tempLen = avail - hostLength - 3;
+                truncated = true;
         }
 
         memcpy (dest, buf, verb);
@@ -1090,10 +2000,8 @@ const char * filterHttpUrl (SOCKET s, const char * buf, size_t & length) {
         memcpy (dest, buf + verb, tempLen - verb);
         dest += tempLen - verb;
 
-        strcpy (dest, "\r\n");
-
-        OutputDebugStringA (temp);
         * dest = 0;
+        g_trace (TRACE_REQUEST, temp);
 
         /*
          * Before we do the URL processing, perform a host replacement if it is
@@ -1107,7 +2015,7 @@ const char * filterHttpUrl (SOCKET s, const char * buf, size_t & length) {
                  */
 
                 if (newHost == 0 || * newHost == 0) {
-                        OutputDebugStringA ("Rejected host\r\n");
+                        g_trace (TRACE_HOST_REJECTED);
                         return 0;
                 }
 
@@ -1132,7 +2040,7 @@ const char * filterHttpUrl (SOCKET s, const char * buf, size_t & length) {
                 buf = splice (buf, host, host + hostLength, length,
                               newHost, "\r\n");
 
-                OutputDebugStringA ("Replaced host\r\n");
+                g_trace (TRACE_HOST_REPLACED);
                 break;
         }
 
@@ -1165,7 +2073,7 @@ const char * filterHttpUrl (SOCKET s, const char * buf, size_t & length) {
                  */
 
                 if (newHost == 0 || * newHost == 0) {
-                        OutputDebugStringA ("Rejected host+url\r\n");
+                        g_trace (TRACE_HOSTURL_REJECTED);
                         return 0;
                 }
 
@@ -1177,7 +2085,7 @@ const char * filterHttpUrl (SOCKET s, const char * buf, size_t & length) {
          */
 
         if (replace == 0 || * replace == 0) {
-                OutputDebugStringA ("Rejected URL\r\n");
+                g_trace (TRACE_URL_REJECTED);
                 return 0;
         }
 
@@ -1195,6 +2103,11 @@ const char * filterHttpUrl (SOCKET s, const char * buf, size_t & length) {
          * up with a virtual host rule that requires its own name rather than
          * the *.steampowered.com one. This forces me to have to look at rules
          * to process the hostnames and allow/disable hosts at that level.
+         *
+         * The name after the < is normally a registry value, but a name of
+         * the form <file:name refers to a file under the install directory,
+         * which is served from a mapping so large documents cost nothing per
+         * connection.
          */
 
         if (replace [0] == '<') {
@@ -1232,7 +2145,109 @@ const char * filterHttpUrl (SOCKET s, const char * buf, size_t & length) {
                         return 0;
                 }
 
-                OutputDebugStringA ("Failed to replace status\r\n");
+                g_trace (TRACE_STATUS_FAILED);
+                return 0;
+        }
+
+        /*
+         * A pattern starting with @ caches the response to a GET for up to the
+         * given number of seconds. If we have a fresh copy it's served just
+         * like a replacement document, otherwise the request goes through and
+         * we capture what comes back.
+         *
+         * The cache key is the host and URL together, so a URL we've had to
+         * truncate can't be cached as it might collide with another.
+         */
+
+        if (replace [0] == '@') {
+                ++ replace;
+
+                unsigned long   ttl = l_getStatus (replace);
+                const char    * key = hostPart != 0 ? hostPart : urlPart;
+                if (verb != 4 || truncated || ttl == 0)
+                        return buf;
+
+                Document      * doc = g_cacheLookup (key);
+                if (doc != 0) {
+                        bool            served = g_addReplacement (s, doc);
+                        g_documentRelease (doc);
+
+                        if (served) {
+                                g_trace (TRACE_CACHE_SERVED);
+                                if (newHost != 0)
+                                        g_poolFree ((void *) buf);
+
+                                length = 0;
+                                return 0;
+                        }
+                }
+
+                g_addCapture (s, key, ttl);
+                return buf;
+        }
+
+        /*
+         * A pattern starting with $ keeps depot chunks in the local store,
+         * serving them from there if we have them and otherwise letting the
+         * request through and writing the chunk into the store as it comes
+         * back. An optional number after the $ is the store size limit in
+         * megabytes.
+         */
+
+        if (replace [0] == '$') {
+                ++ replace;
+
+                unsigned long   limit = l_getStatus (replace);
+                if (limit == 0)
+                        limit = DEPOT_DEFAULT_LIMIT;
+
+                char            key [DEPOT_KEY_LENGTH];
+                if (verb != 4 || ! g_depotKey (urlPart, key))
+                        return buf;
+
+                Document      * doc = g_depotLookup (key);
+                if (doc != 0) {
+                        bool            served = g_addReplacement (s, doc);
+                        g_documentRelease (doc);
+
+                        if (served) {
+                                g_trace (TRACE_DEPOT_SERVED);
+                                if (newHost != 0)
+                                        g_poolFree ((void *) buf);
+
+                                length = 0;
+                                return 0;
+                        }
+                }
+
+                g_addCapture (s, key, limit, CAPTURE_DEPOT);
+                return buf;
+        }
+
+        /*
+         * A pattern starting with % splits a GET across all the targets of
+         * the rule that redirected the connection, with an optional number
+         * after the % being the size of each part in kilobytes. If the
+         * connection wasn't redirected to several servers or the client is
+         * already asking for a range itself, the request just goes through.
+         */
+
+        if (replace [0] == '%') {
+                ++ replace;
+
+                unsigned long   size = l_getStatus (replace);
+                if (size == 0)
+                        size = SEGMENT_DEFAULT_SIZE;
+
+                if (verb != 4 || c_memifind (buf, "\r\nrange:", length) != 0 ||
+                    ! g_segmentStart (s, buf, length, size * 1024))
+                        return buf;
+
+                g_trace (TRACE_SEGMENTED);
+                if (newHost != 0)
+                        g_poolFree ((void *) buf);
+
+                length = 0;
                 return 0;
         }
 
@@ -1266,48 +2281,12 @@ const char * filterHttpUrl (SOCKET s, const char * buf, size_t & length) {
          */
 
         if (newHost != 0)
-                HeapFree (GetProcessHeap (), 0, (LPVOID) buf);
+                g_poolFree ((void *) buf);
 
         return copy;
 
 }
 
-/**
- * Helper for WSASend () etc to optionally log raw sends to OutputDebugString.
- *
- * Since the output function requires a NUL terminator, break up the output
- * into segments (copying into a staging buffer).
- */
-
-void debugWrite (const char * func, const char * buf, size_t len) {
-        char            temp [128];
-        wsprintfA (temp, "%s: %d bytes\r\n", func, len);
-        OutputDebugStringA (temp);
-
-        while (len > 0) {
-                size_t          some = ARRAY_LENGTH (temp) - 1;
-                if (len < some)
-                        some = len;
-
-                memcpy (temp, buf, some);
-                temp [some] = 0;
-
-                OutputDebugStringA (temp);
-
-                buf += some;
-                len -= some;
-        }
-}
-
-/**
- * Flag whether to write raw data to OutputDebugString ().
- *
- * This is mainly for debugging; if needed I'll create a registry setting to
- * let people enable it in the field.
- */
-
-bool            g_debugSend = false;
-
 /**
  * Hook the legacy BSD sockets Send () function.
  *
@@ -1322,6 +2301,7 @@ int WSAAPI sendHook (SOCKET s, const char * buf, int len, int flags) {
         }
 
         InHook          hooking;
+        HookTimer       timer (HOOK_SEND);
 
         Discarding    * discard = g_findDiscard (s);
         if (discard != 0) {
@@ -1329,21 +2309,22 @@ int WSAAPI sendHook (SOCKET s, const char * buf, int len, int flags) {
                 g_consumeDiscard (discard, len, & skip);
                 if (len > skip) {
                         int             sent;
+                        timer.under ();
                         len = (* g_sendHook) (s, buf + skip, len - skip, flags);
+                        timer.back ();
                 } else
                         len = 0;
                 return len + skip;
         }
 
-        if (g_debugSend)
-                debugWrite ("send", buf, len);
+        g_traceData (TRACE_DATA_SENT, buf, len);
 
         size_t          length = len;
         const char    * replace = buf;
         replace = filterHttpUrl (s, replace, length);
 
         if (length == 0) {
-                OutputDebugStringA ("Substituting HTTP request\r\n");
+                g_trace (TRACE_REQUEST_REPLACED);
                 return len;
         }
 
@@ -1356,8 +2337,10 @@ int WSAAPI sendHook (SOCKET s, const char * buf, int len, int flags) {
          * Pass-through is the simple case.
          */
 
-        if (replace == buf)
+        if (replace == buf) {
+                timer.under ();
                 return (* g_sendHook) (s, buf, len, flags);
+        }
 
         /*
          * The complexity with replacing is mainly in the return value to hide
@@ -1365,9 +2348,11 @@ int WSAAPI sendHook (SOCKET s, const char * buf, int len, int flags) {
          */
 
         int             result;
+        timer.under ();
         result = (* g_sendHook) (s, replace, (int) length, flags);
+        timer.back ();
 
-        HeapFree (GetProcessHeap (), 0, (LPVOID) replace);
+        g_poolFree ((void *) replace);
 
         if (result == length)
                 return len;
@@ -1396,6 +2381,7 @@ int WSAAPI wsaSendHook (SOCKET s, LPWSABUF buffers, unsigned long count,
                         OVERLAPPED * overlapped,
                         LPWSAOVERLAPPED_COMPLETION_ROUTINE handler) {
         InHook          hooking;
+        HookTimer       timer (HOOK_WSASEND);
 
         const char    * buf = buffers [0].buf;
         size_t          len = buffers [0].len;
@@ -1411,21 +2397,22 @@ int WSAAPI wsaSendHook (SOCKET s, LPWSABUF buffers, unsigned long count,
                 g_consumeDiscard (discard, len, & skip);
                 if (len > skip) {
                         int             sent;
+                        timer.under ();
                         len = (* g_sendHook) (s, buf + skip, len - skip, flags);
+                        timer.back ();
                 } else
                         len = 0;
                 return len + skip;
         }
 
-        if (g_debugSend)
-                debugWrite ("WSASend", buf, len);
+        g_traceData (TRACE_DATA_SENT, buf, len);
 
         buf = filterHttpUrl (s, buf, len);
 
         if (len == 0) {
                 len = buffers [0].len;
 
-                OutputDebugStringA ("Substituting HTTP request\r\n");
+                g_trace (TRACE_REQUEST_REPLACED);
                 if (overlapped != 0) {
                         overlapped->Internal = ERROR_SUCCESS;
                         overlapped->InternalHigh = len;
@@ -1451,6 +2438,7 @@ int WSAAPI wsaSendHook (SOCKET s, LPWSABUF buffers, unsigned long count,
          */
 
         if (buf == buffers [0].buf) {
+                timer.under ();
                 return (* g_wsaSendHook) (s, buffers, count, sent, flags,
                                           overlapped, handler);
         }
@@ -1472,7 +2460,7 @@ int WSAAPI wsaSendHook (SOCKET s, LPWSABUF buffers, unsigned long count,
          */
 
         if (overlapped != 0 || handler != 0 || count > 1) {
-                HeapFree (GetProcessHeap (), 0, (LPVOID) buf);
+                g_poolFree ((void *) buf);
                 SetLastError (WSAEINVAL);
                 return SOCKET_ERROR;
         }
@@ -1480,9 +2468,11 @@ int WSAAPI wsaSendHook (SOCKET s, LPWSABUF buffers, unsigned long count,
         WSABUF          temp [1] = { len, (char *) buf };
         int             result;
         unsigned long   actual;
+        timer.under ();
         result = (* g_wsaSendHook) (s, temp, 1, & actual, flags, 0, 0);
+        timer.back ();
 
-        HeapFree (GetProcessHeap (), 0, (LPVOID) buf);
+        g_poolFree ((void *) buf);
         if (result != 0)
                 return result;
 
@@ -1490,6 +2480,72 @@ int WSAAPI wsaSendHook (SOCKET s, LPWSABUF buffers, unsigned long count,
         return 0;
 }
 
+/**
+ * Hook the legacy sendto () API, to apply the rules for datagrams.
+ *
+ * Datagrams to a destination the rules block are dropped as if they'd been
+ * sent, which is all that ever happens to a datagram nobody is listening for.
+ */
+
+int WSAAPI sendtoHook (SOCKET s, const char * buf, int len, int flags,
+                       const sockaddr * to, int toLength) {
+        InHook          hooking;
+        HookTimer       timer (HOOK_SENDTO);
+
+        sockaddr_in     temp;
+        FlowAction      action = datagramRoute (s, to, toLength, temp);
+        if (action == FLOW_DROP)
+                return len;
+
+        if (action == FLOW_REDIRECT) {
+                to = (const sockaddr *) & temp;
+                toLength = sizeof (temp);
+        }
+
+        timer.under ();
+        return (* g_sendtoHook) (s, buf, len, flags, to, toLength);
+}
+
+/**
+ * Hook the WSASendTo () API, for the same reasons.
+ */
+
+int WSAAPI wsaSendToHook (SOCKET s, LPWSABUF buffers, unsigned long count,
+                          unsigned long * sent, unsigned long flags,
+                          const sockaddr * to, int toLength,
+                          OVERLAPPED * overlapped,
+                          LPWSAOVERLAPPED_COMPLETION_ROUTINE handler) {
+        InHook          hooking;
+        HookTimer       timer (HOOK_WSASENDTO);
+
+        sockaddr_in     temp;
+        FlowAction      action = datagramRoute (s, to, toLength, temp);
+        if (action == FLOW_DROP) {
+                /*
+                 * Complete the send as having gone; completing a receive is
+                 * just the same as far as the caller can tell.
+                 */
+
+                unsigned long   length = 0;
+                unsigned long   i;
+                for (i = 0 ; i < count ; ++ i)
+                        length += buffers [i].len;
+
+                completeRecv (overlapped, handler, sent, ERROR_SUCCESS,
+                              length);
+                return 0;
+        }
+
+        if (action == FLOW_REDIRECT) {
+                to = (const sockaddr *) & temp;
+                toLength = sizeof (temp);
+        }
+
+        timer.under ();
+        return (* g_wsaSendToHook) (s, buffers, count, sent, flags, to,
+                                    toLength, overlapped, handler);
+}
+
 /**
  * Write a 32-bit value into the output in Intel byte order.
  */
@@ -1572,6 +2628,50 @@ int setFilter (wchar_t * address) {
                 g_rules.append (L"//*/depot/*=;"
                                 L"/authdepot/=#200;"
                                 L"/initsession/=#200 " INITSESSION_RESPONSE);
+
+                /*
+                 * The rules may name different documents now, so drop any
+                 * prepared responses; they'll be rebuilt on first use.
+                 */
+
+                g_replacementCache (0);
+
+                /*
+                 * Likewise any decisions made for datagram flows, noting
+                 * whether the new rules apply to datagrams at all.
+                 */
+
+                g_datagramFlush (g_rules.anyDatagram ());
+
+                /*
+                 * The limits of the old rules stay with the connections made
+                 * under them, but new connections bind to the new rules'.
+                 */
+
+                g_limitFlush ();
+
+                /*
+                 * The rules may set a limit for everything received.
+                 */
+
+                RuleOptions     options = g_rules.options ();
+                g_limitGlobal (options.m_limit);
+
+                /*
+                 * The rules may also set how much the hooks trace; the option
+                 * is kept one higher than given, so zero means it wasn't set.
+                 */
+
+                g_traceSet (options.m_trace != 0 ? options.m_trace - 1 :
+                            TRACE_DEFAULT);
+
+                /*
+                 * Likewise for how long host lookups are cached, in seconds.
+                 */
+
+                g_resolveConfigure (options.m_dnsCache != 0 ?
+                                    options.m_dnsCache - 1 :
+                                    HOST_CACHE_TTL / 1000);
         }
 
         return result ? 1 : 0;
@@ -1752,21 +2852,27 @@ void ApiHook :: unhook (void) {
 
 /**
  * Global counter manipulated by InHook as hook functions are entered to make
- * loading and unloading safer.
+ * loading and unloading safer, for threads without a per-thread block.
  */
 
 /* static */
 LONG            InHook :: g_hookCount;
 
 /**
- * Unhook all the hooked functions.
+ * Unhook all the hooked functions, returning whether they all could be.
  */
 
-void unhookAll (void) {
+bool unhookAll (void) {
         g_connectHook.unhook ();
         g_gethostHook.unhook ();
+        g_getaddrinfoHook.unhook ();
+        g_getAddrInfoWHook.unhook ();
+        g_getAddrInfoExWHook.unhook ();
         g_recvHook.unhook ();
         g_recvfromHook.unhook ();
+        g_sendtoHook.unhook ();
+        g_wsaSendToHook.unhook ();
+        g_wsaRecvFromHook.unhook ();
         g_wsaRecvHook.unhook ();
         g_select_Hook.unhook ();
         g_sendHook.unhook ();
@@ -1775,14 +2881,42 @@ void unhookAll (void) {
         g_wsaGetOverlappedHook.unhook ();
         g_wsaEnumNetworkEventsHook.unhook ();
         g_wsaSendHook.unhook ();
+        g_ioctlsocketHook.unhook ();
 
         /*
          * Wait until none of the main application threads are inside any of
          * the hook routines.
          */
 
-        while (InHook :: g_hookCount > 0)
-                Sleep (1);
+        g_threadQuiesce (& InHook :: g_hookCount);
+
+        /*
+         * The answers to lookups which the filter made up itself can only be
+         * freed by the hooks on the functions which free answers; with the
+         * lookup hooks gone no more can be made, so give the application a
+         * moment to hand back any it's still holding.
+         *
+         * If it's still holding some after that, the hooks which free them
+         * have to stay for as long as the process lives, since handing one
+         * of them to the system's own function would corrupt the heap. The
+         * DLL is pinned, so that unloading it can't take their code away.
+         */
+
+        g_resolveSettle (RESOLVE_SETTLE_TIME);
+        if (g_anyResolved ()) {
+                HMODULE         pinned;
+                GetModuleHandleExW (GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                                    GET_MODULE_HANDLE_EX_FLAG_PIN,
+                                    (LPCWSTR) unhookAll, & pinned);
+                return false;
+        }
+
+        g_freeaddrinfoHook.unhook ();
+        g_freeAddrInfoWHook.unhook ();
+        g_freeAddrInfoExWHook.unhook ();
+
+        g_threadQuiesce (& InHook :: g_hookCount);
+        return true;
 }
 
 /**
@@ -1841,7 +2975,11 @@ STEAMDLL (int) SteamFilter (wchar_t * address, wchar_t * result,
                 Sleep (1000);
         }
 
-        g_initReplacement (rootKey, rootReg);
+        g_threadInit ();
+        g_datagramInit ();
+        g_statsInit ();
+        g_traceInit ();
+        g_initReplacement (rootKey, rootReg, rootDir);
 
         setFilter (address);
 
@@ -1861,15 +2999,83 @@ STEAMDLL (int) SteamFilter (wchar_t * address, wchar_t * result,
                                                  ws2, "WSAGetOverlappedResult") &&
                   g_wsaEnumNetworkEventsHook.attach (wsaEnumNetworkEventsHook,
                                                      ws2, "WSAEnumNetworkEvents") &&
-                  g_wsaSendHook.attach (wsaSendHook, ws2, "WSASend");
+                  g_wsaSendHook.attach (wsaSendHook, ws2, "WSASend") &&
+                  g_ioctlsocketHook.attach (ioctlsocketHook, ws2,
+                                            "ioctlsocket");
 
         g_getpeername = (getpeernameFunc) GetProcAddress (ws2, "getpeername");
+        g_getservbyname = (getservbynameFunc) GetProcAddress (ws2,
+                                                              "getservbyname");
 
         if (! success) {
                 unhookAll ();
                 return ~ 0UL;
         }
 
+        /*
+         * The newer lookup functions aren't in every version of Windows, so
+         * they're hooked where they exist but aren't required. Each one is
+         * only hooked once the function which frees its answers is, since the
+         * answers the filter makes up can't go to the system's own.
+         */
+
+        if (g_freeaddrinfoHook.attach (freeaddrinfoHook, ws2, "freeaddrinfo"))
+                g_getaddrinfoHook.attach (getaddrinfoHook, ws2, "getaddrinfo");
+
+        if (g_freeAddrInfoWHook.attach (freeAddrInfoWHook, ws2,
+                                        "FreeAddrInfoW"))
+                g_getAddrInfoWHook.attach (getAddrInfoWHook, ws2,
+                                           "GetAddrInfoW");
+
+        if (g_freeAddrInfoExWHook.attach (freeAddrInfoExWHook, ws2,
+                                          "FreeAddrInfoExW"))
+                g_getAddrInfoExWHook.attach (getAddrInfoExWHook, ws2,
+                                             "GetAddrInfoExW");
+
+        /*
+         * The datagram hooks aren't required either. The send hooks are only
+         * put in if the source of replies to redirected datagrams can be put
+         * back for both of the ways of receiving them.
+         */
+
+        if (g_wsaRecvFromHook.attach (wsaRecvFromHook, ws2, "WSARecvFrom")) {
+                g_sendtoHook.attach (sendtoHook, ws2, "sendto");
+                g_wsaSendToHook.attach (wsaSendToHook, ws2, "WSASendTo");
+        }
+
+        /*
+         * The rule set resolves its rewrite targets with GetAddrInfoW (), so
+         * it has to go around the hook.
+         */
+
+        if (g_getAddrInfoWHook != 0)
+                FilterRules :: resolver ((void *) * g_getAddrInfoWHook,
+                                         (void *) * g_freeAddrInfoWHook);
+
+        /*
+         * Our own connections go straight to the underlying functions.
+         */
+
+        g_net.m_connect = * g_connectHook;
+        g_net.m_send = * g_sendHook;
+        g_net.m_recv = * g_recvHook;
+        g_net.m_select = * g_select_Hook;
+        g_net.m_closesocket = * g_closesocket_Hook;
+
+        g_resolveInit (* g_gethostHook);
+
+        if (g_netInit (ws2)) {
+                g_net.m_ioctlsocket = * g_ioctlsocketHook;
+                g_healthInit ();
+                g_failoverInit ();
+                g_warmInit ();
+        }
+
+        g_mirrorInit ();
+        g_meterInit ();
+        g_latencyInit ();
+        g_poolInit ();
+
         OutputDebugStringA ("SteamFilter " VER_PRODUCTVERSION_STR " attached\n");
 
         /*
@@ -1897,8 +3103,44 @@ void removeHook (void) {
         if (g_connectHook == 0)
                 return;
 
-        unhookAll ();
+        g_tickerUnload ();
+        g_segmentUnload ();
+
+        bool            unhooked = unhookAll ();
         g_unloadReplacement ();
+
+        g_healthReport ();
+        g_healthUnload ();
+        g_failoverReport ();
+        g_failoverUnload ();
+        g_warmReport ();
+        g_warmUnload ();
+        g_tuneReport ();
+        g_datagramReport ();
+        g_datagramUnload ();
+        g_limitReport ();
+        g_limitUnload ();
+        g_mirrorReport ();
+        g_mirrorUnload ();
+        g_meterReport ();
+        g_latencyReport ();
+        g_latencyUnload ();
+        g_resolveReport ();
+
+        /*
+         * Hooks left in place to free lookup answers still need the lock
+         * around those answers, and the per-thread data used by every hook.
+         */
+
+        if (unhooked)
+                g_resolveUnload ();
+        g_statsUnload ();
+        g_traceUnload ();
+        g_poolReport ();
+        g_poolUnload ();
+        if (unhooked)
+                g_threadUnload ();
+
         OutputDebugStringA ("SteamFilter " VER_PRODUCTVERSION_STR " unhooked\n");
 }
 
@@ -1921,6 +3163,14 @@ STEAMDLL (int) FilterUnload (void) {
 }
 
 BOOL WINAPI DllMain (HINSTANCE instance, unsigned long reason, void *) {
+        /*
+         * Retire the per-thread data of exiting threads, so the blocks can be
+         * reused rather than accumulating in a long-running host.
+         */
+
+        if (reason == DLL_THREAD_DETACH)
+                g_threadDetach ();
+
         if (reason != DLL_PROCESS_DETACH)
                 return TRUE;
 
@@ -36,7 +36,12 @@
 #include <ws2tcpip.h>
 
 #include "filterrule.h"
+#include "health.h"
+#include "mirror.h"
 #include "glob.h"
+#include "stats.h"
+#include "trace.h"
+#include "resolve.h"
 
 /**
  * Cliche for measuring array lengths, to avoid mistakes with sizeof ().
@@ -90,7 +95,8 @@ FreeAddrInfoWFunc       g_freeFunc;
  */
 
 FilterRule :: FilterRule () : m_pattern (0), m_hasPort (false), m_port (0),
-                m_rewrite (0), m_replace (0), m_nextReplace (0), m_next (0) {
+                m_rewrite (0), m_replace (0), m_nextReplace (0), m_options (),
+                m_index (0), m_next (0) {
 }
 
 /**
@@ -470,60 +476,157 @@ bool FilterRule :: parseReplace (const wchar_t * from, const wchar_t * to,
                 break;
         }
 
-        ADDRINFOW     * wide = 0;
-        unsigned long   result = (* g_addrFunc) (from, 0, 0, & wide);
-        if (result != 0) {
+        /*
+         * Names are resolved through the lookup cache, so that rules naming
+         * the same server several times, or being installed again, don't go
+         * to the resolver each time.
+         *
+         * Only the IPv4 addresses in the returned list are of any use, as
+         * while we expect only one it's conceivable an IPv6 could result when
+         * this is being used in very general cases.
+         */
+
+        HostAnswer      answer;
+        if (! g_resolveFind (from, answer)) {
+                ADDRINFOW     * wide = 0;
+                answer.m_error = (* g_addrFunc) (from, 0, 0, & wide);
+                answer.m_count = 0;
+                answer.m_name [0] = 0;
+
+                ADDRINFOW     * scan = wide;
+                for (; scan != 0 ; scan = scan->ai_next) {
+                        if (scan->ai_addr->sa_family != AF_INET ||
+                            answer.m_count == HOST_CACHE_ADDRS)
+                                continue;
+
+                        sockaddr_in   * found = (sockaddr_in *) scan->ai_addr;
+                        unsigned long   value = found->sin_addr.S_un.S_addr;
+                        answer.m_addrs [answer.m_count ++] = value;
+                }
+
+                if (wide != 0)
+                        (* g_freeFunc) (wide);
+
+                g_resolveStore (from, answer);
+        }
+
+        if (answer.m_count == 0) {
                 /*
                  * For now, rather than failing things we make failed address
-                 * resolution result in no replacement.
+                 * resolution result in no replacement, as does a name with no
+                 * IPv4 address.
                  */
 
-                char            example [80];
-                wsprintfA (example, "Failed to resolve %ls: %x\r\n", from, result);
-                OutputDebugStringA (example);
+                if (answer.m_error != 0 && answer.m_error != WSANO_DATA) {
+                        g_traceWide (TRACE_RESOLVE_FAILED, from,
+                                     answer.m_error, 0);
+                } else
+                        g_traceWide (TRACE_RESOLVE_NO_IPV4, from, 0, 0);
 
                 free (mem);
                 return true;
         }
 
-        /*
-         * Pick the first available IPv4 address from the returned list, as
-         * while we expect only one it's conceivable an IPv6 could result when
-         * this is being used in very general cases.
-         */
+        addr->sin_addr.S_un.S_addr = answer.m_addrs [0];
 
-        ADDRINFOW     * choices = wide;
-        while (choices->ai_addr->sa_family != AF_INET) {
-                /*
-                 * If we run out of options, map to nowhere.
-                 */
+        g_traceWide (TRACE_RESOLVED, from, 0, answer.m_addrs [0]);
+
+        link = temp;
+        return true;
+}
 
-                if ((choices = choices->ai_next) == 0) {
-                        char            example [80];
-                        wsprintfA (example, "No IPv4 for %ls\r\n", from);
-                        OutputDebugStringA (example);
+/**
+ * Compare an option name against some text.
+ */
 
-                        free (mem);
-                        return true;
-                }
-        }
+static bool l_optionIs (const wchar_t * from, const wchar_t * to,
+                        const wchar_t * name) {
+        for (; from != to ; ++ from, ++ name)
+                if (* from != * name)
+                        return false;
 
-        sockaddr_in   * chosen = (sockaddr_in *) choices->ai_addr;
-        addr->sin_addr = chosen->sin_addr;
+        return * name == 0;
+}
 
-        char            example [80];
-        wsprintfA (example, "%ls=%d.%d.%d.%d\r\n", from,
-                   chosen->sin_addr.S_un.S_un_b.s_b1,
-                   chosen->sin_addr.S_un.S_un_b.s_b2,
-                   chosen->sin_addr.S_un.S_un_b.s_b3,
-                   chosen->sin_addr.S_un.S_un_b.s_b4);
+/**
+ * Parse the block of options following the targets of a connect rule.
+ *
+ * The grammar for the options looks like this:
+ *      option  ::== <name> ['=' <number>]
+ *
+ * Options that aren't known are passed over, so that rules written for later
+ * versions aren't rejected outright by earlier ones.
+ */
 
-        OutputDebugStringA (example);
+/* static */
+bool FilterRule :: parseOptions (const wchar_t * from, const wchar_t * to,
+                                 RuleOptions & options) {
+        const wchar_t * end = lookahead (from, to, '}');
+        if (end != 0)
+                to = end;
 
-        if (wide != 0)
-                (* g_freeFunc) (wide);
+        while (from != to) {
+                const wchar_t * next = lookahead (from, to, ',');
+                if (next == 0)
+                        next = to;
+
+                while (from != next && * from == ' ')
+                        ++ from;
+
+                const wchar_t * value = lookahead (from, next, '=');
+                const wchar_t * name = value != 0 ? value : next;
+                while (name != from && name [- 1] == ' ')
+                        -- name;
+
+                bool            hasValue = value != 0;
+                unsigned long   number = 0;
+                if (hasValue) {
+                        for (++ value ; value != next ; ++ value) {
+                                if (* value == ' ')
+                                        continue;
+                                if (* value < '0' || * value > '9')
+                                        break;
+
+                                number = number * 10 + * value - '0';
+                        }
+                }
+
+                if (l_optionIs (from, name, L"failover"))
+                        options.m_failover = hasValue ? number :
+                                             RULE_FAILOVER_DEFAULT;
+                if (l_optionIs (from, name, L"race"))
+                        options.m_race = hasValue ? number :
+                                         RULE_RACE_DEFAULT;
+                if (l_optionIs (from, name, L"udp"))
+                        options.m_udp = hasValue ? number : 1;
+                if (l_optionIs (from, name, L"limit"))
+                        options.m_limit = number;
+                if (l_optionIs (from, name, L"weight"))
+                        options.m_weight = number;
+                if (l_optionIs (from, name, L"rcvbuf"))
+                        options.m_rcvbuf = number;
+                if (l_optionIs (from, name, L"sndbuf"))
+                        options.m_sndbuf = number;
+                if (l_optionIs (from, name, L"nodelay"))
+                        options.m_nodelay = (hasValue ? number : 1) + 1;
+                if (l_optionIs (from, name, L"keepalive"))
+                        options.m_keepalive = (hasValue ? number :
+                                               RULE_KEEPALIVE_DEFAULT) + 1;
+                if (l_optionIs (from, name, L"tos"))
+                        options.m_tos = (number & 0xFF) + 1;
+                if (l_optionIs (from, name, L"dscp"))
+                        options.m_tos = ((number & 0x3F) << 2) + 1;
+                if (l_optionIs (from, name, L"trace"))
+                        options.m_trace = (hasValue ? number : TRACE_DETAIL) + 1;
+                if (l_optionIs (from, name, L"dnscache"))
+                        options.m_dnsCache = number + 1;
+
+                if (next == to)
+                        break;
+
+                from = next + 1;
+        }
 
-        link = temp;
         return true;
 }
 
@@ -532,9 +635,10 @@ bool FilterRule :: parseReplace (const wchar_t * from, const wchar_t * to,
  *
  * The grammar for a rule looks roughly like this:
  *      rule    ::== <replace> (',' <replace>)*
- *      rule    ::== <pattern> '=' [<replace> (',' <replace>)*]
+ *      rule    ::== <pattern> '=' [<replace> (',' <replace>)*] [<options>]
  *      replace ::== <host> [':' <port>]
  *      pattern ::== <glob> [':' <port>]
+ *      options ::== '{' <option> (',' <option>)* '}'
  */
 
 bool FilterRule :: parseRule (const wchar_t * from, const wchar_t * to) {
@@ -594,6 +698,16 @@ bool FilterRule :: parseRule (const wchar_t * from, const wchar_t * to) {
                 return true;
         }
 
+        /*
+         * Split off any options from the end of the list of targets.
+         */
+
+        const wchar_t * options = lookahead (replace, replaceTo, '{');
+        if (options != 0) {
+                parseOptions (options + 1, replaceTo, m_options);
+                replaceTo = options;
+        }
+
         /*
          * Now, turn the replacement specs into a sequence of addrinfo data.
          *
@@ -623,11 +737,74 @@ bool FilterRule :: parseRule (const wchar_t * from, const wchar_t * to) {
         return true;
 }
 
+/**
+ * Check whether the health checker thinks a rewrite target is down.
+ *
+ * Targets which block the connection or keep the original address aren't
+ * anything that can be checked; a target which keeps the original port is
+ * checked against the port being connected to.
+ */
+
+static bool l_down (const addrinfo * info, unsigned short port) {
+        const sockaddr_in * addr = (const sockaddr_in *) info->ai_addr;
+        unsigned long   ip = addr->sin_addr.S_un.S_addr;
+        if (ip == 0 || ip == INADDR_NONE)
+                return false;
+
+        return g_healthDown (ip, addr->sin_port != 0 ? addr->sin_port : port);
+}
+
+/**
+ * Choose between the targets of a rule according to how well they've been
+ * performing, leaving out any that are down.
+ *
+ * This only applies where every target is an address we can keep figures
+ * for; if the list has entries which block or keep the original address, or
+ * every target is down, this returns 0 and the rule just rotates.
+ */
+
+static addrinfo * l_choose (addrinfo * list, unsigned short port) {
+        addrinfo      * candidates [RULE_TARGETS_MAX];
+        unsigned long   addrs [RULE_TARGETS_MAX];
+        unsigned short  ports [RULE_TARGETS_MAX];
+        unsigned long   count = 0;
+
+        addrinfo      * scan = list;
+        for (; scan != 0 && count < RULE_TARGETS_MAX ; scan = scan->ai_next) {
+                const sockaddr_in * addr = (const sockaddr_in *) scan->ai_addr;
+                unsigned long   ip = addr->sin_addr.S_un.S_addr;
+                if (ip == 0 || ip == INADDR_NONE)
+                        return 0;
+
+                unsigned short  target = addr->sin_port != 0 ? addr->sin_port :
+                                         port;
+                if (g_healthDown (ip, target))
+                        continue;
+
+                candidates [count] = scan;
+                addrs [count] = ip;
+                ports [count] = target;
+                ++ count;
+        }
+
+        if (count == 0)
+                return 0;
+
+        return candidates [g_mirrorPick (addrs, ports, count)];
+}
+
 /**
  * Match a filter rule based on the text string.
+ *
+ * Where the rule has several targets and the caller has a port to check them
+ * against, the target is chosen according to how they've been performing.
+ * Failing that they're rotated through, passing over any target which the
+ * health checker thinks is down unless they all are, in which case it's best
+ * to carry on as normal.
  */
 
-bool FilterRule :: match (const char * example, addrinfo ** replace) {
+bool FilterRule :: match (const char * example, addrinfo ** replace,
+                          unsigned short port) {
         if (m_pattern != 0 && ! globMatch (example, m_pattern, SLASH_NO_MATCH))
                 return false;
 
@@ -641,6 +818,25 @@ bool FilterRule :: match (const char * example, addrinfo ** replace) {
         if (next == 0)
                 next = m_replace;
 
+        if (port != 0 && next != 0 && m_replace->ai_next != 0) {
+                addrinfo      * choice = l_choose (m_replace, port);
+                if (choice != 0) {
+                        * replace = choice;
+                        return true;
+                }
+
+                addrinfo      * scan = next;
+                do {
+                        if (! l_down (scan, port)) {
+                                next = scan;
+                                break;
+                        }
+
+                        if ((scan = scan->ai_next) == 0)
+                                scan = m_replace;
+                } while (scan != next);
+        }
+
         if ((* replace = next) != 0 && (next = next->ai_next) == 0)
                 next = m_replace;
 
@@ -649,6 +845,34 @@ bool FilterRule :: match (const char * example, addrinfo ** replace) {
 }
 
 
+/**
+ * Copy out the full list of rewrite targets for a rule.
+ *
+ * Entries which block the connection are left out, since the callers wanting
+ * the list are looking for places they can connect to.
+ */
+
+void FilterRule :: targets (RuleTargets & targets) const {
+        targets.m_rule = this;
+        targets.m_index = m_index;
+        targets.m_count = 0;
+        targets.m_options = m_options;
+
+        addrinfo      * scan = m_replace;
+        for (; scan != 0 ; scan = scan->ai_next) {
+                sockaddr_in   * addr = (sockaddr_in *) scan->ai_addr;
+                if (addr->sin_addr.S_un.S_addr == INADDR_NONE)
+                        continue;
+
+                if (targets.m_count == RULE_TARGETS_MAX)
+                        break;
+
+                targets.m_addr [targets.m_count] = addr->sin_addr.S_un.S_addr;
+                targets.m_port [targets.m_count] = addr->sin_port;
+                ++ targets.m_count;
+        }
+}
+
 /**
  * Match a filter rule based on a URL string or other simple string.
  */
@@ -695,13 +919,31 @@ static bool l_initFuncs (void) {
         return g_addrFunc != 0 && g_freeFunc != 0;
 }
 
+/**
+ * Resolve rewrite targets with the given GetAddrInfoW () and FreeAddrInfoW ()
+ * from now on.
+ *
+ * Once the filter hooks those, the rule set has to be given the real ones
+ * underneath the hooks, as otherwise resolving a target would go through the
+ * rules again.
+ */
+
+/* static */
+void FilterRules :: resolver (void * addrFunc, void * freeFunc) {
+        if (! l_initFuncs () || addrFunc == 0 || freeFunc == 0)
+                return;
+
+        g_addrFunc = (GetAddrInfoWFunc) addrFunc;
+        g_freeFunc = (FreeAddrInfoWFunc) freeFunc;
+}
+
 /**
  * Simple constructor for the rule list.
  */
 
 FilterRules :: FilterRules (unsigned short defaultPort) :
                 m_head (0), m_tail (0),  m_pending (0),
-                m_defaultPort (defaultPort) {
+                m_defaultPort (defaultPort), m_options () {
 }
 
 /**
@@ -804,8 +1046,20 @@ bool FilterRules :: parse (const wchar_t * from, const wchar_t * to,
                 if (from == to)
                         continue;
 
+                /*
+                 * A block of options on its own applies to the whole set.
+                 */
+
+                if (* from == '{') {
+                        FilterRule :: parseOptions (from + 1, to, m_options);
+                        from = next;
+                        to = nextTo;
+                        continue;
+                }
+
                 FilterRule    * temp = new FilterRule;
                 if (tail != 0) {
+                        temp->m_index = tail->m_index + 1;
                         tail->m_next = temp;
                 } else
                         head = temp;
@@ -879,6 +1133,7 @@ bool FilterRules :: install (const wchar_t * specs) {
         FilterRule    * head = 0;
         FilterRule    * tail = 0;
 
+        m_options = RuleOptions ();
         if (specs != 0 && ! parse (specs, 0, head, tail))
                 return false;
 
@@ -929,6 +1184,54 @@ bool FilterRules :: append (const wchar_t * specs) {
         return result;
 }
 
+/**
+ * Return the options which apply to the rule set as a whole.
+ */
+
+RuleOptions FilterRules :: options (void) {
+        if (! l_initFuncs ())
+                return RuleOptions ();
+
+        EnterCriticalSection (l_filterLock);
+
+        if (m_pending != 0) {
+                parse (m_pending, 0, m_head, m_tail);
+                free (m_pending);
+                m_pending = 0;
+        }
+
+        RuleOptions     result = m_options;
+
+        LeaveCriticalSection (l_filterLock);
+        return result;
+}
+
+/**
+ * Return whether any of the rules apply to datagrams, so that when none do the
+ * send hooks can leave datagrams alone without looking at them at all.
+ */
+
+bool FilterRules :: anyDatagram (void) {
+        if (! l_initFuncs ())
+                return false;
+
+        EnterCriticalSection (l_filterLock);
+
+        if (m_pending != 0) {
+                parse (m_pending, 0, m_head, m_tail);
+                free (m_pending);
+                m_pending = 0;
+        }
+
+        FilterRule    * test = m_head;
+        for (; test != 0 ; test = test->m_next)
+                if (test->m_options.m_udp != 0)
+                        break;
+
+        LeaveCriticalSection (l_filterLock);
+        return test != 0;
+}
+
 /**
  * Simple equivalent to ntohs.
  *
@@ -944,10 +1247,15 @@ bool FilterRules :: append (const wchar_t * specs) {
  *
  * Since the main spec strings used to match rules are glob patterns, the IPv4
  * address is quickly rendered as text for matching.
+ *
+ * If the caller wants them, the matching rule's full set of rewrite targets is
+ * copied out as well. Rules for datagrams and rules for connections are kept
+ * apart, so only the kind the caller asks for is looked at.
  */
 
 bool FilterRules :: matchIp (const sockaddr_in * name, void * module,
-                             sockaddr_in ** replace) {
+                             sockaddr_in ** replace, RuleTargets * targets,
+                             bool datagram) {
         if (! l_initFuncs ())
                 return false;
 
@@ -995,13 +1303,30 @@ bool FilterRules :: matchIp (const sockaddr_in * name, void * module,
                 if (! test->m_hasPort)
                         continue;
 
+                if ((test->m_options.m_udp != 0) != datagram)
+                        continue;
+
                 if (test->m_port != 0 && test->m_port != port)
                         continue;
 
-                if (test->match (example, & out))
+                if (test->match (example, & out, name->sin_port))
                         break;
         }
 
+        if (targets != 0) {
+                if (test != 0) {
+                        test->targets (* targets);
+                } else {
+                        targets->m_rule = 0;
+                        targets->m_index = 0;
+                        targets->m_count = 0;
+                        targets->m_options = RuleOptions ();
+                }
+        }
+
+        if (test != 0)
+                g_statsRule (test->m_index);
+
         LeaveCriticalSection (l_filterLock);
 
         if (out != 0) {
@@ -1016,7 +1341,8 @@ bool FilterRules :: matchIp (const sockaddr_in * name, void * module,
  * Match the filter rules against a DNS name, returning an IP.
  */
 
-bool FilterRules :: matchDns (const char * name, sockaddr_in ** replace) {
+bool FilterRules :: matchDns (const char * name, sockaddr_in ** replace,
+                              RuleTargets * targets) {
         if (! l_initFuncs ())
                 return false;
 
@@ -1038,6 +1364,20 @@ bool FilterRules :: matchDns (const char * name, sockaddr_in ** replace) {
                         break;
         }
 
+        if (targets != 0) {
+                if (test != 0) {
+                        test->targets (* targets);
+                } else {
+                        targets->m_rule = 0;
+                        targets->m_index = 0;
+                        targets->m_count = 0;
+                        targets->m_options = RuleOptions ();
+                }
+        }
+
+        if (test != 0)
+                g_statsRule (test->m_index);
+
         LeaveCriticalSection (l_filterLock);
 
         if (out != 0) {
@@ -1073,6 +1413,9 @@ bool FilterRules :: matchUrl (const char * name, const char ** replace) {
                         break;
         }
 
+        if (test != 0)
+                g_statsRule (test->m_index);
+
         LeaveCriticalSection (l_filterLock);
 
         return test != 0;
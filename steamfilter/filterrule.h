@@ -64,6 +64,93 @@ struct addrinfo;
 struct sockaddr_in;
 class FilterRules;
 
+/**
+ * Most rewrite targets of a single rule that are reported to callers which
+ * want the whole list.
+ */
+
+#define RULE_TARGETS_MAX        8
+
+/**
+ * Settings which a connect rule can carry in a block of options following its
+ * list of targets, such as "*:27030=a,b,c{failover=2000}". A block of options
+ * standing on its own as a rule applies to the rule set as a whole, for those
+ * settings which make sense that way.
+ *
+ * All of these default to zero, meaning the feature is off. The limit is the
+ * rate at which data may be received, in kilobytes per second, and the weight
+ * is the relative share of a limited rate given to each connection. Racing
+ * gives the number of targets to try at once, fastest first. A rule with the
+ * udp option applies to datagrams sent to matching addresses instead of to
+ * connections made to them.
+ *
+ * The rest tune the sockets of the rule's connections before they connect;
+ * the buffer sizes are in kilobytes, and keepalive gives the idle time before
+ * the first probe, in seconds. The no-delay, keepalive and type-of-service
+ * settings are kept one higher than was given, so that zero can still mean
+ * they weren't set at all, since turning them off is a setting too.
+ *
+ * The trace level and the time host lookups are cached for, in seconds, only
+ * apply to the whole set; they're kept one higher than was given in the same
+ * way.
+ */
+
+struct RuleOptions {
+        unsigned long   m_failover;
+        unsigned long   m_race;
+        unsigned long   m_udp;
+        unsigned long   m_limit;
+        unsigned long   m_weight;
+        unsigned long   m_rcvbuf;
+        unsigned long   m_sndbuf;
+        unsigned long   m_nodelay;
+        unsigned long   m_keepalive;
+        unsigned long   m_tos;
+        unsigned long   m_trace;
+        unsigned long   m_dnsCache;
+};
+
+/**
+ * Connect deadline used when a rule asks for failover without giving one, in
+ * milliseconds.
+ */
+
+#define RULE_FAILOVER_DEFAULT   2000
+
+/**
+ * Number of targets raced when a rule asks for racing without giving one.
+ */
+
+#define RULE_RACE_DEFAULT       2
+
+/**
+ * Keepalive idle time used when a rule asks for keepalive without giving one,
+ * in seconds.
+ */
+
+#define RULE_KEEPALIVE_DEFAULT  60
+
+/**
+ * The list of rewrite targets of a matched rule, copied out for callers that
+ * want to make use of all of them rather than just the one the rule chose,
+ * along with the rule's options.
+ *
+ * Addresses and ports are in network order, with zero meaning the original
+ * connection's address or port is kept, as for the rewrite itself. The rule
+ * itself is identified for callers which keep some state for each rule, but
+ * that's all it's good for; it can't be used to get at the rule. Its index is
+ * its position in the rule set, counting from zero.
+ */
+
+struct RuleTargets {
+        const void    * m_rule;
+        unsigned long   m_index;
+        unsigned long   m_count;
+        unsigned long   m_addr [RULE_TARGETS_MAX];
+        unsigned short  m_port [RULE_TARGETS_MAX];
+        RuleOptions     m_options;
+};
+
 /**
  * Data structure representing parsed filters.
  *
@@ -87,6 +174,8 @@ private:
         char          * m_rewrite;
         addrinfo      * m_replace;
         addrinfo      * m_nextReplace;
+        RuleOptions     m_options;
+        unsigned long   m_index;
         FilterRule    * m_next;
 
 static  const wchar_t * lookahead (const wchar_t * from, const wchar_t * to,
@@ -104,12 +193,16 @@ static  char          * urldup (const wchar_t * from, const wchar_t * to);
                                  unsigned short & port);
         bool            parseReplace (const wchar_t * from, const wchar_t * to,
                                       addrinfo * & link);
+static  bool            parseOptions (const wchar_t * from, const wchar_t * to,
+                                      RuleOptions & options);
         bool            parseRule (const wchar_t * from, const wchar_t * to);
 
 public:
 static  bool            installFilters (wchar_t * str);
 
-        bool            match (const char * example, addrinfo ** replace);
+        bool            match (const char * example, addrinfo ** replace,
+                               unsigned short port = 0);
+        void            targets (RuleTargets & targets) const;
         bool            match (const char * example, const char ** replace,
                                int slashMode);
 
@@ -128,6 +221,7 @@ private:
         wchar_t       * m_pending;
 
         unsigned short  m_defaultPort;
+        RuleOptions     m_options;
 
 static  void            freeRules (FilterRule * head);
 
@@ -138,13 +232,21 @@ public:
                         FilterRules (unsigned short defaultPort = 0);
                       ~ FilterRules ();
 
+static  void            resolver (void * addrFunc, void * freeFunc);
+
         bool            append (const wchar_t * rules);
         bool            install (const wchar_t * rules);
 
+        RuleOptions     options (void);
+        bool            anyDatagram (void);
+
         bool            matchIp (const sockaddr_in * name, void * module,
-                               sockaddr_in ** replace);
+                               sockaddr_in ** replace,
+                               RuleTargets * targets = 0,
+                               bool datagram = false);
         bool            matchDns (const char * name,
-                               sockaddr_in ** replace);
+                                  sockaddr_in ** replace,
+                                  RuleTargets * targets = 0);
         bool            matchUrl (const char * name,
                                   const char ** replace);
         bool            matchHost (const char * name,
@@ -0,0 +1,252 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements a simple fixed-size table of decisions for datagram flows.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "flowtable.h"
+
+/**
+ * Simple default constructor; the table starts out empty.
+ */
+
+FlowTable :: FlowTable () : m_hits (0), m_misses (0), m_evictions (0) {
+        flush ();
+}
+
+/**
+ * Mix a socket and destination into a slot number.
+ *
+ * The addresses of the servers a client talks to tend to differ only in their
+ * low bits and socket handles go up in steps of four, so everything is spread
+ * out with a multiply before being folded together.
+ */
+
+/* static */
+unsigned long FlowTable :: hash (size_t socket, unsigned long addr,
+                                 unsigned short port) {
+        unsigned long   value = (unsigned long) socket * 2654435761UL;
+        value ^= addr * 2246822519UL;
+        value ^= port * 3266489917UL;
+        value ^= value >> 15;
+        return value & (FLOW_TABLE_SIZE - 1);
+}
+
+/**
+ * Find the entry for a socket and address in one of the tables, if there is
+ * one.
+ *
+ * Entries can be removed from the middle of a run, so the whole window is
+ * always looked at rather than stopping at the first empty slot.
+ */
+
+FlowEntry * FlowTable :: find (FlowEntry * table, size_t socket,
+                               unsigned long addr, unsigned short port) {
+        unsigned long   slot = hash (socket, addr, port);
+        unsigned long   i;
+        for (i = 0 ; i < FLOW_PROBE_MAX ; ++ i) {
+                FlowEntry     * scan = table + ((slot + i) &
+                                                (FLOW_TABLE_SIZE - 1));
+                if (scan->m_action != FLOW_EMPTY && scan->m_addr == addr &&
+                    scan->m_port == port && scan->m_socket == socket)
+                        return scan;
+        }
+
+        return 0;
+}
+
+/**
+ * Find somewhere to put the entry for a socket and address; that's where it
+ * already is, or else the first free slot in its window, or else whichever
+ * slot in the window was used least recently.
+ */
+
+FlowEntry * FlowTable :: place (FlowEntry * table, size_t socket,
+                                unsigned long addr, unsigned short port,
+                                unsigned long now) {
+        FlowEntry     * found = find (table, socket, addr, port);
+        if (found != 0)
+                return found;
+
+        unsigned long   slot = hash (socket, addr, port);
+        FlowEntry     * oldest = 0;
+        unsigned long   i;
+        for (i = 0 ; i < FLOW_PROBE_MAX ; ++ i) {
+                FlowEntry     * scan = table + ((slot + i) &
+                                                (FLOW_TABLE_SIZE - 1));
+                if (scan->m_action == FLOW_EMPTY)
+                        return scan;
+
+                if (oldest == 0 || now - scan->m_used > now - oldest->m_used)
+                        oldest = scan;
+        }
+
+        ++ m_evictions;
+        clear (table, oldest);
+        return oldest;
+}
+
+/**
+ * Empty out a slot in one of the tables.
+ */
+
+void FlowTable :: clear (FlowEntry * table, FlowEntry * entry) {
+        if (entry->m_action == FLOW_EMPTY)
+                return;
+
+        if (table == m_reverse)
+                -- m_reversing;
+
+        entry->m_action = FLOW_EMPTY;
+}
+
+/**
+ * Look up the decision for a flow.
+ *
+ * A decision which hasn't been used for a while is forgotten, so the rules
+ * get another look at a flow which has gone quiet.
+ */
+
+bool FlowTable :: lookup (size_t socket, unsigned long addr,
+                          unsigned short port, unsigned long now,
+                          FlowRoute & route) {
+        FlowEntry     * entry = find (m_forward, socket, addr, port);
+        if (entry != 0 && now - entry->m_used > FLOW_IDLE) {
+                clear (m_forward, entry);
+                entry = 0;
+        }
+
+        if (entry == 0) {
+                ++ m_misses;
+                return false;
+        }
+
+        ++ m_hits;
+        entry->m_used = now;
+
+        route.m_action = entry->m_action;
+        route.m_addr = entry->m_toAddr;
+        route.m_port = entry->m_toPort;
+        return true;
+}
+
+/**
+ * Keep the decision for a flow, along with the reverse mapping for a flow
+ * which is redirected.
+ *
+ * A flow which goes straight to its destination takes away any reverse
+ * mapping for that destination on the same socket, since datagrams coming
+ * back from there are then genuinely from there.
+ */
+
+void FlowTable :: store (size_t socket, unsigned long addr,
+                         unsigned short port, const FlowRoute & route,
+                         unsigned long now) {
+        if (route.m_action == FLOW_EMPTY)
+                return;
+
+        FlowEntry     * entry = place (m_forward, socket, addr, port, now);
+        entry->m_socket = socket;
+        entry->m_addr = addr;
+        entry->m_port = port;
+        entry->m_action = (unsigned short) route.m_action;
+        entry->m_toAddr = route.m_addr;
+        entry->m_toPort = route.m_port;
+        entry->m_used = now;
+
+        if (route.m_action != FLOW_REDIRECT) {
+                FlowEntry     * stale = find (m_reverse, socket, addr, port);
+                if (stale != 0)
+                        clear (m_reverse, stale);
+                return;
+        }
+
+        entry = place (m_reverse, socket, route.m_addr, route.m_port, now);
+        if (entry->m_action == FLOW_EMPTY)
+                ++ m_reversing;
+
+        entry->m_socket = socket;
+        entry->m_addr = route.m_addr;
+        entry->m_port = route.m_port;
+        entry->m_action = FLOW_REDIRECT;
+        entry->m_toAddr = addr;
+        entry->m_toPort = port;
+        entry->m_used = now;
+}
+
+/**
+ * Turn the source of a datagram which came back from where a flow was
+ * redirected to into the destination the application originally sent to.
+ */
+
+bool FlowTable :: reverse (size_t socket, unsigned long & addr,
+                           unsigned short & port, unsigned long now) {
+        FlowEntry     * entry = find (m_reverse, socket, addr, port);
+        if (entry == 0)
+                return false;
+
+        entry->m_used = now;
+        addr = entry->m_toAddr;
+        port = entry->m_toPort;
+        return true;
+}
+
+/**
+ * Forget everything kept for a socket, as it's being closed and its handle
+ * may be used again for something else entirely.
+ */
+
+void FlowTable :: close (size_t socket) {
+        unsigned long   i;
+        for (i = 0 ; i < FLOW_TABLE_SIZE ; ++ i) {
+                if (m_forward [i].m_socket == socket)
+                        clear (m_forward, m_forward + i);
+                if (m_reverse [i].m_socket == socket)
+                        clear (m_reverse, m_reverse + i);
+        }
+}
+
+/**
+ * Forget everything, such as when the rules change.
+ */
+
+void FlowTable :: flush (void) {
+        unsigned long   i;
+        for (i = 0 ; i < FLOW_TABLE_SIZE ; ++ i) {
+                m_forward [i].m_action = FLOW_EMPTY;
+                m_forward [i].m_socket = 0;
+                m_reverse [i].m_action = FLOW_EMPTY;
+                m_reverse [i].m_socket = 0;
+        }
+
+        m_reversing = 0;
+}
+
+/**@}*/
@@ -0,0 +1,153 @@
+#ifndef FLOWTABLE_H
+#define FLOWTABLE_H             1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares a simple fixed-size table of decisions for datagram flows.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * A table of the decisions made for datagram flows.
+ *
+ * Datagrams don't have a connect for the rules to be applied at, so instead
+ * they're applied to each destination a socket sends to; working through the
+ * rule set for every datagram would cost far too much for the likes of voice
+ * traffic, so the first datagram of a flow decides what happens to it and
+ * the decision is kept here, keyed on the socket and destination. Where a flow
+ * is redirected, the table also keeps the reverse mapping, so that datagrams
+ * coming back from the new destination can be made to appear to have come
+ * from the one the application thinks it's talking to.
+ *
+ * The table is open-addressed with a short probe window and never allocates;
+ * when a window is full, the entry used least recently is replaced, so this
+ * is really a cache, and a flow which loses its entry just has the rules
+ * applied to it again. Like the host cache, it has no dependency on Windows,
+ * the caller passes in the time in milliseconds and provides any locking
+ * that's needed.
+ */
+
+#include <stddef.h>
+
+/**
+ * Size of each of the forward and reverse tables, which must be a power of
+ * two, and the number of slots an entry may be placed in.
+ */
+
+#define FLOW_TABLE_SIZE         1024
+#define FLOW_PROBE_MAX          8
+
+/**
+ * How long a decision is kept for a flow which hasn't sent anything, in
+ * milliseconds; after that, the rules are applied to the flow afresh.
+ */
+
+#define FLOW_IDLE               120000
+
+/**
+ * What to do with a flow's datagrams.
+ */
+
+enum FlowAction {
+        FLOW_EMPTY,
+        FLOW_PASS,
+        FLOW_DROP,
+        FLOW_REDIRECT
+};
+
+/**
+ * The decision for a flow; the address and port, in network order, are where
+ * a redirected flow is sent instead.
+ */
+
+struct FlowRoute {
+        unsigned long   m_action;
+        unsigned long   m_addr;
+        unsigned short  m_port;
+};
+
+/**
+ * An entry in either table. The socket is held as a plain number, since
+ * that's all the table needs of it.
+ */
+
+struct FlowEntry {
+        size_t          m_socket;
+        unsigned long   m_addr;
+        unsigned short  m_port;
+        unsigned short  m_action;
+        unsigned long   m_toAddr;
+        unsigned short  m_toPort;
+        unsigned long   m_used;
+};
+
+class FlowTable {
+private:
+        FlowEntry       m_forward [FLOW_TABLE_SIZE];
+        FlowEntry       m_reverse [FLOW_TABLE_SIZE];
+        unsigned long   m_reversing;
+
+        unsigned long   m_hits;
+        unsigned long   m_misses;
+        unsigned long   m_evictions;
+
+static  unsigned long   hash (size_t socket, unsigned long addr,
+                              unsigned short port);
+
+        FlowEntry     * find (FlowEntry * table, size_t socket,
+                              unsigned long addr, unsigned short port);
+        FlowEntry     * place (FlowEntry * table, size_t socket,
+                               unsigned long addr, unsigned short port,
+                               unsigned long now);
+        void            clear (FlowEntry * table, FlowEntry * entry);
+
+public:
+                        FlowTable ();
+
+        bool            lookup (size_t socket, unsigned long addr,
+                                unsigned short port, unsigned long now,
+                                FlowRoute & route);
+        void            store (size_t socket, unsigned long addr,
+                               unsigned short port, const FlowRoute & route,
+                               unsigned long now);
+        bool            reverse (size_t socket, unsigned long & addr,
+                                 unsigned short & port, unsigned long now);
+        void            close (size_t socket);
+        void            flush (void);
+
+        unsigned long   reversing (void) const { return m_reversing; }
+
+        unsigned long   hits (void) const { return m_hits; }
+        unsigned long   misses (void) const { return m_misses; }
+        unsigned long   evictions (void) const { return m_evictions; }
+};
+
+/**@}*/
+#endif  /* ! defined (FLOWTABLE_H) */
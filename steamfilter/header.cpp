@@ -0,0 +1,508 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the helpers for building the HTTP headers of synthetic
+ * responses, including a per-second cache of the formatted Date header.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Every synthetic response needs a Date header, and since Steam polls some of
+ * the stubbed-out URLs constantly, formatting one from scratch each time adds
+ * up. The date only changes once a second, so the formatted text is kept in a
+ * small cache and each response just copies it.
+ *
+ * The cache has two slots, selected by whether the second is odd or even. A
+ * thread that finds the slot for the current second stale formats the new
+ * text into it, while threads still finishing with the previous second read
+ * the other slot undisturbed. Each slot has a sequence count which is odd
+ * while the slot is being written, so readers can detect a torn read and just
+ * format the date themselves rather than ever waiting.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+
+#include "header.h"
+
+/**
+ * One slot of the date cache.
+ */
+
+struct DateSlot {
+        volatile LONG   m_sequence;
+        volatile unsigned long  m_second;
+        unsigned long   m_length;
+        char            m_text [DATE_HEADERS_MAX];
+};
+
+static  DateSlot        l_dates [2];
+
+/**
+ * Fixed fragments for the date text.
+ */
+
+static const char       l_days [] = "SunMonTueWedThuFriSat";
+static const char       l_months [] = "   JanFebMarAprMayJunJulAugSepOctNovDec";
+
+/**
+ * Append some text to the header being built.
+ */
+
+void HeaderBuilder :: append (const char * text, unsigned long length) {
+        if (m_dest != 0)
+                memcpy (m_dest + m_length, text, length);
+
+        m_length += length;
+}
+
+void HeaderBuilder :: append (const char * text) {
+        append (text, strlen (text));
+}
+
+/**
+ * Append a value in decimal.
+ */
+
+void HeaderBuilder :: appendDecimal (unsigned long value) {
+        char            digits [12];
+        char          * end = digits + sizeof (digits);
+        char          * scan = end;
+
+        do {
+                * -- scan = (char) ('0' + value % 10);
+                value /= 10;
+        } while (value > 0);
+
+        append (scan, end - scan);
+}
+
+/**
+ * Append an HTTP/1.1 status line.
+ *
+ * The common statuses have their reason text prebuilt; for anything else the
+ * caller's text (or failing that, something generic) is used.
+ */
+
+void HeaderBuilder :: appendStatus (int status, const char * text) {
+        switch (status) {
+        case 200:
+                append ("HTTP/1.1 200 OK\r\n");
+                return;
+
+        case 302:
+                append ("HTTP/1.1 302 REDIRECT\r\n");
+                return;
+
+        default:
+                break;
+        }
+
+        append ("HTTP/1.1 ");
+        appendDecimal (status);
+        append (" ");
+
+        if (text == 0)
+                text = "UNKNOWN";
+
+        unsigned long   length = strlen (text);
+        append (text, length < 100 ? length : 100);
+        append ("\r\n");
+}
+
+/**
+ * Case-insensitive comparison of a header name against a lowercase string.
+ */
+
+bool g_headerIs (const char * name, unsigned long length, const char * match) {
+        while (length > 0 && * match != 0) {
+                unsigned char   ch = * name;
+                if (ch >= 'A' && ch <= 'Z')
+                        ch += 32;
+
+                if (ch != (unsigned char) * match)
+                        return false;
+
+                ++ name;
+                ++ match;
+                -- length;
+        }
+
+        return length == 0 && * match == 0;
+}
+
+/**
+ * Look for a token in a comma-separated header value, case-insensitively,
+ * returning the text following it.
+ */
+
+const char * g_headerToken (const char * value, unsigned long length,
+                            const char * token) {
+        const char    * end = value + length;
+        const char    * scan = value;
+        while (scan != end) {
+                while (scan != end && (* scan == ' ' || * scan == ','))
+                        ++ scan;
+
+                const char    * start = scan;
+                while (scan != end && * scan != ',' && * scan != '=' &&
+                       * scan != ' ')
+                        ++ scan;
+
+                if (scan != start && g_headerIs (start, scan - start, token))
+                        return scan;
+
+                while (scan != end && * scan != ',')
+                        ++ scan;
+        }
+
+        return 0;
+}
+
+/**
+ * Parse a decimal value out of a header.
+ */
+
+bool g_headerValue (const char * value, const char * end,
+                    unsigned long * result) {
+        while (value != end && * value == ' ')
+                ++ value;
+
+        unsigned long   total = 0;
+        const char    * start = value;
+        for (; value != end ; ++ value) {
+                unsigned char   ch = (unsigned char) (* value - '0');
+                if (ch > 9)
+                        break;
+
+                if (total > 0x0FFFFFFF)
+                        return false;
+
+                total = total * 10 + ch;
+        }
+
+        * result = total;
+        return value != start;
+}
+
+/**
+ * Step over the header lines of a message, one per call.
+ *
+ * This fills in the line's name and value; the value excludes the leading
+ * whitespace and trailing CRLF. Continuation lines are obsolete and not
+ * something any server Steam talks to uses, so they're reported with no name
+ * and callers generally treat them as a reason to leave the message alone.
+ */
+
+bool g_nextHeader (const char * & scan, const char * end, HeaderLine & line) {
+        if (end - scan < 2 || (scan [0] == '\r' && scan [1] == '\n'))
+                return false;
+
+        const char    * eol;
+        eol = (const char *) memchr (scan, '\r', end - scan);
+        if (eol == 0 || eol + 1 == end || eol [1] != '\n')
+                return false;
+
+        line.m_line = scan;
+        line.m_lineLength = eol + 2 - scan;
+
+        const char    * colon;
+        colon = (const char *) memchr (scan, ':', eol - scan);
+        if (colon == 0 || * scan == ' ' || * scan == '\t') {
+                line.m_name = 0;
+                line.m_nameLength = 0;
+                line.m_value = scan;
+        } else {
+                line.m_name = scan;
+                line.m_nameLength = colon - scan;
+                line.m_value = colon + 1;
+        }
+
+        while (line.m_value != eol && * line.m_value == ' ')
+                ++ line.m_value;
+
+        line.m_valueLength = eol - line.m_value;
+
+        scan = eol + 2;
+        return true;
+}
+
+/**
+ * Find the end of the headers of a message, if they've all been received.
+ */
+
+const char * g_headerEnd (const char * buf, unsigned long length) {
+        const char    * end = buf + length;
+        const char    * scan = buf;
+        while (end - scan >= 4) {
+                scan = (const char *) memchr (scan, '\r', end - scan - 3);
+                if (scan == 0)
+                        return 0;
+
+                if (scan [1] == '\n' && scan [2] == '\r' && scan [3] == '\n')
+                        return scan + 4;
+
+                ++ scan;
+        }
+
+        return 0;
+}
+
+/**
+ * Write two digits of a date field.
+ */
+
+static char * l_twoDigits (char * dest, unsigned long value) {
+        dest [0] = (char) ('0' + value / 10);
+        dest [1] = (char) ('0' + value % 10);
+        return dest + 2;
+}
+
+/**
+ * Format the Date and Expires headers for a given time, in RFC 1123 form.
+ */
+
+static unsigned long l_formatDate (char * dest, const SYSTEMTIME & now) {
+        char            date [29];
+        char          * scan = date;
+
+        memcpy (scan, l_days + now.wDayOfWeek * 3, 3);
+        scan [3] = ',';
+        scan [4] = ' ';
+        scan = l_twoDigits (scan + 5, now.wDay);
+        * scan ++ = ' ';
+        memcpy (scan, l_months + now.wMonth * 3, 3);
+        scan [3] = ' ';
+        scan = l_twoDigits (scan + 4, now.wYear / 100);
+        scan = l_twoDigits (scan, now.wYear % 100);
+        * scan ++ = ' ';
+        scan = l_twoDigits (scan, now.wHour);
+        * scan ++ = ':';
+        scan = l_twoDigits (scan, now.wMinute);
+        * scan ++ = ':';
+        scan = l_twoDigits (scan, now.wSecond);
+        memcpy (scan, " GMT", 4);
+
+        HeaderBuilder   build (dest);
+        build.append ("Date: ");
+        build.append (date, sizeof (date));
+        build.append ("\r\nExpires: ");
+        build.append (date, sizeof (date));
+        build.append ("\r\n");
+
+        return build.length ();
+}
+
+/**
+ * Convert a file time into the count of whole seconds since 1601.
+ */
+
+static ULONGLONG l_wholeSeconds (const FILETIME & time) {
+        ULARGE_INTEGER  ticks;
+        ticks.LowPart = time.dwLowDateTime;
+        ticks.HighPart = time.dwHighDateTime;
+
+        return ticks.QuadPart / 10000000;
+}
+
+/**
+ * Convert a file time into the whole seconds used for comparing HTTP dates.
+ *
+ * This is only the low 32 bits of the count of seconds since 1601, which is
+ * plenty for telling seconds apart and for the short intervals we compare,
+ * but it can't be turned back into a date; that needs l_wholeSeconds ().
+ */
+
+static unsigned long l_seconds (const FILETIME & time) {
+        return (unsigned long) l_wholeSeconds (time);
+}
+
+/**
+ * Return the current time in seconds.
+ */
+
+unsigned long g_currentSecond (void) {
+        FILETIME        time;
+        GetSystemTimeAsFileTime (& time);
+
+        return l_seconds (time);
+}
+
+/**
+ * Parse a number of at most the given number of digits.
+ */
+
+static bool l_parseNumber (const char * & text, const char * end,
+                           unsigned long digits, unsigned long & value) {
+        value = 0;
+
+        const char    * start = text;
+        while (text != end && digits > 0) {
+                unsigned char   ch = (unsigned char) (* text - '0');
+                if (ch > 9)
+                        break;
+
+                value = value * 10 + ch;
+                ++ text;
+                -- digits;
+        }
+
+        return text != start;
+}
+
+/**
+ * Parse an HTTP date in the RFC 1123 form into seconds.
+ *
+ * The obsolete RFC 850 and asctime () forms are permitted by the spec, but no
+ * server we care about sends them, and an unparseable date in Expires is to
+ * be treated as already having expired, which is the safe outcome anyway.
+ */
+
+bool g_parseHttpDate (const char * text, unsigned long length,
+                      unsigned long * second) {
+        const char    * end = text + length;
+        const char    * comma = (const char *) memchr (text, ',', length);
+        if (comma == 0)
+                return false;
+
+        text = comma + 1;
+        while (text != end && * text == ' ')
+                ++ text;
+
+        SYSTEMTIME      when;
+        memset (& when, 0, sizeof (when));
+
+        unsigned long   day;
+        if (! l_parseNumber (text, end, 2, day) || text == end || * text != ' ')
+                return false;
+
+        ++ text;
+        if (end - text < 4)
+                return false;
+
+        unsigned long   month = 1;
+        for (; month <= 12 ; ++ month)
+                if (memcmp (text, l_months + month * 3, 3) == 0)
+                        break;
+
+        if (month > 12 || text [3] != ' ')
+                return false;
+
+        text += 4;
+
+        unsigned long   year;
+        unsigned long   hour;
+        unsigned long   minute;
+        unsigned long   secs;
+        if (! l_parseNumber (text, end, 4, year) || text == end ||
+            * text ++ != ' ' ||
+            ! l_parseNumber (text, end, 2, hour) || text == end ||
+            * text ++ != ':' ||
+            ! l_parseNumber (text, end, 2, minute) || text == end ||
+            * text ++ != ':' ||
+            ! l_parseNumber (text, end, 2, secs))
+                return false;
+
+        when.wYear = (WORD) year;
+        when.wMonth = (WORD) month;
+        when.wDay = (WORD) day;
+        when.wHour = (WORD) hour;
+        when.wMinute = (WORD) minute;
+        when.wSecond = (WORD) secs;
+
+        FILETIME        time;
+        if (! SystemTimeToFileTime (& when, & time))
+                return false;
+
+        * second = l_seconds (time);
+        return true;
+}
+
+/**
+ * Write the Date and Expires headers for the current time into the buffer,
+ * which must have room for DATE_HEADERS_MAX characters.
+ */
+
+unsigned long g_dateHeaders (char * dest) {
+        FILETIME        time;
+        GetSystemTimeAsFileTime (& time);
+
+        ULONGLONG       whole = l_wholeSeconds (time);
+        unsigned long   second = (unsigned long) whole;
+        DateSlot      * slot = l_dates + (second & 1);
+
+        /*
+         * The usual case; the slot is current, so copy it out and then check
+         * that nobody started rewriting it while we were doing so.
+         */
+
+        LONG            sequence = slot->m_sequence;
+        if ((sequence & 1) == 0 && slot->m_second == second) {
+                MemoryBarrier ();
+                unsigned long   length = slot->m_length;
+                memcpy (dest, slot->m_text, length);
+                MemoryBarrier ();
+
+                if (slot->m_sequence == sequence)
+                        return length;
+        }
+
+        /*
+         * Format the date ourselves, and if nobody else is busy with the slot,
+         * publish the result for everyone else to use.
+         */
+
+        ULARGE_INTEGER  ticks;
+        ticks.QuadPart = whole * 10000000;
+
+        time.dwLowDateTime = ticks.LowPart;
+        time.dwHighDateTime = ticks.HighPart;
+
+        SYSTEMTIME      now;
+        FileTimeToSystemTime (& time, & now);
+
+        unsigned long   length = l_formatDate (dest, now);
+
+        sequence = slot->m_sequence;
+        if ((sequence & 1) != 0 || slot->m_second == second)
+                return length;
+
+        if (InterlockedCompareExchange (& slot->m_sequence, sequence + 1,
+                                        sequence) != sequence)
+                return length;
+
+        memcpy (slot->m_text, dest, length);
+        slot->m_length = length;
+        slot->m_second = second;
+
+        InterlockedExchange (& slot->m_sequence, sequence + 2);
+        return length;
+}
+
+/**@}*/
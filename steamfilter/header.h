@@ -0,0 +1,99 @@
+#ifndef HEADER_H
+#define HEADER_H                1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares helpers for building the HTTP headers of synthetic responses.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Helper for assembling HTTP response headers from fixed fragments.
+ *
+ * This is used in two passes; with no destination it just measures, so the
+ * caller can size a buffer exactly and then run the same sequence of appends
+ * again to fill it. That avoids formatting into a temporary and copying, and
+ * avoids wsprintfA (which is far slower than it has any need to be).
+ */
+
+class HeaderBuilder {
+private:
+        char          * m_dest;
+        unsigned long   m_length;
+
+public:
+                        HeaderBuilder (char * dest = 0) : m_dest (dest),
+                                m_length (0) { }
+
+        unsigned long   length (void) const { return m_length; }
+
+        void            append (const char * text, unsigned long length);
+        void            append (const char * text);
+        void            appendDecimal (unsigned long value);
+        void            appendStatus (int status, const char * text);
+};
+
+/**
+ * One header line from an HTTP message, as found by g_nextHeader ().
+ */
+
+struct HeaderLine {
+        const char    * m_line;
+        unsigned long   m_lineLength;
+        const char    * m_name;
+        unsigned long   m_nameLength;
+        const char    * m_value;
+        unsigned long   m_valueLength;
+};
+
+bool            g_nextHeader (const char * & scan, const char * end,
+                              HeaderLine & line);
+const char    * g_headerEnd (const char * buf, unsigned long length);
+bool            g_headerIs (const char * name, unsigned long length,
+                            const char * match);
+const char    * g_headerToken (const char * value, unsigned long length,
+                               const char * token);
+bool            g_headerValue (const char * value, const char * end,
+                               unsigned long * result);
+
+/**
+ * Length of the longest Date/Expires fragment g_dateHeaders () will produce.
+ */
+
+#define DATE_HEADERS_MAX        80
+
+unsigned long   g_dateHeaders (char * dest);
+
+unsigned long   g_currentSecond (void);
+bool            g_parseHttpDate (const char * text, unsigned long length,
+                                 unsigned long * second);
+
+/**@}*/
+#endif  /* ! defined (HEADER_H) */
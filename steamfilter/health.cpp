@@ -0,0 +1,435 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the background health checking of rewrite targets.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The checks are made from the shared background thread, as non-blocking
+ * connects which are looked at on each tick; where the server is a web server
+ * a HEAD request is sent as well, since a server whose front end accepts
+ * connections but which isn't otherwise working is a common failure mode for
+ * the ISP-hosted caches.
+ *
+ * Servers are added to the table the first time the rule selection asks about
+ * them, and dropped once the rules haven't asked for a while.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "health.h"
+#include "ticker.h"
+#include "netapi.h"
+
+/**
+ * Cliche for measuring array lengths, to avoid mistakes with sizeof ().
+ */
+
+#define ARRAY_LENGTH(x) (sizeof (x) / sizeof (* (x)))
+
+/**
+ * Simple equivalent to ntohs, as elsewhere.
+ */
+
+#define ntohs(x)        ((unsigned char) ((x) >> 8) + \
+                         ((unsigned char) (x) << 8))
+
+/**
+ * Port that gets a HEAD request as well as a connect, in network order.
+ */
+
+#define HEALTH_HTTP_PORT        0x5000
+
+/**
+ * Tracking data for one server.
+ */
+
+struct HealthTarget {
+        unsigned long   m_addr;
+        unsigned short  m_port;
+        bool            m_down;
+        unsigned long   m_rise;
+        unsigned long   m_fall;
+        unsigned long   m_lastUsed;
+        unsigned long   m_nextProbe;
+
+        SOCKET          m_probe;
+        unsigned long   m_probeStart;
+        bool            m_sentHead;
+
+        unsigned long   m_probes;
+        unsigned long   m_failures;
+        unsigned long   m_transitions;
+        unsigned long   m_lastRtt;
+        unsigned long   m_averageRtt;
+};
+
+/**
+ * The table of servers being checked.
+ */
+
+static  HealthTarget    l_targets [HEALTH_TARGETS_MAX];
+static  unsigned long   l_targetCount;
+static  bool            l_ready;
+
+static  CRITICAL_SECTION l_healthLock;
+static  bool            l_lockInit;
+
+/**
+ * Describe a change in a server's state for the benefit of DbgView.
+ */
+
+static void l_show (const HealthTarget & target, const char * state) {
+        char            show [80];
+        const unsigned char * bytes = (const unsigned char *) & target.m_addr;
+        wsprintfA (show, "Target %d.%d.%d.%d:%d %s\r\n",
+                   bytes [0], bytes [1], bytes [2], bytes [3],
+                   ntohs (target.m_port), state);
+        OutputDebugStringA (show);
+}
+
+/**
+ * Record the outcome of a check.
+ */
+
+static void l_result (HealthTarget & target, unsigned long now, bool ok) {
+        if (target.m_probe != INVALID_SOCKET) {
+                (* g_net.m_closesocket) (target.m_probe);
+                target.m_probe = INVALID_SOCKET;
+        }
+
+        ++ target.m_probes;
+        target.m_nextProbe = now + HEALTH_INTERVAL;
+
+        if (ok) {
+                unsigned long   rtt = now - target.m_probeStart;
+                target.m_lastRtt = rtt;
+                target.m_averageRtt = target.m_averageRtt == 0 ? rtt :
+                                      (target.m_averageRtt * 7 + rtt) / 8;
+
+                target.m_fall = 0;
+                if (++ target.m_rise >= HEALTH_RISE && target.m_down) {
+                        target.m_down = false;
+                        ++ target.m_transitions;
+                        l_show (target, "up");
+                }
+
+                return;
+        }
+
+        ++ target.m_failures;
+        target.m_rise = 0;
+        if (++ target.m_fall >= HEALTH_FALL && ! target.m_down) {
+                target.m_down = true;
+                ++ target.m_transitions;
+                l_show (target, "down");
+        }
+}
+
+/**
+ * Start a check on a server.
+ */
+
+static void l_probe (HealthTarget & target, unsigned long now) {
+        sockaddr_in     addr;
+        memset (& addr, 0, sizeof (addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = target.m_port;
+        addr.sin_addr.S_un.S_addr = target.m_addr;
+
+        target.m_probeStart = now;
+        target.m_sentHead = false;
+        target.m_probe = g_netConnect (addr);
+
+        if (target.m_probe == INVALID_SOCKET)
+                l_result (target, now, false);
+}
+
+/**
+ * Move checks along, from the background thread.
+ *
+ * New checks are started where they're due, and then those in progress are
+ * looked at without waiting; anything that hasn't finished is looked at again
+ * next time around.
+ */
+
+static void l_healthTick (unsigned long now) {
+static  const char      head [] = "HEAD / HTTP/1.0\r\n\r\n";
+
+        EnterCriticalSection (& l_healthLock);
+
+        fd_set          read;
+        fd_set          write;
+        fd_set          error;
+        FD_ZERO (& read);
+        FD_ZERO (& write);
+        FD_ZERO (& error);
+
+        unsigned long   i;
+        for (i = 0 ; i < l_targetCount ; ++ i) {
+                HealthTarget  & target = l_targets [i];
+
+                if (target.m_probe == INVALID_SOCKET) {
+                        if (now - target.m_lastUsed > HEALTH_IDLE) {
+                                target = l_targets [-- l_targetCount];
+                                -- i;
+                                continue;
+                        }
+
+                        if ((long) (now - target.m_nextProbe) < 0)
+                                continue;
+
+                        l_probe (target, now);
+                        if (target.m_probe == INVALID_SOCKET)
+                                continue;
+                }
+
+                if (now - target.m_probeStart > HEALTH_TIMEOUT) {
+                        l_result (target, now, false);
+                        continue;
+                }
+
+                if (target.m_sentHead) {
+                        FD_SET (target.m_probe, & read);
+                } else {
+                        FD_SET (target.m_probe, & write);
+                        FD_SET (target.m_probe, & error);
+                }
+        }
+
+        timeval         poll = { 0, 0 };
+        int             result = 0;
+        if (read.fd_count > 0 || write.fd_count > 0)
+                result = (* g_net.m_select) (0, & read, & write, & error,
+                                             & poll);
+
+        for (i = 0 ; i < l_targetCount && result > 0 ; ++ i) {
+                HealthTarget  & target = l_targets [i];
+                SOCKET          s = target.m_probe;
+                if (s == INVALID_SOCKET)
+                        continue;
+
+                if (target.m_sentHead) {
+                        if (! g_netIsSet (s, read))
+                                continue;
+
+                        char            reply [8];
+                        int             length;
+                        length = (* g_net.m_recv) (s, reply, sizeof (reply), 0);
+                        l_result (target, now,
+                                  length >= 5 && memcmp (reply, "HTTP/", 5) == 0);
+                        continue;
+                }
+
+                if (g_netIsSet (s, error)) {
+                        l_result (target, now, false);
+                        continue;
+                }
+
+                if (! g_netIsSet (s, write))
+                        continue;
+
+                if (! g_netConnected (s)) {
+                        l_result (target, now, false);
+                        continue;
+                }
+
+                if (target.m_port != HEALTH_HTTP_PORT) {
+                        l_result (target, now, true);
+                        continue;
+                }
+
+                int             length = sizeof (head) - 1;
+                target.m_sentHead = true;
+                if ((* g_net.m_send) (s, head, length, 0) != length)
+                        l_result (target, now, false);
+        }
+
+        LeaveCriticalSection (& l_healthLock);
+}
+
+/**
+ * Start checking.
+ */
+
+bool g_healthInit (void) {
+        if (! l_lockInit) {
+                InitializeCriticalSection (& l_healthLock);
+                l_lockInit = true;
+        }
+
+        l_ready = g_tickerAdd (l_healthTick, TICKER_RESOLUTION);
+        return l_ready;
+}
+
+/**
+ * Stop checking; the background thread must already have been stopped.
+ */
+
+void g_healthUnload (void) {
+        if (! l_lockInit)
+                return;
+
+        EnterCriticalSection (& l_healthLock);
+
+        l_ready = false;
+
+        unsigned long   i;
+        for (i = 0 ; i < l_targetCount ; ++ i)
+                if (l_targets [i].m_probe != INVALID_SOCKET)
+                        (* g_net.m_closesocket) (l_targets [i].m_probe);
+
+        l_targetCount = 0;
+
+        LeaveCriticalSection (& l_healthLock);
+}
+
+/**
+ * Ask whether a server is currently thought to be down.
+ *
+ * A server we haven't heard of is added to the table and assumed to be up
+ * until it's been checked. The address and port are in network order.
+ */
+
+bool g_healthDown (unsigned long addr, unsigned short port) {
+        if (! l_ready)
+                return false;
+
+        unsigned long   now = GetTickCount ();
+        bool            down = false;
+
+        EnterCriticalSection (& l_healthLock);
+
+        unsigned long   i;
+        for (i = 0 ; i < l_targetCount ; ++ i)
+                if (l_targets [i].m_addr == addr && l_targets [i].m_port == port)
+                        break;
+
+        if (i == l_targetCount && l_targetCount < HEALTH_TARGETS_MAX) {
+                HealthTarget  & target = l_targets [l_targetCount ++];
+                memset (& target, 0, sizeof (target));
+                target.m_addr = addr;
+                target.m_port = port;
+                target.m_probe = INVALID_SOCKET;
+                target.m_nextProbe = now;
+        }
+
+        if (i < l_targetCount) {
+                l_targets [i].m_lastUsed = now;
+                down = l_targets [i].m_down;
+        }
+
+        LeaveCriticalSection (& l_healthLock);
+        return down;
+}
+
+/**
+ * Return the average time a server has been taking to answer checks, in
+ * milliseconds, or zero if it hasn't answered any yet or isn't known at all.
+ */
+
+unsigned long g_healthRtt (unsigned long addr, unsigned short port) {
+        if (! l_ready)
+                return 0;
+
+        unsigned long   rtt = 0;
+
+        EnterCriticalSection (& l_healthLock);
+
+        unsigned long   i;
+        for (i = 0 ; i < l_targetCount ; ++ i) {
+                if (l_targets [i].m_addr == addr &&
+                    l_targets [i].m_port == port) {
+                        rtt = l_targets [i].m_averageRtt;
+                        break;
+                }
+        }
+
+        LeaveCriticalSection (& l_healthLock);
+        return rtt;
+}
+
+/**
+ * Copy out the counters for the servers being checked.
+ */
+
+unsigned long g_healthStats (HealthStats * stats, unsigned long count) {
+        if (! l_lockInit)
+                return 0;
+
+        EnterCriticalSection (& l_healthLock);
+
+        unsigned long   i;
+        for (i = 0 ; i < l_targetCount && i < count ; ++ i) {
+                const HealthTarget & target = l_targets [i];
+                HealthStats   & item = stats [i];
+
+                item.m_addr = target.m_addr;
+                item.m_port = target.m_port;
+                item.m_down = target.m_down;
+                item.m_probes = target.m_probes;
+                item.m_failures = target.m_failures;
+                item.m_transitions = target.m_transitions;
+                item.m_lastRtt = target.m_lastRtt;
+                item.m_averageRtt = target.m_averageRtt;
+        }
+
+        LeaveCriticalSection (& l_healthLock);
+        return i;
+}
+
+/**
+ * Write the counters out for the benefit of DbgView.
+ */
+
+void g_healthReport (void) {
+        HealthStats     stats [HEALTH_TARGETS_MAX];
+        unsigned long   count = g_healthStats (stats, ARRAY_LENGTH (stats));
+
+        unsigned long   index;
+        for (index = 0 ; index < count ; ++ index) {
+                HealthStats   & item = stats [index];
+                const unsigned char * bytes;
+                bytes = (const unsigned char *) & item.m_addr;
+
+                char            show [160];
+                wsprintfA (show, "target %d.%d.%d.%d:%d: %s, %lu probes, "
+                           "%lu failed, %lu changes, rtt %lums avg %lums\r\n",
+                           bytes [0], bytes [1], bytes [2], bytes [3],
+                           ntohs (item.m_port), item.m_down ? "down" : "up",
+                           item.m_probes, item.m_failures, item.m_transitions,
+                           item.m_lastRtt, item.m_averageRtt);
+                OutputDebugStringA (show);
+        }
+}
+
+/**@}*/
@@ -0,0 +1,103 @@
+#ifndef HEALTH_H
+#define HEALTH_H                1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the background health checking of rewrite targets.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Where a rule rewrites connections to a list of servers, it's important not
+ * to keep sending connections to one which has gone away, since each of those
+ * costs a full TCP connect timeout before Steam tries again. So, the servers
+ * are checked in the background, and the rule selection passes over any which
+ * aren't answering until they come back.
+ *
+ * The state changes only after a couple of checks in a row agree, so a single
+ * dropped probe doesn't take a server out of rotation, and a server which is
+ * flapping doesn't keep coming back into it.
+ */
+
+/**
+ * Most servers that are tracked at once.
+ */
+
+#define HEALTH_TARGETS_MAX      64
+
+/**
+ * How often each server is checked, and how long a check is given to succeed,
+ * in milliseconds.
+ */
+
+#define HEALTH_INTERVAL         10000
+#define HEALTH_TIMEOUT          3000
+
+/**
+ * How many checks in a row it takes to mark a server down, or back up again.
+ */
+
+#define HEALTH_FALL             2
+#define HEALTH_RISE             2
+
+/**
+ * How long a server is still checked after the rules stop asking about it.
+ */
+
+#define HEALTH_IDLE             (10 * 60 * 1000)
+
+/**
+ * Counters for one server, as returned by g_healthStats ().
+ *
+ * The address and port are in network order; times are in milliseconds.
+ */
+
+struct HealthStats {
+        unsigned long   m_addr;
+        unsigned short  m_port;
+        bool            m_down;
+        unsigned long   m_probes;
+        unsigned long   m_failures;
+        unsigned long   m_transitions;
+        unsigned long   m_lastRtt;
+        unsigned long   m_averageRtt;
+};
+
+bool            g_healthInit (void);
+void            g_healthUnload (void);
+
+bool            g_healthDown (unsigned long addr, unsigned short port);
+unsigned long   g_healthRtt (unsigned long addr, unsigned short port);
+
+unsigned long   g_healthStats (HealthStats * stats, unsigned long count);
+void            g_healthReport (void);
+
+/**@}*/
+#endif  /* ! defined (HEALTH_H) */
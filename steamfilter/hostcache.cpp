@@ -0,0 +1,247 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements a simple fixed-size cache of host lookup answers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "hostcache.h"
+
+/**
+ * Simple default constructor; the cache does nothing until configured.
+ */
+
+HostCache :: HostCache () : m_ttl (0), m_negative (0), m_hits (0),
+                m_misses (0), m_refreshes (0) {
+        flush ();
+}
+
+/**
+ * Hash a name, ignoring case as DNS does, and measure it while we're at it.
+ */
+
+/* static */
+unsigned long HostCache :: hash (const char * name, size_t * length) {
+        unsigned long   result = 2166136261UL;
+        const char    * scan = name;
+        for (; * scan != 0 ; ++ scan) {
+                char            ch = * scan;
+                if (ch >= 'A' && ch <= 'Z')
+                        ch += 'a' - 'A';
+
+                result = (result ^ (unsigned char) ch) * 16777619UL;
+        }
+
+        * length = scan - name;
+        return result;
+}
+
+/**
+ * Compare two names, ignoring case.
+ */
+
+/* static */
+bool HostCache :: same (const char * left, const char * right) {
+        for (;; ++ left, ++ right) {
+                char            l = * left;
+                char            r = * right;
+                if (l >= 'A' && l <= 'Z')
+                        l += 'a' - 'A';
+                if (r >= 'A' && r <= 'Z')
+                        r += 'a' - 'A';
+
+                if (l != r)
+                        return false;
+                if (l == 0)
+                        return true;
+        }
+}
+
+/**
+ * Find the entry for a name, if there is one.
+ *
+ * Names too long to keep are never found, and have no hash returned.
+ */
+
+HostEntry * HostCache :: find (const char * name, unsigned long * hashed) {
+        size_t          length;
+        unsigned long   value = hash (name, & length);
+        if (length >= HOST_CACHE_NAME_MAX)
+                return 0;
+
+        * hashed = value;
+
+        HostEntry     * scan = m_entries;
+        for (; scan != m_entries + HOST_CACHE_SIZE ; ++ scan) {
+                if (scan->m_valid && scan->m_hash == value &&
+                    same (scan->m_key, name))
+                        return scan;
+        }
+
+        return 0;
+}
+
+/**
+ * Set how long answers and failures are kept, in milliseconds; a time of zero
+ * turns the cache off.
+ *
+ * Changing the times throws away everything kept so far.
+ */
+
+void HostCache :: configure (unsigned long ttl, unsigned long negative) {
+        if (ttl == m_ttl && negative == m_negative)
+                return;
+
+        m_ttl = ttl;
+        m_negative = negative;
+        flush ();
+}
+
+/**
+ * Look for a current answer for a name.
+ */
+
+bool HostCache :: lookup (const char * name, unsigned long now,
+                          HostAnswer & answer) {
+        if (! active ())
+                return false;
+
+        unsigned long   hashed = 0;
+        HostEntry     * entry = find (name, & hashed);
+        if (entry == 0 || now - entry->m_stored >= entry->m_ttl) {
+                ++ m_misses;
+                return false;
+        }
+
+        ++ m_hits;
+        ++ entry->m_hits;
+        entry->m_used = now;
+        answer = entry->m_answer;
+        return true;
+}
+
+/**
+ * Keep an answer for a name, replacing any earlier one.
+ *
+ * If the table is full, the entry used least recently goes to make room.
+ */
+
+void HostCache :: store (const char * name, const HostAnswer & answer,
+                         unsigned long now) {
+        if (! active ())
+                return;
+
+        unsigned long   hashed = 0;
+        HostEntry     * entry = find (name, & hashed);
+        if (entry == 0) {
+                size_t          length;
+                hashed = hash (name, & length);
+                if (length >= HOST_CACHE_NAME_MAX)
+                        return;
+
+                HostEntry     * scan = m_entries;
+                for (; scan != m_entries + HOST_CACHE_SIZE ; ++ scan) {
+                        if (! scan->m_valid) {
+                                entry = scan;
+                                break;
+                        }
+
+                        if (entry == 0 ||
+                            now - scan->m_used > now - entry->m_used)
+                                entry = scan;
+                }
+
+                for (size_t i = 0 ; i <= length ; ++ i)
+                        entry->m_key [i] = name [i];
+
+                entry->m_hash = hashed;
+                entry->m_used = now;
+                entry->m_valid = true;
+        }
+
+        entry->m_answer = answer;
+        entry->m_stored = now;
+        entry->m_ttl = answer.m_error != 0 ? m_negative : m_ttl;
+        entry->m_hits = 0;
+        entry->m_refreshing = false;
+}
+
+/**
+ * Find a popular entry which is nearly due to expire and so should be looked
+ * up again, returning its name.
+ *
+ * The entry is marked so it won't be handed out twice; storing the new answer
+ * clears the mark. If the refresh fails, the entry just expires as normal and
+ * the next use of it looks the name up again.
+ */
+
+bool HostCache :: refreshDue (unsigned long now, char * name, size_t length) {
+        if (! active ())
+                return false;
+
+        HostEntry     * scan = m_entries;
+        for (; scan != m_entries + HOST_CACHE_SIZE ; ++ scan) {
+                if (! scan->m_valid || scan->m_refreshing ||
+                    scan->m_answer.m_error != 0 ||
+                    scan->m_hits < HOST_CACHE_POPULAR)
+                        continue;
+
+                unsigned long   age = now - scan->m_stored;
+                if (age < scan->m_ttl - scan->m_ttl / 4 || age >= scan->m_ttl)
+                        continue;
+
+                size_t          i = 0;
+                for (; i + 1 < length && scan->m_key [i] != 0 ; ++ i)
+                        name [i] = scan->m_key [i];
+
+                name [i] = 0;
+                if (scan->m_key [i] != 0)
+                        continue;
+
+                scan->m_refreshing = true;
+                ++ m_refreshes;
+                return true;
+        }
+
+        return false;
+}
+
+/**
+ * Throw away everything in the cache.
+ */
+
+void HostCache :: flush (void) {
+        for (HostEntry * scan = m_entries ;
+             scan != m_entries + HOST_CACHE_SIZE ; ++ scan) {
+                scan->m_valid = false;
+                scan->m_refreshing = false;
+        }
+}
+
+/**@}*/
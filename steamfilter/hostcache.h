@@ -0,0 +1,149 @@
+#ifndef HOSTCACHE_H
+#define HOSTCACHE_H             1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares a simple fixed-size cache of host lookup answers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * A cache of host lookup answers.
+ *
+ * The Steam client looks up the same handful of content server names over and
+ * over, and each of those goes off to the system resolver; this keeps the
+ * answers for a while, including the answer that a name doesn't exist, for a
+ * shorter while. Entries which are being used get refreshed a little before
+ * they would expire, so that as long as a name stays in use, looking it up
+ * never has to wait on the network.
+ *
+ * The classic gethostbyname () doesn't tell us the DNS time-to-live of what
+ * it returns, so entries live for a configured time instead.
+ *
+ * The cache is a fixed-size table with the least recently used entry being
+ * replaced when it's full, so it never allocates. Like the token bucket, it
+ * has no dependency on Windows, the caller passes in the time in milliseconds
+ * and provides any locking that's needed, so it can be exercised on its own
+ * against a stub resolver and a simulated clock.
+ */
+
+#include <stddef.h>
+
+/**
+ * Size of the table.
+ */
+
+#define HOST_CACHE_SIZE         128
+
+/**
+ * Most addresses kept for a name, and the longest name kept.
+ */
+
+#define HOST_CACHE_ADDRS        8
+#define HOST_CACHE_NAME_MAX     128
+
+/**
+ * Defaults for how long answers and failures are kept, in milliseconds.
+ */
+
+#define HOST_CACHE_TTL          60000
+#define HOST_CACHE_NEGATIVE     10000
+
+/**
+ * An entry is refreshed ahead of time when it has been used at least this many
+ * times since it was filled, and is in the last quarter of its life.
+ */
+
+#define HOST_CACHE_POPULAR      2
+
+/**
+ * An answer to a lookup, in network order. A failure has an error code and no
+ * addresses; the name is the host's canonical name, if there is one.
+ */
+
+struct HostAnswer {
+        unsigned long   m_error;
+        unsigned long   m_count;
+        unsigned long   m_addrs [HOST_CACHE_ADDRS];
+        char            m_name [HOST_CACHE_NAME_MAX];
+};
+
+/**
+ * An entry in the table.
+ */
+
+struct HostEntry {
+        char            m_key [HOST_CACHE_NAME_MAX];
+        unsigned long   m_hash;
+        HostAnswer      m_answer;
+        unsigned long   m_stored;
+        unsigned long   m_ttl;
+        unsigned long   m_used;
+        unsigned long   m_hits;
+        bool            m_valid;
+        bool            m_refreshing;
+};
+
+class HostCache {
+private:
+        HostEntry       m_entries [HOST_CACHE_SIZE];
+        unsigned long   m_ttl;
+        unsigned long   m_negative;
+
+        unsigned long   m_hits;
+        unsigned long   m_misses;
+        unsigned long   m_refreshes;
+
+static  unsigned long   hash (const char * name, size_t * length);
+static  bool            same (const char * left, const char * right);
+
+        HostEntry     * find (const char * name, unsigned long * hash);
+
+public:
+                        HostCache ();
+
+        void            configure (unsigned long ttl, unsigned long negative);
+        bool            active (void) const { return m_ttl != 0; }
+
+        bool            lookup (const char * name, unsigned long now,
+                                HostAnswer & answer);
+        void            store (const char * name, const HostAnswer & answer,
+                               unsigned long now);
+        bool            refreshDue (unsigned long now, char * name,
+                                    size_t length);
+        void            flush (void);
+
+        unsigned long   hits (void) const { return m_hits; }
+        unsigned long   misses (void) const { return m_misses; }
+        unsigned long   refreshes (void) const { return m_refreshes; }
+};
+
+/**@}*/
+#endif  /* ! defined (HOSTCACHE_H) */
@@ -0,0 +1,215 @@
+#ifndef HOSTINFO_H
+#define HOSTINFO_H              1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the building of answers to host lookups made through the
+ * getaddrinfo () family of functions.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Answers to getaddrinfo () style lookups which the filter makes up itself,
+ * rather than having the resolver find them.
+ *
+ * There are three flavours of the structure an answer is made of, one for
+ * each of getaddrinfo (), GetAddrInfoW () and GetAddrInfoExW (); they differ
+ * in the type of the canonical name and in the extra fields on the end of the
+ * last, but the fields which matter here are common to them all, so these are
+ * templates over the structure and character type.
+ *
+ * An answer is one block of memory holding every entry, every address and the
+ * canonical name, so that it can be handed back as one. Like the lookup cache,
+ * there is no dependency on Windows; the includer brings in whatever declares
+ * addrinfo and sockaddr_in on the platform in question, so the answers can be
+ * built and checked against the system's own on any of them.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * What the caller of the lookup asked for, from the hints they passed; the
+ * port is in network order.
+ */
+
+struct HostInfoRequest {
+        int             m_family;
+        int             m_socktype;
+        int             m_protocol;
+        int             m_flags;
+        unsigned short  m_port;
+};
+
+/**
+ * Take the request from the hints, which can be left out entirely.
+ */
+
+template <class Info>
+void hostInfoRequest (const Info * hints, HostInfoRequest & request) {
+        request.m_family = hints != 0 ? hints->ai_family : AF_UNSPEC;
+        request.m_socktype = hints != 0 ? hints->ai_socktype : 0;
+        request.m_protocol = hints != 0 ? hints->ai_protocol : 0;
+        request.m_flags = hints != 0 ? hints->ai_flags : 0;
+        request.m_port = 0;
+}
+
+/**
+ * Narrow a name, which must be plain ASCII and fit in the given space.
+ */
+
+template <class Char>
+bool hostInfoNarrow (const Char * name, char * narrow, size_t size) {
+        size_t          i = 0;
+        for (; name [i] != 0 ; ++ i) {
+                if (i + 1 >= size || name [i] < 0 || name [i] >= 0x80)
+                        return false;
+
+                narrow [i] = (char) name [i];
+        }
+
+        narrow [i] = 0;
+        return true;
+}
+
+/**
+ * Turn a service given as a number into a port, in host order.
+ *
+ * No service at all is port zero; anything not entirely digits is left for
+ * the caller to look up as a service name.
+ */
+
+template <class Char>
+bool hostInfoPort (const Char * service, unsigned short & port) {
+        port = 0;
+        if (service == 0)
+                return true;
+
+        unsigned long   value = 0;
+        size_t          i = 0;
+        for (; service [i] != 0 ; ++ i) {
+                if (service [i] < '0' || service [i] > '9')
+                        return false;
+
+                value = value * 10 + (service [i] - '0');
+                if (value > 0xFFFF)
+                        return false;
+        }
+
+        port = (unsigned short) value;
+        return true;
+}
+
+/**
+ * Work out the size of the block needed for an answer.
+ */
+
+template <class Info, class Char>
+size_t hostInfoSize (unsigned long count, const Char * name) {
+        size_t          size = count * (sizeof (Info) + sizeof (sockaddr_in));
+        if (name == 0)
+                return size;
+
+        size_t          length = 0;
+        while (name [length] != 0)
+                ++ length;
+
+        return size + (length + 1) * sizeof (Char);
+}
+
+/**
+ * Build an answer listing the given IPv4 addresses, in order, in a block of
+ * the size given by hostInfoSize ().
+ *
+ * There is one entry for each address, carrying the socket type and protocol
+ * that were asked for; the canonical name, if there is one, hangs off the
+ * first entry, as the system's own answers do.
+ */
+
+template <class Info, class Char>
+Info * hostInfoBuild (void * mem, const unsigned long * addrs,
+                      unsigned long count, const HostInfoRequest & request,
+                      const Char * name) {
+        if (count == 0)
+                return 0;
+
+        memset (mem, 0, hostInfoSize<Info> (count, name));
+
+        Info          * info = (Info *) mem;
+        sockaddr_in   * addr = (sockaddr_in *) (info + count);
+
+        for (unsigned long i = 0 ; i < count ; ++ i) {
+                addr [i].sin_family = AF_INET;
+                addr [i].sin_port = request.m_port;
+                addr [i].sin_addr.s_addr = addrs [i];
+
+                info [i].ai_family = AF_INET;
+                info [i].ai_socktype = request.m_socktype;
+                info [i].ai_protocol = request.m_protocol;
+                info [i].ai_addrlen = sizeof (sockaddr_in);
+                info [i].ai_addr = (sockaddr *) (addr + i);
+                info [i].ai_next = i + 1 < count ? info + i + 1 : 0;
+        }
+
+        if (name != 0) {
+                Char          * copy = (Char *) (addr + count);
+                size_t          i = 0;
+                for (; name [i] != 0 ; ++ i)
+                        copy [i] = name [i];
+
+                copy [i] = 0;
+                info->ai_canonname = copy;
+        }
+
+        return info;
+}
+
+/**
+ * Collect the IPv4 addresses from an answer, such as one from the system to
+ * be kept in the lookup cache; returns how many there were room for.
+ */
+
+template <class Info>
+unsigned long hostInfoAddrs (const Info * info, unsigned long * addrs,
+                             unsigned long max) {
+        unsigned long   count = 0;
+        for (; info != 0 && count < max ; info = info->ai_next) {
+                if (info->ai_addr == 0 || info->ai_addr->sa_family != AF_INET)
+                        continue;
+
+                const sockaddr_in * addr = (const sockaddr_in *) info->ai_addr;
+                addrs [count ++] = addr->sin_addr.s_addr;
+        }
+
+        return count;
+}
+
+/**@}*/
+#endif  /* ! defined (HOSTINFO_H) */
@@ -0,0 +1,461 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the cache of captured upstream HTTP responses used by the
+ * "=@ttl" URL rules.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The cache is a short list kept in most-recently-used order under a lock;
+ * it only ever holds a handful of documents, and it's only consulted when a
+ * request matches a caching rule, so nothing cleverer is called for.
+ *
+ * Captured responses are turned into the same kind of Document used for
+ * replacement responses, so a cache hit is served by the existing replacement
+ * machinery and the receive hooks don't need to know the difference. The
+ * upstream Date and Expires headers are dropped in favour of the ones spliced
+ * in for each response, as are any hop-by-hop headers.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+
+#include "httpcache.h"
+#include "document.h"
+#include "header.h"
+#include "pool.h"
+
+/**
+ * Entry in the response cache.
+ */
+
+struct CacheItem {
+        CacheItem     * m_next;
+        CacheItem     * m_prev;
+        unsigned long   m_expires;
+        unsigned long   m_size;
+        Document      * m_doc;
+        char            m_key [1];
+};
+
+/**
+ * The cache list, most recently used first, and its lock.
+ */
+
+static  CRITICAL_SECTION l_lock [1];
+static  bool            l_init;
+
+static  CacheItem     * l_head;
+static  CacheItem     * l_tail;
+static  unsigned long   l_used;
+
+/**
+ * Headers which describe the upstream connection or response timing rather
+ * than the document, and which we don't replay.
+ */
+
+static const char     * l_dropped [] = {
+        "date", "expires", "age", "connection", "keep-alive",
+        "proxy-connection", 0
+};
+
+/**
+ * Set up the cache.
+ */
+
+void g_cacheInit (void) {
+        if (l_init)
+                return;
+
+        InitializeCriticalSection (l_lock);
+        l_init = true;
+}
+
+/**
+ * Unlink an entry; the caller holds the lock.
+ */
+
+static void l_unlink (CacheItem * item) {
+        if (item->m_prev == 0) {
+                l_head = item->m_next;
+        } else
+                item->m_prev->m_next = item->m_next;
+
+        if (item->m_next == 0) {
+                l_tail = item->m_prev;
+        } else
+                item->m_next->m_prev = item->m_prev;
+
+        item->m_next = item->m_prev = 0;
+}
+
+/**
+ * Link an entry in as the most recently used; the caller holds the lock.
+ */
+
+static void l_push (CacheItem * item) {
+        item->m_prev = 0;
+        item->m_next = l_head;
+        if (l_head != 0) {
+                l_head->m_prev = item;
+        } else
+                l_tail = item;
+
+        l_head = item;
+}
+
+/**
+ * Discard an entry; the caller holds the lock.
+ *
+ * Sockets still being sent the document hold their own references to it.
+ */
+
+static void l_discard (CacheItem * item) {
+        l_unlink (item);
+        l_used -= item->m_size;
+
+        g_documentRelease (item->m_doc);
+        g_poolFree (item);
+}
+
+/**
+ * Discard everything in the cache.
+ */
+
+void g_cacheFlush (void) {
+        if (! l_init)
+                return;
+
+        EnterCriticalSection (l_lock);
+
+        while (l_head != 0)
+                l_discard (l_head);
+
+        LeaveCriticalSection (l_lock);
+}
+
+/**
+ * Release the cache at unload time.
+ */
+
+void g_cacheUnload (void) {
+        if (! l_init)
+                return;
+
+        g_cacheFlush ();
+
+        DeleteCriticalSection (l_lock);
+        l_init = false;
+}
+
+/**
+ * Look for a fresh cached response for a request.
+ *
+ * The result holds a reference which the caller must release.
+ */
+
+Document * g_cacheLookup (const char * key) {
+        if (! l_init || key == 0)
+                return 0;
+
+        unsigned long   now = g_currentSecond ();
+        Document      * doc = 0;
+
+        EnterCriticalSection (l_lock);
+
+        CacheItem     * scan = l_head;
+        for (; scan != 0 ; scan = scan->m_next) {
+                if (strcmp (scan->m_key, key) != 0)
+                        continue;
+
+                if ((long) (scan->m_expires - now) <= 0) {
+                        l_discard (scan);
+                        break;
+                }
+
+                l_unlink (scan);
+                l_push (scan);
+
+                doc = scan->m_doc;
+                g_documentAddRef (doc);
+                break;
+        }
+
+        LeaveCriticalSection (l_lock);
+        return doc;
+}
+
+/**
+ * Check whether a partial response is one we could cache, and if so how long
+ * the headers and the complete response will be.
+ *
+ * This returns false as soon as the response is known not to be cacheable;
+ * otherwise the total is set to 0 until all the headers have been seen. Only
+ * successful responses with an explicit Content-Length are accepted, since
+ * without one the end of the response can only be found by the connection
+ * closing or by decoding chunked encoding, neither of which is worth doing
+ * for this.
+ */
+
+bool g_cacheResponseLength (const char * buf, unsigned long length,
+                            unsigned long limit, unsigned long * header,
+                            unsigned long * total) {
+        * total = 0;
+
+        if (length >= 12 && memcmp (buf, "HTTP/1.", 7) != 0)
+                return false;
+        if (length >= 13 && memcmp (buf + 8, " 200 ", 5) != 0)
+                return false;
+
+        const char    * end = g_headerEnd (buf, length);
+        if (end == 0)
+                return length < CACHE_HEADER_MAX;
+
+        const char    * scan = (const char *) memchr (buf, '\n', end - buf);
+        if (scan == 0)
+                return false;
+
+        ++ scan;
+
+        unsigned long   content = ~ 0UL;
+        HeaderLine      line;
+        while (g_nextHeader (scan, end, line)) {
+                if (line.m_name == 0)
+                        return false;
+
+                if (g_headerIs (line.m_name, line.m_nameLength,
+                              "transfer-encoding"))
+                        return false;
+
+                if (g_headerIs (line.m_name, line.m_nameLength,
+                              "content-length") &&
+                    ! g_headerValue (line.m_value,
+                                    line.m_value + line.m_valueLength,
+                                    & content))
+                        return false;
+        }
+
+        if (content > limit)
+                return false;
+
+        * header = end - buf;
+        * total = (end - buf) + content;
+        return true;
+}
+
+/**
+ * Work out how long a response may be cached for, given the rule's limit.
+ *
+ * Anything the server marks as private, uncacheable or per-user (a cookie) is
+ * refused outright; otherwise max-age or Expires can shorten the lifetime.
+ * An Expires value is measured against the server's own Date where there is
+ * one, so a skewed server clock doesn't distort it.
+ */
+
+static unsigned long l_lifetime (const char * scan, const char * end,
+                                 unsigned long ttl) {
+        bool            maxAge = false;
+        bool            expires = false;
+        unsigned long   expiresAt = 0;
+        bool            dated = false;
+        unsigned long   dateAt = 0;
+
+        HeaderLine      line;
+        while (g_nextHeader (scan, end, line)) {
+                const char    * name = line.m_name;
+                unsigned long   length = line.m_nameLength;
+                const char    * value = line.m_value;
+                unsigned long   valueLength = line.m_valueLength;
+
+                if (g_headerIs (name, length, "set-cookie"))
+                        return 0;
+
+                if (g_headerIs (name, length, "vary") &&
+                    g_headerToken (value, valueLength, "*") != 0)
+                        return 0;
+
+                if (g_headerIs (name, length, "pragma") &&
+                    g_headerToken (value, valueLength, "no-cache") != 0)
+                        return 0;
+
+                if (g_headerIs (name, length, "cache-control")) {
+                        if (g_headerToken (value, valueLength, "no-store") != 0 ||
+                            g_headerToken (value, valueLength, "no-cache") != 0 ||
+                            g_headerToken (value, valueLength, "private") != 0)
+                                return 0;
+
+                        const char    * age;
+                        age = g_headerToken (value, valueLength, "max-age");
+                        unsigned long   seconds;
+                        if (age != 0 && * age == '=' &&
+                            g_headerValue (age + 1, value + valueLength,
+                                          & seconds)) {
+                                maxAge = true;
+                                if (seconds < ttl)
+                                        ttl = seconds;
+                        }
+                }
+
+                if (g_headerIs (name, length, "expires")) {
+                        expires = true;
+                        if (! g_parseHttpDate (value, valueLength, & expiresAt))
+                                return 0;
+                }
+
+                if (g_headerIs (name, length, "date"))
+                        dated = g_parseHttpDate (value, valueLength, & dateAt);
+        }
+
+        if (expires && ! maxAge) {
+                if (! dated)
+                        dateAt = g_currentSecond ();
+
+                long            lifetime = (long) (expiresAt - dateAt);
+                if (lifetime <= 0)
+                        return 0;
+                if ((unsigned long) lifetime < ttl)
+                        ttl = lifetime;
+        }
+
+        return ttl;
+}
+
+/**
+ * Append the headers to replay for a captured response.
+ *
+ * This returns the length of the status line, after which the per-response
+ * Date header is spliced in.
+ */
+
+static unsigned long l_buildHead (HeaderBuilder & build, const char * buf,
+                                  const char * end) {
+        const char    * scan = (const char *) memchr (buf, '\n', end - buf) + 1;
+        build.append (buf, scan - buf);
+        unsigned long   split = build.length ();
+
+        HeaderLine      line;
+        while (g_nextHeader (scan, end, line)) {
+                const char   ** drop = l_dropped;
+                for (; * drop != 0 ; ++ drop)
+                        if (g_headerIs (line.m_name, line.m_nameLength, * drop))
+                                break;
+
+                if (* drop == 0)
+                        build.append (line.m_line, line.m_lineLength);
+        }
+
+        build.append ("Connection: Keep-Alive\r\n\r\n");
+        return split;
+}
+
+/**
+ * Add a complete captured response to the cache.
+ *
+ * The response has already been checked by g_cacheResponseLength (), so the
+ * headers are known to be complete and well-formed with the body following.
+ */
+
+bool g_cacheStore (const char * key, unsigned long ttl, const char * response,
+                   unsigned long length) {
+        if (! l_init || key == 0)
+                return false;
+
+        const char    * end = g_headerEnd (response, length);
+        if (end == 0)
+                return false;
+
+        const char    * headers;
+        headers = (const char *) memchr (response, '\n', end - response) + 1;
+
+        ttl = l_lifetime (headers, end, ttl);
+        if (ttl == 0)
+                return false;
+
+        unsigned long   bodyLength = response + length - end;
+
+        HeaderBuilder   measure;
+        unsigned long   split = l_buildHead (measure, response, end);
+
+        Document      * doc;
+        doc = g_newDocument (measure.length (), split, bodyLength, bodyLength);
+        if (doc == 0)
+                return false;
+
+        HeaderBuilder   build ((char *) doc->m_head);
+        l_buildHead (build, response, end);
+        memcpy ((void *) doc->m_body, end, bodyLength);
+
+        size_t          keyLength = strlen (key);
+        CacheItem     * item;
+        item = (CacheItem *) g_poolAlloc (sizeof (CacheItem) + keyLength);
+        if (item == 0) {
+                g_documentRelease (doc);
+                return false;
+        }
+
+        memcpy (item->m_key, key, keyLength + 1);
+        item->m_doc = doc;
+        item->m_size = sizeof (CacheItem) + keyLength + measure.length () +
+                       bodyLength;
+        item->m_expires = g_currentSecond () + ttl;
+
+        /*
+         * Replace any existing entry for the same request, then make room by
+         * discarding whatever has expired and after that the least recently
+         * used entries.
+         */
+
+        unsigned long   now = g_currentSecond ();
+
+        EnterCriticalSection (l_lock);
+
+        CacheItem     * scan = l_head;
+        while (scan != 0) {
+                CacheItem     * next = scan->m_next;
+                if (strcmp (scan->m_key, key) == 0 ||
+                    (long) (scan->m_expires - now) <= 0)
+                        l_discard (scan);
+
+                scan = next;
+        }
+
+        while (l_tail != 0 && l_used + item->m_size > CACHE_BUDGET)
+                l_discard (l_tail);
+
+        l_push (item);
+        l_used += item->m_size;
+
+        LeaveCriticalSection (l_lock);
+
+        OutputDebugStringA ("Cached HTTP response\r\n");
+        return true;
+}
+
+/**@}*/
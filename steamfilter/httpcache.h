@@ -0,0 +1,73 @@
+#ifndef HTTPCACHE_H
+#define HTTPCACHE_H             1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the cache of captured upstream HTTP responses.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Some of the documents Steam fetches over HTTP, such as server lists and
+ * configuration blobs, are small and re-fetched far more often than they
+ * change. A URL rule of the form "=@ttl" asks for the upstream response to be
+ * captured as it's received and then served locally for up to ttl seconds,
+ * subject to whatever the server's own caching headers allow.
+ */
+
+struct Document;
+
+/**
+ * Limits on what the cache will hold, in bytes.
+ *
+ * Responses with headers longer than the header limit, or a body larger than
+ * the entry limit, are never captured; the budget caps the total held across
+ * all entries, with the least-recently used being discarded to make room.
+ */
+
+#define CACHE_HEADER_MAX        8192
+#define CACHE_ENTRY_MAX         (256 * 1024)
+#define CACHE_BUDGET            (4 * 1024 * 1024)
+
+void            g_cacheInit (void);
+void            g_cacheUnload (void);
+void            g_cacheFlush (void);
+
+Document      * g_cacheLookup (const char * key);
+
+bool            g_cacheResponseLength (const char * buf, unsigned long length,
+                                       unsigned long limit,
+                                       unsigned long * header,
+                                       unsigned long * total);
+bool            g_cacheStore (const char * key, unsigned long ttl,
+                              const char * response, unsigned long length);
+
+/**@}*/
+#endif  /* ! defined (HTTPCACHE_H) */
@@ -0,0 +1,371 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the timers which measure how long the hooks take, and how
+ * much of that is the filter's own doing.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <windows.h>
+
+#include "latency.h"
+
+#if     FILTER_LATENCY
+
+#include "perthread.h"
+#include "stats.h"
+#include "ticker.h"
+
+/**
+ * Readings of the cycle counter and the performance counter when we started,
+ * from which the rate of the cycle counter is worked out; the cycle counter's
+ * rate isn't something Windows will tell us, and the performance counter is
+ * too slow to read in the hooks themselves.
+ */
+
+static  unsigned long long l_baseCycles;
+static  LARGE_INTEGER   l_baseCount;
+static  double          l_nsPerCycle;
+
+/**
+ * Names of the hooks, for the report.
+ */
+
+static  const char    * l_names [HOOK_COUNT] = {
+        "connect", "send", "WSASend", "recv", "WSARecv", "sendto",
+        "WSASendTo"
+};
+
+/**
+ * Return the position of the highest set bit in a value.
+ */
+
+static unsigned long l_log2 (unsigned long long value) {
+        unsigned long   bits = 0;
+        if ((value >> 32) != 0) {
+                value >>= 32;
+                bits += 32;
+        }
+        if ((value >> 16) != 0) {
+                value >>= 16;
+                bits += 16;
+        }
+        if ((value >> 8) != 0) {
+                value >>= 8;
+                bits += 8;
+        }
+        if ((value >> 4) != 0) {
+                value >>= 4;
+                bits += 4;
+        }
+        if ((value >> 2) != 0) {
+                value >>= 2;
+                bits += 2;
+        }
+        if ((value >> 1) != 0)
+                ++ bits;
+
+        return bits;
+}
+
+/**
+ * Work out which bucket of a histogram a time goes in.
+ *
+ * Small values each have a bucket to themselves; beyond that, the top bit of
+ * the value picks a group of buckets and the next few bits below it pick the
+ * bucket within the group.
+ */
+
+static unsigned long l_bucket (unsigned long long value) {
+        if (value < LATENCY_SUB)
+                return (unsigned long) value;
+
+        unsigned long   bits = l_log2 (value);
+        if (bits >= LATENCY_TOP_BITS)
+                return LATENCY_BUCKETS - 1;
+
+        unsigned long   shift = bits - LATENCY_SUB_BITS;
+        unsigned long   step = (unsigned long) (value >> shift);
+        return ((shift + 1) << LATENCY_SUB_BITS) + (step & (LATENCY_SUB - 1));
+}
+
+/**
+ * Return the highest time which goes in a bucket.
+ */
+
+static unsigned long long l_upper (unsigned long bucket) {
+        if (bucket < LATENCY_SUB)
+                return bucket;
+
+        unsigned long   shift = (bucket >> LATENCY_SUB_BITS) - 1;
+        unsigned long long low;
+        low = (unsigned long long) (LATENCY_SUB + (bucket & (LATENCY_SUB - 1)));
+        return (low << shift) + ((1ULL << shift) - 1);
+}
+
+/**
+ * Add a time to a histogram.
+ */
+
+static void l_add (LatencyHistogram & histogram, unsigned long long value) {
+        ++ histogram.m_counts [l_bucket (value)];
+        if (value > histogram.m_max)
+                histogram.m_max = value;
+}
+
+/**
+ * Record the times for one invocation of a hook, into the calling thread's
+ * histograms.
+ *
+ * The histograms are only made for threads which actually go through one of
+ * the timed hooks; they're only ever written by the thread owning them, and
+ * the background thread reading them can live with seeing a count or two out
+ * of date.
+ */
+
+void g_latencyRecord (FilterStatsHook hook, unsigned long long total,
+                      unsigned long long call, bool called) {
+        ThreadData    * thread = g_threadData ();
+        if (thread == 0)
+                return;
+
+        LatencyData   * data = (LatencyData *) thread->m_latency;
+        if (data == 0) {
+                data = (LatencyData *) HeapAlloc (GetProcessHeap (),
+                                                  HEAP_ZERO_MEMORY,
+                                                  sizeof (LatencyData));
+                if (data == 0)
+                        return;
+
+                thread->m_latency = data;
+        }
+
+        LatencyHistogram      * histograms = data->m_hooks [hook];
+        l_add (histograms [LATENCY_ADDED], call < total ? total - call : 0);
+        if (called)
+                l_add (histograms [LATENCY_CALL], call);
+}
+
+/**
+ * Sum one histogram over all the threads.
+ */
+
+static unsigned long l_sum (FilterStatsHook hook, LatencyKind kind,
+                            LatencyHistogram & sum) {
+        ZeroMemory (& sum, sizeof (sum));
+
+        ThreadData    * scan = g_threadList ();
+        for (; scan != 0 ; scan = scan->m_next) {
+                LatencyData   * data = (LatencyData *) scan->m_latency;
+                if (data == 0)
+                        continue;
+
+                LatencyHistogram      & from = data->m_hooks [hook] [kind];
+                for (unsigned long i = 0 ; i < LATENCY_BUCKETS ; ++ i)
+                        sum.m_counts [i] += from.m_counts [i];
+
+                if (from.m_max > sum.m_max)
+                        sum.m_max = from.m_max;
+        }
+
+        unsigned long   total = 0;
+        for (unsigned long i = 0 ; i < LATENCY_BUCKETS ; ++ i)
+                total += sum.m_counts [i];
+
+        return total;
+}
+
+/**
+ * Convert a time in cycles to nanoseconds, as it fits in the shared block.
+ */
+
+static unsigned int l_nanoseconds (unsigned long long cycles) {
+        double          result = cycles * l_nsPerCycle;
+        if (result >= 4294967295.0)
+                return ~ 0U;
+
+        return (unsigned int) result;
+}
+
+/**
+ * Find the time below which the given proportion of a histogram lies, in
+ * parts per thousand.
+ */
+
+static unsigned int l_percentile (const LatencyHistogram & histogram,
+                                  unsigned long total, unsigned long part) {
+        unsigned long long want = ((unsigned long long) total * part + 999) / 1000;
+        unsigned long long seen = 0;
+
+        for (unsigned long i = 0 ; i < LATENCY_BUCKETS ; ++ i) {
+                seen += histogram.m_counts [i];
+                if (seen < want)
+                        continue;
+
+                unsigned long long value = l_upper (i);
+                if (value > histogram.m_max)
+                        value = histogram.m_max;
+
+                return l_nanoseconds (value);
+        }
+
+        return l_nanoseconds (histogram.m_max);
+}
+
+/**
+ * Work out the figures for one hook.
+ */
+
+static void l_figures (FilterStatsHook hook, FilterStatsLatency & figures) {
+        LatencyHistogram        sum;
+        unsigned long   total = l_sum (hook, LATENCY_ADDED, sum);
+
+        figures.m_calls = total;
+        figures.m_addedP50 = l_percentile (sum, total, 500);
+        figures.m_addedP99 = l_percentile (sum, total, 990);
+        figures.m_addedMax = l_nanoseconds (sum.m_max);
+
+        total = l_sum (hook, LATENCY_CALL, sum);
+        figures.m_callP50 = l_percentile (sum, total, 500);
+        figures.m_callP99 = l_percentile (sum, total, 990);
+        figures.m_callMax = l_nanoseconds (sum.m_max);
+        figures.m_reserved = 0;
+}
+
+/**
+ * Work out the rate of the cycle counter, over the whole time since we began.
+ */
+
+static void l_calibrate (void) {
+        LARGE_INTEGER   count;
+        LARGE_INTEGER   frequency;
+        unsigned long long cycles = g_latencyClock () - l_baseCycles;
+        if (! QueryPerformanceCounter (& count) ||
+            ! QueryPerformanceFrequency (& frequency))
+                return;
+
+        double          elapsed = (double) (count.QuadPart - l_baseCount.QuadPart);
+        if (cycles == 0 || elapsed <= 0)
+                return;
+
+        l_nsPerCycle = elapsed * 1e9 / ((double) frequency.QuadPart * cycles);
+}
+
+/**
+ * Publish the figures in the shared block, from the background thread.
+ *
+ * The background thread is the only writer of anything under the sequence
+ * lock, so as with the meter the increments either side are all it needs.
+ */
+
+static void l_latencyTick (unsigned long now) {
+        l_calibrate ();
+
+        volatile FilterStats  * stats = g_stats;
+        if (stats == 0)
+                return;
+
+        FilterStatsLatency      figures [HOOK_COUNT];
+        unsigned long   hook;
+        for (hook = 0 ; hook < HOOK_COUNT ; ++ hook)
+                l_figures ((FilterStatsHook) hook, figures [hook]);
+
+        ++ stats->m_sequence;
+        FILTER_STATS_BARRIER ();
+
+        for (hook = 0 ; hook < HOOK_COUNT ; ++ hook) {
+                volatile FilterStatsLatency * to = stats->m_latency + hook;
+                to->m_calls = figures [hook].m_calls;
+                to->m_addedP50 = figures [hook].m_addedP50;
+                to->m_addedP99 = figures [hook].m_addedP99;
+                to->m_addedMax = figures [hook].m_addedMax;
+                to->m_callP50 = figures [hook].m_callP50;
+                to->m_callP99 = figures [hook].m_callP99;
+                to->m_callMax = figures [hook].m_callMax;
+        }
+
+        FILTER_STATS_BARRIER ();
+        ++ stats->m_sequence;
+}
+
+/**
+ * Take the starting readings of the counters, and have the figures published
+ * periodically.
+ */
+
+void g_latencyInit (void) {
+        QueryPerformanceCounter (& l_baseCount);
+        l_baseCycles = g_latencyClock ();
+
+        g_tickerAdd (l_latencyTick, LATENCY_INTERVAL);
+}
+
+/**
+ * Write the figures out for the benefit of DbgView.
+ */
+
+void g_latencyReport (void) {
+        l_calibrate ();
+
+        for (unsigned long hook = 0 ; hook < HOOK_COUNT ; ++ hook) {
+                FilterStatsLatency      figures;
+                l_figures ((FilterStatsHook) hook, figures);
+                if (figures.m_calls == 0)
+                        continue;
+
+                char            show [200];
+                wsprintfA (show, "latency: %s %lu calls, added %lu/%lu/%lu ns, "
+                           "call %lu/%lu/%lu ns (50%%/99%%/max)\r\n",
+                           l_names [hook], figures.m_calls,
+                           figures.m_addedP50, figures.m_addedP99,
+                           figures.m_addedMax, figures.m_callP50,
+                           figures.m_callP99, figures.m_callMax);
+                OutputDebugStringA (show);
+        }
+}
+
+/**
+ * Release the per-thread histograms; the hooks must have been removed, and the
+ * background thread stopped, before this is called.
+ */
+
+void g_latencyUnload (void) {
+        ThreadData    * scan = g_threadList ();
+        for (; scan != 0 ; scan = scan->m_next) {
+                void          * data = scan->m_latency;
+                scan->m_latency = 0;
+
+                if (data != 0)
+                        HeapFree (GetProcessHeap (), 0, data);
+        }
+}
+
+#endif  /* FILTER_LATENCY */
+
+/**@}*/
@@ -0,0 +1,195 @@
+#ifndef LATENCY_H
+#define LATENCY_H               1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the timers which measure how long the hooks take, and how
+ * much of that is the filter's own doing.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * To know how much time the filter adds to the calls it hooks, the busiest
+ * hooks can be timed with the processor's cycle counter; each invocation is
+ * split into the time spent in the underlying function and the rest, which is
+ * what the filter itself added.
+ *
+ * The times go into histograms kept per thread and per hook, so that the hooks
+ * never contend with each other; the histograms are log-linear in the style of
+ * HdrHistogram, with each power of two split into a few linear steps, so they
+ * cover everything from a few cycles to minutes in a small fixed space with a
+ * bounded relative error. The background thread sums them every few seconds
+ * and publishes the 50th and 99th percentiles and the maximum in the shared
+ * statistics, and they're written out for DbgView at unload.
+ *
+ * Defining FILTER_LATENCY as 0 compiles all of this out, leaving the timers
+ * as empty objects which generate no code at all.
+ */
+
+#ifndef FILTER_LATENCY
+#define FILTER_LATENCY          1
+#endif
+
+#include "../filterstats.h"
+
+#if     FILTER_LATENCY
+
+#if     defined (_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+/**
+ * Each power of two is split into this many linear steps, as a power of two;
+ * three bits gives a relative error of at most one part in eight.
+ */
+
+#define LATENCY_SUB_BITS        3
+#define LATENCY_SUB             (1 << LATENCY_SUB_BITS)
+
+/**
+ * Times of this power of two cycles and above all go in the last bucket; at
+ * current clock rates, that's several minutes.
+ */
+
+#define LATENCY_TOP_BITS        40
+
+#define LATENCY_BUCKETS         ((LATENCY_TOP_BITS - LATENCY_SUB_BITS + 1) << \
+                                 LATENCY_SUB_BITS)
+
+/**
+ * How often the histograms are summed and published, in milliseconds.
+ */
+
+#define LATENCY_INTERVAL        5000
+
+/**
+ * One histogram of times, in cycles.
+ */
+
+struct LatencyHistogram {
+        unsigned long   m_counts [LATENCY_BUCKETS];
+        unsigned long long m_max;
+};
+
+/**
+ * The kinds of time measured for each hook.
+ */
+
+enum LatencyKind {
+        LATENCY_ADDED,
+        LATENCY_CALL,
+
+        LATENCY_KINDS
+};
+
+/**
+ * The histograms for one thread.
+ */
+
+struct LatencyData {
+        LatencyHistogram m_hooks [HOOK_COUNT] [LATENCY_KINDS];
+};
+
+/**
+ * Read the cycle counter.
+ */
+
+inline  unsigned long long g_latencyClock (void) {
+        return __rdtsc ();
+}
+
+void            g_latencyRecord (FilterStatsHook hook, unsigned long long total,
+                                 unsigned long long call, bool called);
+
+void            g_latencyInit (void);
+void            g_latencyReport (void);
+void            g_latencyUnload (void);
+
+/**
+ * Time a hook, from construction to destruction.
+ *
+ * The hook calls under () just before calling the underlying function, and
+ * back () once it returns if there's more to do afterwards; when the call is
+ * the last thing the hook does, the destructor stands in for back (). A hook
+ * which calls down more than once has the calls added together.
+ */
+
+class HookTimer {
+private:
+        FilterStatsHook m_hook;
+        unsigned long long m_start;
+        unsigned long long m_under;
+        unsigned long long m_call;
+        bool            m_called;
+
+public:
+                        HookTimer (FilterStatsHook hook) : m_hook (hook),
+                                m_start (g_latencyClock ()), m_under (0),
+                                m_call (0), m_called (false) { }
+                      ~ HookTimer () {
+                                unsigned long long end = g_latencyClock ();
+                                if (m_under != 0)
+                                        m_call += end - m_under;
+
+                                g_latencyRecord (m_hook, end - m_start, m_call,
+                                                 m_called);
+                        }
+
+        void            under (void) {
+                                m_under = g_latencyClock ();
+                                m_called = true;
+                        }
+        void            back (void) {
+                                if (m_under != 0)
+                                        m_call += g_latencyClock () - m_under;
+                                m_under = 0;
+                        }
+};
+
+#else   /* ! FILTER_LATENCY */
+
+inline  void            g_latencyInit (void) { }
+inline  void            g_latencyReport (void) { }
+inline  void            g_latencyUnload (void) { }
+
+class HookTimer {
+public:
+                        HookTimer (FilterStatsHook) { }
+
+        void            under (void) { }
+        void            back (void) { }
+};
+
+#endif  /* ! FILTER_LATENCY */
+
+/**@}*/
+#endif  /* ! defined (LATENCY_H) */
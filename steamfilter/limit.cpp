@@ -0,0 +1,583 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the bandwidth limiting applied in the receive hooks.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The buckets themselves are kept simple and portable, with the locking and
+ * the clock supplied from here; one lock covers all the buckets, since a
+ * receive has to check both the global one and that of its rule together.
+ *
+ * Each bucket's rate is shared fairly between the connections receiving under
+ * it, weighted by the rules they were made through, so that a connection can't
+ * take more than its share just by asking more often than the others.
+ *
+ * Data which is taken in advance for an overlapped receive that doesn't
+ * complete straight away is charged as though the whole slice arrived, since
+ * there's no guarantee we'll see the completion; if we do, the part that
+ * didn't arrive is put back. A client can have several such receives
+ * outstanding on a connection at once, so each charge is remembered against
+ * the OVERLAPPED it was made for.
+ *
+ * Connections are bound to the limit of the rule they were made through by the
+ * rule's index; the rule set can be replaced at any time, after which the same
+ * index may well mean a different rule, so the bindings are let go then and
+ * new connections start afresh with the new rules' limits.
+ *
+ * A connection only has a record while some bucket applies to it. One bound to
+ * a rule's limit keeps the limits active until it's closed; those which only
+ * hold a share of the global limit are kept apart, so that they can all be let
+ * go at once when the global limit is turned off or the rules are replaced,
+ * and the receive hooks then go back to doing nothing extra at all.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "limit.h"
+#include "bucket.h"
+#include "socktrack.h"
+
+/**
+ * A limit shared by the connections made through one rule.
+ */
+
+struct RuleLimit {
+        unsigned long   m_rule;
+        bool            m_current;
+        volatile LONG   m_users;
+        TokenBucket     m_bucket;
+        FairShare       m_share;
+};
+
+/**
+ * An overlapped receive which was charged in advance.
+ */
+
+struct Charge {
+        OVERLAPPED    * m_overlapped;
+        unsigned long   m_length;
+};
+
+/**
+ * Record binding a connection to the limit of its rule, holding its shares of
+ * the rates, and remembering the overlapped receives that were charged in
+ * advance.
+ */
+
+struct Limited : public SocketTrack {
+        RuleLimit     * m_limit;
+        Charge          m_pending [LIMIT_PENDING_MAX];
+        ShareState      m_global;
+        ShareState      m_rule;
+
+                        Limited (SOCKET handle, RuleLimit * limit,
+                                 unsigned long weight) :
+                                SocketTrack (handle), m_limit (limit) {
+                memset (m_pending, 0, sizeof (m_pending));
+                m_global.m_weight = m_rule.m_weight = weight;
+                if (limit != 0) {
+                        InterlockedIncrement (& limit->m_users);
+                        InterlockedIncrement (& g_limitActive);
+                }
+        }
+                      ~ Limited () {
+                if (m_limit != 0) {
+                        InterlockedDecrement (& m_limit->m_users);
+                        InterlockedDecrement (& g_limitActive);
+                }
+        }
+};
+
+/**
+ * Nonzero when the global limit is set or any connection is bound to the limit
+ * of a rule.
+ */
+
+volatile LONG           g_limitActive;
+
+/**
+ * The buckets, and the lock covering them.
+ */
+
+static  TokenBucket     l_global;
+static  FairShare       l_globalShare;
+static  bool            l_globalSet;
+static  RuleLimit       l_rules [LIMIT_RULES_MAX];
+static  CRITICAL_SECTION l_limitLock;
+static  bool            l_lockInit;
+
+/**
+ * The connections bound to the limit of a rule, and those which only have a
+ * share of the global limit; the limit lock covers both lists as well.
+ */
+
+static  SocketList<Limited> l_limited;
+static  SocketList<Limited> l_sharing;
+
+/**
+ * Simple counters, for reporting.
+ */
+
+static  volatile LONG   l_waited;
+static  volatile LONG   l_refused;
+static  volatile LONG   l_sliced;
+static  unsigned long long l_received;
+
+/**
+ * Set up a bucket for a rate in kilobytes per second.
+ */
+
+static void l_configure (TokenBucket & bucket, unsigned long rate) {
+        unsigned long   bytes = rate * 1024;
+        unsigned long   burst = bytes / 1000 * LIMIT_BURST_TIME;
+        if (burst < LIMIT_SLICE_MIN)
+                burst = LIMIT_SLICE_MIN;
+
+        bucket.configure (bytes, burst, GetTickCount ());
+}
+
+/**
+ * Set the limit for everything received by the process, in kilobytes per
+ * second; zero turns it off, and lets go of the connections' shares of it.
+ *
+ * This is always called when the rules are installed, before the hooks are
+ * attached, which is what sets up the lock.
+ */
+
+void g_limitGlobal (unsigned long rate) {
+        if (! l_lockInit) {
+                InitializeCriticalSection (& l_limitLock);
+                l_lockInit = true;
+        }
+
+        EnterCriticalSection (& l_limitLock);
+
+        if (rate != 0) {
+                l_configure (l_global, rate);
+        } else
+                l_global.configure (0, 0, 0);
+
+        bool            set = rate != 0;
+        if (set != l_globalSet) {
+                l_globalSet = set;
+                if (set) {
+                        InterlockedIncrement (& g_limitActive);
+                } else
+                        InterlockedDecrement (& g_limitActive);
+        }
+
+        if (! set)
+                l_sharing.free ();
+
+        LeaveCriticalSection (& l_limitLock);
+}
+
+/**
+ * Bind a new connection to the limit for the rule it was made through, and
+ * give it the rule's weight in sharing the rates.
+ *
+ * If the rule's rate has changed since the last connection, the bucket is set
+ * up afresh; if every slot is in use by other rules, the connection just isn't
+ * limited other than by the global limit, and if that isn't set either then
+ * there's nothing to bind it to.
+ */
+
+void g_limitConnect (SOCKET handle, unsigned long rule, unsigned long rate,
+                     unsigned long weight) {
+        g_limitClose (handle);
+
+        if (weight == 0)
+                weight = 1;
+
+        if (! l_lockInit || (rate == 0 && weight == 1))
+                return;
+
+        EnterCriticalSection (& l_limitLock);
+
+        RuleLimit     * found = 0;
+        RuleLimit     * free = 0;
+        unsigned long   i;
+        for (i = 0 ; rate != 0 && i < LIMIT_RULES_MAX ; ++ i) {
+                RuleLimit     & limit = l_rules [i];
+                if (limit.m_current && limit.m_rule == rule &&
+                    limit.m_bucket.active ()) {
+                        found = & limit;
+                        break;
+                }
+
+                if (free == 0 && limit.m_users == 0)
+                        free = & limit;
+        }
+
+        if (found == 0 && (found = free) != 0) {
+                found->m_rule = rule;
+                found->m_current = true;
+                l_configure (found->m_bucket, rate);
+        } else if (found != 0 && found->m_bucket.rate () != rate * 1024)
+                l_configure (found->m_bucket, rate);
+
+        SocketList<Limited> & list = found != 0 ? l_limited : l_sharing;
+        Limited       * item = 0;
+        if (found != 0 || l_globalSet)
+                item = new Limited (handle, found, weight);
+        if (item != 0)
+                list.add (* item);
+
+        LeaveCriticalSection (& l_limitLock);
+}
+
+/**
+ * Forget about a connection, when it's closed.
+ */
+
+void g_limitClose (SOCKET handle) {
+        if (! g_anyLimit ())
+                return;
+
+        EnterCriticalSection (& l_limitLock);
+        l_limited.remove (handle);
+        l_sharing.remove (handle);
+        LeaveCriticalSection (& l_limitLock);
+}
+
+/**
+ * Let go of the bindings between rules and their limits, when the rules are
+ * replaced.
+ *
+ * Connections already made keep the limit they were made under, since their
+ * records point at it directly; a slot is only reused once the last of them
+ * has gone. The shares of the global limit were weighted by the old rules, so
+ * those are let go, and connections still receiving simply start new ones.
+ */
+
+void g_limitFlush (void) {
+        if (! l_lockInit)
+                return;
+
+        EnterCriticalSection (& l_limitLock);
+
+        unsigned long   i;
+        for (i = 0 ; i < LIMIT_RULES_MAX ; ++ i)
+                l_rules [i].m_current = false;
+
+        l_sharing.free ();
+
+        LeaveCriticalSection (& l_limitLock);
+}
+
+/**
+ * Release everything; the hooks must already have been removed.
+ */
+
+void g_limitUnload (void) {
+        l_limited.free ();
+        l_sharing.free ();
+}
+
+/**
+ * Find the record for a connection, with the limit lock held.
+ *
+ * If it doesn't have one yet and the global limit is set, one can be added so
+ * that it gets a share of that; otherwise no bucket applies to the connection,
+ * and it doesn't need a record at all.
+ */
+
+static Limited * l_find (SOCKET handle, bool add) {
+        Limited       * item = l_limited.find (handle);
+        if (item == 0)
+                item = l_sharing.find (handle);
+
+        if (item == 0 && add && l_globalSet &&
+            (item = new Limited (handle, 0, 1)) != 0)
+                l_sharing.add (* item);
+
+        return item;
+}
+
+/**
+ * Check a bucket and a connection's share of it, with the limit lock held.
+ *
+ * This returns how long to wait before the needed amount can be received; if
+ * it can be received now, the allowance is lowered to what this bucket and the
+ * connection's share of it permit.
+ */
+
+static unsigned long l_check (TokenBucket & bucket, FairShare & share,
+                              ShareState * flow, unsigned long now,
+                              unsigned long need, unsigned long & allow) {
+        if (! bucket.active ())
+                return 0;
+
+        unsigned long   wait = bucket.wait (now, need);
+        unsigned long   credit = ~ 0UL;
+
+        if (flow != 0) {
+                unsigned long   active = share.active ();
+                unsigned long   cap = bucket.burst ();
+                if (active > 0)
+                        cap = cap / active * flow->m_weight;
+                if (cap < LIMIT_SLICE_MIN)
+                        cap = LIMIT_SLICE_MIN;
+
+                share.advance (now, bucket.rate ());
+                credit = share.credit (* flow, cap);
+
+                unsigned long   shareWait;
+                shareWait = share.wait (* flow, need, bucket.rate ());
+                if (shareWait > wait)
+                        wait = shareWait;
+        }
+
+        if (wait != 0)
+                return wait;
+
+        unsigned long   available = bucket.available (now);
+        if (credit < available)
+                available = credit;
+        if (available < allow)
+                allow = available;
+
+        return 0;
+}
+
+/**
+ * Wait until a receive of up to the given length can go ahead, returning how
+ * much of it the limits allow.
+ *
+ * Only a blocking receive may be held up. A receive on a non-blocking socket
+ * which would have to wait is refused, this returning zero so that the caller
+ * fails it with WSAEWOULDBLOCK; an overlapped one can't be refused like that,
+ * so it's allowed the smallest slice instead, which leaves the buckets in debt
+ * and so holds up whatever is received next.
+ */
+
+unsigned long g_limitAllow (SOCKET handle, unsigned long length,
+                            LimitWait mode) {
+        if (length == 0 || ! l_lockInit)
+                return length;
+
+        unsigned long   need = length < LIMIT_SLICE_MIN ? length :
+                               LIMIT_SLICE_MIN;
+        unsigned long   allow = 0;
+
+        for (;;) {
+                EnterCriticalSection (& l_limitLock);
+
+                Limited       * item = l_find (handle, true);
+                RuleLimit     * rule = item != 0 ? item->m_limit : 0;
+                unsigned long   now = GetTickCount ();
+                allow = ~ 0UL;
+
+                unsigned long   wait;
+                wait = l_check (l_global, l_globalShare,
+                                item != 0 ? & item->m_global : 0, now, need,
+                                allow);
+                if (rule != 0) {
+                        unsigned long   ruleWait;
+                        ruleWait = l_check (rule->m_bucket, rule->m_share,
+                                            & item->m_rule, now, need, allow);
+                        if (ruleWait > wait)
+                                wait = ruleWait;
+                }
+
+                LeaveCriticalSection (& l_limitLock);
+
+                if (wait == 0)
+                        break;
+
+                if (mode == LIMIT_SLICE) {
+                        InterlockedIncrement (& l_sliced);
+                        return need;
+                }
+
+                if (mode == LIMIT_REFUSE) {
+                        InterlockedIncrement (& l_refused);
+                        return 0;
+                }
+
+                if (wait > LIMIT_SLEEP_MAX)
+                        wait = LIMIT_SLEEP_MAX;
+
+                InterlockedExchangeAdd (& l_waited, wait);
+                Sleep (wait);
+        }
+
+        if (allow == 0)
+                allow = need;
+
+        return allow < length ? allow : length;
+}
+
+/**
+ * Charge data that has been received against the limits, and the shares of
+ * the connection it was received on; the caller holds the limit lock.
+ */
+
+static void l_charge (Limited * item, unsigned long length) {
+        l_global.consume (length);
+        if (item != 0) {
+                l_globalShare.consume (item->m_global, length);
+
+                RuleLimit     * rule = item->m_limit;
+                if (rule != 0) {
+                        rule->m_bucket.consume (length);
+                        rule->m_share.consume (item->m_rule, length);
+                }
+        }
+
+        l_received += length;
+}
+
+/**
+ * Charge data received by a connection against the limits.
+ */
+
+void g_limitReceived (SOCKET handle, unsigned long length) {
+        if (length == 0 || ! l_lockInit)
+                return;
+
+        EnterCriticalSection (& l_limitLock);
+        l_charge (l_find (handle, false), length);
+        LeaveCriticalSection (& l_limitLock);
+}
+
+/**
+ * Charge an overlapped receive which didn't complete immediately in advance,
+ * remembering it so that anything which doesn't arrive can be put back.
+ */
+
+void g_limitDeferred (SOCKET handle, OVERLAPPED * overlapped,
+                      unsigned long length) {
+        if (length == 0 || ! l_lockInit)
+                return;
+
+        EnterCriticalSection (& l_limitLock);
+
+        Limited       * item = l_find (handle, true);
+        l_charge (item, length);
+
+        /*
+         * An OVERLAPPED that's being used again must have completed already,
+         * so its old charge is simply replaced.
+         */
+
+        Charge        * slot = 0;
+        unsigned long   i;
+        for (i = 0 ; item != 0 && i < LIMIT_PENDING_MAX ; ++ i) {
+                Charge        & charge = item->m_pending [i];
+                if (charge.m_overlapped == overlapped) {
+                        slot = & charge;
+                        break;
+                }
+
+                if (slot == 0 && charge.m_overlapped == 0)
+                        slot = & charge;
+        }
+
+        if (slot != 0) {
+                slot->m_overlapped = overlapped;
+                slot->m_length = length;
+        }
+
+        LeaveCriticalSection (& l_limitLock);
+}
+
+/**
+ * Put back whatever part of an overlapped receive charged in advance didn't
+ * arrive, when its completion is collected.
+ */
+
+void g_limitCompleted (SOCKET handle, OVERLAPPED * overlapped,
+                       unsigned long length) {
+        if (! g_anyLimit () || overlapped == 0)
+                return;
+
+        EnterCriticalSection (& l_limitLock);
+
+        Limited       * item = l_find (handle, false);
+        if (item == 0) {
+                LeaveCriticalSection (& l_limitLock);
+                return;
+        }
+
+        unsigned long   charged = 0;
+        unsigned long   i;
+        for (i = 0 ; i < LIMIT_PENDING_MAX ; ++ i) {
+                Charge        & charge = item->m_pending [i];
+                if (charge.m_overlapped == overlapped) {
+                        charged = charge.m_length;
+                        charge.m_overlapped = 0;
+                        charge.m_length = 0;
+                        break;
+                }
+        }
+
+        if (length >= charged) {
+                LeaveCriticalSection (& l_limitLock);
+                return;
+        }
+
+        unsigned long   unused = charged - length;
+        l_global.refund (unused);
+        l_globalShare.refund (item->m_global, unused);
+
+        RuleLimit     * rule = item->m_limit;
+        if (rule != 0) {
+                rule->m_bucket.refund (unused);
+                rule->m_share.refund (item->m_rule, unused);
+        }
+
+        l_received -= unused;
+
+        LeaveCriticalSection (& l_limitLock);
+}
+
+/**
+ * Write the counters out for the benefit of DbgView.
+ */
+
+void g_limitReport (void) {
+        if (! l_lockInit || l_received == 0)
+                return;
+
+        char            show [200];
+        wsprintfA (show, "limit: %lu KB received under limits, "
+                   "%lu ms spent waiting, %lu receives refused, "
+                   "%lu overlapped receives sliced\r\n",
+                   (unsigned long) (l_received / 1024),
+                   (unsigned long) l_waited, (unsigned long) l_refused,
+                   (unsigned long) l_sliced);
+        OutputDebugStringA (show);
+}
+
+/**@}*/
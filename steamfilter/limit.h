@@ -0,0 +1,142 @@
+#ifndef LIMIT_H
+#define LIMIT_H                 1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the bandwidth limiting applied in the receive hooks.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The original intent of metering the receive hooks was always to be able to
+ * apply a real bandwidth limit, without the sawtooth that shaping at the OS
+ * level tends to give, since that works by dropping packets and letting TCP
+ * back off.
+ *
+ * Here, a limit can be set for everything received by the process, with an
+ * options block standing on its own in the rules such as "{limit=500}", and
+ * for all the connections made through a connect rule together, with the same
+ * option following the rule's targets. Limits are in kilobytes per second.
+ *
+ * Receives are paced by holding them up until there are enough tokens in the
+ * buckets that apply, and then shortening them to what the buckets allow; an
+ * overlapped receive is sliced the same way, the client simply seeing it
+ * complete with less data than it asked for, as can happen anyway. Only a
+ * blocking receive is ever held up, though. A receive on a non-blocking socket
+ * is refused with WSAEWOULDBLOCK instead when it would have to wait, just as
+ * if the data hadn't arrived yet, but that error means something else entirely
+ * for an overlapped receive, so one of those is never refused; when the
+ * buckets are short it is still posted, cut down to the smallest slice, and
+ * the debt that leaves in the buckets holds up the receives that follow.
+ *
+ * Steam opens several connections at once for a download, and under a limit
+ * one of them could otherwise take most of the rate while the rest starve,
+ * which stretches out the time to finish the last chunks. So, the rate is
+ * shared fairly between the connections receiving under it; a rule can give
+ * its connections a larger share with a weight option, such as "{weight=2}".
+ */
+
+#include <winsock2.h>
+
+/**
+ * Burst allowance, as the amount of data the rate allows for in this many
+ * milliseconds.
+ */
+
+#define LIMIT_BURST_TIME        250
+
+/**
+ * Smallest receive worth waiting for the tokens for, so that a slow rate
+ * doesn't turn into a stream of tiny reads.
+ */
+
+#define LIMIT_SLICE_MIN         1024
+
+/**
+ * Longest single sleep while waiting for tokens, in milliseconds.
+ */
+
+#define LIMIT_SLEEP_MAX         100
+
+/**
+ * Most rules which can have a limit at once.
+ */
+
+#define LIMIT_RULES_MAX         16
+
+/**
+ * Most overlapped receives charged in advance that are remembered for each
+ * connection; if a client has more than this outstanding at once, the excess
+ * are simply never refunded.
+ */
+
+#define LIMIT_PENDING_MAX       4
+
+/**
+ * What a receive which the limits won't allow yet should do instead.
+ */
+
+enum LimitWait {
+        LIMIT_BLOCK,
+        LIMIT_REFUSE,
+        LIMIT_SLICE
+};
+
+/**
+ * Nonzero when a bucket is configured, either the global limit or that of a
+ * rule which a connection is still bound to, which the receive hooks check
+ * before doing anything further.
+ */
+
+extern  volatile LONG   g_limitActive;
+
+inline  bool            g_anyLimit (void) {
+        return g_limitActive != 0;
+}
+
+void            g_limitGlobal (unsigned long rate);
+void            g_limitConnect (SOCKET handle, unsigned long rule,
+                                unsigned long rate, unsigned long weight);
+void            g_limitClose (SOCKET handle);
+void            g_limitFlush (void);
+void            g_limitUnload (void);
+
+unsigned long   g_limitAllow (SOCKET handle, unsigned long length,
+                              LimitWait wait);
+void            g_limitReceived (SOCKET handle, unsigned long length);
+void            g_limitDeferred (SOCKET handle, OVERLAPPED * overlapped,
+                                 unsigned long length);
+void            g_limitCompleted (SOCKET handle, OVERLAPPED * overlapped,
+                                  unsigned long length);
+
+void            g_limitReport (void);
+
+/**@}*/
+#endif  /* ! defined (LIMIT_H) */
@@ -0,0 +1,173 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the meter for received bandwidth.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+
+#include "meter.h"
+#include "ticker.h"
+
+/**
+ * The averages are kept in fixed point with this many fractional bits.
+ */
+
+#define METER_SHIFT             11
+#define METER_ONE               (1UL << METER_SHIFT)
+
+/**
+ * The decay factors for the 1, 10 and 60 second averages, for a sample every
+ * second; these are (1 - exp (- 1 / period)) in fixed point.
+ */
+
+static  const unsigned long l_decay [3] = { 1294, 195, 34 };
+
+/**
+ * The meter for everything received by the process.
+ */
+
+Meter           g_meter;
+
+/**
+ * Simple default constructor.
+ */
+
+Meter :: Meter () : m_last (0), m_lastSum (0), m_total (0) {
+        InitializeCriticalSection (& m_lock);
+
+        m_average [0] = m_average [1] = m_average [2] = 0;
+}
+
+/**
+ * Clean up the lock.
+ */
+
+Meter :: ~ Meter () {
+        DeleteCriticalSection (& m_lock);
+}
+
+/**
+ * Sum the per-thread counts and fold them into the total and the averages.
+ *
+ * The per-thread counts are 32-bit and so wrap around, but the sum of them
+ * wraps around in the same way, so the difference from the last sum is still
+ * right as long as less than 4Gb arrives between samples.
+ */
+
+void Meter :: sample (unsigned long now) {
+        unsigned long   sum = 0;
+        ThreadData    * scan = g_threadList ();
+        for (; scan != 0 ; scan = scan->m_next)
+                sum += scan->m_received;
+
+        EnterCriticalSection (& m_lock);
+
+        unsigned long   bytes = sum - m_lastSum;
+        unsigned long   elapsed = now - m_last;
+        bool            first = m_last == 0;
+        m_lastSum = sum;
+        m_last = now;
+        m_total += bytes;
+
+        if (! first && elapsed > 0) {
+                unsigned long long rate = bytes;
+                rate = (rate * 1000 / elapsed) << METER_SHIFT;
+
+                unsigned long   i;
+                for (i = 0 ; i < 3 ; ++ i) {
+                        unsigned long long & average = m_average [i];
+                        if (rate >= average) {
+                                average += (rate - average) * l_decay [i] >>
+                                           METER_SHIFT;
+                        } else
+                                average -= (average - rate) * l_decay [i] >>
+                                           METER_SHIFT;
+                }
+        }
+
+        LeaveCriticalSection (& m_lock);
+}
+
+/**
+ * Copy out the current figures.
+ */
+
+void Meter :: stats (MeterStats & stats) {
+        EnterCriticalSection (& m_lock);
+
+        stats.m_total = m_total;
+        stats.m_rate1 = (unsigned long) (m_average [0] >> METER_SHIFT);
+        stats.m_rate10 = (unsigned long) (m_average [1] >> METER_SHIFT);
+        stats.m_rate60 = (unsigned long) (m_average [2] >> METER_SHIFT);
+
+        LeaveCriticalSection (& m_lock);
+}
+
+/**
+ * Sample the meter from the background thread.
+ */
+
+static void l_meterTick (unsigned long now) {
+        g_meter.sample (now);
+}
+
+/**
+ * Start sampling the meter.
+ */
+
+bool g_meterInit (void) {
+        g_meter.sample (GetTickCount ());
+        return g_tickerAdd (l_meterTick, METER_INTERVAL);
+}
+
+/**
+ * Write the figures out for the benefit of DbgView.
+ *
+ * Since this is called at unload, after the background thread has stopped,
+ * take a last sample first so the total is complete.
+ */
+
+void g_meterReport (void) {
+        g_meter.sample (GetTickCount ());
+
+        MeterStats      stats;
+        g_meter.stats (stats);
+
+        char            show [160];
+        wsprintfA (show, "meter: %lu KB received, %lu/%lu/%lu KB/s over "
+                   "1/10/60s\r\n", (unsigned long) (stats.m_total / 1024),
+                   stats.m_rate1 / 1024, stats.m_rate10 / 1024,
+                   stats.m_rate60 / 1024);
+        OutputDebugStringA (show);
+}
+
+/**@}*/
@@ -0,0 +1,116 @@
+#ifndef METER_H
+#define METER_H                 1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the meter for received bandwidth.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * For measuring bandwidth.
+ *
+ * Counting what's received is done on the hottest path in the process, in
+ * every call to recv (), recvfrom () and WSARecv (); so, each thread counts
+ * into its own per-thread block, which is only ever written by that thread
+ * and sits on a cache line of its own. The hooks thus do a single uncontended
+ * add, with no lock and without even reading the clock.
+ *
+ * The work of turning that into something useful is done once a second from
+ * the background thread, which sums the per-thread counts and folds the result
+ * into the total and into moving averages over 1, 10 and 60 seconds, in the
+ * style of the UNIX load averages.
+ */
+
+#include "perthread.h"
+
+/**
+ * How often the counts are summed, in milliseconds.
+ */
+
+#define METER_INTERVAL          1000
+
+/**
+ * Figures from the meter, as returned by Meter :: stats ().
+ *
+ * The rates are in bytes per second.
+ */
+
+struct MeterStats {
+        unsigned long long m_total;
+        unsigned long   m_rate1;
+        unsigned long   m_rate10;
+        unsigned long   m_rate60;
+};
+
+class Meter {
+public:
+typedef CRITICAL_SECTION        Mutex;
+
+private:
+        Mutex           m_lock;
+        unsigned long   m_last;
+        unsigned long   m_lastSum;
+        unsigned long long m_total;
+        unsigned long long m_average [3];
+
+public:
+                        Meter ();
+                      ~ Meter ();
+
+        void            operator += (int bytes);
+
+        void            sample (unsigned long now);
+        void            stats (MeterStats & stats);
+};
+
+/**
+ * Count some received bytes against the calling thread.
+ *
+ * Errors from the hooked functions show up here as negative counts, which
+ * are just ignored.
+ */
+
+inline void Meter :: operator += (int bytes) {
+        if (bytes <= 0)
+                return;
+
+        ThreadData    * data = g_threadData ();
+        if (data != 0)
+                data->m_received += bytes;
+}
+
+extern  Meter           g_meter;
+
+bool            g_meterInit (void);
+void            g_meterReport (void);
+
+/**@}*/
+#endif  /* ! defined (METER_H) */
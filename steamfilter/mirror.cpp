@@ -0,0 +1,506 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the throughput tracking used to choose between equivalent
+ * servers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The receive hooks credit each redirected connection's data to its server
+ * with nothing more than an atomic add, and once a second the background
+ * thread folds those into an exponentially-weighted moving average of the
+ * throughput per busy connection. Dividing by the number of connections that
+ * actually received something means an idle keep-alive connection doesn't
+ * make a server look slow, and a server isn't made to look fast just because
+ * more connections happened to be sent its way.
+ *
+ * The time from connecting to the first data arriving is averaged in the same
+ * way, and used to break ties between servers delivering much the same.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "mirror.h"
+#include "socktrack.h"
+#include "ticker.h"
+
+/**
+ * Cliche for measuring array lengths, to avoid mistakes with sizeof ().
+ */
+
+#define ARRAY_LENGTH(x) (sizeof (x) / sizeof (* (x)))
+
+/**
+ * Simple equivalent to ntohs, as elsewhere.
+ */
+
+#define ntohs(x)        ((unsigned char) ((x) >> 8) + \
+                         ((unsigned char) (x) << 8))
+
+/**
+ * One pick in this many is made purely at random.
+ */
+
+#define MIRROR_EXPLORE          8
+
+/**
+ * Tracking data for one server.
+ *
+ * The counters updated by the receive hooks are only ever touched with atomic
+ * operations; everything else is protected by the table lock.
+ */
+
+struct MirrorTarget {
+        bool            m_used;
+        unsigned long   m_addr;
+        unsigned short  m_port;
+        unsigned long   m_lastUsed;
+
+        volatile LONG   m_active;
+        volatile LONG   m_bytes;
+        volatile LONG   m_busy;
+        volatile LONG   m_rttSum;
+        volatile LONG   m_rttCount;
+
+        unsigned long   m_connects;
+        unsigned long   m_samples;
+        unsigned long   m_rate;
+        unsigned long   m_rtt;
+        unsigned long long m_total;
+};
+
+/**
+ * Record crediting a connection's data to a server.
+ */
+
+struct Flow : public SocketTrack {
+        MirrorTarget  * m_target;
+        unsigned long   m_start;
+        unsigned long   m_tick;
+        bool            m_first;
+        OVERLAPPED    * m_pending;
+
+                        Flow (SOCKET handle, MirrorTarget * target) :
+                                SocketTrack (handle), m_target (target),
+                                m_start (GetTickCount ()), m_tick (0),
+                                m_first (false), m_pending (0) {
+                InterlockedIncrement (& target->m_active);
+                InterlockedIncrement (& g_flowPending);
+        }
+                      ~ Flow () {
+                InterlockedDecrement (& m_target->m_active);
+                InterlockedDecrement (& g_flowPending);
+        }
+};
+
+/**
+ * Count of live flow records, for the receive-side fast path.
+ */
+
+volatile LONG           g_flowPending;
+
+/**
+ * The table of servers, and the connections being credited to them.
+ *
+ * Entries in the table never move, so the flow records can point at them; an
+ * entry is only reused once nothing is connected to it.
+ */
+
+static  MirrorTarget    l_mirrors [MIRROR_TARGETS_MAX];
+static  CRITICAL_SECTION l_mirrorLock;
+static  bool            l_lockInit;
+static  bool            l_ready;
+
+SocketList<Flow>        l_flows;
+
+/**
+ * The number of the current scoring interval, so that the receive hooks can
+ * count each connection as busy at most once per interval.
+ */
+
+static  volatile unsigned long l_tick;
+static  unsigned long   l_lastTick;
+
+/**
+ * State for the random number generator used in picking.
+ */
+
+static  unsigned long   l_seed;
+
+/**
+ * Generate a random number, Marsaglia xorshift style.
+ *
+ * This only needs to be good enough to spread picks around, and it's only used
+ * with the table lock held.
+ */
+
+static unsigned long l_random (void) {
+        unsigned long   x = l_seed;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return l_seed = x;
+}
+
+/**
+ * Find a server's entry in the table, adding it if need be; the table lock
+ * must be held.
+ */
+
+static MirrorTarget * l_find (unsigned long addr, unsigned short port) {
+        MirrorTarget  * free = 0;
+
+        unsigned long   i;
+        for (i = 0 ; i < MIRROR_TARGETS_MAX ; ++ i) {
+                MirrorTarget  & target = l_mirrors [i];
+                if (! target.m_used) {
+                        if (free == 0)
+                                free = & target;
+                        continue;
+                }
+
+                if (target.m_addr == addr && target.m_port == port)
+                        return & target;
+        }
+
+        if (free == 0)
+                return 0;
+
+        free->m_addr = addr;
+        free->m_port = port;
+        free->m_connects = 0;
+        free->m_samples = 0;
+        free->m_rate = 0;
+        free->m_rtt = 0;
+        free->m_total = 0;
+        free->m_bytes = 0;
+        free->m_busy = 0;
+        free->m_rttSum = 0;
+        free->m_rttCount = 0;
+        free->m_used = true;
+        return free;
+}
+
+/**
+ * Score a server for picking; higher is better.
+ *
+ * A server we don't have any figures for yet scores as highly as possible, so
+ * it gets tried. Otherwise the score is the throughput per connection, less a
+ * little for the time taken to get started.
+ */
+
+static unsigned long l_score (const MirrorTarget * target) {
+        if (target == 0 || target->m_samples == 0)
+                return ~ 0UL;
+
+        unsigned long long rate = target->m_rate;
+        return (unsigned long) (rate * 1000 / (1000 + target->m_rtt));
+}
+
+/**
+ * Update the scores, from the background thread.
+ */
+
+static void l_mirrorTick (unsigned long now) {
+        unsigned long   elapsed = now - l_lastTick;
+        l_lastTick = now;
+        if (elapsed == 0)
+                elapsed = 1;
+
+        EnterCriticalSection (& l_mirrorLock);
+
+        unsigned long   i;
+        for (i = 0 ; i < MIRROR_TARGETS_MAX ; ++ i) {
+                MirrorTarget  & target = l_mirrors [i];
+                if (! target.m_used)
+                        continue;
+
+                unsigned long   bytes = InterlockedExchange (& target.m_bytes, 0);
+                unsigned long   busy = InterlockedExchange (& target.m_busy, 0);
+                target.m_total += bytes;
+
+                if (busy > 0) {
+                        unsigned long long sample = bytes;
+                        sample = sample * 1000 / elapsed / busy;
+
+                        target.m_rate = target.m_samples == 0 ?
+                                        (unsigned long) sample :
+                                        (unsigned long) ((target.m_rate * 3ULL +
+                                                          sample) / 4);
+                        ++ target.m_samples;
+                }
+
+                unsigned long   count = InterlockedExchange (& target.m_rttCount, 0);
+                unsigned long   sum = InterlockedExchange (& target.m_rttSum, 0);
+                if (count > 0) {
+                        unsigned long   sample = sum / count;
+                        target.m_rtt = target.m_rtt == 0 ? sample :
+                                       (target.m_rtt * 7 + sample) / 8;
+                }
+
+                if (target.m_active == 0 &&
+                    now - target.m_lastUsed > MIRROR_IDLE)
+                        target.m_used = false;
+        }
+
+        ++ l_tick;
+
+        LeaveCriticalSection (& l_mirrorLock);
+}
+
+/**
+ * Start tracking.
+ */
+
+bool g_mirrorInit (void) {
+        if (! l_lockInit) {
+                InitializeCriticalSection (& l_mirrorLock);
+                l_lockInit = true;
+        }
+
+        l_seed = GetTickCount () | 1;
+        l_lastTick = GetTickCount ();
+        l_ready = g_tickerAdd (l_mirrorTick, MIRROR_INTERVAL);
+        return l_ready;
+}
+
+/**
+ * Stop tracking; the background thread must already have been stopped.
+ */
+
+void g_mirrorUnload (void) {
+        l_ready = false;
+        l_flows.free ();
+
+        if (! l_lockInit)
+                return;
+
+        EnterCriticalSection (& l_mirrorLock);
+
+        unsigned long   i;
+        for (i = 0 ; i < MIRROR_TARGETS_MAX ; ++ i)
+                l_mirrors [i].m_used = false;
+
+        LeaveCriticalSection (& l_mirrorLock);
+}
+
+/**
+ * Choose between a set of equivalent servers.
+ *
+ * The addresses and ports are in network order; the result is the index of
+ * the chosen one.
+ */
+
+unsigned long g_mirrorPick (const unsigned long * addr,
+                            const unsigned short * port,
+                            unsigned long count) {
+        if (! l_ready || count < 2)
+                return 0;
+
+        unsigned long   now = GetTickCount ();
+
+        EnterCriticalSection (& l_mirrorLock);
+
+        unsigned long   random = l_random ();
+        unsigned long   first = random % count;
+        unsigned long   second = (first + 1 + (random >> 8) % (count - 1)) % count;
+
+        MirrorTarget  * left = l_find (addr [first], port [first]);
+        MirrorTarget  * right = l_find (addr [second], port [second]);
+        if (left != 0)
+                left->m_lastUsed = now;
+        if (right != 0)
+                right->m_lastUsed = now;
+
+        unsigned long   pick = first;
+        if ((random >> 16) % MIRROR_EXPLORE != 0) {
+                unsigned long   leftScore = l_score (left);
+                unsigned long   rightScore = l_score (right);
+                if (rightScore > leftScore ||
+                    (rightScore == leftScore && (random & 0x80000000) != 0))
+                        pick = second;
+        }
+
+        LeaveCriticalSection (& l_mirrorLock);
+        return pick;
+}
+
+/**
+ * Start crediting a connection's data to the server it was sent to.
+ */
+
+void g_mirrorConnect (SOCKET handle, unsigned long addr, unsigned short port) {
+        if (! l_ready)
+                return;
+
+        g_mirrorClose (handle);
+
+        EnterCriticalSection (& l_mirrorLock);
+
+        Flow          * flow = 0;
+        MirrorTarget  * target = l_find (addr, port);
+        if (target != 0) {
+                target->m_lastUsed = GetTickCount ();
+                ++ target->m_connects;
+                flow = new Flow (handle, target);
+        }
+
+        LeaveCriticalSection (& l_mirrorLock);
+
+        if (flow != 0)
+                l_flows.add (* flow);
+}
+
+/**
+ * Credit received data to the server a connection was sent to.
+ */
+
+void g_mirrorReceived (SOCKET handle, unsigned long length) {
+        if (length == 0 || ! g_anyFlow ())
+                return;
+
+        Flow          * flow = l_flows.find (handle);
+        if (flow == 0)
+                return;
+
+        MirrorTarget  * target = flow->m_target;
+        InterlockedExchangeAdd (& target->m_bytes, length);
+
+        unsigned long   tick = l_tick;
+        if (flow->m_tick != tick) {
+                flow->m_tick = tick;
+                InterlockedIncrement (& target->m_busy);
+        }
+
+        if (! flow->m_first) {
+                flow->m_first = true;
+                InterlockedExchangeAdd (& target->m_rttSum,
+                                        GetTickCount () - flow->m_start);
+                InterlockedIncrement (& target->m_rttCount);
+        }
+}
+
+/**
+ * Remember an overlapped receive on a connection that didn't complete
+ * immediately, so that its data can be credited when it does.
+ *
+ * Overlapped sends complete through the same path, so this is how the two are
+ * told apart.
+ */
+
+void g_mirrorDeferred (SOCKET handle, OVERLAPPED * overlapped) {
+        Flow          * flow = g_anyFlow () ? l_flows.find (handle) : 0;
+        if (flow != 0)
+                flow->m_pending = overlapped;
+}
+
+/**
+ * Credit the data from an overlapped receive when its completion is collected.
+ */
+
+void g_mirrorCompleted (SOCKET handle, OVERLAPPED * overlapped,
+                        unsigned long length) {
+        Flow          * flow = g_anyFlow () ? l_flows.find (handle) : 0;
+        if (flow == 0 || flow->m_pending != overlapped)
+                return;
+
+        flow->m_pending = 0;
+        g_mirrorReceived (handle, length);
+}
+
+/**
+ * Stop crediting a connection, when it's closed.
+ */
+
+void g_mirrorClose (SOCKET handle) {
+        if (g_anyFlow ())
+                l_flows.remove (handle);
+}
+
+/**
+ * Copy out the counters for the servers being tracked.
+ */
+
+unsigned long g_mirrorStats (MirrorStats * stats, unsigned long count) {
+        if (! l_lockInit)
+                return 0;
+
+        EnterCriticalSection (& l_mirrorLock);
+
+        unsigned long   found = 0;
+        unsigned long   i;
+        for (i = 0 ; i < MIRROR_TARGETS_MAX && found < count ; ++ i) {
+                const MirrorTarget & target = l_mirrors [i];
+                if (! target.m_used)
+                        continue;
+
+                MirrorStats   & item = stats [found ++];
+                item.m_addr = target.m_addr;
+                item.m_port = target.m_port;
+                item.m_connects = target.m_connects;
+                item.m_active = target.m_active;
+                item.m_rate = target.m_rate;
+                item.m_rtt = target.m_rtt;
+                item.m_total = target.m_total;
+        }
+
+        LeaveCriticalSection (& l_mirrorLock);
+        return found;
+}
+
+/**
+ * Write the counters out for the benefit of DbgView.
+ */
+
+void g_mirrorReport (void) {
+        MirrorStats     stats [MIRROR_TARGETS_MAX];
+        unsigned long   count = g_mirrorStats (stats, ARRAY_LENGTH (stats));
+
+        unsigned long   index;
+        for (index = 0 ; index < count ; ++ index) {
+                MirrorStats   & item = stats [index];
+                const unsigned char * bytes;
+                bytes = (const unsigned char *) & item.m_addr;
+
+                char            show [160];
+                wsprintfA (show, "mirror %d.%d.%d.%d:%d: %lu connects, "
+                           "%lu KB total, %lu KB/s per connection, "
+                           "first byte %lums\r\n",
+                           bytes [0], bytes [1], bytes [2], bytes [3],
+                           ntohs (item.m_port), item.m_connects,
+                           (unsigned long) (item.m_total / 1024),
+                           item.m_rate / 1024, item.m_rtt);
+                OutputDebugStringA (show);
+        }
+}
+
+/**@}*/
@@ -0,0 +1,120 @@
+#ifndef MIRROR_H
+#define MIRROR_H                1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the throughput tracking used to choose between equivalent
+ * servers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Where a rule lists several equivalent servers, round-robin selection treats
+ * them all the same even though their performance can vary a great deal over
+ * the course of a day. So, the bytes received on each redirected connection
+ * are credited to the server it went to, and new connections favour whichever
+ * servers are currently delivering the most.
+ *
+ * Selection uses the "power of two choices" scheme; two candidates are picked
+ * at random and the better-scoring one wins. That keeps most of the benefit of
+ * always picking the best while avoiding every new connection piling onto the
+ * same server, and a fraction of picks are made purely at random so that the
+ * scores of servers which haven't been used lately are kept fresh.
+ */
+
+#include <winsock2.h>
+
+/**
+ * Most servers that are tracked at once.
+ */
+
+#define MIRROR_TARGETS_MAX      64
+
+/**
+ * How often the scores are updated, in milliseconds.
+ */
+
+#define MIRROR_INTERVAL         1000
+
+/**
+ * How long a server is kept in the table once it's no longer in use.
+ */
+
+#define MIRROR_IDLE             (10 * 60 * 1000)
+
+/**
+ * Counters for one server, as returned by g_mirrorStats ().
+ *
+ * The address and port are in network order. The rate is the smoothed
+ * throughput per busy connection in bytes per second, and the RTT is the
+ * smoothed time from connecting to the first data arriving.
+ */
+
+struct MirrorStats {
+        unsigned long   m_addr;
+        unsigned short  m_port;
+        unsigned long   m_connects;
+        unsigned long   m_active;
+        unsigned long   m_rate;
+        unsigned long   m_rtt;
+        unsigned long long m_total;
+};
+
+/**
+ * Count of connections whose received data is being credited to a server,
+ * which the receive hooks check before looking for one.
+ */
+
+extern  volatile LONG   g_flowPending;
+
+inline  bool            g_anyFlow (void) {
+        return g_flowPending != 0;
+}
+
+bool            g_mirrorInit (void);
+void            g_mirrorUnload (void);
+
+unsigned long   g_mirrorPick (const unsigned long * addr,
+                              const unsigned short * port,
+                              unsigned long count);
+
+void            g_mirrorConnect (SOCKET handle, unsigned long addr,
+                                 unsigned short port);
+void            g_mirrorReceived (SOCKET handle, unsigned long length);
+void            g_mirrorDeferred (SOCKET handle, OVERLAPPED * overlapped);
+void            g_mirrorCompleted (SOCKET handle, OVERLAPPED * overlapped,
+                                   unsigned long length);
+void            g_mirrorClose (SOCKET handle);
+
+unsigned long   g_mirrorStats (MirrorStats * stats, unsigned long count);
+void            g_mirrorReport (void);
+
+/**@}*/
+#endif  /* ! defined (MIRROR_H) */
@@ -0,0 +1,132 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the helpers for the filter's own network connections.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "netapi.h"
+
+/**
+ * The underlying socket functions.
+ */
+
+NetApi                  g_net;
+
+/**
+ * Look up the socket functions we don't hook.
+ *
+ * The entry points of the hooked functions are filled in by the hook code
+ * itself, since those need to be the resume thunks rather than the exports.
+ * WSAIoctl () is only used for tuning sockets, so that can do without.
+ */
+
+bool g_netInit (HMODULE ws2) {
+        g_net.m_socket = (NetSocketFunc) GetProcAddress (ws2, "socket");
+        g_net.m_ioctlsocket = (NetIoctlFunc) GetProcAddress (ws2,
+                                                             "ioctlsocket");
+        g_net.m_getsockopt = (NetGetOptFunc) GetProcAddress (ws2,
+                                                             "getsockopt");
+        g_net.m_setsockopt = (NetSetOptFunc) GetProcAddress (ws2,
+                                                             "setsockopt");
+        g_net.m_wsaIoctl = (NetWSAIoctlFunc) GetProcAddress (ws2, "WSAIoctl");
+
+        return g_net.m_socket != 0 && g_net.m_ioctlsocket != 0 &&
+               g_net.m_getsockopt != 0 && g_net.m_setsockopt != 0;
+}
+
+/**
+ * Start a non-blocking TCP connection.
+ *
+ * The result is a socket whose connection is in progress; use g_netWait () to
+ * find when it's writeable, and g_netConnected () to see whether that means it
+ * connected or failed.
+ */
+
+SOCKET g_netConnect (const sockaddr_in & addr) {
+        if (g_net.m_socket == 0 || g_net.m_connect == 0)
+                return INVALID_SOCKET;
+
+        SOCKET          s = (* g_net.m_socket) (AF_INET, SOCK_STREAM,
+                                                IPPROTO_TCP);
+        if (s == INVALID_SOCKET)
+                return s;
+
+        unsigned long   nonBlocking = 1;
+        if ((* g_net.m_ioctlsocket) (s, FIONBIO, & nonBlocking) != 0) {
+                (* g_net.m_closesocket) (s);
+                return INVALID_SOCKET;
+        }
+
+        int             result;
+        result = (* g_net.m_connect) (s, (const sockaddr *) & addr,
+                                      sizeof (addr));
+        if (result != 0 && GetLastError () != WSAEWOULDBLOCK) {
+                (* g_net.m_closesocket) (s);
+                return INVALID_SOCKET;
+        }
+
+        return s;
+}
+
+/**
+ * Check whether a non-blocking connect has succeeded, once the socket has
+ * become writeable (or been reported with an error).
+ */
+
+bool g_netConnected (SOCKET s) {
+        int             error = 0;
+        int             length = sizeof (error);
+        if ((* g_net.m_getsockopt) (s, SOL_SOCKET, SO_ERROR, (char *) & error,
+                                    & length) != 0)
+                return false;
+
+        return error == 0;
+}
+
+/**
+ * Equivalent to FD_ISSET ().
+ *
+ * The macro in the SDK calls __WSAFDIsSet () in WS2_32.DLL, which would add a
+ * static dependency; the Windows fd_set is just an array, so search it.
+ */
+
+bool g_netIsSet (SOCKET s, const fd_set & set) {
+        for (unsigned long i = 0 ; i < set.fd_count ; ++ i)
+                if (set.fd_array [i] == s)
+                        return true;
+
+        return false;
+}
+
+/**@}*/
@@ -0,0 +1,106 @@
+#ifndef NETAPI_H
+#define NETAPI_H                1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the table of underlying socket functions used by the filter
+ * for its own connections.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The filter makes some network connections of its own, for things such as
+ * fetching segments of a download from several servers at once. Those need to
+ * go straight to the underlying implementation rather than through our own
+ * hooks, so this holds the original entry points of the hooked functions as
+ * well as the handful of others we use but don't hook.
+ *
+ * As elsewhere, there's no static dependency on WS2_32.DLL; everything here is
+ * filled in once the hooks have been attached.
+ */
+
+#include <winsock2.h>
+
+/**
+ * Prototypes of the entry points, so that the ones looked up by name can be
+ * cast to the right type.
+ */
+
+typedef SOCKET        (WSAAPI * NetSocketFunc) (int family, int type,
+                                                int protocol);
+typedef int           (WSAAPI * NetConnectFunc) (SOCKET s,
+                                                 const sockaddr * name,
+                                                 int length);
+typedef int           (WSAAPI * NetSendFunc) (SOCKET s, const char * buf,
+                                              int len, int flags);
+typedef int           (WSAAPI * NetRecvFunc) (SOCKET s, char * buf, int len,
+                                              int flags);
+typedef int           (WSAAPI * NetSelectFunc) (int count, fd_set * read,
+                                                fd_set * write,
+                                                fd_set * error,
+                                                const struct timeval * timeout);
+typedef int           (WSAAPI * NetCloseFunc) (SOCKET s);
+typedef int           (WSAAPI * NetIoctlFunc) (SOCKET s, long command,
+                                               unsigned long * arg);
+typedef int           (WSAAPI * NetGetOptFunc) (SOCKET s, int level, int name,
+                                                char * value, int * length);
+typedef int           (WSAAPI * NetSetOptFunc) (SOCKET s, int level, int name,
+                                                const char * value,
+                                                int length);
+typedef int           (WSAAPI * NetWSAIoctlFunc)
+                        (SOCKET s, unsigned long code, void * in,
+                         unsigned long inLength, void * out,
+                         unsigned long outLength, unsigned long * returned,
+                         OVERLAPPED * overlapped,
+                         LPWSAOVERLAPPED_COMPLETION_ROUTINE handler);
+
+struct NetApi {
+        NetSocketFunc   m_socket;
+        NetConnectFunc  m_connect;
+        NetSendFunc     m_send;
+        NetRecvFunc     m_recv;
+        NetSelectFunc   m_select;
+        NetCloseFunc    m_closesocket;
+        NetIoctlFunc    m_ioctlsocket;
+        NetGetOptFunc   m_getsockopt;
+        NetSetOptFunc   m_setsockopt;
+        NetWSAIoctlFunc m_wsaIoctl;
+};
+
+extern  NetApi          g_net;
+
+bool            g_netInit (HMODULE ws2);
+
+SOCKET          g_netConnect (const sockaddr_in & addr);
+bool            g_netConnected (SOCKET s);
+bool            g_netIsSet (SOCKET s, const fd_set & set);
+
+/**@}*/
+#endif  /* ! defined (NETAPI_H) */
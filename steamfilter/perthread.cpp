@@ -0,0 +1,228 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This holds the per-thread data blocks used by the hook functions.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+
+#include "perthread.h"
+
+/**
+ * Per-thread blocks are aligned to a cache line, so that the blocks belonging
+ * to different threads don't share one.
+ */
+
+#define CACHE_LINE              64
+
+/**
+ * The TLS slot holding the current thread's data block.
+ *
+ * Since the CRT's own per-thread machinery is stubbed out in nolocale.h, and
+ * __declspec (thread) doesn't work in a DLL loaded by LoadLibrary () on older
+ * versions of Windows, this uses the plain Win32 TLS API.
+ */
+
+unsigned long           l_tlsIndex = TLS_OUT_OF_INDEXES;
+
+/**
+ * List of all the blocks ever created, live or retired.
+ */
+
+ThreadData    * volatile l_threads;
+
+/**
+ * Allocate the TLS slot used for the per-thread blocks.
+ */
+
+void g_threadInit (void) {
+        if (l_tlsIndex == TLS_OUT_OF_INDEXES)
+                l_tlsIndex = TlsAlloc ();
+}
+
+/**
+ * Set up a data block for a thread which doesn't yet have one.
+ *
+ * Retired blocks are reused if there are any, otherwise a new one is made and
+ * pushed on the front of the list.
+ */
+
+static ThreadData * l_attach (void) {
+        ThreadData    * scan = l_threads;
+        for (; scan != 0 ; scan = scan->m_next) {
+                if (scan->m_live != 0)
+                        continue;
+
+                if (InterlockedCompareExchange (& scan->m_live, 1, 0) == 0)
+                        break;
+        }
+
+        if (scan == 0) {
+                size_t          size = sizeof (ThreadData) + CACHE_LINE;
+                void          * mem = HeapAlloc (GetProcessHeap (),
+                                                 HEAP_ZERO_MEMORY, size);
+                if (mem == 0)
+                        return 0;
+
+                ULONG_PTR       addr = (ULONG_PTR) mem + CACHE_LINE - 1;
+                scan = (ThreadData *) (addr & ~ (ULONG_PTR) (CACHE_LINE - 1));
+                scan->m_base = mem;
+                scan->m_live = 1;
+
+                ThreadData    * head;
+                do {
+                        head = l_threads;
+                        scan->m_next = head;
+                } while (InterlockedCompareExchangePointer ((void * volatile *) & l_threads,
+                                                            scan, head) != head);
+        }
+
+        TlsSetValue (l_tlsIndex, scan);
+        return scan;
+}
+
+/**
+ * Return the calling thread's data block, creating it if necessary.
+ *
+ * TlsGetValue () clears the thread's last-error value when it succeeds, which
+ * would upset hooks that have already set up an error code for their caller,
+ * so the error value is preserved around it.
+ */
+
+ThreadData * g_threadData (void) {
+        if (l_tlsIndex == TLS_OUT_OF_INDEXES)
+                return 0;
+
+        unsigned long   error = GetLastError ();
+        ThreadData    * data = (ThreadData *) TlsGetValue (l_tlsIndex);
+        if (data == 0)
+                data = l_attach ();
+
+        SetLastError (error);
+        return data;
+}
+
+/**
+ * Return the head of the list of all data blocks, for things which want to
+ * aggregate per-thread state.
+ */
+
+ThreadData * g_threadList (void) {
+        return l_threads;
+}
+
+/**
+ * Prototype for FlushProcessWriteBuffers (), which isn't in Windows XP.
+ */
+
+typedef void (WINAPI * FlushFunc) (void);
+
+/**
+ * Wait until no thread is inside any of the hooks, once they've been removed.
+ *
+ * A thread entering a hook only does a plain store to its own count, which on
+ * x86 can sit in the processor's store buffer for a little while where other
+ * processors can't see it. FlushProcessWriteBuffers () makes every processor
+ * drain its store buffer, after which a scan of the counts can be trusted; on
+ * Windows XP, which doesn't have it, a short sleep before the scan does much
+ * the same job in practice.
+ *
+ * Threads which had no data block count themselves in a shared counter
+ * instead, which is checked too.
+ */
+
+void g_threadQuiesce (volatile LONG * shared) {
+        HMODULE         kernel = GetModuleHandleA ("KERNEL32.DLL");
+        FlushFunc       flush = 0;
+        if (kernel != 0)
+                flush = (FlushFunc) GetProcAddress (kernel,
+                                                    "FlushProcessWriteBuffers");
+
+        for (;;) {
+                if (flush != 0) {
+                        flush ();
+                } else
+                        Sleep (1);
+
+                bool            busy = * shared > 0;
+                ThreadData    * scan = l_threads;
+                for (; scan != 0 && ! busy ; scan = scan->m_next)
+                        busy = scan->m_inHook != 0;
+
+                if (! busy)
+                        return;
+
+                Sleep (1);
+        }
+}
+
+/**
+ * Called from DllMain () when a thread exits, to retire its data block.
+ */
+
+void g_threadDetach (void) {
+        if (l_tlsIndex == TLS_OUT_OF_INDEXES)
+                return;
+
+        ThreadData    * data = (ThreadData *) TlsGetValue (l_tlsIndex);
+        if (data == 0)
+                return;
+
+        TlsSetValue (l_tlsIndex, 0);
+        g_poolFlush (data->m_pool);
+
+        InterlockedExchange (& data->m_live, 0);
+}
+
+/**
+ * Release all the per-thread blocks and the TLS slot.
+ *
+ * This must only be called once the hooks have been removed and no thread is
+ * still inside one of them.
+ */
+
+void g_threadUnload (void) {
+        if (l_tlsIndex == TLS_OUT_OF_INDEXES)
+                return;
+
+        TlsFree (l_tlsIndex);
+        l_tlsIndex = TLS_OUT_OF_INDEXES;
+
+        ThreadData    * scan;
+        scan = (ThreadData *) InterlockedExchangePointer ((void * volatile *) & l_threads, 0);
+        while (scan != 0) {
+                ThreadData    * next = scan->m_next;
+                HeapFree (GetProcessHeap (), 0, scan->m_base);
+                scan = next;
+        }
+}
+
+/**@}*/
@@ -0,0 +1,115 @@
+#ifndef PERTHREAD_H
+#define PERTHREAD_H             1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the per-thread data block shared by the filter's hooks.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pool.h"
+#include "filterrule.h"
+#include "hostcache.h"
+
+/**
+ * Storage for a host lookup answer made up by the filter.
+ *
+ * Winsock keeps the result of gethostbyname () per thread, valid until that
+ * thread's next lookup, and rewritten answers follow suit by living in the
+ * thread's data block; so lookups on different threads can't trample each
+ * other, and making an answer never allocates anything. There's room for all
+ * the targets a rule can have, and for a name as long as the lookup cache
+ * will keep.
+ */
+
+struct HostStorage {
+        hostent         m_host;
+        char          * m_list [RULE_TARGETS_MAX + 1];
+        char          * m_aliases [1];
+        unsigned long   m_addrs [RULE_TARGETS_MAX];
+        char            m_name [HOST_CACHE_NAME_MAX];
+};
+
+/**
+ * Per-thread state for the hook functions.
+ *
+ * Several parts of the filter want some state private to each thread so that
+ * the hooks don't all contend on the same shared cache lines. Rather than give
+ * each of them a TLS index of their own, they live together in this block so
+ * that there is one TLS lookup and one list to walk when something needs to
+ * see the state of every thread.
+ *
+ * Blocks are never freed while the filter is attached; when a thread exits its
+ * block is retired and handed on to the next new thread instead. This means
+ * that walking the list never needs a lock, at the cost of holding onto the
+ * memory for the peak number of threads the host process has had.
+ *
+ * The count of bytes received is only ever written by the thread owning the
+ * block, and is read by the meter summing over all of them; since a retired
+ * block is handed on rather than freed, the count carries on from where the
+ * last owner left it and nothing is lost.
+ *
+ * The trace ring and latency histograms are only made once the thread first
+ * needs them, and the same goes for them; they're handed on with the block.
+ *
+ * The count of hooks the thread is inside is what makes unloading safe; since
+ * only the owning thread writes it, entering and leaving a hook is a plain
+ * increment and decrement rather than an interlocked operation on a counter
+ * shared by every thread. Unloading checks all of them instead, which is much
+ * the rarer event. The count of lookup hooks the thread is inside works the
+ * same way, to spot Winsock's lookup functions calling each other.
+ */
+
+struct ThreadData {
+        ThreadData    * m_next;
+        void          * m_base;
+        volatile LONG   m_live;
+        volatile LONG   m_inHook;
+        unsigned long   m_inLookup;
+
+        volatile unsigned long m_received;
+        void          * volatile m_trace;
+        void          * volatile m_latency;
+
+        HostStorage     m_host;
+        PoolCache       m_pool;
+};
+
+void            g_threadInit (void);
+void            g_threadDetach (void);
+void            g_threadUnload (void);
+
+ThreadData    * g_threadData (void);
+ThreadData    * g_threadList (void);
+
+void            g_threadQuiesce (volatile LONG * shared);
+
+/**@}*/
+#endif  /* ! defined (PERTHREAD_H) */
@@ -0,0 +1,421 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements a slab allocator for the small, short-lived objects the hooks
+ * create on a per-connection basis.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Steam opens and closes a lot of short-lived HTTP connections, and for each
+ * one the filter may create a couple of tracking records and a rewritten copy
+ * of the request. Going to the process heap for all of those puts us in the
+ * path of whatever else the host process is doing with its heap lock, so the
+ * small allocations are served from fixed-size slabs instead.
+ *
+ * Each size class has a lock-free free list (the Win32 interlocked SList, which
+ * has been in every version of Windows we care about), and each thread keeps
+ * a small stack of free blocks of each size so that the common case of a block
+ * being allocated and freed on the same thread touches no shared state at all.
+ * The usage is counted per thread as well and only summed when it's wanted,
+ * with the high-water marks kept up to date by sampling it every so often.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+
+#include "perthread.h"
+#include "ticker.h"
+
+/**
+ * Cliche for measuring array lengths, to avoid mistakes with sizeof ().
+ */
+
+#define ARRAY_LENGTH(x) (sizeof (x) / sizeof (* (x)))
+
+/**
+ * Slabs are committed in units of 64kb, which is the allocation granularity
+ * of VirtualAlloc () anyway.
+ */
+
+#define POOL_SLAB               (64 * 1024)
+
+/**
+ * Space reserved at the start of each slab for its list link.
+ */
+
+#define POOL_SLAB_HEADER        64
+
+/**
+ * Marker class index for blocks that came from the process heap.
+ */
+
+#define POOL_OVERSIZE           POOL_CLASSES
+
+/**
+ * Header in front of each block.
+ *
+ * While a block is allocated this records its size class; when it's free the
+ * same space holds the link for the free list.
+ */
+
+union PoolHeader {
+        SLIST_ENTRY     m_link;
+        unsigned long   m_class;
+        unsigned char   m_align [MEMORY_ALLOCATION_ALIGNMENT];
+};
+
+/**
+ * Header placed at the start of each slab, so they can be released on unload.
+ */
+
+union PoolSlab {
+        SLIST_ENTRY     m_link;
+        unsigned char   m_reserve [POOL_SLAB_HEADER];
+};
+
+/**
+ * State for a single size class.
+ *
+ * The SList header has to be suitably aligned, and since it's updated from
+ * every thread, each class gets a cache line of its own.
+ */
+
+struct __declspec (align (64)) PoolClass {
+        SLIST_HEADER    m_free;
+
+        volatile LONG   m_peak;
+        volatile LONG   m_slabs;
+
+        /*
+         * Counters for threads without a data block of their own, which is
+         * rare but possible before the filter is fully set up.
+         */
+
+        volatile LONG   m_requests;
+        volatile LONG   m_hits;
+        volatile LONG   m_allocs;
+        volatile LONG   m_frees;
+};
+
+/**
+ * Block sizes, including the header, for each class.
+ */
+
+static const unsigned long l_sizes [POOL_CLASSES] = {
+        32, 64, 128, 256, 512, 1024, 2048, 4096
+};
+
+/**
+ * The size classes, plus one extra entry for tracking oversized blocks.
+ *
+ * An all-zero SList header is a valid empty list, so these need no explicit
+ * initialization.
+ */
+
+PoolClass               l_classes [POOL_CLASSES + 1];
+
+/**
+ * All the slabs committed so far.
+ */
+
+SLIST_HEADER            l_slabs;
+
+/**
+ * Raise the high-water mark for a size class to the usage just sampled; both
+ * the ticker and the final report sample it, so this has to allow for them
+ * racing each other.
+ */
+
+static void l_peak (PoolClass & pool, LONG now) {
+        LONG            peak;
+        while (now > (peak = pool.m_peak)) {
+                if (InterlockedCompareExchange (& pool.m_peak, now, peak) == peak)
+                        break;
+        }
+}
+
+/**
+ * Commit a new slab for a size class, returning one block from it and putting
+ * the rest onto the shared free list.
+ */
+
+static PoolHeader * l_carve (unsigned long index) {
+        unsigned char * mem;
+        mem = (unsigned char *) VirtualAlloc (0, POOL_SLAB,
+                                              MEM_COMMIT | MEM_RESERVE,
+                                              PAGE_READWRITE);
+        if (mem == 0)
+                return 0;
+
+        PoolClass     & pool = l_classes [index];
+        InterlockedPushEntrySList (& l_slabs, & ((PoolSlab *) mem)->m_link);
+        InterlockedIncrement (& pool.m_slabs);
+
+        unsigned long   size = l_sizes [index];
+        unsigned long   count = (POOL_SLAB - POOL_SLAB_HEADER) / size;
+        unsigned char * block = mem + POOL_SLAB_HEADER;
+
+        PoolHeader    * first = (PoolHeader *) block;
+        while (-- count > 0) {
+                block += size;
+                InterlockedPushEntrySList (& pool.m_free,
+                                           & ((PoolHeader *) block)->m_link);
+        }
+
+        return first;
+}
+
+/**
+ * Allocate a block of memory.
+ *
+ * The memory is aligned in the same way as from HeapAlloc (), and must be
+ * released with g_poolFree ().
+ */
+
+void * g_poolAlloc (size_t length) {
+        size_t          need = length + sizeof (PoolHeader);
+        unsigned long   index = 0;
+        while (index < POOL_CLASSES && l_sizes [index] < need)
+                ++ index;
+
+        ThreadData    * thread = g_threadData ();
+        PoolCache     * cache = thread == 0 ? 0 : & thread->m_pool;
+        PoolClass     & pool = l_classes [index];
+
+        if (cache != 0) {
+                ++ cache->m_requests [index];
+        } else
+                InterlockedIncrement (& pool.m_requests);
+
+        PoolHeader    * block = 0;
+        bool            hit = true;
+
+        if (index == POOL_OVERSIZE) {
+                block = (PoolHeader *) HeapAlloc (GetProcessHeap (), 0, need);
+                hit = false;
+        } else if (cache != 0 && cache->m_count [index] > 0) {
+                unsigned long   top = -- cache->m_count [index];
+                block = (PoolHeader *) cache->m_items [index] [top];
+        } else {
+                block = (PoolHeader *) InterlockedPopEntrySList (& pool.m_free);
+                if (block == 0) {
+                        block = l_carve (index);
+                        hit = false;
+                }
+        }
+
+        if (block == 0)
+                return 0;
+
+        if (cache != 0) {
+                ++ cache->m_allocs [index];
+                if (hit)
+                        ++ cache->m_hits [index];
+        } else {
+                InterlockedIncrement (& pool.m_allocs);
+                if (hit)
+                        InterlockedIncrement (& pool.m_hits);
+        }
+
+        block->m_class = index;
+        return block + 1;
+}
+
+/**
+ * Release a block obtained from g_poolAlloc ().
+ */
+
+void g_poolFree (void * mem) {
+        if (mem == 0)
+                return;
+
+        PoolHeader    * block = (PoolHeader *) mem - 1;
+        unsigned long   index = block->m_class;
+        PoolClass     & pool = l_classes [index];
+
+        ThreadData    * thread = g_threadData ();
+        if (thread != 0) {
+                ++ thread->m_pool.m_frees [index];
+        } else
+                InterlockedIncrement (& pool.m_frees);
+
+        if (index == POOL_OVERSIZE) {
+                HeapFree (GetProcessHeap (), 0, block);
+                return;
+        }
+
+        if (thread != 0) {
+                PoolCache     & cache = thread->m_pool;
+                unsigned long   count = cache.m_count [index];
+                if (count < POOL_CACHE) {
+                        cache.m_items [index] [count] = block;
+                        cache.m_count [index] = count + 1;
+                        return;
+                }
+        }
+
+        InterlockedPushEntrySList (& pool.m_free, & block->m_link);
+}
+
+/**
+ * Return all the blocks in a thread's cache to the shared free lists, as the
+ * thread is exiting.
+ */
+
+void g_poolFlush (PoolCache & cache) {
+        unsigned long   index;
+        for (index = 0 ; index < POOL_CLASSES ; ++ index) {
+                PoolClass     & pool = l_classes [index];
+                unsigned long   count = cache.m_count [index];
+                while (count > 0) {
+                        -- count;
+                        PoolHeader    * block;
+                        block = (PoolHeader *) cache.m_items [index] [count];
+                        InterlockedPushEntrySList (& pool.m_free, & block->m_link);
+                }
+
+                cache.m_count [index] = 0;
+        }
+}
+
+/**
+ * Collect the statistics for each size class, raising the high-water marks to
+ * the usage found.
+ *
+ * The per-thread counters are read without any synchronization, so the totals
+ * are approximate while the pool is in use; that's fine for what they're for.
+ */
+
+unsigned long g_poolStats (PoolStats * stats, unsigned long count) {
+        if (count > POOL_CLASSES + 1)
+                count = POOL_CLASSES + 1;
+
+        unsigned long   index;
+        for (index = 0 ; index < count ; ++ index) {
+                PoolClass     & pool = l_classes [index];
+                PoolStats     & out = stats [index];
+
+                out.m_size = index < POOL_CLASSES ? l_sizes [index] : 0;
+                out.m_requests = pool.m_requests;
+                out.m_hits = pool.m_hits;
+                out.m_slabs = pool.m_slabs;
+
+                unsigned long   allocs = pool.m_allocs;
+                unsigned long   frees = pool.m_frees;
+
+                ThreadData    * scan = g_threadList ();
+                for (; scan != 0 ; scan = scan->m_next) {
+                        out.m_requests += scan->m_pool.m_requests [index];
+                        out.m_hits += scan->m_pool.m_hits [index];
+                        allocs += scan->m_pool.m_allocs [index];
+                        frees += scan->m_pool.m_frees [index];
+                }
+
+                /*
+                 * Reading the counters while they change can see a free
+                 * without the allocation it matches.
+                 */
+
+                out.m_inUse = allocs > frees ? allocs - frees : 0;
+                l_peak (pool, (LONG) out.m_inUse);
+                out.m_peak = pool.m_peak;
+        }
+
+        return count;
+}
+
+/**
+ * Sample the usage of each size class, to keep the high-water marks.
+ */
+
+static void l_poolTick (unsigned long now) {
+        PoolStats       stats [POOL_CLASSES + 1];
+        g_poolStats (stats, ARRAY_LENGTH (stats));
+}
+
+/**
+ * Have the usage sampled periodically.
+ */
+
+void g_poolInit (void) {
+        g_tickerAdd (l_poolTick, POOL_INTERVAL);
+}
+
+/**
+ * Write the pool statistics out for the benefit of DbgView.
+ */
+
+void g_poolReport (void) {
+        PoolStats       stats [POOL_CLASSES + 1];
+        unsigned long   count = g_poolStats (stats, ARRAY_LENGTH (stats));
+
+        unsigned long   index;
+        for (index = 0 ; index < count ; ++ index) {
+                PoolStats     & item = stats [index];
+                if (item.m_requests == 0)
+                        continue;
+
+                unsigned long   rate;
+                rate = (unsigned long) ((item.m_hits * 100ULL) / item.m_requests);
+
+                char            show [128];
+                wsprintfA (show, "pool %lu: %lu requests, %lu%% hit, "
+                           "%lu in use, %lu peak, %lu slabs\r\n",
+                           item.m_size, item.m_requests, rate,
+                           item.m_inUse, item.m_peak, item.m_slabs);
+                OutputDebugStringA (show);
+        }
+}
+
+/**
+ * Release all the slabs.
+ *
+ * This must only be called once nothing can still be holding a pool block,
+ * which means after the hooks are removed and the tracking data is freed.
+ */
+
+void g_poolUnload (void) {
+        ThreadData    * scan = g_threadList ();
+        for (; scan != 0 ; scan = scan->m_next)
+                memset (scan->m_pool.m_count, 0, sizeof (scan->m_pool.m_count));
+
+        unsigned long   index;
+        for (index = 0 ; index < POOL_CLASSES ; ++ index)
+                InterlockedFlushSList (& l_classes [index].m_free);
+
+        PSLIST_ENTRY    slab = InterlockedFlushSList (& l_slabs);
+        while (slab != 0) {
+                PSLIST_ENTRY    next = slab->Next;
+                VirtualFree (slab, 0, MEM_RELEASE);
+                slab = next;
+        }
+}
+
+/**@}*/
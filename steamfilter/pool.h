@@ -0,0 +1,110 @@
+#ifndef POOL_H
+#define POOL_H                  1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares a simple slab allocator used for per-connection tracking data,
+ * so that the host process heap stays out of the connection setup path.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <winsock2.h>
+
+/**
+ * The fixed block sizes handed out by the pool are powers of two from 32 bytes
+ * up to 4kb; anything larger goes directly to the process heap, since it isn't
+ * something we expect to do on a per-connection basis.
+ */
+
+#define POOL_CLASSES            8
+
+/**
+ * How many free blocks of each size a thread can keep for itself before they
+ * are handed back to the shared free list.
+ */
+
+#define POOL_CACHE              16
+
+/**
+ * How often the usage of each size class is sampled to keep its high-water
+ * mark, in milliseconds.
+ */
+
+#define POOL_INTERVAL           1000
+
+/**
+ * Thread-local cache of free blocks, held in the per-thread data block.
+ *
+ * The counters are only ever written by the owning thread, and are summed
+ * over all the threads when the statistics are wanted; a block freed on a
+ * different thread from the one which allocated it is simply counted out by
+ * the one and in by the other.
+ */
+
+struct PoolCache {
+        unsigned long   m_count [POOL_CLASSES];
+        void          * m_items [POOL_CLASSES] [POOL_CACHE];
+
+        unsigned long   m_requests [POOL_CLASSES + 1];
+        unsigned long   m_hits [POOL_CLASSES + 1];
+        unsigned long   m_allocs [POOL_CLASSES + 1];
+        unsigned long   m_frees [POOL_CLASSES + 1];
+};
+
+/**
+ * Statistics for one size class, as returned by g_poolStats ().
+ *
+ * A "hit" is a request satisfied from an already-carved block, whether from a
+ * thread cache or the shared free list, as opposed to one which needed a new
+ * slab to be committed (or for oversized blocks, a trip to the process heap).
+ * The peak is as seen by the periodic sampling of the usage, so a burst that
+ * comes and goes between samples doesn't show in it.
+ */
+
+struct PoolStats {
+        unsigned long   m_size;
+        unsigned long   m_requests;
+        unsigned long   m_hits;
+        unsigned long   m_inUse;
+        unsigned long   m_peak;
+        unsigned long   m_slabs;
+};
+
+void            g_poolInit (void);
+void          * g_poolAlloc (size_t length);
+void            g_poolFree (void * mem);
+void            g_poolFlush (PoolCache & cache);
+
+unsigned long   g_poolStats (PoolStats * stats, unsigned long count);
+void            g_poolReport (void);
+void            g_poolUnload (void);
+
+/**@}*/
+#endif  /* ! defined (POOL_H) */
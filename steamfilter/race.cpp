@@ -0,0 +1,209 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the schedule for racing connects to several servers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "race.h"
+
+/**
+ * Simple default constructor; the race has no candidates until reset.
+ */
+
+ConnectRace :: ConnectRace () {
+        reset (0, 0, 0);
+}
+
+/**
+ * Start a new race with no candidates, given the current time, the stagger
+ * between attempts and the deadline each attempt is given, in milliseconds,
+ * and the most candidates to try; no limit means all of them.
+ */
+
+void ConnectRace :: reset (unsigned long now, unsigned long stagger,
+                           unsigned long deadline, unsigned long limit) {
+        m_count = 0;
+        m_limit = limit != 0 ? limit : RACE_CANDIDATES_MAX;
+        m_started = 0;
+        m_live = 0;
+        m_stagger = stagger;
+        m_deadline = deadline;
+        m_begin = now;
+        m_nextStart = now;
+        m_winner = RACE_PENDING;
+}
+
+/**
+ * Add a candidate, given how long it has been taking to connect, with zero
+ * meaning that isn't known; candidates are numbered from zero in the order
+ * they're added.
+ */
+
+bool ConnectRace :: add (unsigned long expected) {
+        if (m_count == RACE_CANDIDATES_MAX || m_started > 0)
+                return false;
+
+        m_expected [m_count] = expected;
+        m_order [m_count] = (unsigned char) m_count;
+        m_state [m_count] = WAITING;
+        ++ m_count;
+        return true;
+}
+
+/**
+ * Put the candidates in order of how fast they have been connecting.
+ *
+ * This is a simple insertion sort, which is stable, so that candidates which
+ * are as fast as each other, or which have no history, stay in the order they
+ * were added. Taking one off each time makes no history at all wrap around to
+ * the largest time there is, so those candidates go last.
+ */
+
+void ConnectRace :: rank (void) {
+        if (m_started > 0)
+                return;
+
+        for (unsigned long i = 1 ; i < m_count ; ++ i) {
+                unsigned char   which = m_order [i];
+                unsigned long   expected = m_expected [which] - 1;
+
+                unsigned long   j = i;
+                for (; j > 0 ; -- j) {
+                        if (m_expected [m_order [j - 1]] - 1 <= expected)
+                                break;
+
+                        m_order [j] = m_order [j - 1];
+                }
+
+                m_order [j] = which;
+        }
+}
+
+/**
+ * Return when the race as a whole will be given up on, which is once the last
+ * candidate that might be tried has had its deadline.
+ */
+
+unsigned long ConnectRace :: end (void) const {
+        unsigned long   tries = limit ();
+        if (tries == 0)
+                return m_begin;
+
+        return m_begin + m_stagger * (tries - 1) + m_deadline;
+}
+
+/**
+ * Return the next candidate to start an attempt on now, or RACE_PENDING if
+ * there's none due; after each start, the caller should ask again in case
+ * there's another.
+ */
+
+int ConnectRace :: start (unsigned long now) {
+        if (m_winner >= 0 || m_started >= limit ())
+                return RACE_PENDING;
+
+        if (m_live > 0 && (long) (now - m_nextStart) < 0)
+                return RACE_PENDING;
+
+        unsigned char   which = m_order [m_started ++];
+        m_state [which] = LIVE;
+        ++ m_live;
+
+        m_nextStart = now + m_stagger;
+        return which;
+}
+
+/**
+ * Note that an attempt failed, so that the next can start straight away.
+ */
+
+void ConnectRace :: failed (unsigned long which) {
+        if (! live (which))
+                return;
+
+        m_state [which] = LOST;
+        -- m_live;
+}
+
+/**
+ * Note that an attempt connected, which decides the race.
+ */
+
+void ConnectRace :: won (unsigned long which) {
+        if (! live (which) || m_winner >= 0)
+                return;
+
+        m_state [which] = WON;
+        -- m_live;
+        m_winner = (int) which;
+}
+
+/**
+ * Return the winning candidate, RACE_FAILED if every attempt has failed or
+ * the race has run out of time, or RACE_PENDING.
+ *
+ * Once the race is decided, any attempts still live should be abandoned.
+ */
+
+int ConnectRace :: result (unsigned long now) const {
+        if (m_winner >= 0)
+                return m_winner;
+
+        if (m_live == 0 && m_started >= limit ())
+                return RACE_FAILED;
+
+        if ((long) (now - end ()) >= 0)
+                return RACE_FAILED;
+
+        return RACE_PENDING;
+}
+
+/**
+ * Return how long the caller can wait for attempts to answer before the race
+ * next needs looking at, in milliseconds.
+ */
+
+unsigned long ConnectRace :: wait (unsigned long now) const {
+        if (result (now) != RACE_PENDING)
+                return 0;
+
+        unsigned long   due = end () - now;
+        if (m_started < limit ()) {
+                if (m_live == 0 || (long) (m_nextStart - now) <= 0)
+                        return 0;
+
+                if (m_nextStart - now < due)
+                        due = m_nextStart - now;
+        }
+
+        return due;
+}
+
+/**@}*/
@@ -0,0 +1,133 @@
+#ifndef RACE_H
+#define RACE_H                  1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the schedule for racing connects to several servers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The schedule for racing connects to several equivalent servers.
+ *
+ * Given the candidates, and how long each has been taking to connect where
+ * that's known, this decides which to try and when; the caller makes the
+ * connections and reports back how each one went. One attempt starts at a
+ * time, with the next starting if the first hasn't answered within a stagger
+ * delay, or straight away if every attempt so far has failed, in the style of
+ * the "Happy Eyeballs" connection racing in RFC 8305. Only so many candidates
+ * are ever tried, and the race as a whole is given up on once the last one to
+ * start has had its full deadline.
+ *
+ * Candidates are tried in the order they're added unless they're ranked, in
+ * which case those that have been connecting fastest go first and those with
+ * no history at all go last, still in the order they were added.
+ *
+ * Like the token bucket, there's no dependency on Windows; the caller passes
+ * in the time in milliseconds and does any locking, so a schedule can be run
+ * against a simulated clock or against real listeners on any platform.
+ */
+
+/**
+ * Most candidates in one race.
+ */
+
+#define RACE_CANDIDATES_MAX     8
+
+/**
+ * The stagger between attempts when racing ranked candidates, in milliseconds;
+ * this is the "Connection Attempt Delay" that RFC 8305 recommends.
+ */
+
+#define RACE_STAGGER            250
+
+/**
+ * Results from the schedule other than the index of a candidate.
+ */
+
+#define RACE_PENDING            (- 1)
+#define RACE_FAILED             (- 2)
+
+/**
+ * The schedule for one race.
+ */
+
+class ConnectRace {
+private:
+        enum {
+                WAITING,
+                LIVE,
+                LOST,
+                WON
+        };
+
+        unsigned long   m_count;
+        unsigned long   m_limit;
+        unsigned long   m_started;
+        unsigned long   m_live;
+        unsigned long   m_stagger;
+        unsigned long   m_deadline;
+        unsigned long   m_begin;
+        unsigned long   m_nextStart;
+        int             m_winner;
+
+        unsigned long   m_expected [RACE_CANDIDATES_MAX];
+        unsigned char   m_order [RACE_CANDIDATES_MAX];
+        unsigned char   m_state [RACE_CANDIDATES_MAX];
+
+        unsigned long   limit (void) const {
+                return m_limit < m_count ? m_limit : m_count;
+        }
+        unsigned long   end (void) const;
+
+public:
+                        ConnectRace ();
+
+        void            reset (unsigned long now, unsigned long stagger,
+                               unsigned long deadline,
+                               unsigned long limit = RACE_CANDIDATES_MAX);
+        bool            add (unsigned long expected = 0);
+        void            rank (void);
+
+        unsigned long   count (void) const { return m_count; }
+        bool            live (unsigned long which) const {
+                return which < m_count && m_state [which] == LIVE;
+        }
+
+        int             start (unsigned long now);
+        void            failed (unsigned long which);
+        void            won (unsigned long which);
+
+        int             result (unsigned long now) const;
+        unsigned long   wait (unsigned long now) const;
+};
+
+/**@}*/
+#endif  /* ! defined (RACE_H) */
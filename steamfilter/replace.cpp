@@ -72,6 +72,13 @@
 #include <winsock2.h>
 
 #include "replace.h"
+#include "socktrack.h"
+#include "document.h"
+#include "header.h"
+#include "httpcache.h"
+#include "depot.h"
+#include "pool.h"
+#include "stats.h"
 
 /**
  * Cliche for measuring array lengths, to avoid mistakes with sizeof ().
@@ -80,266 +87,92 @@
 #define ARRAY_LENGTH(x) (sizeof (x) / sizeof (* (x)))
 
 /**
- * Base object for implementing socket state tracking.
+ * Count of live replacement items, for the receive-side fast path.
  *
- * This is set up for binding sockets and event handles so that applications
- * get notified when a socket becomes readable, since the lack of true AIO in
- * classic sockets requires separate eventing mechanisms (from the simple to
- * the absurd as in epoll (), which is essentially socket-specific as well as
- * baroque and hard to use compared to a universal AIO model).
+ * This is maintained by the Replacement constructor and destructor rather than
+ * by the list operations, so that it errs on the side of being high; an item
+ * being counted slightly before it's visible on the list just means one extra
+ * lookup, whereas counting it late could cause a read to be missed.
  */
 
-class SocketTrack {
-        /*
-         * Friend-ing an entire template is not something you see often, but
-         * it's been a part of the language for a while.
-         */
-
-        template <class T>
-        friend class SocketList;
-
-private:
-        SocketTrack   * m_next;
-        SocketTrack   * m_prev;
-        SOCKET          m_handle;
-
-public:
-        WSAEVENT        m_event;
-
-private:
-        /* NOCOPY */    SocketTrack (const SocketTrack &);
-        void            operator = (const SocketTrack &);
-
-public:
-                        SocketTrack (SOCKET handle);
-
-        SOCKET          handle (void) const { return m_handle; }
-
-static  void          * operator new (size_t length) throw ();
-static  void          * operator new (size_t length, void * mem) throw ();
-static  void            operator delete (void * mem) throw ();
-};
-
-/**
- * Regular replacement new, non-throwing.
- */
-
-/* static */
-void * SocketTrack :: operator new (size_t length) throw () {
-        return HeapAlloc (GetProcessHeap (), 0, length);
-}
-
-/**
- * Non-throwing placement new, generally used with manual calls to the plain
- * operator function to allocate variable-sized memory blocks.
- */
-
-/* static */
-void * SocketTrack :: operator new (size_t length, void * mem) throw () {
-        return mem;
-}
-
-/**
- * Trivial deallocator to match the replacement new.
- */
-
-/* static */
-void SocketTrack :: operator delete (void * mem) throw () {
-        HeapFree (GetProcessHeap (), 0, mem);
-}
+volatile LONG           g_replacePending;
 
 /**
- * Trivial constructor.
+ * Count of live capture records, used in the same way.
  */
 
-SocketTrack :: SocketTrack (SOCKET handle) : m_next (0), m_prev (0),
-                m_handle (handle), m_event (0) {
-}
+volatile LONG           g_capturePending;
 
 /**
- * Simple list-holder.
- *
- * Intrusive lists have been a part of C++ forever, since they were the common
- * thing done in C for many years before. However, in early C++ what was done
- * in most programs was to convert a common node structure and extend it using
- * virtual functions.
- *
- * Although this could be done to be typesafe, it had problems not the least of
- * which was typesafety required constantly injecting new virtual functions
- * into the base classes or the moral equivalent (e.g. COM-style QueryInterface
- * which was elegant but not being integrated into the language, lots of work).
+ * Structure for representing a replacement context.
  *
- * Templates in the 1990 ARM promised to help with this by introducing some
- * parametric genericity, but being mostly a system pf complex hygenic macro-
- * expanders the quality of implementation was low and remained low for well
- * into the 2000s and even then tended to cause code explosion. Finally, around
- * the late 2000's quality implementations of templates style could really
- * rival the old pre-1990s one in total efficiency thanks to function-level
- * linking and deduplication (although that's not entirely free either, as it
- * can make for a disorienting debug experience).
+ * The response being served is made up of the shared document, with the Date
+ * header for this particular response spliced in after the status line. The
+ * position within the response is tracked as a part number and an offset
+ * within that part, so nothing needs to be copied until it's consumed.
  */
 
-template <class T>
-struct SocketList {
-typedef CRITICAL_SECTION      Mutex;
+struct Replacement : public SocketTrack {
+        Document      * m_doc;
 
-        Mutex           m_lock [1];
-        T             * m_head;
+        unsigned long   m_part;
+        unsigned long   m_offset;
 
-                        SocketList ();
-                      ~ SocketList ();
+        unsigned long   m_dateLength;
+        char            m_date [DATE_HEADERS_MAX];
 
-        void            free (void);
+                        Replacement (SOCKET handle) : SocketTrack (handle),
+                                m_doc (0), m_part (0), m_offset (0),
+                                m_dateLength (0) {
+                InterlockedIncrement (& g_replacePending);
+        }
+                      ~ Replacement () {
+                g_documentRelease (m_doc);
+                InterlockedDecrement (& g_replacePending);
+        }
 
-        void            add (T & item);
-        T             * find (SOCKET handle);
-        void            remove (T * item, bool free = false);
-        void            remove (SOCKET handle);
+        bool            part (unsigned long index, const unsigned char * & data,
+                              unsigned long & length) const;
 };
 
 /**
- * Initialize an empty list.
- */
-
-template <class T>
-SocketList<T> :: SocketList () : m_head (0) {
-        InitializeCriticalSection (m_lock);
-}
-
-/**
- * Deinitialize the list and locking structure.
- */
-
-template <class T>
-SocketList<T> :: ~ SocketList () {
-        free ();
-
-        DeleteCriticalSection (m_lock);
-}
-
-/**
- * Free all the list members, deallocating them.
- */
-
-template <class T>
-void SocketList<T> :: free (void) {
-        EnterCriticalSection (m_lock);
-
-        while (m_head != 0)
-                remove (m_head, true);
-
-        LeaveCriticalSection (m_lock);
-}
-
-/**
- * Add a new item.
- */
-
-template <class T>
-void SocketList<T> :: add (T & item) {
-        EnterCriticalSection (m_lock);
-
-        item.m_next = m_head;
-        item.m_prev = 0;
-        m_head = & item;
-
-        LeaveCriticalSection (m_lock);
-}
-
-/**
- * Find an item.
+ * Return the data for one part of a replacement response.
  *
- * In a more general template, this would be a member template so that the
- * key type and comparison function could be parameterized, but this is just
- * a simplified example of the general style so I haven't bothered.
- *
- * The key reason this is here is to show a clean example of something memory-
- * light, which nothing in the modern STL can really claim to be (even for the
- * few good parts of classic STL, the retrofitting of exceptions into the STL
- * containers meant it's usually easier to ditch them in memory-constrained or
- * code-size-limited environments).
+ * The parts are the status line, the Date header, the rest of the headers and
+ * then the body; a document with no split point doesn't want a Date header at
+ * all, in which case the first two parts are empty.
  */
 
-template <class T>
-T * SocketList<T> :: find (SOCKET handle) {
-        EnterCriticalSection (m_lock);
-
-        T             * scan = m_head;
-        while (scan != 0) {
-                if (scan->m_handle == handle)
-                        break;
-
-                scan = (T *) scan->m_next;
-        }
+bool Replacement :: part (unsigned long index, const unsigned char * & data,
+                          unsigned long & length) const {
+        unsigned long   split = m_doc->m_split;
 
-        LeaveCriticalSection (m_lock);
-        return scan;
-}
-
-/**
- * Remove an item from the list, optionally freeing it.
- */
-
-template <class T>
-void SocketList<T> :: remove (T * item, bool free) {
-        EnterCriticalSection (m_lock);
-
-        T             * prev = (T *) item->m_prev;
-        T             * next = (T *) item->m_next;
-        if (prev == 0) {
-                m_head = next;
-        } else
-                prev->m_next = next;
-        if (next != 0)
-                next->m_prev = prev;
-
-        LeaveCriticalSection (m_lock);
-
-        if (free)
-                delete item;
-}
+        switch (index) {
+        case 0:
+                data = m_doc->m_head;
+                length = split;
+                return true;
 
-/**
- * Remove and free an item based on a key.
- */
+        case 1:
+                data = (const unsigned char *) m_date;
+                length = m_dateLength;
+                return true;
 
-template <class T>
-void SocketList<T> :: remove (SOCKET handle) {
-        EnterCriticalSection (m_lock);
+        case 2:
+                data = m_doc->m_head + split;
+                length = m_doc->m_headLength - split;
+                return true;
 
-        T            ** link = & m_head;
-        T             * scan = m_head;
-        T             * prev = 0;
-        while ((scan = * link) != 0) {
-                if (scan->m_handle == handle) {
-                        * link = (T *) scan->m_next;
-                        scan->m_prev = prev;
-                        break;
-                }
+        case 3:
+                data = m_doc->m_body;
+                length = m_doc->m_bodyLength;
+                return true;
 
-                prev = scan;
-                link = (T **) & scan->m_next;
+        default:
+                return false;
         }
-
-        LeaveCriticalSection (m_lock);
-
-        if (scan != 0)
-                delete scan;
 }
 
-/**
- * Structure for representing a replacement context.
- */
-
-struct Replacement : public SocketTrack {
-        unsigned long   m_length;
-        unsigned long   m_offset;
-
-        unsigned char * m_data;
-
-                        Replacement (SOCKET handle) : SocketTrack (handle) { }
-};
-
 /**
  * Structure for representing an context where we're discarding output.
  */
@@ -369,21 +202,74 @@ SocketList<Replacement> l_replace;
 SocketList<Discarding>  l_discard;
 
 /**
- * Root registry key in which replacement items are located.
+ * Most buffers we'll remember for a deferred overlapped receive.
  */
 
-HKEY                    l_rootKey;
+#define CAPTURE_BUFFERS         4
 
 /**
- * Set the root path used as the context for the names of replacement items.
+ * Structure for representing a response being captured for the cache.
  *
- * It would presumably be nice to support either or both of registry and file
- * paths here, so that users could choose. In the first instance I'll probably
- * only implement registry-hosted item support, but it would be sensible to
- * have the filesystem path setup present in the hosting machinery.
+ * The received data is accumulated until the whole response has arrived, at
+ * which point it's handed to the cache. Depot chunks are too big to want to
+ * hold in memory, so for those only the headers are accumulated and the body
+ * is written straight out to the store as it arrives.
+ *
+ * For overlapped receives that don't complete immediately, the caller's
+ * buffers are remembered so the data can be picked up when the completion is
+ * collected.
  */
 
-void g_initReplacement (ReplaceHKEY key, const wchar_t * regPath) {
+struct Capture : public SocketTrack {
+        char          * m_key;
+        CaptureKind     m_kind;
+        unsigned long   m_param;
+
+        char          * m_data;
+        unsigned long   m_buffered;
+        unsigned long   m_size;
+
+        unsigned long   m_length;
+        unsigned long   m_header;
+        unsigned long   m_total;
+        DepotFile     * m_file;
+
+        OVERLAPPED    * m_pending;
+        unsigned long   m_pendingCount;
+        WSABUF          m_buffers [CAPTURE_BUFFERS];
+
+                        Capture (SOCKET handle) : SocketTrack (handle),
+                                m_key (0), m_kind (CAPTURE_CACHE),
+                                m_param (0), m_data (0), m_buffered (0),
+                                m_size (0), m_length (0), m_header (0),
+                                m_total (0), m_file (0), m_pending (0),
+                                m_pendingCount (0) {
+                InterlockedIncrement (& g_capturePending);
+        }
+                      ~ Capture () {
+                g_depotAbandon (m_file);
+                g_poolFree (m_key);
+                g_poolFree (m_data);
+                InterlockedDecrement (& g_capturePending);
+        }
+};
+
+/**
+ * Global list of sockets where we are capturing a response.
+ */
+
+SocketList<Capture>     l_capture;
+
+/**
+ * Set the root paths used as the context for the names of replacement items.
+ *
+ * Documents can be held either as values under a registry key or as files
+ * under a directory; names in rules starting with "file:" are looked up in the
+ * directory, and everything else in the registry.
+ */
+
+void g_initReplacement (ReplaceHKEY key, const wchar_t * regPath,
+                        const wchar_t * rootDir) {
         LSTATUS         status = ERROR_NOT_FOUND;
         HKEY            result = 0;
         if (regPath != 0) {
@@ -391,8 +277,20 @@ void g_initReplacement (ReplaceHKEY key, const wchar_t * regPath) {
                                         & result);
         }
 
+        DocumentStore * store = 0;
         if (status == ERROR_SUCCESS)
-                l_rootKey = result;
+                store = new RegistryStore (result);
+
+        g_setDocumentStore (store);
+
+        store = 0;
+        if (rootDir != 0 && rootDir [0] != 0)
+                store = new FileStore (rootDir);
+
+        g_setFileStore (store);
+
+        g_cacheInit ();
+        g_depotInit (rootDir);
 }
 
 /**
@@ -400,13 +298,15 @@ void g_initReplacement (ReplaceHKEY key, const wchar_t * regPath) {
  */
 
 void g_unloadReplacement (void) {
-        if (l_rootKey != 0) {
-                RegCloseKey (l_rootKey);
-                l_rootKey = 0;
-        }
-
         l_replace.free ();
         l_events.free ();
+        l_discard.free ();
+        l_capture.free ();
+
+        g_setDocumentStore (0);
+        g_setFileStore (0);
+        g_cacheUnload ();
+        g_depotUnload ();
 }
 
 /**
@@ -424,9 +324,22 @@ void g_addEventHandle (SOCKET handle, WSAEVENT event) {
         }
 
         item = new SocketTrack (handle);
+        if (item == 0)
+                return;
+
+        item->m_event = event;
         l_events.add (* item);
 }
 
+/**
+ * Find the event handle bound to a socket, if there is one.
+ */
+
+WSAEVENT g_findEventHandle (SOCKET handle) {
+        SocketTrack   * item = l_events.find (handle);
+        return item != 0 ? item->m_event : 0;
+}
+
 /**
  * When a socket handle is being closed, remove any tracking data for it.
  */
@@ -435,174 +348,55 @@ void g_removeTracking (SOCKET handle) {
         l_events.remove (handle);
         l_replace.remove (handle);
         l_discard.remove (handle);
+        l_capture.remove (handle);
 }
 
 /**
- * Add a potential replacement document to the replacement set.
- *
- * This is a hook into us performed during rule parsing, although if we're
- * sourcing data from the registry we will probably do nothing.
+ * Manage the cache of replacement documents.
  *
- * Whether file or registry is preferred, the name of the source is always
- * going to be relative to something; another problem with file access is that
- * the source directory for such content is unlikely to be one we can arrange
- * as such in the context of Steam itself, and it will need to have been set up
- * for us during the filter load somehow.
- */
-
-void g_replacementCache (const wchar_t * /* name */) {
-}
-
-/**
- * Format the current local date and time as an RFC 822/RFC 1123 string.
+ * With a name, this loads the named document into the cache ahead of it being
+ * needed; with no name, it discards everything in the cache (along with any
+ * captured responses), which is done whenever the rules are changed.
  */
 
-bool l_formatDate (char * buffer, size_t length) {
-        if (length < 32)
-                return false;
-
-static  char          * days [7] = {
-                "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
-        };
-static  char          * months [13] = {
-                "",
-                "Jan", "Feb", "Mar", "Apr", "May", "Jun",
-                "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
-        };
-
-        SYSTEMTIME      now;
-        GetSystemTime (& now);
+void g_replacementCache (const wchar_t * name) {
+        if (name == 0) {
+                g_flushDocuments ();
+                g_cacheFlush ();
+                return;
+        }
 
-        wsprintfA (buffer, "%s, %d %s %04d %02d:%02d:%02d GMT",
-                   days [now.wDayOfWeek], now.wDay, months [now.wMonth],
-                   now.wYear, now.wHour, now.wMinute, now.wSecond);
+        char            tempName [80];
+        if (WideCharToMultiByte (CP_UTF8, 0, name, - 1, tempName,
+                                 ARRAY_LENGTH (tempName), 0, 0) == 0)
+                return;
 
-        return true;
+        g_documentRelease (g_findDocument (tempName));
 }
 
 /**
- * Helper for g_addReplacement (), create a replacement item record.
+ * Queue a prepared document to be served as the response on a socket.
+ *
+ * The replacement takes its own reference to the document, so the caller
+ * still owns the one it passed in.
  */
 
-bool g_addReplacement (SOCKET handle, const wchar_t * replacement, int status,
-                       const char * extraText) {
-        /*
-         * Compute the space required to hold a UTF-8 version of the input, and
-         * any template-type substitution needed (not that we support that as
-         * yet).
-         */
-
-        int             utf8 = 0;
-        if (replacement != 0) {
-                utf8 = WideCharToMultiByte (CP_UTF8, 0, replacement, - 1, 0, 0, 0, 0);
-                if (utf8 == 0)
-                        return false;
-
-                -- utf8;
-        }
-
-        /*
-         * Given the size of the replacement document, we can prepare the HTTP
-         * headers for it and thus know the size of the header and thus the
-         * total combined space to allocate.
-         */
-
-        char            date [80];
-        if (! l_formatDate (date, ARRAY_LENGTH (date)))
+bool g_addReplacement (SOCKET handle, Document * doc) {
+        if (doc == 0)
                 return false;
 
-        char            redirect [512];
-
-        const char    * location = "";
-        const char    * statusText = "UNKNOWN";
-        switch (status) {
-        case 200:
-                if (replacement == 0 && extraText != 0)
-                        utf8 = strlen (extraText);
-
-                statusText = "OK";
-                break;
-
-        case 302:
-                if (extraText == 0)
-                        return false;
-
-                wsprintfA (redirect, "Location: %s\r\n", extraText);
-                location = redirect;
-
-                statusText = "REDIRECT";
-                break;
-
-        default:
-                if (extraText != 0)
-                        statusText = extraText;
-                break;
-        }
-
-        char            header [1024];
-        wsprintfA (header,
-                   "HTTP/1.1 %d %s\r\n"
-                   "Date: %s\r\n"
-                   "Expires: %s\r\n"
-                   "Content-Type: text/html; charset=UTF8\r\n"
-                   "Content-Length: %ld\r\n"
-                   "Connection: Keep-Alive\r\n"
-                   "%s"
-                   "\r\n", status, statusText, date, date, utf8, location);
-
-        size_t          headerLength = strlen (header);
-
-        unsigned long   size = sizeof (Replacement) + headerLength + utf8 + 1;
-
-        /*
-         * Allocate the replacement control structure, and copy the replacement
-         * document text into it (converting to UTF-8).
-         */
-
-        void          * mem = Replacement :: operator new (size);
-        if (mem == 0)
+        Replacement   * item = new Replacement (handle);
+        if (item == 0)
                 return false;
 
-        Replacement   * item = new (mem) Replacement (handle);
-        item->m_data = (unsigned char *) (item + 1);
+        g_documentAddRef (doc);
+        item->m_doc = doc;
 
-        memcpy (item->m_data, header, headerLength);
-
-        if (replacement != 0) {
-                utf8 = WideCharToMultiByte (CP_UTF8, 0, replacement, - 1,
-                                            (LPSTR) item->m_data + headerLength,
-                                            utf8, 0, 0);
-                if (utf8 == 0) {
-                        delete item;
-                        return false;
-                }
-                -- utf8;
-        } else if (utf8 > 0) {
-                /*
-                 * An alternative way to supply content via a #200 rule. In
-                 * this mode, we use ~ as an escape for '\n';
-                 */
-
-                unsigned char * dest = item->m_data + headerLength;
-                unsigned long   count = utf8;
-                while (count > 0) {
-                        unsigned char   ch = * extraText;
-                        ++ extraText;
-
-                        if (ch == '~')
-                                ch = '\n';
-
-                        * dest = ch;
-
-                        ++ dest;
-                        -- count;
-                }
-        }
-
-        item->m_length = headerLength + utf8;
-        item->m_offset = 0;
+        if (doc->m_split > 0)
+                item->m_dateLength = g_dateHeaders (item->m_date);
 
         l_replace.add (* item);
+        g_statsCount (STAT_SYNTHETIC);
 
         /*
          * Look for a bound event handle for the owner socket, and signal it as
@@ -617,75 +411,34 @@ bool g_addReplacement (SOCKET handle, const wchar_t * replacement, int status,
 }
 
 /**
- * Add a named replacement document item to be substituted on the indicated handle.
+ * Helper for g_addReplacement (), create a replacement item record.
+ *
+ * Status-only responses are cached keyed by their text, so repeated hits on
+ * the same '#' rule share one prepared document.
  */
 
-bool g_addReplacement (SOCKET handle, const char * name, const char * /* url */) {
-        wchar_t         tempName [80];
-        int             result;
-        result = MultiByteToWideChar (CP_UTF8, 0, name, - 1,
-                                      tempName, ARRAY_LENGTH (tempName));
-        if (result == 0)
-                return false;
-
-        /*
-         * Determine whether the named item exists, and what its size in UTF-16
-         * characters is.
-         */
-
-        LSTATUS         status;
-        unsigned long   length = 0;
-        status = RegQueryValueExW (l_rootKey, tempName, 0, 0, 0, & length);
-        if (status != ERROR_SUCCESS) {
-                OutputDebugStringA ("HTTP replacement not found\r\n");
-                return false;
-        }
-
-        wchar_t       * replacement;
-        replacement = (wchar_t *) HeapAlloc (GetProcessHeap (), 0, length);
-        if (replacement == 0)
-                return false;
-
-        unsigned long   type;
-        status = RegQueryValueExW (l_rootKey, tempName, 0, & type,
-                                   (LPBYTE) replacement, & length);
-        if (status != ERROR_SUCCESS) {
-                HeapFree (GetProcessHeap (), 0, replacement);
-                return false;
-        }
+bool g_addReplacement (SOCKET handle, const wchar_t * replacement, int status,
+                       const char * extraText) {
+        Document      * doc;
+        if (replacement == 0) {
+                doc = g_findDocument (status, extraText);
+        } else
+                doc = g_makeDocument (status, extraText, replacement);
 
-        if (type == REG_MULTI_SZ) {
-                /*
-                 * For MULTI_SZ just join all the component strings by changing
-                 * the interior terminator bytes into newlines.
-                 */
-
-                length = length / sizeof (wchar_t);
-                wchar_t       * scan = replacement;
-                wchar_t       * end = scan + length - 1;
-                for (; scan != end ; ++ scan)
-                        if (* scan == 0)
-                                * scan = '\n';
-        } else if (type == REG_SZ || type == REG_EXPAND_SZ) {
-                length = length / sizeof (wchar_t);
-        } else {
-                HeapFree (GetProcessHeap (), 0, replacement);
-                return false;
-        }
+        bool            value = g_addReplacement (handle, doc);
+        g_documentRelease (doc);
+        return value;
+}
 
-        /*
-         * Since a registry value has the potential to not be terminated,
-         * ensure that a terminator is present.
-         */
+/**
+ * Add a named replacement document item to be substituted on the indicated handle.
+ */
 
-        if (replacement [length - 1] != 0) {
-                replacement [length] = 0;
-                ++ length;
-        }
+bool g_addReplacement (SOCKET handle, const char * name, const char * /* url */) {
+        Document      * doc = g_findDocument (name);
 
-        bool            value;
-        value = g_addReplacement (handle, replacement, 200, 0);
-        HeapFree (GetProcessHeap (), 0, replacement);
+        bool            value = g_addReplacement (handle, doc);
+        g_documentRelease (doc);
         return value;
 }
 
@@ -694,6 +447,9 @@ bool g_addReplacement (SOCKET handle, const char * name, const char * /* url */)
  */
 
 Replacement * g_findReplacement (SOCKET handle) {
+        if (! g_anyReplacement ())
+                return 0;
+
         return l_replace.find (handle);
 }
 
@@ -715,18 +471,40 @@ bool g_consumeReplacement (Replacement * item, unsigned long length, void * buf,
         if (item == 0 || buf == 0)
                 return false;
 
-        unsigned long   avail = item->m_length - item->m_offset;
-        if (length < avail)
-                avail = length;
+        unsigned char * dest = (unsigned char *) buf;
+        unsigned long   total = 0;
+
+        const unsigned char * data;
+        unsigned long   size;
+        while (item->part (item->m_part, data, size)) {
+                unsigned long   avail = size - item->m_offset;
+                if (length < avail)
+                        avail = length;
 
-        memcpy (buf, item->m_data, avail);
+                memcpy (dest, data + item->m_offset, avail);
+                dest += avail;
+                total += avail;
+                length -= avail;
+
+                item->m_offset += avail;
+                if (item->m_offset < size)
+                        break;
+
+                ++ item->m_part;
+                item->m_offset = 0;
+        }
 
         if (copied != 0)
-                * copied = avail;
+                * copied = total;
 
-        item->m_offset += avail;
+        /*
+         * Skip over any empty parts, so we can tell whether anything remains.
+         */
+
+        while (item->part (item->m_part, data, size) && size == 0)
+                ++ item->m_part;
 
-        if (item->m_offset != item->m_length)
+        if (item->part (item->m_part, data, size))
                 return true;
 
         /*
@@ -787,4 +565,239 @@ bool g_consumeDiscard (Discarding * item, unsigned long length, unsigned long *
         return true;
 }
 
+/**
+ * Start capturing the response to a request on a socket, for the cache.
+ *
+ * The parameter is the lifetime for a cached response, or the store size
+ * limit for a depot chunk. Any capture already in progress on the socket is
+ * abandoned, since it means the previous response didn't arrive in a form we
+ * could use.
+ */
+
+bool g_addCapture (SOCKET handle, const char * key, unsigned long param,
+                   CaptureKind kind) {
+        l_capture.remove (handle);
+
+        Capture       * item = new Capture (handle);
+        if (item == 0)
+                return false;
+
+        size_t          length = strlen (key) + 1;
+        item->m_key = (char *) g_poolAlloc (length);
+        if (item->m_key == 0) {
+                delete item;
+                return false;
+        }
+
+        memcpy (item->m_key, key, length);
+        item->m_kind = kind;
+        item->m_param = param;
+
+        l_capture.add (* item);
+        return true;
+}
+
+/**
+ * Find the capture in progress on a socket, if any.
+ */
+
+Capture * g_findCapture (SOCKET handle) {
+        if (! g_anyCapture ())
+                return 0;
+
+        return l_capture.find (handle);
+}
+
+/**
+ * Give up on capturing a response.
+ */
+
+void g_abandonCapture (Capture * item) {
+        if (item != 0)
+                l_capture.remove (item, true);
+}
+
+/**
+ * Append received data to a capture's buffer, growing it as needed.
+ *
+ * Until the headers are complete the buffer grows by doubling; once they are,
+ * the total length is known and the buffer is sized to fit it exactly.
+ */
+
+static bool l_appendCapture (Capture * item, const char * buf,
+                             unsigned long length) {
+        unsigned long   need = item->m_buffered + length;
+        if (item->m_total != 0 && need > item->m_total)
+                return false;
+
+        if (need > item->m_size) {
+                unsigned long   size = item->m_size == 0 ? 2048 : item->m_size;
+                while (size < need)
+                        size *= 2;
+
+                if (item->m_total != 0) {
+                        size = item->m_total;
+                } else if (size > CACHE_HEADER_MAX + CACHE_ENTRY_MAX)
+                        return false;
+
+                char          * data = (char *) g_poolAlloc (size);
+                if (data == 0)
+                        return false;
+
+                if (item->m_buffered > 0)
+                        memcpy (data, item->m_data, item->m_buffered);
+
+                g_poolFree (item->m_data);
+                item->m_data = data;
+                item->m_size = size;
+        }
+
+        memcpy (item->m_data + item->m_buffered, buf, length);
+        item->m_buffered = need;
+        return true;
+}
+
+/**
+ * Take some received data for a capture, either buffering it or for a depot
+ * chunk whose headers we've seen, writing it out.
+ */
+
+static bool l_takeCapture (Capture * item, const char * buf,
+                           unsigned long length) {
+        if (item->m_total != 0 && item->m_length + length > item->m_total)
+                return false;
+
+        item->m_length += length;
+
+        if (item->m_file != 0)
+                return g_depotWrite (item->m_file, buf, length);
+
+        return l_appendCapture (item, buf, length);
+}
+
+/**
+ * Once the headers of a depot chunk have arrived, open the file in the store
+ * and move whatever of the body we've buffered into it.
+ */
+
+static bool l_beginDepot (Capture * item) {
+        item->m_file = g_depotBegin (item->m_key);
+        if (item->m_file == 0)
+                return false;
+
+        unsigned long   body = item->m_buffered - item->m_header;
+        if (body > 0 && ! g_depotWrite (item->m_file,
+                                        item->m_data + item->m_header, body))
+                return false;
+
+        item->m_buffered = item->m_header;
+        return true;
+}
+
+/**
+ * Feed received data into a capture.
+ *
+ * The data is given as a list of buffers, which receive calls fill in order.
+ * Once the whole response has arrived it's passed to the cache or the depot
+ * store and the capture is finished with; if at any point the response turns
+ * out not to be cacheable, the capture is abandoned and the rest of it is
+ * simply ignored.
+ */
+
+void g_captureData (Capture * item, const WSABUF * buffers,
+                    unsigned long count, unsigned long length) {
+        if (item == 0 || length == 0)
+                return;
+
+        /*
+         * If there's an overlapped receive outstanding, this data may not be
+         * what comes next in the stream; we can't tell, so give up.
+         */
+
+        if (item->m_pending != 0) {
+                g_abandonCapture (item);
+                return;
+        }
+
+        for (; count > 0 && length > 0 ; ++ buffers, -- count) {
+                unsigned long   some = buffers->len;
+                if (some > length)
+                        some = length;
+
+                if (! l_takeCapture (item, buffers->buf, some)) {
+                        g_abandonCapture (item);
+                        return;
+                }
+
+                length -= some;
+        }
+
+        if (item->m_total == 0) {
+                unsigned long   limit = CACHE_ENTRY_MAX;
+                if (item->m_kind == CAPTURE_DEPOT)
+                        limit = DEPOT_CHUNK_MAX;
+
+                if (! g_cacheResponseLength (item->m_data, item->m_buffered,
+                                             limit, & item->m_header,
+                                             & item->m_total)) {
+                        g_abandonCapture (item);
+                        return;
+                }
+
+                if (item->m_total != 0 && item->m_kind == CAPTURE_DEPOT &&
+                    ! l_beginDepot (item)) {
+                        g_abandonCapture (item);
+                        return;
+                }
+        }
+
+        if (item->m_total == 0 || item->m_length < item->m_total)
+                return;
+
+        if (item->m_kind == CAPTURE_DEPOT) {
+                DepotFile     * file = item->m_file;
+                item->m_file = 0;
+                g_depotCommit (item->m_key, file,
+                               item->m_total - item->m_header, item->m_param);
+        } else
+                g_cacheStore (item->m_key, item->m_param, item->m_data,
+                              item->m_buffered);
+
+        g_abandonCapture (item);
+}
+
+/**
+ * Note an overlapped receive which didn't complete immediately, so the data
+ * can be captured when the completion is collected.
+ */
+
+void g_captureDeferred (Capture * item, OVERLAPPED * overlapped,
+                        const WSABUF * buffers, unsigned long count) {
+        if (item == 0)
+                return;
+
+        if (item->m_pending != 0 || count > CAPTURE_BUFFERS) {
+                g_abandonCapture (item);
+                return;
+        }
+
+        item->m_pending = overlapped;
+        item->m_pendingCount = count;
+        memcpy (item->m_buffers, buffers, count * sizeof (WSABUF));
+}
+
+/**
+ * Collect the data from a completed overlapped receive.
+ */
+
+void g_captureCompleted (SOCKET handle, OVERLAPPED * overlapped,
+                         unsigned long length) {
+        Capture       * item = g_findCapture (handle);
+        if (item == 0 || item->m_pending != overlapped)
+                return;
+
+        item->m_pending = 0;
+        g_captureData (item, item->m_buffers, item->m_pendingCount, length);
+}
+
 /**@}*/
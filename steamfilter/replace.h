@@ -37,23 +37,42 @@
 
 struct Replacement;
 struct Discarding;
+struct Capture;
+struct Document;
 
 #include <winsock2.h>
 
 typedef void          * ReplaceHKEY;
 
-void            g_initReplacement (ReplaceHKEY key, const wchar_t * regPath);
+void            g_initReplacement (ReplaceHKEY key, const wchar_t * regPath,
+                                   const wchar_t * rootDir);
 void            g_unloadReplacement (void);
 
 void            g_addEventHandle (SOCKET handle, WSAEVENT event);
+WSAEVENT        g_findEventHandle (SOCKET handle);
 void            g_removeTracking (SOCKET handle);
 
 void            g_replacementCache (const wchar_t * name);
+bool            g_addReplacement (SOCKET handle, Document * doc);
 bool            g_addReplacement (SOCKET handle, const char * name,
                                   const char * url);
 bool            g_addReplacement (SOCKET handle, const wchar_t * replacement,
                                   int status = 200, const char * extraText = 0);
 
+/**
+ * Count of replacement items currently outstanding.
+ *
+ * The receive hooks check this before calling g_findReplacement () so that
+ * the normal case of no synthetic response being pending costs only a single
+ * aligned load rather than a lock and a list walk.
+ */
+
+extern  volatile LONG   g_replacePending;
+
+inline  bool            g_anyReplacement (void) {
+        return g_replacePending != 0;
+}
+
 Replacement   * g_findReplacement (SOCKET handle);
 bool            g_consumeReplacement (Replacement * item, unsigned long length,
                                       void * buf, unsigned long * copied);
@@ -63,5 +82,37 @@ Discarding    * g_findDiscard (SOCKET handle);
 bool            g_consumeDiscard (Discarding * item, unsigned long length,
                                   unsigned long * skip);
 
+/**
+ * Count of responses currently being captured for the cache, which the
+ * receive hooks check in the same way as for replacements.
+ */
+
+extern  volatile LONG   g_capturePending;
+
+inline  bool            g_anyCapture (void) {
+        return g_capturePending != 0;
+}
+
+/**
+ * What a captured response is destined for.
+ */
+
+enum CaptureKind {
+        CAPTURE_CACHE,
+        CAPTURE_DEPOT
+};
+
+bool            g_addCapture (SOCKET handle, const char * key,
+                              unsigned long param,
+                              CaptureKind kind = CAPTURE_CACHE);
+Capture       * g_findCapture (SOCKET handle);
+void            g_abandonCapture (Capture * item);
+void            g_captureData (Capture * item, const WSABUF * buffers,
+                               unsigned long count, unsigned long length);
+void            g_captureDeferred (Capture * item, OVERLAPPED * overlapped,
+                                   const WSABUF * buffers, unsigned long count);
+void            g_captureCompleted (SOCKET handle, OVERLAPPED * overlapped,
+                                    unsigned long length);
+
 /**@}*/
 #endif  /*! defined (REPLACE_H) */
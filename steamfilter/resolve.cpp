@@ -0,0 +1,534 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the cache of host lookups used by the filter.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <windows.h>
+#include <winsock2.h>
+
+#include "resolve.h"
+#include "perthread.h"
+#include "ticker.h"
+
+/**
+ * The cache and its lock; the lock is set up by whichever of configuring the
+ * cache or starting it up comes first, both of which happen before the hooks
+ * are attached.
+ */
+
+static  HostCache       l_cache;
+static  CRITICAL_SECTION l_lock;
+static  bool            l_ready;
+
+/**
+ * The real gethostbyname (), beneath the hook, for refreshing entries in the
+ * background.
+ */
+
+static  ResolveFunc     l_resolver;
+
+/**
+ * Count of background refreshes which haven't finished yet.
+ */
+
+static  volatile LONG   l_pending;
+
+/**
+ * The answers made up by the filter which haven't been freed yet; each sits
+ * behind a link in a list, which is kept under the same lock as the cache.
+ * The link is padded out so the answer behind it is still 8-byte aligned.
+ */
+
+struct ResolveOwned {
+        ResolveOwned  * m_next;
+        unsigned long   m_pad;
+};
+
+static  ResolveOwned  * l_owned;
+
+volatile LONG           g_resolveOwned;
+
+/**
+ * Set up the lock around the cache, if it isn't already.
+ */
+
+static void l_setup (void) {
+        if (l_ready)
+                return;
+
+        InitializeCriticalSection (& l_lock);
+        l_ready = true;
+}
+
+/**
+ * Decide whether the outcome of a lookup is worth keeping, and tidy it up.
+ *
+ * Failures which say the name doesn't exist are kept, but anything which might
+ * be a passing problem with the network isn't. A name which exists but has no
+ * IPv4 address is kept as the failure gethostbyname () would report for it.
+ */
+
+static bool l_keep (HostAnswer & answer) {
+        if (answer.m_error == 0 && answer.m_count == 0)
+                answer.m_error = WSANO_DATA;
+
+        return answer.m_error == 0 || answer.m_error == WSAHOST_NOT_FOUND ||
+               answer.m_error == WSANO_DATA;
+}
+
+/**
+ * Copy what gethostbyname () returned into an answer for the cache.
+ */
+
+static void l_answer (const hostent * result, unsigned long error,
+                      HostAnswer & answer) {
+        answer.m_error = result != 0 ? 0 : error;
+        answer.m_count = 0;
+        answer.m_name [0] = 0;
+        if (result == 0 || result->h_addrtype != AF_INET ||
+            result->h_length != sizeof (unsigned long))
+                return;
+
+        char         ** scan = result->h_addr_list;
+        for (; * scan != 0 && answer.m_count < HOST_CACHE_ADDRS ; ++ scan)
+                answer.m_addrs [answer.m_count ++] = * (unsigned long *) * scan;
+
+        if (result->h_name != 0 && strlen (result->h_name) < HOST_CACHE_NAME_MAX)
+                strcpy (answer.m_name, result->h_name);
+}
+
+/**
+ * Narrow a name for the cache, which only deals in plain ASCII names.
+ */
+
+static bool l_narrow (const wchar_t * name, char * narrow) {
+        size_t          i = 0;
+        for (; name [i] != 0 ; ++ i) {
+                if (i + 1 >= HOST_CACHE_NAME_MAX || name [i] >= 0x80)
+                        return false;
+
+                narrow [i] = (char) name [i];
+        }
+
+        narrow [i] = 0;
+        return true;
+}
+
+/**
+ * Keep an answer, if it's worth keeping.
+ */
+
+static void l_store (const char * name, HostAnswer & answer) {
+        if (! l_ready || ! l_keep (answer))
+                return;
+
+        EnterCriticalSection (& l_lock);
+        l_cache.store (name, answer, GetTickCount ());
+        LeaveCriticalSection (& l_lock);
+}
+
+/**
+ * Fill in a thread's host lookup storage with a list of addresses.
+ */
+
+hostent * g_hostFill (HostStorage & storage, const unsigned long * addrs,
+                      unsigned long count, const char * name) {
+        if (count > RULE_TARGETS_MAX)
+                count = RULE_TARGETS_MAX;
+
+        for (unsigned long i = 0 ; i < count ; ++ i) {
+                storage.m_addrs [i] = addrs [i];
+                storage.m_list [i] = (char *) (storage.m_addrs + i);
+        }
+
+        storage.m_list [count] = 0;
+        storage.m_aliases [0] = 0;
+
+        size_t          length = strlen (name);
+        if (length >= sizeof (storage.m_name))
+                length = sizeof (storage.m_name) - 1;
+
+        memcpy (storage.m_name, name, length);
+        storage.m_name [length] = 0;
+
+        storage.m_host.h_addrtype = AF_INET;
+        storage.m_host.h_addr_list = storage.m_list;
+        storage.m_host.h_aliases = storage.m_aliases;
+        storage.m_host.h_length = sizeof (unsigned long);
+        storage.m_host.h_name = storage.m_name;
+        return & storage.m_host;
+}
+
+/**
+ * Look up a name for the host process, from the cache if we can.
+ *
+ * On a miss the real function's own result is handed back, after keeping a
+ * copy of it; on a hit, the answer is rebuilt in the calling thread's storage.
+ * The hook passes in the real function itself, since it can be called before
+ * the background refreshing has been started.
+ */
+
+hostent * g_resolveHost (ResolveFunc resolver, const char * name) {
+        ThreadData    * data = 0;
+        if (name != 0 && l_ready && l_cache.active ())
+                data = g_threadData ();
+
+        if (data == 0)
+                return (* resolver) (name);
+
+        HostAnswer      answer;
+        EnterCriticalSection (& l_lock);
+        bool            found = l_cache.lookup (name, GetTickCount (), answer);
+        LeaveCriticalSection (& l_lock);
+
+        if (! found) {
+                hostent       * result = (* resolver) (name);
+                unsigned long   error = GetLastError ();
+
+                l_answer (result, error, answer);
+                l_store (name, answer);
+
+                SetLastError (error);
+                return result;
+        }
+
+        if (answer.m_error != 0) {
+                SetLastError (answer.m_error);
+                return 0;
+        }
+
+        const char    * canonical = answer.m_name [0] != 0 ? answer.m_name : name;
+        return g_hostFill (data->m_host, answer.m_addrs, answer.m_count,
+                           canonical);
+}
+
+/**
+ * Look for a cached answer on behalf of the lookup hooks which make up their
+ * own answers.
+ */
+
+bool g_resolveFind (const char * name, HostAnswer & answer) {
+        if (! l_ready)
+                return false;
+
+        EnterCriticalSection (& l_lock);
+        bool            found = l_cache.lookup (name, GetTickCount (), answer);
+        LeaveCriticalSection (& l_lock);
+        return found;
+}
+
+/**
+ * Look for a cached answer on behalf of the rule set, which resolves the names
+ * given as rewrite targets.
+ */
+
+bool g_resolveFind (const wchar_t * name, HostAnswer & answer) {
+        char            narrow [HOST_CACHE_NAME_MAX];
+        if (! l_narrow (name, narrow))
+                return false;
+
+        return g_resolveFind (narrow, answer);
+}
+
+/**
+ * Keep an answer found by one of the lookup hooks, if it's worth keeping.
+ */
+
+void g_resolveStore (const char * name, HostAnswer & answer) {
+        if (strlen (name) < HOST_CACHE_NAME_MAX)
+                l_store (name, answer);
+}
+
+/**
+ * Keep an answer found by the rule set, if it's worth keeping.
+ */
+
+void g_resolveStore (const wchar_t * name, HostAnswer & answer) {
+        char            narrow [HOST_CACHE_NAME_MAX];
+        if (l_narrow (name, narrow))
+                l_store (narrow, answer);
+}
+
+/**
+ * Allocate the memory for an answer made up by the filter, and keep track of
+ * it until it's handed back.
+ */
+
+void * g_resolveAlloc (size_t size) {
+        if (! l_ready)
+                return 0;
+
+        ResolveOwned  * owned;
+        owned = (ResolveOwned *) HeapAlloc (GetProcessHeap (), 0,
+                                            sizeof (* owned) + size);
+        if (owned == 0)
+                return 0;
+
+        EnterCriticalSection (& l_lock);
+        owned->m_next = l_owned;
+        l_owned = owned;
+        InterlockedIncrement (& g_resolveOwned);
+        LeaveCriticalSection (& l_lock);
+
+        return owned + 1;
+}
+
+/**
+ * Free an answer if it's one the filter made up; if it isn't, the caller
+ * hands it to the system's own function instead.
+ *
+ * The answer is only compared against the ones in the list, never looked
+ * into, since it could be anything the host process allocated.
+ */
+
+bool g_resolveRelease (void * answer) {
+        if (! l_ready)
+                return false;
+
+        EnterCriticalSection (& l_lock);
+
+        ResolveOwned ** link = & l_owned;
+        ResolveOwned  * owned;
+        while ((owned = * link) != 0 && owned + 1 != answer)
+                link = & owned->m_next;
+
+        if (owned != 0) {
+                * link = owned->m_next;
+                InterlockedDecrement (& g_resolveOwned);
+        }
+
+        LeaveCriticalSection (& l_lock);
+
+        if (owned == 0)
+                return false;
+
+        HeapFree (GetProcessHeap (), 0, owned);
+        return true;
+}
+
+/**
+ * Give the host process a little while to free the answers the filter made
+ * up, once the lookup hooks are gone but before the hooks which free them are.
+ *
+ * Any still held after that are left alone rather than freed from under the
+ * host process, and the hooks which free them have to stay.
+ */
+
+void g_resolveSettle (unsigned long wait) {
+        unsigned long   start = GetTickCount ();
+        while (g_resolveOwned > 0 && GetTickCount () - start < wait)
+                Sleep (10);
+}
+
+/**
+ * Everything needed to deliver an asynchronous lookup's completion.
+ */
+
+struct ResolveCompletion {
+        OVERLAPPED    * m_overlapped;
+        ResolveDone     m_done;
+        int             m_error;
+};
+
+/**
+ * Deliver the completion of an asynchronous lookup, on a thread from the
+ * system's pool.
+ */
+
+static DWORD WINAPI l_complete (void * param) {
+        ResolveCompletion     * completion = (ResolveCompletion *) param;
+        (* completion->m_done) (completion->m_error, 0,
+                                completion->m_overlapped);
+
+        HeapFree (GetProcessHeap (), 0, completion);
+        InterlockedDecrement (& l_pending);
+        return 0;
+}
+
+/**
+ * Complete an asynchronous lookup whose answer is already to hand.
+ *
+ * The status goes in the overlapped, where GetAddrInfoExOverlappedResult ()
+ * looks for it, and then the caller is told in the way they asked; that's the
+ * completion routine if they gave one, and the event otherwise, never both,
+ * as with the system's own lookups. The lookup is reported as pending, as it
+ * would be from the system, so that the completion routine is never run
+ * before the caller is ready for it.
+ */
+
+int g_resolveComplete (OVERLAPPED * overlapped, ResolveDone done, int error) {
+        overlapped->Internal = error;
+        overlapped->InternalHigh = 0;
+
+        if (done == 0) {
+                if (overlapped->hEvent != 0)
+                        SetEvent (overlapped->hEvent);
+
+                return WSA_IO_PENDING;
+        }
+
+        ResolveCompletion     * completion;
+        completion = (ResolveCompletion *) HeapAlloc (GetProcessHeap (), 0,
+                                                      sizeof (* completion));
+        if (completion != 0) {
+                completion->m_overlapped = overlapped;
+                completion->m_done = done;
+                completion->m_error = error;
+
+                InterlockedIncrement (& l_pending);
+                if (QueueUserWorkItem (l_complete, completion,
+                                       WT_EXECUTEDEFAULT))
+                        return WSA_IO_PENDING;
+
+                InterlockedDecrement (& l_pending);
+                HeapFree (GetProcessHeap (), 0, completion);
+        }
+
+        /*
+         * If it can't be handed off, then the answer is still good and can be
+         * returned straight away, which the caller has to be ready for in any
+         * case.
+         */
+
+        return error;
+}
+
+/**
+ * Refresh an entry in the cache, on a thread from the system's pool.
+ */
+
+static DWORD WINAPI l_refresh (void * param) {
+        char          * name = (char *) param;
+
+        hostent       * result = (* l_resolver) (name);
+        HostAnswer      answer;
+        l_answer (result, GetLastError (), answer);
+        l_store (name, answer);
+
+        HeapFree (GetProcessHeap (), 0, name);
+        InterlockedDecrement (& l_pending);
+        return 0;
+}
+
+/**
+ * Look for entries due for a refresh, from the background thread.
+ *
+ * Since the lookups themselves block, they're handed off to the system thread
+ * pool rather than holding up the other background tasks.
+ */
+
+static void l_resolveTick (unsigned long now) {
+        EnterCriticalSection (& l_lock);
+
+        for (unsigned long i = 0 ; i < RESOLVE_REFRESH_MAX ; ++ i) {
+                char            name [HOST_CACHE_NAME_MAX];
+                if (! l_cache.refreshDue (now, name, sizeof (name)))
+                        break;
+
+                size_t          length = strlen (name) + 1;
+                char          * copy;
+                copy = (char *) HeapAlloc (GetProcessHeap (), 0, length);
+                if (copy == 0)
+                        break;
+
+                memcpy (copy, name, length);
+                InterlockedIncrement (& l_pending);
+                if (! QueueUserWorkItem (l_refresh, copy, WT_EXECUTEDEFAULT)) {
+                        InterlockedDecrement (& l_pending);
+                        HeapFree (GetProcessHeap (), 0, copy);
+                        break;
+                }
+        }
+
+        LeaveCriticalSection (& l_lock);
+}
+
+/**
+ * Start using the cache for lookups made through the hook, given the real
+ * gethostbyname () to resolve names with.
+ */
+
+void g_resolveInit (ResolveFunc resolver) {
+        l_setup ();
+        l_resolver = resolver;
+        g_tickerAdd (l_resolveTick, RESOLVE_INTERVAL);
+}
+
+/**
+ * Set how long answers are kept for, in seconds, as given by the rule set; no
+ * time at all turns the cache off. Failures are kept for a shorter time.
+ */
+
+void g_resolveConfigure (unsigned long seconds) {
+        l_setup ();
+
+        unsigned long   ttl = seconds * 1000;
+        unsigned long   negative = HOST_CACHE_NEGATIVE;
+        if (negative > ttl)
+                negative = ttl;
+
+        EnterCriticalSection (& l_lock);
+        l_cache.configure (ttl, negative);
+        LeaveCriticalSection (& l_lock);
+}
+
+/**
+ * Write the figures out for the benefit of DbgView.
+ */
+
+void g_resolveReport (void) {
+        if (! l_ready)
+                return;
+
+        char            show [120];
+        wsprintfA (show, "resolve: %lu hits, %lu misses, %lu refreshed\r\n",
+                   l_cache.hits (), l_cache.misses (), l_cache.refreshes ());
+        OutputDebugStringA (show);
+}
+
+/**
+ * Wait for any background refreshes and completions to finish, and release
+ * the lock; the hooks must have been removed, and the background thread
+ * stopped.
+ */
+
+void g_resolveUnload (void) {
+        while (l_pending > 0)
+                Sleep (1);
+
+        if (! l_ready)
+                return;
+
+        DeleteCriticalSection (& l_lock);
+        l_ready = false;
+}
+
+/**@}*/
@@ -0,0 +1,118 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H               1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the cache of host lookups used by the filter.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The filter's side of the host lookup cache: this holds the cache itself,
+ * the lock around it, and what's needed to look names up with the real
+ * gethostbyname () underneath the hook, whether on behalf of the host process
+ * or in the background to refresh entries before they expire.
+ *
+ * Answers from the cache are handed back in the calling thread's own storage,
+ * as gethostbyname () does, so they're good until that thread's next lookup.
+ *
+ * The getaddrinfo () family of lookups instead hand back answers which the
+ * caller frees when it's done with them. Those the filter makes up itself are
+ * kept track of here, so that the hooks on the functions which free answers
+ * can tell them apart from the system's own.
+ */
+
+#include <winsock2.h>
+
+#include "hostcache.h"
+
+struct HostStorage;
+
+typedef hostent * (WSAAPI * ResolveFunc) (const char * name);
+
+/**
+ * How often to look for entries to refresh, in milliseconds, and the most to
+ * start refreshing each time.
+ */
+
+#define RESOLVE_INTERVAL        1000
+#define RESOLVE_REFRESH_MAX     4
+
+/**
+ * How long to wait when unloading for the host process to free answers the
+ * filter made up, in milliseconds.
+ */
+
+#define RESOLVE_SETTLE_TIME     1000
+
+/**
+ * Signature of the routine an asynchronous lookup completes to.
+ */
+
+typedef void (CALLBACK * ResolveDone) (DWORD error, DWORD length,
+                                       OVERLAPPED * overlapped);
+
+void            g_resolveInit (ResolveFunc resolver);
+void            g_resolveConfigure (unsigned long seconds);
+void            g_resolveReport (void);
+void            g_resolveUnload (void);
+
+hostent       * g_resolveHost (ResolveFunc resolver, const char * name);
+bool            g_resolveFind (const char * name, HostAnswer & answer);
+bool            g_resolveFind (const wchar_t * name, HostAnswer & answer);
+void            g_resolveStore (const char * name, HostAnswer & answer);
+void            g_resolveStore (const wchar_t * name, HostAnswer & answer);
+
+hostent       * g_hostFill (HostStorage & storage, const unsigned long * addrs,
+                            unsigned long count, const char * name);
+
+/**
+ * Count of answers made up by the filter which haven't been freed yet.
+ *
+ * The hooks on the functions which free answers check this before calling
+ * g_resolveRelease (), so that freeing the system's own answers costs only a
+ * single load in the normal case of the filter not having made up any.
+ */
+
+extern  volatile LONG   g_resolveOwned;
+
+inline  bool            g_anyResolved (void) {
+        return g_resolveOwned != 0;
+}
+
+void          * g_resolveAlloc (size_t size);
+bool            g_resolveRelease (void * answer);
+void            g_resolveSettle (unsigned long wait);
+
+int             g_resolveComplete (OVERLAPPED * overlapped, ResolveDone done,
+                                   int error);
+
+/**@}*/
+#endif  /* ! defined (RESOLVE_H) */
@@ -0,0 +1,1333 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements downloads split across several servers using Range requests,
+ * for the "=%" URL rules.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The way this fits into the rest of the filter is much like the replacement
+ * documents; the client's request is swallowed by the send hooks, and the
+ * receive hooks feed it a response which we create ourselves. The difference
+ * is that here the response is being assembled on the fly by a worker thread
+ * which keeps a connection open to each of the servers the rule names.
+ *
+ * The first request asks one server for the first part only, which tells us
+ * the full size of the document and gives us the headers to present to the
+ * client; if the server doesn't understand ranges we just relay its response
+ * as-is. Otherwise the remaining parts are handed out to whichever servers are
+ * free, in order, and the client is fed everything up to the first part that
+ * hasn't arrived yet.
+ *
+ * A server that fails in the middle of a part has the rest of that part
+ * handed out again, and a server that fails too often is dropped; only when
+ * there are no servers left does the client see an error.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "segment.h"
+#include "socktrack.h"
+#include "filterrule.h"
+#include "replace.h"
+#include "netapi.h"
+#include "health.h"
+#include "warm.h"
+#include "header.h"
+#include "pool.h"
+
+/**
+ * Most servers a download will be split across.
+ */
+
+#define SEGMENT_SOURCES_MAX     RULE_TARGETS_MAX
+
+/**
+ * Most parts waiting to be requested again, after a server has failed part
+ * way through one or only sent us some of what we asked for.
+ */
+
+#define SEGMENT_RETRY_MAX       (SEGMENT_SOURCES_MAX * 2)
+
+/**
+ * Longest request or response header we'll deal with.
+ */
+
+#define SEGMENT_HEADER_MAX      4096
+
+/**
+ * Smallest part size we'll use, in bytes.
+ */
+
+#define SEGMENT_SIZE_MIN        (16 * 1024)
+
+/**
+ * Number of failures after which a server is given up on.
+ */
+
+#define SEGMENT_FAILURES_MAX    3
+
+/**
+ * How often the worker looks around, in milliseconds, and how long a server
+ * can go without sending us anything before we give up on the connection.
+ */
+
+#define SEGMENT_POLL            50
+#define SEGMENT_STALL           15000
+
+/**
+ * Value of the total length while it isn't known, which is also the case
+ * when relaying a response with no length which ends when the server closes.
+ */
+
+#define SEGMENT_UNKNOWN         (~ 0UL)
+
+/**
+ * The states of a connection to one of the servers.
+ */
+
+enum SourceState {
+        SOURCE_IDLE,
+        SOURCE_CONNECTING,
+        SOURCE_HEAD,
+        SOURCE_BODY,
+        SOURCE_DISABLED
+};
+
+/**
+ * One of the servers a download is being split across.
+ *
+ * The connection is kept open between parts where the server allows it, and
+ * the part currently being fetched is the range from m_start to m_end, with
+ * m_pos being the next byte we expect to get.
+ */
+
+struct Source {
+        sockaddr_in     m_addr;
+        SOCKET          m_socket;
+        SourceState     m_state;
+        unsigned long   m_failures;
+        bool            m_reused;
+        bool            m_close;
+
+        unsigned long   m_start;
+        unsigned long   m_end;
+        unsigned long   m_pos;
+        unsigned long   m_last;
+
+        unsigned long   m_headLength;
+        char            m_head [SEGMENT_HEADER_MAX];
+};
+
+/**
+ * A segmented download in progress.
+ *
+ * This is shared between the worker thread and the socket it's feeding, so
+ * it's reference-counted; the parts touched by both sides are protected by
+ * the lock, and the rest belong to the worker.
+ */
+
+struct Stream {
+        Stream        * m_next;
+        Stream        * m_prev;
+        volatile LONG   m_refs;
+        volatile LONG   m_cancel;
+
+        SOCKET          m_client;
+        HANDLE          m_thread;
+        HANDLE          m_ready;
+        HANDLE          m_wake;
+        CRITICAL_SECTION m_lock;
+
+        char            m_request [SEGMENT_HEADER_MAX];
+        unsigned long   m_requestLength;
+        unsigned long   m_lineLength;
+        unsigned long   m_size;
+
+        unsigned long   m_sourceCount;
+        Source          m_sources [SEGMENT_SOURCES_MAX];
+
+        bool            m_ranged;
+        unsigned long   m_nextStart;
+        unsigned long   m_retryCount;
+        unsigned long   m_retryStart [SEGMENT_RETRY_MAX];
+        unsigned long   m_retryEnd [SEGMENT_RETRY_MAX];
+
+        bool            m_headReady;
+        char          * m_head;
+        unsigned long   m_headLength;
+        unsigned long   m_headSent;
+
+        unsigned long   m_total;
+        unsigned long   m_frontier;
+        volatile unsigned long m_consumed;
+        unsigned long   m_error;
+
+        unsigned char * m_ring;
+};
+
+/**
+ * Record for a connection that a rule redirected to one of several servers,
+ * so that a later request on it knows what all the servers were.
+ */
+
+struct Redirect : public SocketTrack {
+        unsigned long   m_count;
+        sockaddr_in     m_targets [RULE_TARGETS_MAX];
+
+                        Redirect (SOCKET handle) : SocketTrack (handle),
+                                m_count (0) { }
+};
+
+/**
+ * Record for a socket being fed a segmented download.
+ */
+
+struct Segmented : public SocketTrack {
+        Stream        * m_stream;
+
+                        Segmented (SOCKET handle) : SocketTrack (handle),
+                                m_stream (0) {
+                InterlockedIncrement (& g_segmentPending);
+        }
+                      ~ Segmented ();
+};
+
+/**
+ * Count of live segmented records, for the receive-side fast path.
+ */
+
+volatile LONG           g_segmentPending;
+
+/**
+ * The sockets with redirections and segmented downloads.
+ */
+
+static  SocketList<Redirect> l_redirects;
+static  SocketList<Segmented> l_segments;
+
+/**
+ * All the live downloads, so that unloading can find the worker threads.
+ */
+
+struct StreamList {
+        CRITICAL_SECTION m_lock;
+        Stream        * m_head;
+
+                        StreamList () : m_head (0) {
+                InitializeCriticalSection (& m_lock);
+        }
+                      ~ StreamList () {
+                DeleteCriticalSection (& m_lock);
+        }
+};
+
+static  StreamList      l_streams;
+
+/**
+ * Drop a reference to a download, freeing it with the last one.
+ */
+
+static void l_release (Stream * stream) {
+        if (InterlockedDecrement (& stream->m_refs) > 0)
+                return;
+
+        EnterCriticalSection (& l_streams.m_lock);
+        if (stream->m_prev == 0) {
+                l_streams.m_head = stream->m_next;
+        } else
+                stream->m_prev->m_next = stream->m_next;
+        if (stream->m_next != 0)
+                stream->m_next->m_prev = stream->m_prev;
+        LeaveCriticalSection (& l_streams.m_lock);
+
+        if (stream->m_thread != 0)
+                CloseHandle (stream->m_thread);
+        if (stream->m_ready != 0)
+                CloseHandle (stream->m_ready);
+        if (stream->m_wake != 0)
+                CloseHandle (stream->m_wake);
+        if (stream->m_ring != 0)
+                VirtualFree (stream->m_ring, 0, MEM_RELEASE);
+
+        DeleteCriticalSection (& stream->m_lock);
+        g_poolFree (stream->m_head);
+        g_poolFree (stream);
+}
+
+/**
+ * Ask the worker for a download to stop.
+ */
+
+static void l_cancel (Stream * stream) {
+        InterlockedExchange (& stream->m_cancel, 1);
+        SetEvent (stream->m_wake);
+}
+
+/**
+ * Closing the socket (or the download completing) stops the worker.
+ */
+
+Segmented :: ~ Segmented () {
+        if (m_stream != 0) {
+                l_cancel (m_stream);
+                l_release (m_stream);
+        }
+
+        InterlockedDecrement (& g_segmentPending);
+}
+
+/**
+ * Let the client know there's something new for it, whether that's more data
+ * or the download having finished or failed.
+ */
+
+static void l_signal (Stream * stream) {
+        SetEvent (stream->m_ready);
+
+        WSAEVENT        event = g_findEventHandle (stream->m_client);
+        if (event != 0)
+                SetEvent (event);
+}
+
+/**
+ * Fail the download as a whole.
+ */
+
+static void l_abort (Stream * stream, unsigned long error) {
+        EnterCriticalSection (& stream->m_lock);
+        if (stream->m_error == 0)
+                stream->m_error = error;
+        LeaveCriticalSection (& stream->m_lock);
+
+        l_signal (stream);
+}
+
+/**
+ * Work out how much of the download has arrived in order, and pass that on to
+ * the client.
+ *
+ * Everything below the start of the lowest part still outstanding has been
+ * received, whether that part is in progress or waiting to be handed out.
+ */
+
+static void l_advance (Stream * stream) {
+        if (! stream->m_headReady)
+                return;
+
+        unsigned long   frontier = stream->m_nextStart;
+
+        unsigned long   i;
+        for (i = 0 ; i < stream->m_sourceCount ; ++ i) {
+                Source        & source = stream->m_sources [i];
+                if (source.m_state == SOURCE_IDLE ||
+                    source.m_state == SOURCE_DISABLED)
+                        continue;
+
+                if (source.m_pos < frontier)
+                        frontier = source.m_pos;
+        }
+
+        for (i = 0 ; i < stream->m_retryCount ; ++ i)
+                if (stream->m_retryStart [i] < frontier)
+                        frontier = stream->m_retryStart [i];
+
+        if (frontier > stream->m_total)
+                frontier = stream->m_total;
+
+        EnterCriticalSection (& stream->m_lock);
+        bool            changed = frontier > stream->m_frontier;
+        if (changed)
+                stream->m_frontier = frontier;
+        LeaveCriticalSection (& stream->m_lock);
+
+        if (changed)
+                l_signal (stream);
+}
+
+/**
+ * Queue a range to be requested again.
+ */
+
+static bool l_retry (Stream * stream, unsigned long start, unsigned long end) {
+        if (start >= end)
+                return true;
+
+        if (stream->m_retryCount == SEGMENT_RETRY_MAX)
+                return false;
+
+        stream->m_retryStart [stream->m_retryCount] = start;
+        stream->m_retryEnd [stream->m_retryCount] = end;
+        ++ stream->m_retryCount;
+        return true;
+}
+
+/**
+ * Drop the connection to a server after something has gone wrong with it.
+ *
+ * Whatever was left of the part it was fetching goes back to be requested
+ * again; if the server was just closing an idle connection that doesn't count
+ * against it, otherwise after a few failures it's given up on entirely.
+ */
+
+static void l_fail (Stream * stream, Source & source, bool counts = true) {
+        if (source.m_socket != INVALID_SOCKET) {
+                (* g_net.m_closesocket) (source.m_socket);
+                source.m_socket = INVALID_SOCKET;
+        }
+
+        if (source.m_state == SOURCE_IDLE || source.m_state == SOURCE_DISABLED)
+                return;
+
+        /*
+         * If the server doesn't do ranges, there's no way to resume a part
+         * that has been started.
+         */
+
+        if (stream->m_headReady && ! stream->m_ranged) {
+                source.m_state = SOURCE_IDLE;
+                l_abort (stream, WSAECONNRESET);
+                return;
+        }
+
+        if (! l_retry (stream, source.m_pos, source.m_end))
+                l_abort (stream, WSAECONNRESET);
+
+        source.m_state = SOURCE_IDLE;
+        source.m_headLength = 0;
+        if (counts && ++ source.m_failures >= SEGMENT_FAILURES_MAX)
+                source.m_state = SOURCE_DISABLED;
+
+        unsigned long   i;
+        for (i = 0 ; i < stream->m_sourceCount ; ++ i)
+                if (stream->m_sources [i].m_state != SOURCE_DISABLED)
+                        return;
+
+        l_abort (stream, WSAECONNRESET);
+}
+
+/**
+ * Send the request for a part to a server.
+ */
+
+static bool l_sendRange (Stream * stream, Source & source) {
+        char            temp [SEGMENT_HEADER_MAX + 64];
+        HeaderBuilder   build (temp);
+
+        build.append (stream->m_request, stream->m_lineLength);
+        build.append ("Range: bytes=");
+        build.appendDecimal (source.m_start);
+        build.append ("-");
+        build.appendDecimal (source.m_end - 1);
+        build.append ("\r\n");
+        build.append (stream->m_request + stream->m_lineLength,
+                      stream->m_requestLength - stream->m_lineLength);
+
+        /*
+         * Requests are small and the connection is idle, so there's always
+         * room for the whole thing in the socket buffer.
+         */
+
+        int             length = (int) build.length ();
+        return (* g_net.m_send) (source.m_socket, temp, length, 0) == length;
+}
+
+/**
+ * Start a server on a part, connecting first if necessary.
+ *
+ * Where there's a connection to the server already made and waiting, that
+ * saves a handshake; as for a connection kept open from an earlier part, the
+ * server may have given up on it just as we send, so a failure straight away
+ * doesn't count against the server.
+ */
+
+static void l_start (Stream * stream, Source & source, unsigned long start,
+                     unsigned long end) {
+        source.m_start = start;
+        source.m_end = end;
+        source.m_pos = start;
+        source.m_headLength = 0;
+        source.m_last = GetTickCount ();
+
+        if (source.m_socket == INVALID_SOCKET)
+                source.m_socket = g_warmTake (source.m_addr);
+
+        if (source.m_socket == INVALID_SOCKET) {
+                source.m_socket = g_netConnect (source.m_addr);
+                source.m_reused = false;
+                source.m_state = SOURCE_CONNECTING;
+                if (source.m_socket == INVALID_SOCKET)
+                        l_fail (stream, source);
+
+                return;
+        }
+
+        source.m_reused = true;
+        source.m_state = SOURCE_HEAD;
+        if (! l_sendRange (stream, source))
+                l_fail (stream, source, false);
+}
+
+/**
+ * Hand out parts to any servers that are free.
+ *
+ * Parts that need to be requested again go first, since they're holding the
+ * client up; new parts are only handed out if they fit in the window. Until
+ * the first response has arrived, only one request is made at a time.
+ */
+
+static void l_assign (Stream * stream) {
+        unsigned long   i;
+        for (i = 0 ; i < stream->m_sourceCount ; ++ i) {
+                Source        & source = stream->m_sources [i];
+                if (source.m_state != SOURCE_IDLE)
+                        continue;
+
+                if (! stream->m_headReady) {
+                        unsigned long   j;
+                        for (j = 0 ; j < stream->m_sourceCount ; ++ j) {
+                                SourceState state = stream->m_sources [j].m_state;
+                                if (state != SOURCE_IDLE &&
+                                    state != SOURCE_DISABLED)
+                                        return;
+                        }
+                } else if (! stream->m_ranged)
+                        return;
+
+                unsigned long   start;
+                unsigned long   end;
+                if (stream->m_retryCount > 0) {
+                        unsigned long   low = 0;
+                        unsigned long   j;
+                        for (j = 1 ; j < stream->m_retryCount ; ++ j)
+                                if (stream->m_retryStart [j] <
+                                    stream->m_retryStart [low])
+                                        low = j;
+
+                        start = stream->m_retryStart [low];
+                        end = stream->m_retryEnd [low];
+
+                        -- stream->m_retryCount;
+                        stream->m_retryStart [low] =
+                                stream->m_retryStart [stream->m_retryCount];
+                        stream->m_retryEnd [low] =
+                                stream->m_retryEnd [stream->m_retryCount];
+                } else if (! stream->m_headReady) {
+                        start = 0;
+                        end = stream->m_size;
+                } else {
+                        start = stream->m_nextStart;
+                        if (start >= stream->m_total)
+                                return;
+
+                        end = stream->m_total - start > stream->m_size ?
+                              start + stream->m_size : stream->m_total;
+                        if (end - stream->m_consumed > SEGMENT_WINDOW)
+                                return;
+
+                        stream->m_nextStart = end;
+                }
+
+                l_start (stream, source, start, end);
+        }
+}
+
+/**
+ * Parse the value of a Content-Range header.
+ */
+
+static bool l_contentRange (const char * value, const char * end,
+                            unsigned long & first, unsigned long & last,
+                            unsigned long & total) {
+        if (end - value < 6 || ! g_headerIs (value, 6, "bytes "))
+                return false;
+
+        value += 6;
+        const char    * dash = (const char *) memchr (value, '-', end - value);
+        if (dash == 0)
+                return false;
+
+        const char    * slash = (const char *) memchr (dash, '/', end - dash);
+        if (slash == 0)
+                return false;
+
+        return g_headerValue (value, dash, & first) &&
+               g_headerValue (dash + 1, slash, & last) &&
+               g_headerValue (slash + 1, end, & total) &&
+               first <= last && last < total;
+}
+
+/**
+ * Build the response header the client sees for a ranged download.
+ *
+ * This is the first server's response, minus the headers that describe the
+ * part it sent or its own connection, and with the length of the whole thing.
+ */
+
+static unsigned long l_buildHead (HeaderBuilder & build, const char * scan,
+                                  const char * end, unsigned long total) {
+static  const char    * drop [] = {
+                "content-range", "content-length", "connection", "keep-alive",
+                0
+        };
+
+        build.append ("HTTP/1.1 200 OK\r\n");
+
+        HeaderLine      line;
+        while (g_nextHeader (scan, end, line)) {
+                const char   ** test = drop;
+                for (; * test != 0 ; ++ test)
+                        if (g_headerIs (line.m_name, line.m_nameLength, * test))
+                                break;
+
+                if (* test == 0)
+                        build.append (line.m_line, line.m_lineLength);
+        }
+
+        build.append ("Content-Length: ");
+        build.appendDecimal (total);
+        build.append ("\r\n\r\n");
+        return build.length ();
+}
+
+/**
+ * Copy part of the download into the reassembly buffer.
+ */
+
+static void l_store (Stream * stream, Source & source, const char * data,
+                     unsigned long length) {
+        while (length > 0) {
+                unsigned long   offset = source.m_pos % SEGMENT_WINDOW;
+                unsigned long   chunk = SEGMENT_WINDOW - offset;
+                if (chunk > length)
+                        chunk = length;
+
+                memcpy (stream->m_ring + offset, data, chunk);
+                source.m_pos += chunk;
+                data += chunk;
+                length -= chunk;
+        }
+}
+
+/**
+ * A server has finished sending a part; if it's happy to keep the connection
+ * open, it can be given another.
+ */
+
+static void l_finished (Stream * stream, Source & source) {
+        source.m_state = SOURCE_IDLE;
+        source.m_headLength = 0;
+        source.m_failures = 0;
+
+        if (source.m_close) {
+                (* g_net.m_closesocket) (source.m_socket);
+                source.m_socket = INVALID_SOCKET;
+        }
+}
+
+/**
+ * Process the response header from a server.
+ *
+ * For the first response, this decides how the download proceeds and what
+ * the client sees; after that, the server must be sending exactly the part we
+ * asked for (or at least the start of it).
+ */
+
+static bool l_response (Stream * stream, Source & source, const char * end) {
+        const char    * scan = source.m_head;
+        const char    * eol = (const char *) memchr (scan, '\n', end - scan);
+        const char    * space = (const char *) memchr (scan, ' ', end - scan);
+        unsigned long   status = 0;
+        if (eol == 0 || space == 0 || space > eol ||
+            ! g_headerValue (space + 1, eol, & status))
+                return false;
+
+        scan = eol + 1;
+
+        unsigned long   length = SEGMENT_UNKNOWN;
+        unsigned long   first = 0;
+        unsigned long   last = 0;
+        unsigned long   total = 0;
+        bool            range = false;
+        source.m_close = false;
+
+        HeaderLine      line;
+        while (g_nextHeader (scan, end, line)) {
+                const char    * value = line.m_value;
+                const char    * valueEnd = value + line.m_valueLength;
+
+                if (g_headerIs (line.m_name, line.m_nameLength,
+                                "content-length")) {
+                        if (! g_headerValue (value, valueEnd, & length))
+                                return false;
+                } else if (g_headerIs (line.m_name, line.m_nameLength,
+                                       "content-range")) {
+                        range = l_contentRange (value, valueEnd, first, last,
+                                                total);
+                } else if (g_headerIs (line.m_name, line.m_nameLength,
+                                       "connection")) {
+                        source.m_close = g_headerToken (value, line.m_valueLength,
+                                                        "close") != 0;
+                }
+        }
+
+        unsigned long   headLength = end - source.m_head;
+
+        if (stream->m_headReady) {
+                if (status != 206 || ! range || first != source.m_start ||
+                    last >= source.m_end || total != stream->m_total)
+                        return false;
+        } else if (status == 206 && range && first == 0) {
+                /*
+                 * The server does ranges, so we're in business.
+                 */
+
+                HeaderBuilder   measure;
+                unsigned long   size;
+                size = l_buildHead (measure, eol + 1, end, total);
+
+                char          * head = (char *) g_poolAlloc (size);
+                if (head == 0)
+                        return false;
+
+                HeaderBuilder   build (head);
+                l_buildHead (build, eol + 1, end, total);
+
+                if (source.m_end > total)
+                        source.m_end = total;
+
+                stream->m_ranged = true;
+                stream->m_nextStart = source.m_end;
+
+                EnterCriticalSection (& stream->m_lock);
+                stream->m_head = head;
+                stream->m_headLength = size;
+                stream->m_total = total;
+                stream->m_headReady = true;
+                LeaveCriticalSection (& stream->m_lock);
+
+                l_signal (stream);
+        } else {
+                /*
+                 * Pass the response through to the client as it is. If it has
+                 * no length it ends when the server closes the connection, or
+                 * it has no body at all.
+                 */
+
+                char          * head = (char *) g_poolAlloc (headLength);
+                if (head == 0)
+                        return false;
+
+                memcpy (head, source.m_head, headLength);
+
+                if (status < 200 || status == 204 || status == 304)
+                        length = 0;
+
+                stream->m_ranged = false;
+                stream->m_nextStart = length;
+                last = length - 1;
+                source.m_start = 0;
+                source.m_end = length;
+
+                EnterCriticalSection (& stream->m_lock);
+                stream->m_head = head;
+                stream->m_headLength = headLength;
+                stream->m_total = length;
+                stream->m_headReady = true;
+                LeaveCriticalSection (& stream->m_lock);
+
+                l_signal (stream);
+        }
+
+        /*
+         * The server may have sent less than we asked for; if so, the rest
+         * goes back to be asked for again.
+         */
+
+        if (stream->m_ranged && last + 1 < source.m_end) {
+                if (! l_retry (stream, last + 1, source.m_end))
+                        return false;
+
+                source.m_end = last + 1;
+        }
+
+        if (stream->m_ranged && length != source.m_end - source.m_start)
+                return false;
+
+        /*
+         * Keep whatever of the body came along with the header.
+         */
+
+        unsigned long   extra = source.m_headLength - headLength;
+        if (extra > source.m_end - source.m_pos)
+                return false;
+
+        source.m_state = SOURCE_BODY;
+        l_store (stream, source, end, extra);
+
+        if (source.m_pos == source.m_end)
+                l_finished (stream, source);
+
+        return true;
+}
+
+/**
+ * How much of the window a server can write into next.
+ */
+
+static unsigned long l_space (Stream * stream, Source & source) {
+        unsigned long   limit = stream->m_consumed + SEGMENT_WINDOW;
+        return source.m_pos < limit ? limit - source.m_pos : 0;
+}
+
+/**
+ * Deal with a server's connection becoming readable.
+ */
+
+static void l_receive (Stream * stream, Source & source) {
+        source.m_last = GetTickCount ();
+
+        if (source.m_state == SOURCE_HEAD) {
+                unsigned long   space = SEGMENT_HEADER_MAX - source.m_headLength;
+                int             result;
+                result = (* g_net.m_recv) (source.m_socket,
+                                           source.m_head + source.m_headLength,
+                                           space, 0);
+                if (result == SOCKET_ERROR && GetLastError () == WSAEWOULDBLOCK)
+                        return;
+
+                /*
+                 * A server closing a connection we kept open from the last part
+                 * is normal enough, so just connect again.
+                 */
+
+                if (result <= 0) {
+                        l_fail (stream, source,
+                                ! source.m_reused || source.m_headLength > 0);
+                        return;
+                }
+
+                source.m_headLength += result;
+
+                const char    * end;
+                end = g_headerEnd (source.m_head, source.m_headLength);
+                if (end == 0) {
+                        if (source.m_headLength == SEGMENT_HEADER_MAX)
+                                l_fail (stream, source);
+
+                        return;
+                }
+
+                /*
+                 * A server that answers a range request with something else is
+                 * never going to be any use to us.
+                 */
+
+                if (! l_response (stream, source, end)) {
+                        source.m_failures = SEGMENT_FAILURES_MAX;
+                        l_fail (stream, source);
+                }
+
+                l_advance (stream);
+                return;
+        }
+
+        unsigned long   offset = source.m_pos % SEGMENT_WINDOW;
+        unsigned long   space = SEGMENT_WINDOW - offset;
+        if (space > source.m_end - source.m_pos)
+                space = source.m_end - source.m_pos;
+        if (space > l_space (stream, source))
+                space = l_space (stream, source);
+
+        int             result;
+        result = (* g_net.m_recv) (source.m_socket,
+                                   (char *) stream->m_ring + offset,
+                                   space, 0);
+        if (result == SOCKET_ERROR && GetLastError () == WSAEWOULDBLOCK)
+                return;
+
+        /*
+         * A response with no length ends when the connection closes.
+         */
+
+        if (result == 0 && stream->m_total == SEGMENT_UNKNOWN) {
+                stream->m_nextStart = source.m_pos;
+                source.m_end = source.m_pos;
+
+                EnterCriticalSection (& stream->m_lock);
+                stream->m_total = source.m_pos;
+                LeaveCriticalSection (& stream->m_lock);
+
+                l_finished (stream, source);
+                l_advance (stream);
+                l_signal (stream);
+                return;
+        }
+
+        if (result <= 0) {
+                l_fail (stream, source);
+                return;
+        }
+
+        source.m_pos += result;
+        if (source.m_pos == source.m_end)
+                l_finished (stream, source);
+
+        l_advance (stream);
+}
+
+/**
+ * Check whether a download is over, one way or the other.
+ */
+
+static bool l_over (Stream * stream) {
+        EnterCriticalSection (& stream->m_lock);
+        bool            over = stream->m_error != 0 ||
+                               (stream->m_headReady &&
+                                stream->m_frontier == stream->m_total);
+        LeaveCriticalSection (& stream->m_lock);
+
+        return over;
+}
+
+/**
+ * The body of the worker thread.
+ */
+
+static void l_run (Stream * stream) {
+        while (stream->m_cancel == 0) {
+                l_assign (stream);
+                if (l_over (stream))
+                        break;
+
+                fd_set          read;
+                fd_set          write;
+                fd_set          error;
+                FD_ZERO (& read);
+                FD_ZERO (& write);
+                FD_ZERO (& error);
+
+                unsigned long   now = GetTickCount ();
+                unsigned long   i;
+                for (i = 0 ; i < stream->m_sourceCount ; ++ i) {
+                        Source        & source = stream->m_sources [i];
+                        if (source.m_state != SOURCE_IDLE &&
+                            source.m_state != SOURCE_DISABLED &&
+                            now - source.m_last > SEGMENT_STALL &&
+                            (source.m_state != SOURCE_BODY ||
+                             l_space (stream, source) > 0))
+                                l_fail (stream, source);
+
+                        switch (source.m_state) {
+                        case SOURCE_CONNECTING:
+                                FD_SET (source.m_socket, & write);
+                                FD_SET (source.m_socket, & error);
+                                break;
+
+                        case SOURCE_HEAD:
+                                FD_SET (source.m_socket, & read);
+                                break;
+
+                        case SOURCE_BODY:
+                                if (l_space (stream, source) > 0) {
+                                        FD_SET (source.m_socket, & read);
+                                } else
+                                        source.m_last = now;
+                                break;
+
+                        default:
+                                break;
+                        }
+                }
+
+                if (read.fd_count == 0 && write.fd_count == 0) {
+                        WaitForSingleObject (stream->m_wake, SEGMENT_POLL);
+                        continue;
+                }
+
+                timeval         wait = { 0, SEGMENT_POLL * 1000 };
+                int             result;
+                result = (* g_net.m_select) (0, & read, & write, & error,
+                                             & wait);
+                if (result == SOCKET_ERROR) {
+                        l_abort (stream, WSAECONNRESET);
+                        break;
+                }
+
+                for (i = 0 ; i < stream->m_sourceCount && result > 0 ; ++ i) {
+                        Source        & source = stream->m_sources [i];
+                        if (source.m_socket == INVALID_SOCKET)
+                                continue;
+
+                        if (source.m_state == SOURCE_CONNECTING) {
+                                if (g_netIsSet (source.m_socket, error)) {
+                                        l_fail (stream, source);
+                                } else if (g_netIsSet (source.m_socket, write)) {
+                                        source.m_state = SOURCE_HEAD;
+                                        if (! g_netConnected (source.m_socket) ||
+                                            ! l_sendRange (stream, source))
+                                                l_fail (stream, source);
+                                }
+                        } else if (g_netIsSet (source.m_socket, read))
+                                l_receive (stream, source);
+                }
+        }
+
+        unsigned long   i;
+        for (i = 0 ; i < stream->m_sourceCount ; ++ i) {
+                Source        & source = stream->m_sources [i];
+                if (source.m_socket != INVALID_SOCKET)
+                        (* g_net.m_closesocket) (source.m_socket);
+        }
+
+        if (! l_over (stream))
+                l_abort (stream, WSAECONNRESET);
+}
+
+/**
+ * Thread entry point for the worker.
+ */
+
+static unsigned long __stdcall l_worker (void * param) {
+        Stream        * stream = (Stream *) param;
+        l_run (stream);
+        l_release (stream);
+        return 0;
+}
+
+/**
+ * Work out the address of one of a rule's targets for a connection.
+ *
+ * Zero addresses or ports in the rule's targets mean the connection's original
+ * address or port is kept.
+ */
+
+static void l_target (sockaddr_in & addr, const sockaddr_in & original,
+                      const RuleTargets & targets, unsigned long index) {
+        addr = original;
+        if (targets.m_addr [index] != 0)
+                addr.sin_addr.S_un.S_addr = targets.m_addr [index];
+        if (targets.m_port [index] != 0)
+                addr.sin_port = targets.m_port [index];
+}
+
+/**
+ * Remember the servers a connection could have gone to.
+ *
+ * Servers the health checker thinks are down are left out, unless that would
+ * leave nothing.
+ */
+
+void g_addRedirect (SOCKET handle, const sockaddr_in & original,
+                    const RuleTargets & targets) {
+        Redirect      * item = l_redirects.find (handle);
+        if (item == 0) {
+                item = new Redirect (handle);
+                if (item == 0)
+                        return;
+
+                l_redirects.add (* item);
+        }
+
+        unsigned long   count = 0;
+        unsigned long   i;
+        for (i = 0 ; i < targets.m_count ; ++ i) {
+                sockaddr_in   & addr = item->m_targets [count];
+                l_target (addr, original, targets, i);
+
+                if (! g_healthDown (addr.sin_addr.S_un.S_addr, addr.sin_port))
+                        ++ count;
+        }
+
+        if (count == 0) {
+                for (i = 0 ; i < targets.m_count ; ++ i)
+                        l_target (item->m_targets [i], original, targets, i);
+
+                count = targets.m_count;
+        }
+
+        item->m_count = count;
+}
+
+/**
+ * Begin a segmented download of the request being sent on a socket.
+ *
+ * This only applies where the connection was redirected by a rule with more
+ * than one target. If it does, the caller doesn't send the request on and the
+ * response will be delivered by the receive hooks.
+ */
+
+bool g_segmentStart (SOCKET handle, const char * request, unsigned long length,
+                     unsigned long size) {
+        Redirect      * redirect = l_redirects.find (handle);
+        if (redirect == 0 || redirect->m_count < 2 ||
+            g_findSegmented (handle) != 0)
+                return false;
+
+        const char    * end = g_headerEnd (request, length);
+        if (end == 0 || end - request > SEGMENT_HEADER_MAX)
+                return false;
+
+        const char    * line;
+        line = (const char *) memchr (request, '\n', end - request);
+
+        Stream        * stream = (Stream *) g_poolAlloc (sizeof (Stream));
+        if (stream == 0)
+                return false;
+
+        memset (stream, 0, sizeof (Stream));
+        InitializeCriticalSection (& stream->m_lock);
+        stream->m_refs = 1;
+        stream->m_client = handle;
+        stream->m_total = SEGMENT_UNKNOWN;
+
+        memcpy (stream->m_request, request, end - request);
+        stream->m_requestLength = end - request;
+        stream->m_lineLength = line + 1 - request;
+
+        if (size < SEGMENT_SIZE_MIN)
+                size = SEGMENT_SIZE_MIN;
+        if (size > SEGMENT_WINDOW / 2)
+                size = SEGMENT_WINDOW / 2;
+        stream->m_size = size;
+
+        unsigned long   i;
+        for (i = 0 ; i < redirect->m_count ; ++ i) {
+                Source        & source = stream->m_sources [i];
+                source.m_addr = redirect->m_targets [i];
+                source.m_socket = INVALID_SOCKET;
+        }
+
+        stream->m_sourceCount = redirect->m_count;
+
+        EnterCriticalSection (& l_streams.m_lock);
+        stream->m_next = l_streams.m_head;
+        if (l_streams.m_head != 0)
+                l_streams.m_head->m_prev = stream;
+        l_streams.m_head = stream;
+        LeaveCriticalSection (& l_streams.m_lock);
+
+        stream->m_ready = CreateEventW (0, TRUE, FALSE, 0);
+        stream->m_wake = CreateEventW (0, FALSE, FALSE, 0);
+        stream->m_ring = (unsigned char *) VirtualAlloc (0, SEGMENT_WINDOW,
+                                                         MEM_COMMIT,
+                                                         PAGE_READWRITE);
+
+        Segmented     * item = 0;
+        if (stream->m_ready != 0 && stream->m_wake != 0 &&
+            stream->m_ring != 0)
+                item = new Segmented (handle);
+
+        if (item == 0) {
+                l_release (stream);
+                return false;
+        }
+
+        item->m_stream = stream;
+
+        InterlockedIncrement (& stream->m_refs);
+        unsigned long   id;
+        stream->m_thread = CreateThread (0, 0, l_worker, stream, 0, & id);
+        if (stream->m_thread == 0) {
+                l_release (stream);
+                delete item;
+                return false;
+        }
+
+        l_segments.add (* item);
+        return true;
+}
+
+/**
+ * Find the segmented download being fed to a socket, if any.
+ */
+
+Segmented * g_findSegmented (SOCKET handle) {
+        if (! g_anySegmented ())
+                return 0;
+
+        return l_segments.find (handle);
+}
+
+/**
+ * Check whether a read on a socket being fed a download would return at once,
+ * for emulating select () and the like.
+ */
+
+bool g_segmentReady (Segmented * item) {
+        Stream        * stream = item->m_stream;
+
+        EnterCriticalSection (& stream->m_lock);
+        bool            ready = stream->m_error != 0 ||
+                                (stream->m_headReady &&
+                                 (stream->m_headSent < stream->m_headLength ||
+                                  stream->m_consumed < stream->m_frontier ||
+                                  stream->m_consumed == stream->m_total));
+        LeaveCriticalSection (& stream->m_lock);
+
+        return ready;
+}
+
+/**
+ * Read from a segmented download on behalf of the client.
+ *
+ * If nothing has arrived yet, this either blocks or says so depending on
+ * whether the client has set the socket up for event notification (which
+ * makes it non-blocking); overlapped reads are simply completed synchronously
+ * once there's something to give them. Once the client has read everything,
+ * the socket reverts to normal.
+ *
+ * The result is a Winsock error code, or ERROR_SUCCESS.
+ */
+
+unsigned long g_segmentRead (Segmented * item, char * buf,
+                             unsigned long length, bool overlapped,
+                             unsigned long * copied) {
+        Stream        * stream = item->m_stream;
+        SOCKET          handle = item->handle ();
+        bool            block = overlapped || g_findEventHandle (handle) == 0;
+
+        InterlockedIncrement (& stream->m_refs);
+
+        unsigned long   count = 0;
+        unsigned long   error = ERROR_SUCCESS;
+        bool            done = false;
+
+        for (;;) {
+                EnterCriticalSection (& stream->m_lock);
+
+                if (stream->m_headReady) {
+                        unsigned long   part;
+                        part = stream->m_headLength - stream->m_headSent;
+                        if (part > length)
+                                part = length;
+
+                        memcpy (buf, stream->m_head + stream->m_headSent, part);
+                        stream->m_headSent += part;
+                        count = part;
+
+                        while (count < length &&
+                               stream->m_consumed < stream->m_frontier) {
+                                unsigned long   offset;
+                                offset = stream->m_consumed % SEGMENT_WINDOW;
+                                part = SEGMENT_WINDOW - offset;
+                                if (part > stream->m_frontier - stream->m_consumed)
+                                        part = stream->m_frontier - stream->m_consumed;
+                                if (part > length - count)
+                                        part = length - count;
+
+                                memcpy (buf + count, stream->m_ring + offset,
+                                        part);
+                                stream->m_consumed += part;
+                                count += part;
+                        }
+
+                        done = stream->m_headSent == stream->m_headLength &&
+                               stream->m_consumed == stream->m_total;
+                }
+
+                if (count == 0 && ! done) {
+                        error = stream->m_error;
+                        ResetEvent (stream->m_ready);
+                }
+
+                LeaveCriticalSection (& stream->m_lock);
+
+                if (count > 0 || done || error != 0)
+                        break;
+
+                if (! block) {
+                        error = WSAEWOULDBLOCK;
+                        break;
+                }
+
+                WaitForSingleObject (stream->m_ready, INFINITE);
+        }
+
+        if (count > 0)
+                SetEvent (stream->m_wake);
+
+        l_release (stream);
+
+        if (done)
+                l_segments.remove (handle);
+
+        * copied = count;
+        return error;
+}
+
+/**
+ * When a socket handle is being closed, drop any download going to it.
+ */
+
+void g_removeSegmented (SOCKET handle) {
+        l_redirects.remove (handle);
+
+        if (g_anySegmented ())
+                l_segments.remove (handle);
+}
+
+/**
+ * Stop all the downloads and wait for the workers to finish.
+ */
+
+void g_segmentUnload (void) {
+        l_segments.free ();
+        l_redirects.free ();
+
+        HANDLE          threads [MAXIMUM_WAIT_OBJECTS];
+        unsigned long   count = 0;
+
+        EnterCriticalSection (& l_streams.m_lock);
+
+        Stream        * scan;
+        for (scan = l_streams.m_head ; scan != 0 ; scan = scan->m_next) {
+                l_cancel (scan);
+                if (count == MAXIMUM_WAIT_OBJECTS || scan->m_thread == 0)
+                        continue;
+
+                if (DuplicateHandle (GetCurrentProcess (), scan->m_thread,
+                                     GetCurrentProcess (), threads + count,
+                                     SYNCHRONIZE, FALSE, 0))
+                        ++ count;
+        }
+
+        LeaveCriticalSection (& l_streams.m_lock);
+
+        if (count > 0)
+                WaitForMultipleObjects (count, threads, TRUE, 5000);
+
+        while (count > 0)
+                CloseHandle (threads [-- count]);
+}
+
+/**@}*/
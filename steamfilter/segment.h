@@ -0,0 +1,96 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H               1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the functions for splitting a download across several servers
+ * using Range requests.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Where a rule rewrites a connection to one of several equivalent servers,
+ * a large download on that connection can be fetched faster by asking each of
+ * the servers for a different part of it at the same time using HTTP Range
+ * requests, and then stitching the parts back together in order to present
+ * the client with what looks like the single ordinary response it asked for.
+ *
+ * This is what the "=%" URL rules do; an optional number after the % is the
+ * size of the parts to request, in kilobytes.
+ */
+
+#include <winsock2.h>
+
+struct RuleTargets;
+struct Segmented;
+
+/**
+ * Default size of the ranges a download is split into, in kilobytes.
+ */
+
+#define SEGMENT_DEFAULT_SIZE    256
+
+/**
+ * Size of the reassembly buffer for a download.
+ *
+ * Parts are only requested if they fit within this distance of what the client
+ * has read so far, so a slow client or one slow server bounds how far ahead
+ * the other servers can get rather than how much memory gets used.
+ */
+
+#define SEGMENT_WINDOW          (4 * 1024 * 1024)
+
+/**
+ * Count of sockets currently being fed a segmented download, which the
+ * receive hooks check in the same way as for replacements.
+ */
+
+extern  volatile LONG   g_segmentPending;
+
+inline  bool            g_anySegmented (void) {
+        return g_segmentPending != 0;
+}
+
+void            g_addRedirect (SOCKET handle, const sockaddr_in & original,
+                               const RuleTargets & targets);
+bool            g_segmentStart (SOCKET handle, const char * request,
+                                unsigned long length, unsigned long size);
+
+Segmented     * g_findSegmented (SOCKET handle);
+bool            g_segmentReady (Segmented * item);
+unsigned long   g_segmentRead (Segmented * item, char * buf,
+                               unsigned long length, bool overlapped,
+                               unsigned long * copied);
+
+void            g_removeSegmented (SOCKET handle);
+void            g_segmentUnload (void);
+
+/**@}*/
+#endif  /* ! defined (SEGMENT_H) */
@@ -0,0 +1,80 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the base structure for tracking per-socket state.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "socktrack.h"
+#include "pool.h"
+
+/**
+ * Regular replacement new, non-throwing.
+ *
+ * Tracking records come and go with every connection Steam makes, so these
+ * are served from the slab pool rather than the process heap.
+ */
+
+/* static */
+void * SocketTrack :: operator new (size_t length) throw () {
+        return g_poolAlloc (length);
+}
+
+/**
+ * Non-throwing placement new, generally used with manual calls to the plain
+ * operator function to allocate variable-sized memory blocks.
+ */
+
+/* static */
+void * SocketTrack :: operator new (size_t length, void * mem) throw () {
+        return mem;
+}
+
+/**
+ * Trivial deallocator to match the replacement new.
+ */
+
+/* static */
+void SocketTrack :: operator delete (void * mem) throw () {
+        g_poolFree (mem);
+}
+
+/**
+ * Trivial constructor.
+ */
+
+SocketTrack :: SocketTrack (SOCKET handle) : m_next (0), m_prev (0),
+                m_handle (handle), m_event (0) {
+}
+
+/**@}*/
@@ -0,0 +1,257 @@
+#ifndef SOCKTRACK_H
+#define SOCKTRACK_H             1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the base structure for tracking per-socket state in the hooks,
+ * and a simple list of such records keyed by socket handle.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <winsock2.h>
+
+/**
+ * Base object for implementing socket state tracking.
+ *
+ * This is set up for binding sockets and event handles so that applications
+ * get notified when a socket becomes readable, since the lack of true AIO in
+ * classic sockets requires separate eventing mechanisms (from the simple to
+ * the absurd as in epoll (), which is essentially socket-specific as well as
+ * baroque and hard to use compared to a universal AIO model).
+ */
+
+class SocketTrack {
+        /*
+         * Friend-ing an entire template is not something you see often, but
+         * it's been a part of the language for a while.
+         */
+
+        template <class T>
+        friend class SocketList;
+
+private:
+        SocketTrack   * m_next;
+        SocketTrack   * m_prev;
+        SOCKET          m_handle;
+
+public:
+        WSAEVENT        m_event;
+
+private:
+        /* NOCOPY */    SocketTrack (const SocketTrack &);
+        void            operator = (const SocketTrack &);
+
+public:
+                        SocketTrack (SOCKET handle);
+
+        SOCKET          handle (void) const { return m_handle; }
+
+static  void          * operator new (size_t length) throw ();
+static  void          * operator new (size_t length, void * mem) throw ();
+static  void            operator delete (void * mem) throw ();
+};
+
+/**
+ * Simple list-holder.
+ *
+ * Intrusive lists have been a part of C++ forever, since they were the common
+ * thing done in C for many years before. However, in early C++ what was done
+ * in most programs was to convert a common node structure and extend it using
+ * virtual functions.
+ *
+ * Although this could be done to be typesafe, it had problems not the least of
+ * which was typesafety required constantly injecting new virtual functions
+ * into the base classes or the moral equivalent (e.g. COM-style QueryInterface
+ * which was elegant but not being integrated into the language, lots of work).
+ *
+ * Templates in the 1990 ARM promised to help with this by introducing some
+ * parametric genericity, but being mostly a system pf complex hygenic macro-
+ * expanders the quality of implementation was low and remained low for well
+ * into the 2000s and even then tended to cause code explosion. Finally, around
+ * the late 2000's quality implementations of templates style could really
+ * rival the old pre-1990s one in total efficiency thanks to function-level
+ * linking and deduplication (although that's not entirely free either, as it
+ * can make for a disorienting debug experience).
+ */
+
+template <class T>
+struct SocketList {
+typedef CRITICAL_SECTION      Mutex;
+
+        Mutex           m_lock [1];
+        T             * m_head;
+
+                        SocketList ();
+                      ~ SocketList ();
+
+        void            free (void);
+
+        void            add (T & item);
+        T             * find (SOCKET handle);
+        void            remove (T * item, bool free = false);
+        void            remove (SOCKET handle);
+};
+
+/**
+ * Initialize an empty list.
+ */
+
+template <class T>
+SocketList<T> :: SocketList () : m_head (0) {
+        InitializeCriticalSection (m_lock);
+}
+
+/**
+ * Deinitialize the list and locking structure.
+ */
+
+template <class T>
+SocketList<T> :: ~ SocketList () {
+        free ();
+
+        DeleteCriticalSection (m_lock);
+}
+
+/**
+ * Free all the list members, deallocating them.
+ */
+
+template <class T>
+void SocketList<T> :: free (void) {
+        EnterCriticalSection (m_lock);
+
+        while (m_head != 0)
+                remove (m_head, true);
+
+        LeaveCriticalSection (m_lock);
+}
+
+/**
+ * Add a new item.
+ */
+
+template <class T>
+void SocketList<T> :: add (T & item) {
+        EnterCriticalSection (m_lock);
+
+        item.m_next = m_head;
+        item.m_prev = 0;
+        if (m_head != 0)
+                m_head->m_prev = & item;
+        m_head = & item;
+
+        LeaveCriticalSection (m_lock);
+}
+
+/**
+ * Find an item.
+ *
+ * In a more general template, this would be a member template so that the
+ * key type and comparison function could be parameterized, but this is just
+ * a simplified example of the general style so I haven't bothered.
+ *
+ * The key reason this is here is to show a clean example of something memory-
+ * light, which nothing in the modern STL can really claim to be (even for the
+ * few good parts of classic STL, the retrofitting of exceptions into the STL
+ * containers meant it's usually easier to ditch them in memory-constrained or
+ * code-size-limited environments).
+ */
+
+template <class T>
+T * SocketList<T> :: find (SOCKET handle) {
+        EnterCriticalSection (m_lock);
+
+        T             * scan = m_head;
+        while (scan != 0) {
+                if (scan->m_handle == handle)
+                        break;
+
+                scan = (T *) scan->m_next;
+        }
+
+        LeaveCriticalSection (m_lock);
+        return scan;
+}
+
+/**
+ * Remove an item from the list, optionally freeing it.
+ */
+
+template <class T>
+void SocketList<T> :: remove (T * item, bool free) {
+        EnterCriticalSection (m_lock);
+
+        T             * prev = (T *) item->m_prev;
+        T             * next = (T *) item->m_next;
+        if (prev == 0) {
+                m_head = next;
+        } else
+                prev->m_next = next;
+        if (next != 0)
+                next->m_prev = prev;
+
+        LeaveCriticalSection (m_lock);
+
+        if (free)
+                delete item;
+}
+
+/**
+ * Remove and free an item based on a key.
+ */
+
+template <class T>
+void SocketList<T> :: remove (SOCKET handle) {
+        EnterCriticalSection (m_lock);
+
+        T            ** link = & m_head;
+        T             * scan = m_head;
+        T             * prev = 0;
+        while ((scan = * link) != 0) {
+                if (scan->m_handle == handle) {
+                        T             * next = (T *) scan->m_next;
+                        * link = next;
+                        if (next != 0)
+                                next->m_prev = prev;
+                        break;
+                }
+
+                prev = scan;
+                link = (T **) & scan->m_next;
+        }
+
+        LeaveCriticalSection (m_lock);
+
+        if (scan != 0)
+                delete scan;
+}
+
+/**@}*/
+#endif  /* ! defined (SOCKTRACK_H) */
@@ -0,0 +1,141 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the statistics the filter shares with the monitor.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+
+#include "stats.h"
+#include "meter.h"
+#include "ticker.h"
+
+/**
+ * The shared block, and the mapping it's a view of.
+ */
+
+volatile FilterStats  * g_stats;
+static  HANDLE          l_mapping;
+
+/**
+ * Copy the meter figures into the shared block, from the background thread.
+ *
+ * The background thread is the only writer of anything under the sequence
+ * lock, so it needs nothing more than the increments either side.
+ */
+
+static void l_statsTick (unsigned long now) {
+        volatile FilterStats  * stats = g_stats;
+        if (stats == 0)
+                return;
+
+        MeterStats      meter;
+        g_meter.stats (meter);
+
+        ++ stats->m_sequence;
+        FILTER_STATS_BARRIER ();
+
+        stats->m_meter.m_total = meter.m_total;
+        stats->m_meter.m_rate1 = meter.m_rate1;
+        stats->m_meter.m_rate10 = meter.m_rate10;
+        stats->m_meter.m_rate60 = meter.m_rate60;
+        stats->m_meter.m_updated = now;
+
+        FILTER_STATS_BARRIER ();
+        ++ stats->m_sequence;
+}
+
+/**
+ * Create the shared block, named for the process we're loaded into.
+ *
+ * If a block of that name already exists, such as from an earlier load of the
+ * filter into the same process, it's simply reused; the counters carry on and
+ * the header is rewritten in case the layout version has changed.
+ */
+
+bool g_statsInit (void) {
+        if (g_stats != 0)
+                return true;
+
+        char            name [80];
+        wsprintfA (name, FILTER_STATS_NAME, GetCurrentProcessId ());
+
+        l_mapping = CreateFileMappingA (INVALID_HANDLE_VALUE, 0, PAGE_READWRITE,
+                                        0, sizeof (FilterStats), name);
+        if (l_mapping == 0)
+                return false;
+
+        void          * view = MapViewOfFile (l_mapping, FILE_MAP_WRITE, 0, 0,
+                                              sizeof (FilterStats));
+        if (view == 0) {
+                CloseHandle (l_mapping);
+                l_mapping = 0;
+                return false;
+        }
+
+        /*
+         * Were the previous filter to have stopped part way through an update,
+         * readers would never see the figures as settled.
+         */
+
+        volatile FilterStats  * stats = (volatile FilterStats *) view;
+        if ((stats->m_sequence & 1) != 0)
+                ++ stats->m_sequence;
+
+        stats->m_version = FILTER_STATS_VERSION;
+        stats->m_size = sizeof (FilterStats);
+        stats->m_rules = FILTER_STATS_RULES;
+        FILTER_STATS_BARRIER ();
+        stats->m_magic = FILTER_STATS_MAGIC;
+
+        g_stats = stats;
+        g_tickerAdd (l_statsTick, METER_INTERVAL);
+        return true;
+}
+
+/**
+ * Release the shared block; the hooks must already have been removed, and the
+ * background thread stopped.
+ */
+
+void g_statsUnload (void) {
+        volatile FilterStats  * stats = g_stats;
+        g_stats = 0;
+
+        if (stats != 0)
+                UnmapViewOfFile ((void *) stats);
+        if (l_mapping != 0)
+                CloseHandle (l_mapping);
+
+        l_mapping = 0;
+}
+
+/**@}*/
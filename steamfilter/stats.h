@@ -0,0 +1,77 @@
+#ifndef STATS_H
+#define STATS_H                 1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the statistics the filter shares with the monitor.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The filter's side of the statistics shared with the monitor; the layout of
+ * the shared block itself is in filterstats.h, since the readers need it too.
+ *
+ * If the shared memory can't be created, everything here quietly does nothing,
+ * so the counting points don't need to check for themselves.
+ */
+
+#include <windows.h>
+
+#include "../filterstats.h"
+
+/**
+ * The shared block, once created.
+ */
+
+extern  volatile FilterStats  * g_stats;
+
+bool            g_statsInit (void);
+void            g_statsUnload (void);
+
+/**
+ * Count an event.
+ */
+
+inline  void            g_statsCount (FilterStatsCounter counter) {
+        if (g_stats != 0)
+                InterlockedIncrement ((volatile LONG *) & g_stats->m_counters [counter]);
+}
+
+/**
+ * Count a hit on a rule, given its position in the rule set.
+ */
+
+inline  void            g_statsRule (unsigned long index) {
+        if (g_stats != 0 && index < FILTER_STATS_RULES)
+                InterlockedIncrement ((volatile LONG *) & g_stats->m_ruleHits [index]);
+}
+
+/**@}*/
+#endif  /* ! defined (STATS_H) */
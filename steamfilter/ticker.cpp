@@ -0,0 +1,161 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements a shared background thread for periodic housekeeping.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+
+#include "ticker.h"
+
+/**
+ * A registered callback.
+ */
+
+struct TickTask {
+        TickFunc        m_func;
+        unsigned long   m_interval;
+        unsigned long   m_last;
+};
+
+/**
+ * The registered callbacks.
+ *
+ * These are only added to, and the count is only bumped once an entry has
+ * been filled in, so the thread can walk the table without a lock.
+ */
+
+static  TickTask        l_tasks [TICKER_TASKS_MAX];
+static  volatile LONG   l_taskCount;
+
+/**
+ * The thread, and the event used to ask it to stop.
+ */
+
+static  HANDLE          l_thread;
+static  HANDLE          l_stop;
+
+/**
+ * Lock for adding tasks and starting the thread.
+ */
+
+static  CRITICAL_SECTION l_tickerLock;
+static  volatile LONG   l_lockInit;
+
+/**
+ * The body of the background thread.
+ */
+
+static unsigned long __stdcall l_ticker (void *) {
+        while (WaitForSingleObject (l_stop, TICKER_RESOLUTION) == WAIT_TIMEOUT) {
+                unsigned long   now = GetTickCount ();
+
+                LONG            count = l_taskCount;
+                LONG            i;
+                for (i = 0 ; i < count ; ++ i) {
+                        TickTask      & task = l_tasks [i];
+                        if (now - task.m_last < task.m_interval)
+                                continue;
+
+                        task.m_last = now;
+                        (* task.m_func) (now);
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * Register a callback to be made every so often, starting the thread the first
+ * time through.
+ */
+
+bool g_tickerAdd (TickFunc func, unsigned long interval) {
+        if (InterlockedExchange (& l_lockInit, 1) == 0)
+                InitializeCriticalSection (& l_tickerLock);
+
+        EnterCriticalSection (& l_tickerLock);
+
+        bool            added = false;
+        if (l_taskCount < TICKER_TASKS_MAX) {
+                if (l_stop == 0)
+                        l_stop = CreateEventW (0, TRUE, FALSE, 0);
+
+                if (l_stop != 0 && l_thread == 0) {
+                        unsigned long   id;
+                        l_thread = CreateThread (0, 0, l_ticker, 0, 0, & id);
+                }
+
+                if (l_thread != 0) {
+                        TickTask      & task = l_tasks [l_taskCount];
+                        task.m_func = func;
+                        task.m_interval = interval;
+                        task.m_last = GetTickCount ();
+
+                        InterlockedIncrement (& l_taskCount);
+                        added = true;
+                }
+        }
+
+        LeaveCriticalSection (& l_tickerLock);
+        return added;
+}
+
+/**
+ * Stop the thread, and forget the callbacks.
+ *
+ * This has to happen before anything the callbacks use is torn down.
+ */
+
+void g_tickerUnload (void) {
+        if (l_lockInit == 0)
+                return;
+
+        EnterCriticalSection (& l_tickerLock);
+
+        if (l_thread != 0) {
+                SetEvent (l_stop);
+                WaitForSingleObject (l_thread, 5000);
+                CloseHandle (l_thread);
+                l_thread = 0;
+        }
+
+        if (l_stop != 0) {
+                CloseHandle (l_stop);
+                l_stop = 0;
+        }
+
+        l_taskCount = 0;
+
+        LeaveCriticalSection (& l_tickerLock);
+}
+
+/**@}*/
@@ -0,0 +1,66 @@
+#ifndef TICKER_H
+#define TICKER_H                1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares a shared background thread for periodic housekeeping.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Some parts of the filter need to do things in the background periodically,
+ * such as checking on the health of the servers that rules redirect to. Rather
+ * than each of them having a thread of its own, they share one, which calls
+ * each of them back at the interval they ask for.
+ *
+ * The callbacks shouldn't block for any length of time, since they hold up
+ * all the others; anything involving the network should be done as a series
+ * of non-blocking steps, one per call.
+ */
+
+typedef void         (* TickFunc) (unsigned long now);
+
+/**
+ * Most callbacks that can be registered.
+ */
+
+#define TICKER_TASKS_MAX        16
+
+/**
+ * Granularity of the intervals, in milliseconds.
+ */
+
+#define TICKER_RESOLUTION       50
+
+bool            g_tickerAdd (TickFunc func, unsigned long interval);
+void            g_tickerUnload (void);
+
+/**@}*/
+#endif  /* ! defined (TICKER_H) */
@@ -0,0 +1,354 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the trace buffers used by the hooks to describe what they're
+ * doing, without paying for formatting or a kernel transition on the way.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <windows.h>
+
+#include "trace.h"
+#include "perthread.h"
+#include "ticker.h"
+
+/**
+ * Cliche for measuring array lengths, to avoid mistakes with sizeof ().
+ */
+
+#define ARRAY_LENGTH(x) (sizeof (x) / sizeof (* (x)))
+
+/**
+ * Simple equivalent to ntohs, as elsewhere.
+ */
+
+#define ntohs(x)        ((unsigned char) ((x) >> 8) + \
+                         ((unsigned char) (x) << 8))
+
+/**
+ * Each thread's ring of trace records.
+ *
+ * The head is only ever written by the thread owning the ring, and the tail
+ * only by the background thread draining it, so neither needs a lock; each of
+ * them publishes its index with an interlocked exchange so that the other
+ * sees the records themselves first. The two indexes are kept on different
+ * cache lines so the writer and reader aren't contending for the same one.
+ *
+ * The count of dropped records is also only written by the owner, and the
+ * background thread keeps its own note of how many of them it has reported.
+ */
+
+struct TraceRing {
+        volatile LONG   m_head;
+        unsigned long   m_dropped;
+        char            m_pad1 [56];
+
+        volatile LONG   m_tail;
+        unsigned long   m_reported;
+        char            m_pad2 [56];
+
+        TraceRecord     m_records [TRACE_RING_SIZE];
+};
+
+/**
+ * The current level of tracing.
+ */
+
+volatile LONG           g_traceLevel = TRACE_DEFAULT;
+
+/**
+ * Messages for the events which carry nothing else worth showing, indexed by
+ * the low part of the event code.
+ */
+
+static  const char    * l_messages [] = {
+        "passthrough", 0, 0, 0, 0, 0, 0,
+        "Rejected host",
+        "Replaced host",
+        "Rejected host+url",
+        "Rejected URL",
+        "Failed to replace status",
+        "Serving cached response",
+        "Serving stored depot chunk",
+        "Segmenting download",
+        "Substituting HTTP response",
+        "Substituting HTTP request"
+};
+
+/**
+ * Return the calling thread's ring, creating it if need be.
+ *
+ * Rings are only made for threads which actually trace something, since most
+ * of the threads in the host process never enter the hooks.
+ */
+
+static TraceRing * l_ring (void) {
+        ThreadData    * data = g_threadData ();
+        if (data == 0)
+                return 0;
+
+        TraceRing     * ring = (TraceRing *) data->m_trace;
+        if (ring != 0)
+                return ring;
+
+        ring = (TraceRing *) HeapAlloc (GetProcessHeap (), HEAP_ZERO_MEMORY,
+                                        sizeof (TraceRing));
+        data->m_trace = ring;
+        return ring;
+}
+
+/**
+ * Write a record into the calling thread's ring.
+ *
+ * The text is copied up to the given length or the first NUL, whichever comes
+ * first, and cut short to fit the record.
+ */
+
+void g_traceWrite (TraceEvent event, const char * text, size_t length,
+                   unsigned long value, const sockaddr_in * from,
+                   const sockaddr_in * to, unsigned long rule) {
+        TraceRing     * ring = l_ring ();
+        if (ring == 0)
+                return;
+
+        unsigned long   head = ring->m_head;
+        if (head - ring->m_tail >= TRACE_RING_SIZE) {
+                ++ ring->m_dropped;
+                return;
+        }
+
+        TraceRecord   & record = ring->m_records [head & (TRACE_RING_SIZE - 1)];
+        record.m_time = GetTickCount ();
+        record.m_event = (unsigned short) event;
+        record.m_rule = (unsigned short) rule;
+        record.m_addr [0] = from != 0 ? from->sin_addr.S_un.S_addr : 0;
+        record.m_port [0] = from != 0 ? from->sin_port : 0;
+        record.m_addr [1] = to != 0 ? to->sin_addr.S_un.S_addr : 0;
+        record.m_port [1] = to != 0 ? to->sin_port : 0;
+        record.m_value = value;
+
+        size_t          count = 0;
+        if (text != 0) {
+                for (; count < length && count < TRACE_TEXT_MAX - 1 ; ++ count) {
+                        if (text [count] == 0)
+                                break;
+
+                        record.m_text [count] = text [count];
+                }
+        }
+
+        record.m_text [count] = 0;
+
+        InterlockedExchange (& ring->m_head, head + 1);
+}
+
+/**
+ * Trace some wide text, such as a name from the rule set, along with a value
+ * and an address.
+ *
+ * The text is narrowed crudely, since it's only for show.
+ */
+
+void g_traceWide (TraceEvent event, const wchar_t * text, unsigned long value,
+                  unsigned long addr) {
+        if (! g_tracing (event))
+                return;
+
+        char            narrow [TRACE_TEXT_MAX];
+        size_t          count = 0;
+        for (; count < TRACE_TEXT_MAX - 1 && text [count] != 0 ; ++ count)
+                narrow [count] = text [count] < 0x80 ? (char) text [count] : '?';
+
+        narrow [count] = 0;
+
+        sockaddr_in     temp;
+        temp.sin_family = AF_INET;
+        temp.sin_port = 0;
+        temp.sin_addr.S_un.S_addr = addr;
+        g_traceWrite (event, narrow, count, value, & temp, 0, 0);
+}
+
+/**
+ * Format a record for the benefit of DbgView.
+ */
+
+static void l_format (const TraceRecord & record, char * out) {
+        const unsigned char   * from = (const unsigned char *) record.m_addr;
+        const unsigned char   * to = (const unsigned char *) (record.m_addr + 1);
+        unsigned long   index = record.m_event & ((1 << TRACE_LEVEL_SHIFT) - 1);
+
+        switch (record.m_event) {
+        case TRACE_CONNECT_REFUSED:
+                wsprintfA (out, "Connect refused %d.%d.%d.%d:%d\r\n",
+                           from [0], from [1], from [2], from [3],
+                           ntohs (record.m_port [0]));
+                break;
+
+        case TRACE_CONNECT_REDIRECT:
+                wsprintfA (out, "Connect redirected %d.%d.%d.%d to "
+                           "%d.%d.%d.%d:%d by rule %d\r\n",
+                           from [0], from [1], from [2], from [3],
+                           to [0], to [1], to [2], to [3],
+                           ntohs (record.m_port [1]), record.m_rule);
+                break;
+
+        case TRACE_DATAGRAM_DROPPED:
+                wsprintfA (out, "Datagrams dropped to %d.%d.%d.%d:%d\r\n",
+                           from [0], from [1], from [2], from [3],
+                           ntohs (record.m_port [0]));
+                break;
+
+        case TRACE_DATAGRAM_REDIRECT:
+                wsprintfA (out, "Datagrams redirected %d.%d.%d.%d to "
+                           "%d.%d.%d.%d:%d by rule %d\r\n",
+                           from [0], from [1], from [2], from [3],
+                           to [0], to [1], to [2], to [3],
+                           ntohs (record.m_port [1]), record.m_rule);
+                break;
+
+        case TRACE_LOOKUP_REFUSED:
+                wsprintfA (out, "lookup %.50s refused\r\n", record.m_text);
+                break;
+
+        case TRACE_LOOKUP_FAILED:
+                wsprintfA (out, "lookup %.50s failed\r\n", record.m_text);
+                break;
+
+        case TRACE_LOOKUP:
+                wsprintfA (out, "lookup %.50s as %d.%d.%d.%d\r\n",
+                           record.m_text, from [0], from [1], from [2],
+                           from [3]);
+                break;
+
+        case TRACE_REQUEST:
+                wsprintfA (out, "%s\r\n", record.m_text);
+                break;
+
+        case TRACE_DATA_SENT:
+                wsprintfA (out, "sent %lu bytes: %s\r\n", record.m_value,
+                           record.m_text);
+                break;
+
+        case TRACE_RESOLVED:
+                wsprintfA (out, "%s=%d.%d.%d.%d\r\n", record.m_text,
+                           from [0], from [1], from [2], from [3]);
+                break;
+
+        case TRACE_RESOLVE_FAILED:
+                wsprintfA (out, "Failed to resolve %s: %x\r\n",
+                           record.m_text, record.m_value);
+                break;
+
+        case TRACE_RESOLVE_NO_IPV4:
+                wsprintfA (out, "No IPv4 for %s\r\n", record.m_text);
+                break;
+
+        default:
+                if (index < ARRAY_LENGTH (l_messages) &&
+                    l_messages [index] != 0) {
+                        wsprintfA (out, "%s\r\n", l_messages [index]);
+                } else {
+                        wsprintfA (out, "trace event %x\r\n", record.m_event);
+                }
+                break;
+        }
+}
+
+/**
+ * Drain every thread's ring, from the background thread.
+ */
+
+static void l_traceTick (unsigned long now) {
+        char            show [256];
+
+        ThreadData    * scan = g_threadList ();
+        for (; scan != 0 ; scan = scan->m_next) {
+                TraceRing     * ring = (TraceRing *) scan->m_trace;
+                if (ring == 0)
+                        continue;
+
+                unsigned long   tail = ring->m_tail;
+                unsigned long   head = ring->m_head;
+                for (; tail != head ; ++ tail) {
+                        l_format (ring->m_records [tail & (TRACE_RING_SIZE - 1)],
+                                  show);
+                        OutputDebugStringA (show);
+                }
+
+                InterlockedExchange (& ring->m_tail, tail);
+
+                unsigned long   dropped = ring->m_dropped;
+                if (dropped == ring->m_reported)
+                        continue;
+
+                wsprintfA (show, "trace: %lu records dropped\r\n",
+                           dropped - ring->m_reported);
+                OutputDebugStringA (show);
+                ring->m_reported = dropped;
+        }
+}
+
+/**
+ * Start draining the trace rings in the background.
+ */
+
+void g_traceInit (void) {
+        g_tickerAdd (l_traceTick, TRACE_INTERVAL);
+}
+
+/**
+ * Set the level of tracing, as given by the rule set.
+ */
+
+void g_traceSet (unsigned long level) {
+        if (level > TRACE_DETAIL)
+                level = TRACE_DETAIL;
+
+        InterlockedExchange (& g_traceLevel, level);
+}
+
+/**
+ * Write out anything left in the rings and release them; the hooks must have
+ * been removed, and the background thread stopped, before this is called.
+ */
+
+void g_traceUnload (void) {
+        l_traceTick (GetTickCount ());
+
+        ThreadData    * scan = g_threadList ();
+        for (; scan != 0 ; scan = scan->m_next) {
+                void          * ring = scan->m_trace;
+                scan->m_trace = 0;
+
+                if (ring != 0)
+                        HeapFree (GetProcessHeap (), 0, ring);
+        }
+}
+
+/**@}*/
@@ -0,0 +1,222 @@
+#ifndef TRACE_H
+#define TRACE_H                 1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares the trace buffers used by the hooks to describe what they're
+ * doing, without paying for formatting or a kernel transition on the way.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The hooks used to describe what they were doing for the benefit of DbgView
+ * by formatting a message with wsprintfA () and handing it straight to
+ * OutputDebugStringA (), which is a kernel transition; all of that on the
+ * path of every connect, lookup and HTTP request the filter looks at.
+ *
+ * Instead, the hooks now write fixed-size binary records into a ring buffer
+ * belonging to the calling thread, which only that thread ever writes to. The
+ * background thread comes round every so often to format whatever has been
+ * written and pass it on to OutputDebugStringA (), so the hooks themselves
+ * only ever copy a few words and a little text.
+ *
+ * Each kind of event has a level, and anything above the current level is
+ * skipped with a single compare before any arguments are looked at, so that
+ * turning tracing down costs the hooks next to nothing. The level is set by a
+ * "trace" option in the rule set, as in "{trace=3}".
+ */
+
+#include <winsock2.h>
+
+/**
+ * Levels of tracing, in increasing order of verbosity.
+ *
+ * The default keeps the messages that were always written before there were
+ * levels at all; the detail level adds the passthrough notices and raw data
+ * written by the send hooks.
+ */
+
+enum TraceLevel {
+        TRACE_NONE,
+        TRACE_ERRORS,
+        TRACE_EVENTS,
+        TRACE_DETAIL,
+
+        TRACE_DEFAULT = TRACE_EVENTS
+};
+
+/**
+ * The kinds of events which can be traced.
+ *
+ * Each carries its level in the high bits, so that the check whether to write
+ * one needs nothing but the event code itself.
+ */
+
+#define TRACE_LEVEL_SHIFT       8
+#define TRACE_EVENT(level, n)   (((level) << TRACE_LEVEL_SHIFT) + (n))
+
+enum TraceEvent {
+        TRACE_CONNECT_PASSED    = TRACE_EVENT (TRACE_DETAIL, 0),
+        TRACE_CONNECT_REFUSED   = TRACE_EVENT (TRACE_EVENTS, 1),
+        TRACE_CONNECT_REDIRECT  = TRACE_EVENT (TRACE_EVENTS, 2),
+        TRACE_LOOKUP_REFUSED    = TRACE_EVENT (TRACE_EVENTS, 3),
+        TRACE_LOOKUP_FAILED     = TRACE_EVENT (TRACE_ERRORS, 4),
+        TRACE_LOOKUP            = TRACE_EVENT (TRACE_EVENTS, 5),
+        TRACE_REQUEST           = TRACE_EVENT (TRACE_EVENTS, 6),
+        TRACE_HOST_REJECTED     = TRACE_EVENT (TRACE_EVENTS, 7),
+        TRACE_HOST_REPLACED     = TRACE_EVENT (TRACE_EVENTS, 8),
+        TRACE_HOSTURL_REJECTED  = TRACE_EVENT (TRACE_EVENTS, 9),
+        TRACE_URL_REJECTED      = TRACE_EVENT (TRACE_EVENTS, 10),
+        TRACE_STATUS_FAILED     = TRACE_EVENT (TRACE_ERRORS, 11),
+        TRACE_CACHE_SERVED      = TRACE_EVENT (TRACE_EVENTS, 12),
+        TRACE_DEPOT_SERVED      = TRACE_EVENT (TRACE_EVENTS, 13),
+        TRACE_SEGMENTED         = TRACE_EVENT (TRACE_EVENTS, 14),
+        TRACE_RESPONSE_REPLACED = TRACE_EVENT (TRACE_EVENTS, 15),
+        TRACE_REQUEST_REPLACED  = TRACE_EVENT (TRACE_EVENTS, 16),
+        TRACE_DATA_SENT         = TRACE_EVENT (TRACE_DETAIL, 17),
+        TRACE_RESOLVED          = TRACE_EVENT (TRACE_EVENTS, 18),
+        TRACE_RESOLVE_FAILED    = TRACE_EVENT (TRACE_ERRORS, 19),
+        TRACE_RESOLVE_NO_IPV4   = TRACE_EVENT (TRACE_ERRORS, 20),
+        TRACE_DATAGRAM_DROPPED  = TRACE_EVENT (TRACE_EVENTS, 21),
+        TRACE_DATAGRAM_REDIRECT = TRACE_EVENT (TRACE_EVENTS, 22)
+};
+
+/**
+ * Most text carried by a record; longer text is cut short.
+ */
+
+#define TRACE_TEXT_MAX          104
+
+/**
+ * A single trace record, which is exactly two cache lines.
+ *
+ * Addresses and ports are in network order, as they came from the socket
+ * APIs; what the value means depends on the event, being a length for data
+ * or an error code for failures.
+ */
+
+struct TraceRecord {
+        unsigned long   m_time;
+        unsigned short  m_event;
+        unsigned short  m_rule;
+        unsigned long   m_addr [2];
+        unsigned short  m_port [2];
+        unsigned long   m_value;
+        char            m_text [TRACE_TEXT_MAX];
+};
+
+/**
+ * Number of records in each thread's ring, which must be a power of two.
+ *
+ * A thread which writes more than this between visits from the background
+ * thread has its newest records dropped and counted, rather than overwriting
+ * ones that might be in the middle of being read.
+ */
+
+#define TRACE_RING_SIZE         64
+
+/**
+ * How often the rings are drained, in milliseconds.
+ */
+
+#define TRACE_INTERVAL          100
+
+/**
+ * The current level of tracing.
+ */
+
+extern  volatile LONG   g_traceLevel;
+
+inline  bool            g_tracing (TraceEvent event) {
+        return g_traceLevel >= (event >> TRACE_LEVEL_SHIFT);
+}
+
+void            g_traceInit (void);
+void            g_traceSet (unsigned long level);
+void            g_traceUnload (void);
+
+void            g_traceWrite (TraceEvent event, const char * text,
+                              size_t length, unsigned long value,
+                              const sockaddr_in * from, const sockaddr_in * to,
+                              unsigned long rule);
+void            g_traceWide (TraceEvent event, const wchar_t * text,
+                             unsigned long value, unsigned long addr);
+
+/**
+ * Trace an event, perhaps with some text and a value.
+ */
+
+inline  void            g_trace (TraceEvent event, const char * text = 0,
+                                 unsigned long value = 0) {
+        if (g_tracing (event))
+                g_traceWrite (event, text, ~ 0U, value, 0, 0, 0);
+}
+
+/**
+ * Trace an event concerning a connection, from the address the caller asked
+ * for to the one we chose, along with the rule that chose it.
+ */
+
+inline  void            g_traceConnect (TraceEvent event,
+                                        const sockaddr_in * from,
+                                        const sockaddr_in * to = 0,
+                                        unsigned long rule = 0) {
+        if (g_tracing (event))
+                g_traceWrite (event, 0, 0, 0, from, to, rule);
+}
+
+/**
+ * Trace a name and the address it resolved to.
+ */
+
+inline  void            g_traceLookup (TraceEvent event, const char * name,
+                                       unsigned long addr = 0) {
+        if (! g_tracing (event))
+                return;
+
+        sockaddr_in     temp;
+        temp.sin_family = AF_INET;
+        temp.sin_port = 0;
+        temp.sin_addr.S_un.S_addr = addr;
+        g_traceWrite (event, name, ~ 0U, 0, & temp, 0, 0);
+}
+
+/**
+ * Trace some data, along with its full length.
+ */
+
+inline  void            g_traceData (TraceEvent event, const char * data,
+                                     size_t length) {
+        if (g_tracing (event))
+                g_traceWrite (event, data, length, length, 0, 0, 0);
+}
+
+/**@}*/
+#endif  /* ! defined (TRACE_H) */
@@ -0,0 +1,142 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements the tuning of socket options for redirected connections.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Options which Windows doesn't take are passed over, and counted; there's
+ * nothing useful the client could do about them. In particular, the type of
+ * service is usually ignored unless the system has been set up to allow it,
+ * as QoS in Windows is meant to be applied by policy rather than by sockets.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mstcpip.h>
+
+#include "tune.h"
+#include "filterrule.h"
+#include "netapi.h"
+
+/**
+ * Simple counters, for reporting.
+ */
+
+static  volatile LONG   l_tuned;
+static  volatile LONG   l_refused;
+
+/**
+ * Set an option which takes a plain number, counting it if that fails.
+ */
+
+static void l_set (SOCKET s, int level, int name, unsigned long value) {
+        int             temp = (int) value;
+        if ((* g_net.m_setsockopt) (s, level, name, (const char *) & temp,
+                                    sizeof (temp)) != 0)
+                InterlockedIncrement (& l_refused);
+}
+
+/**
+ * Turn keepalive on with the given idle time, in seconds, or off.
+ *
+ * SO_KEEPALIVE on its own uses the system's idle time of two hours, which is
+ * no use at all for noticing a dead server, so where WSAIoctl () is to hand
+ * the time is set along with it; probes then go every second until the
+ * system gives up.
+ */
+
+static void l_keepalive (SOCKET s, unsigned long seconds) {
+        if (seconds == 0 || g_net.m_wsaIoctl == 0) {
+                l_set (s, SOL_SOCKET, SO_KEEPALIVE, seconds != 0);
+                return;
+        }
+
+        tcp_keepalive   values;
+        values.onoff = 1;
+        values.keepalivetime = seconds * 1000;
+        values.keepaliveinterval = 1000;
+
+        unsigned long   returned = 0;
+        if ((* g_net.m_wsaIoctl) (s, SIO_KEEPALIVE_VALS, & values,
+                                  sizeof (values), 0, 0, & returned, 0,
+                                  0) != 0)
+                InterlockedIncrement (& l_refused);
+}
+
+/**
+ * Check whether a rule's options include any socket tuning at all.
+ */
+
+bool g_tuneWanted (const RuleOptions & options) {
+        return options.m_rcvbuf != 0 || options.m_sndbuf != 0 ||
+               options.m_nodelay != 0 || options.m_keepalive != 0 ||
+               options.m_tos != 0;
+}
+
+/**
+ * Apply a rule's socket options to a socket which is about to connect.
+ */
+
+void g_tuneConnect (SOCKET s, const RuleOptions & options) {
+        if (g_net.m_setsockopt == 0 || ! g_tuneWanted (options))
+                return;
+
+        InterlockedIncrement (& l_tuned);
+
+        if (options.m_rcvbuf != 0)
+                l_set (s, SOL_SOCKET, SO_RCVBUF, options.m_rcvbuf * 1024);
+        if (options.m_sndbuf != 0)
+                l_set (s, SOL_SOCKET, SO_SNDBUF, options.m_sndbuf * 1024);
+        if (options.m_nodelay != 0)
+                l_set (s, IPPROTO_TCP, TCP_NODELAY, options.m_nodelay - 1 != 0);
+        if (options.m_keepalive != 0)
+                l_keepalive (s, options.m_keepalive - 1);
+        if (options.m_tos != 0)
+                l_set (s, IPPROTO_IP, IP_TOS, options.m_tos - 1);
+}
+
+/**
+ * Write the counters out for the benefit of DbgView.
+ */
+
+void g_tuneReport (void) {
+        if (l_tuned == 0)
+                return;
+
+        char            show [80];
+        wsprintfA (show, "tune: %lu sockets tuned, %lu options refused\r\n",
+                   (unsigned long) l_tuned, (unsigned long) l_refused);
+        OutputDebugStringA (show);
+}
+
+/**@}*/
@@ -0,0 +1,480 @@
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This implements a pool of connections kept open ahead of time to servers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The connections are made and looked after from the background thread, as
+ * for the health checks; taking one is just a matter of finding one that is
+ * ready and checking that the server hasn't closed it in the meantime.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "warm.h"
+#include "health.h"
+#include "netapi.h"
+#include "ticker.h"
+
+/**
+ * One connection kept for a server.
+ *
+ * While there's no socket, the time is when to next try making one; while
+ * there is, it's when that was started, or when the connection was made once
+ * it's ready.
+ */
+
+struct WarmSocket {
+        SOCKET          m_socket;
+        bool            m_ready;
+        unsigned long   m_time;
+};
+
+/**
+ * The connections kept for one server; the address and port are in network
+ * order.
+ */
+
+struct WarmTarget {
+        unsigned long   m_addr;
+        unsigned short  m_port;
+        unsigned long   m_lastUsed;
+        WarmSocket      m_sockets [WARM_PER_TARGET];
+};
+
+/**
+ * The table of servers.
+ */
+
+static  WarmTarget      l_targets [WARM_TARGETS_MAX];
+static  unsigned long   l_targetCount;
+static  bool            l_ready;
+
+static  CRITICAL_SECTION l_warmLock;
+static  bool            l_lockInit;
+
+/**
+ * Simple counters, for reporting; the total time spent making connections is
+ * what each one taken from the table saves.
+ */
+
+static  unsigned long   l_hits;
+static  unsigned long   l_misses;
+static  unsigned long   l_made;
+static  unsigned long   l_madeTime;
+static  unsigned long   l_replaced;
+static  unsigned long   l_given;
+static  unsigned long   l_vouched;
+
+/**
+ * Close a connection, and say when to try again.
+ */
+
+static void l_close (WarmSocket & item, unsigned long next) {
+        if (item.m_socket != INVALID_SOCKET)
+                (* g_net.m_closesocket) (item.m_socket);
+
+        item.m_socket = INVALID_SOCKET;
+        item.m_ready = false;
+        item.m_time = next;
+}
+
+/**
+ * Check whether a ready connection is still good to use.
+ *
+ * Nothing has been asked of the server on it yet, so if it's readable the
+ * server has closed it or something has gone wrong.
+ */
+
+static bool l_usable (SOCKET s) {
+        fd_set          read;
+        FD_ZERO (& read);
+        FD_SET (s, & read);
+
+        timeval         poll = { 0, 0 };
+        return (* g_net.m_select) (0, & read, 0, 0, & poll) == 0;
+}
+
+/**
+ * Look after the connections, from the background thread.
+ *
+ * Servers nothing has asked about for a while are dropped, connections are
+ * started where they're missing, and those in progress or ready are looked at
+ * without waiting.
+ */
+
+static void l_warmTick (unsigned long now) {
+        EnterCriticalSection (& l_warmLock);
+
+        fd_set          read;
+        fd_set          write;
+        fd_set          error;
+        FD_ZERO (& read);
+        FD_ZERO (& write);
+        FD_ZERO (& error);
+
+        unsigned long   i;
+        for (i = 0 ; i < l_targetCount ; ++ i) {
+                WarmTarget    & target = l_targets [i];
+                unsigned long   j;
+
+                if (now - target.m_lastUsed > WARM_IDLE) {
+                        for (j = 0 ; j < WARM_PER_TARGET ; ++ j)
+                                l_close (target.m_sockets [j], now);
+
+                        target = l_targets [-- l_targetCount];
+                        -- i;
+                        continue;
+                }
+
+                bool            down;
+                down = g_healthDown (target.m_addr, target.m_port);
+
+                for (j = 0 ; j < WARM_PER_TARGET ; ++ j) {
+                        WarmSocket    & item = target.m_sockets [j];
+
+                        if (item.m_socket == INVALID_SOCKET) {
+                                if (down || (long) (now - item.m_time) < 0)
+                                        continue;
+
+                                sockaddr_in     addr;
+                                memset (& addr, 0, sizeof (addr));
+                                addr.sin_family = AF_INET;
+                                addr.sin_port = target.m_port;
+                                addr.sin_addr.S_un.S_addr = target.m_addr;
+
+                                item.m_socket = g_netConnect (addr);
+                                item.m_time = now;
+                                if (item.m_socket == INVALID_SOCKET) {
+                                        item.m_time = now + WARM_RETRY;
+                                        continue;
+                                }
+                        }
+
+                        if (! item.m_ready) {
+                                if (now - item.m_time > WARM_TIMEOUT) {
+                                        l_close (item, now + WARM_RETRY);
+                                        continue;
+                                }
+
+                                FD_SET (item.m_socket, & write);
+                                FD_SET (item.m_socket, & error);
+                                continue;
+                        }
+
+                        if (down || now - item.m_time > WARM_AGE) {
+                                ++ l_replaced;
+                                l_close (item, now);
+                                continue;
+                        }
+
+                        FD_SET (item.m_socket, & read);
+                }
+        }
+
+        timeval         poll = { 0, 0 };
+        int             result = 0;
+        if (read.fd_count > 0 || write.fd_count > 0)
+                result = (* g_net.m_select) (0, & read, & write, & error,
+                                             & poll);
+
+        for (i = 0 ; i < l_targetCount && result > 0 ; ++ i) {
+                WarmTarget    & target = l_targets [i];
+                unsigned long   j;
+                for (j = 0 ; j < WARM_PER_TARGET ; ++ j) {
+                        WarmSocket    & item = target.m_sockets [j];
+                        SOCKET          s = item.m_socket;
+                        if (s == INVALID_SOCKET)
+                                continue;
+
+                        if (item.m_ready) {
+                                if (g_netIsSet (s, read))
+                                        l_close (item, now);
+
+                                continue;
+                        }
+
+                        if (g_netIsSet (s, error)) {
+                                l_close (item, now + WARM_RETRY);
+                                continue;
+                        }
+
+                        if (! g_netIsSet (s, write))
+                                continue;
+
+                        if (! g_netConnected (s)) {
+                                l_close (item, now + WARM_RETRY);
+                                continue;
+                        }
+
+                        ++ l_made;
+                        l_madeTime += now - item.m_time;
+                        item.m_ready = true;
+                        item.m_time = now;
+                }
+        }
+
+        LeaveCriticalSection (& l_warmLock);
+}
+
+/**
+ * Start looking after connections.
+ */
+
+bool g_warmInit (void) {
+        if (! l_lockInit) {
+                InitializeCriticalSection (& l_warmLock);
+                l_lockInit = true;
+        }
+
+        l_ready = g_tickerAdd (l_warmTick, TICKER_RESOLUTION);
+        return l_ready;
+}
+
+/**
+ * Close all the connections; the background thread must already have been
+ * stopped.
+ */
+
+void g_warmUnload (void) {
+        if (! l_lockInit)
+                return;
+
+        EnterCriticalSection (& l_warmLock);
+
+        l_ready = false;
+
+        unsigned long   i;
+        for (i = 0 ; i < l_targetCount ; ++ i) {
+                unsigned long   j;
+                for (j = 0 ; j < WARM_PER_TARGET ; ++ j)
+                        l_close (l_targets [i].m_sockets [j], 0);
+        }
+
+        l_targetCount = 0;
+
+        LeaveCriticalSection (& l_warmLock);
+}
+
+/**
+ * Find the entry for a server, adding it if there's room; the lock must be
+ * held.
+ */
+
+static WarmTarget * l_find (const sockaddr_in & addr, unsigned long now) {
+        unsigned long   i;
+        for (i = 0 ; i < l_targetCount ; ++ i)
+                if (l_targets [i].m_addr == addr.sin_addr.S_un.S_addr &&
+                    l_targets [i].m_port == addr.sin_port)
+                        break;
+
+        if (i == l_targetCount) {
+                if (l_targetCount == WARM_TARGETS_MAX)
+                        return 0;
+
+                WarmTarget    & target = l_targets [l_targetCount ++];
+                target.m_addr = addr.sin_addr.S_un.S_addr;
+                target.m_port = addr.sin_port;
+
+                unsigned long   j;
+                for (j = 0 ; j < WARM_PER_TARGET ; ++ j) {
+                        target.m_sockets [j].m_socket = INVALID_SOCKET;
+                        l_close (target.m_sockets [j], now);
+                }
+        }
+
+        l_targets [i].m_lastUsed = now;
+        return l_targets + i;
+}
+
+/**
+ * Take a connection to a server that is already made, if there is one.
+ *
+ * The socket is non-blocking, as from g_netConnect (), and belongs to the
+ * caller from then on. A server we haven't heard of is added to the table, so
+ * that connections to it are ready the next time.
+ */
+
+SOCKET g_warmTake (const sockaddr_in & addr) {
+        if (! l_ready)
+                return INVALID_SOCKET;
+
+        unsigned long   now = GetTickCount ();
+        SOCKET          result = INVALID_SOCKET;
+
+        EnterCriticalSection (& l_warmLock);
+
+        WarmTarget    * target = l_find (addr, now);
+        unsigned long   j;
+        for (j = 0 ; target != 0 && j < WARM_PER_TARGET ; ++ j) {
+                WarmSocket    & item = target->m_sockets [j];
+                if (! item.m_ready)
+                        continue;
+
+                SOCKET          s = item.m_socket;
+                item.m_socket = INVALID_SOCKET;
+                l_close (item, now);
+
+                if (l_usable (s)) {
+                        result = s;
+                        break;
+                }
+
+                (* g_net.m_closesocket) (s);
+        }
+
+        if (result != INVALID_SOCKET)
+                ++ l_hits;
+        else
+                ++ l_misses;
+
+        LeaveCriticalSection (& l_warmLock);
+        return result;
+}
+
+/**
+ * Check whether a server has a connection ready, without taking it.
+ *
+ * A server the filter can connect to right now needn't be probed to find
+ * whether it's up, which is what the connect race does with this; asking
+ * counts as using the server, so its connections are kept ready while the
+ * race keeps asking, but a server we haven't heard of isn't added.
+ */
+
+bool g_warmReady (const sockaddr_in & addr) {
+        if (! l_ready)
+                return false;
+
+        unsigned long   now = GetTickCount ();
+        bool            found = false;
+
+        EnterCriticalSection (& l_warmLock);
+
+        unsigned long   i;
+        for (i = 0 ; i < l_targetCount ; ++ i) {
+                WarmTarget    & target = l_targets [i];
+                if (target.m_addr != addr.sin_addr.S_un.S_addr ||
+                    target.m_port != addr.sin_port)
+                        continue;
+
+                target.m_lastUsed = now;
+
+                unsigned long   j;
+                for (j = 0 ; j < WARM_PER_TARGET && ! found ; ++ j) {
+                        WarmSocket    & item = target.m_sockets [j];
+                        if (! item.m_ready)
+                                continue;
+
+                        found = l_usable (item.m_socket);
+                        if (! found)
+                                l_close (item, now);
+                }
+
+                break;
+        }
+
+        if (found)
+                ++ l_vouched;
+
+        LeaveCriticalSection (& l_warmLock);
+        return found;
+}
+
+/**
+ * Hand over a connection to a server that the filter made for some other
+ * reason and has no further use for, such as the probe that won a connect
+ * race; the client's own socket still has to connect for itself, but the
+ * handshake the probe paid for needn't be wasted.
+ *
+ * The connection takes the place of one still being made, or fills an empty
+ * slot; if the server's connections are all ready already, or there's no room
+ * for the server in the table, it's closed.
+ */
+
+void g_warmGive (const sockaddr_in & addr, SOCKET s) {
+        if (s == INVALID_SOCKET)
+                return;
+
+        if (! l_ready) {
+                (* g_net.m_closesocket) (s);
+                return;
+        }
+
+        unsigned long   now = GetTickCount ();
+
+        EnterCriticalSection (& l_warmLock);
+
+        WarmTarget    * target = l_find (addr, now);
+        unsigned long   j;
+        for (j = 0 ; target != 0 && j < WARM_PER_TARGET ; ++ j) {
+                WarmSocket    & item = target->m_sockets [j];
+                if (item.m_ready)
+                        continue;
+
+                l_close (item, now);
+                item.m_socket = s;
+                item.m_ready = true;
+                item.m_time = now;
+
+                ++ l_given;
+                s = INVALID_SOCKET;
+                break;
+        }
+
+        LeaveCriticalSection (& l_warmLock);
+
+        if (s != INVALID_SOCKET)
+                (* g_net.m_closesocket) (s);
+}
+
+/**
+ * Write the counters out for the benefit of DbgView.
+ *
+ * The average time taken to make a connection is what each one taken from
+ * the table saved, compared to connecting when asked.
+ */
+
+void g_warmReport (void) {
+        if (l_hits == 0 && l_misses == 0 && l_given == 0 && l_vouched == 0)
+                return;
+
+        unsigned long   average = l_made != 0 ? l_madeTime / l_made : 0;
+
+        char            show [160];
+        wsprintfA (show, "warm: %lu taken, %lu not ready, %lu made avg %lums, "
+                   "%lu given, %lu vouched for, %lu replaced\r\n", l_hits,
+                   l_misses, l_made, average, l_given, l_vouched, l_replaced);
+        OutputDebugStringA (show);
+}
+
+/**@}*/
@@ -0,0 +1,96 @@
+#ifndef WARM_H
+#define WARM_H                  1
+
+/**@addtogroup Filter Steam limiter filter hook DLL.
+ * @{@file
+ *
+ * This declares a pool of connections kept open ahead of time to servers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Connections the filter makes itself, such as those fetching the parts of a
+ * segmented download, each pay for a TCP handshake to the server before they
+ * can do anything; with many small parts going to distant servers, that can
+ * be most of the time spent. So, a few connections are kept open ahead of time
+ * to each of the servers that are in use, ready to be taken.
+ *
+ * Only the filter's own connections can use these. Taking over the client's
+ * connect with one would mean swapping one socket handle for another under
+ * the client, which Windows has no way of doing, unlike dup2 () in UNIX. For
+ * the same reason, when a connect race is won by one of the filter's probe
+ * connections the client still connects for itself, so the winning probe is
+ * handed over to be kept here rather than thrown away. Later races to that
+ * server then see it has a connection ready and go straight to it, without
+ * waiting on a probe of their own.
+ *
+ * A server joins the table the first time a connection to it is asked for,
+ * and is dropped once nothing has asked for a while; servers the health
+ * checker thinks are down get no connections. Connections which have sat
+ * unused for a while are replaced with fresh ones, before the server decides
+ * to close them itself.
+ */
+
+#include <winsock2.h>
+
+/**
+ * Most servers that connections are kept for, and most connections kept for
+ * each one.
+ */
+
+#define WARM_TARGETS_MAX        16
+#define WARM_PER_TARGET         2
+
+/**
+ * How long a connection is given to be made, and how long to wait before
+ * trying again after one couldn't be, in milliseconds.
+ */
+
+#define WARM_TIMEOUT            3000
+#define WARM_RETRY              5000
+
+/**
+ * How long a connection is kept unused before being replaced, and how long a
+ * server is kept in the table after nothing has asked for it, in milliseconds.
+ */
+
+#define WARM_AGE                20000
+#define WARM_IDLE               60000
+
+bool            g_warmInit (void);
+void            g_warmUnload (void);
+
+SOCKET          g_warmTake (const sockaddr_in & addr);
+bool            g_warmReady (const sockaddr_in & addr);
+void            g_warmGive (const sockaddr_in & addr, SOCKET s);
+
+void            g_warmReport (void);
+
+/**@}*/
+#endif  /* ! defined (WARM_H) */
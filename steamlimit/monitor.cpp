@@ -36,6 +36,7 @@
 #include "hyperlink.h"
 #include "profile.h"
 #include "../nolocale.h"
+#include "../filterstats.h"
 
 #include "resource.h"
 #include <shellapi.h>
@@ -338,6 +339,59 @@ static  unsigned long   unloadCount;
         g_steamProcess = processId;
 }
 
+/**
+ * The filter's shared statistics in the Steam process, if we have them mapped,
+ * and which process that is.
+ */
+
+HANDLE          g_statsMapping;
+const volatile FilterStats * g_stats;
+unsigned long   g_statsProcess;
+
+/**
+ * Show the filter's current download rate in the notification area tooltip.
+ *
+ * Once the filter's statistics are mapped, reading them costs next to nothing,
+ * so this is fine to do on every poll.
+ */
+
+void showStats (NOTIFYICONDATA & data, const wchar_t * title) {
+        if (g_statsProcess != g_steamProcess || g_stats == 0) {
+                if (g_stats != 0)
+                        UnmapViewOfFile ((void *) g_stats);
+                if (g_statsMapping != 0)
+                        CloseHandle (g_statsMapping);
+
+                g_stats = 0;
+                g_statsMapping = 0;
+                g_statsProcess = g_steamProcess;
+
+                char            name [80];
+                wsprintfA (name, FILTER_STATS_NAME, g_steamProcess);
+                if (g_steamProcess != 0)
+                        g_statsMapping = OpenFileMappingA (FILE_MAP_READ,
+                                                           FALSE, name);
+                if (g_statsMapping != 0)
+                        g_stats = (const volatile FilterStats *)
+                                MapViewOfFile (g_statsMapping, FILE_MAP_READ,
+                                               0, 0, 0);
+        }
+
+        wchar_t         tip [ARRAY_LENGTH (data.szTip)];
+        FilterStatsMeter meter;
+        if (g_stats != 0 && filterStatsValid (g_stats) &&
+            filterStatsMeter (g_stats, meter)) {
+                wsprintfW (tip, L"%s - %u KB/s", title, meter.m_rate10 / 1024);
+        } else
+                wcscpy_s (tip, ARRAY_LENGTH (tip), title);
+
+        if (wcscmp (tip, data.szTip) == 0)
+                return;
+
+        wcscpy_s (data.szTip, ARRAY_LENGTH (data.szTip), tip);
+        Shell_NotifyIconW (NIM_MODIFY, & data);
+}
+
 /**
  * Set the enable state for the filter.
  */
@@ -1110,6 +1164,9 @@ reinitialize:
         LoadStringW (instance, IDS_APPTITLE, data.szTip,
                      ARRAY_LENGTH (data.szTip));
 
+        wchar_t         title [ARRAY_LENGTH (data.szTip)];
+        wcscpy_s (title, ARRAY_LENGTH (title), data.szTip);
+
         /*
          * Use WS_EX_TOOLWINDOW to prevent the window showing up in the taskbar
          * or ALT-TAB lists when active, and move it offscreen as well. This is
@@ -1169,6 +1226,7 @@ reinitialize:
                          */
 
                         steamPoll (true);
+                        showStats (data, title);
 
                         /*
                          * After a number of continuous poll cycles, wipe the
@@ -0,0 +1,401 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the token bucket used for bandwidth limits, and the fair sharing
+ * of a limited rate between connections.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check the token bucket and fair sharing against a simulated clock; since
+ * they're given the time on every call, the clock here is just a number moved
+ * along by the test.
+ */
+
+#include <stdio.h>
+
+#include "steamfilter/bucket.h"
+#include "check.h"
+
+/**
+ * Check filling, draining and waiting.
+ */
+
+static void l_checkBasics (void) {
+        TokenBucket     bucket;
+        CHECK (! bucket.active ());
+        CHECK (bucket.available (0) == ~ 0UL);
+        CHECK (bucket.wait (0, 1000000) == 0);
+
+        bucket.configure (10000, 2500, 0);
+        CHECK (bucket.active ());
+        CHECK (bucket.available (0) == 2500);
+
+        bucket.consume (2500);
+        CHECK (bucket.available (0) == 0);
+        CHECK (bucket.wait (0, 1000) == 100);
+        CHECK (bucket.available (50) == 500);
+        CHECK (bucket.wait (50, 1000) == 50);
+        CHECK (bucket.available (100) == 1000);
+        CHECK (bucket.wait (100, 1000) == 0);
+
+        /*
+         * It never fills past the burst allowance, and asking for more than
+         * that is treated as asking for all of it.
+         */
+
+        CHECK (bucket.available (100000) == 2500);
+        CHECK (bucket.wait (100000, 1000000) == 0);
+        bucket.consume (1);
+        CHECK (bucket.wait (100000, 1000000) == 1);
+
+        /*
+         * Receiving more than was available puts it in debt, which has to be
+         * paid off before anything more is allowed.
+         */
+
+        bucket.consume (2499 + 5000);
+        CHECK (bucket.available (100000) == 0);
+        CHECK (bucket.wait (100000, 1000) == 600);
+        CHECK (bucket.available (100500) == 0);
+        CHECK (bucket.available (100600) == 1000);
+
+        /*
+         * A refund can't take it past the burst allowance either.
+         */
+
+        bucket.refund (1000);
+        CHECK (bucket.available (100600) == 2000);
+        bucket.refund (1000);
+        CHECK (bucket.available (100600) == 2500);
+}
+
+/**
+ * Check that slow rates and frequent calls don't lose anything to rounding.
+ */
+
+static void l_checkRounding (void) {
+        TokenBucket     bucket;
+        bucket.configure (3, 100, 0);
+        bucket.consume (100);
+
+        unsigned long   now;
+        for (now = 1 ; now <= 10000 ; ++ now)
+                bucket.available (now);
+
+        CHECK (bucket.available (now - 1) == 30);
+
+        bucket.configure (1000, 10, 0);
+        bucket.consume (10);
+        CHECK (bucket.wait (0, 1) == 1);
+        CHECK (bucket.available (1) == 1);
+}
+
+/**
+ * Check that the millisecond tick count wrapping around does no harm.
+ *
+ * That only holds where "unsigned long" is 32 bits wide, as it is for the
+ * filter, so there's nothing to check on a 64-bit build.
+ */
+
+static void l_checkWrap (void) {
+        if (sizeof (unsigned long) != 4)
+                return;
+
+        TokenBucket     bucket;
+        unsigned long   start = 0xFFFFFF00UL;
+        bucket.configure (10000, 10000, start);
+        bucket.consume (10000);
+
+        unsigned long   later = (unsigned long) (start + 512) & 0xFFFFFFFFUL;
+        CHECK (bucket.available (later) == 5120);
+}
+
+/**
+ * Run a client receiving as fast as the bucket lets it, with an uneven read
+ * size, and check that it gets the rate it should over a simulated minute.
+ */
+
+static void l_checkPacing (void) {
+        TokenBucket     bucket;
+        unsigned long   rate = 100 * 1024;
+        unsigned long   burst = rate / 4;
+        bucket.configure (rate, burst, 0);
+
+        unsigned long   now = 0;
+        unsigned long long received = 0;
+        unsigned long   reads = 0;
+        unsigned long   worst = 0;
+
+        while (now < 60000) {
+                unsigned long   need = 1024;
+                unsigned long   wait = bucket.wait (now, need);
+                if (wait != 0) {
+                        if (wait > worst)
+                                worst = wait;
+
+                        now += wait;
+                        continue;
+                }
+
+                unsigned long   allow = bucket.available (now);
+                unsigned long   read = 1460 * (1 + reads % 7);
+                if (read > allow)
+                        read = allow;
+
+                bucket.consume (read);
+                received += read;
+                ++ reads;
+        }
+
+        unsigned long long expect = (unsigned long long) rate * 60 + burst;
+        CHECK (received <= expect);
+        CHECK (received >= expect - 2 * 1460 * 7);
+        CHECK (worst <= 1000 * 1024 / rate + 1);
+}
+
+/**
+ * Check the credit handed out to connections sharing a rate.
+ */
+
+static void l_checkShare (void) {
+        FairShare       share;
+        ShareState      first;
+        ShareState      second;
+        unsigned long   rate = 10000;
+
+        /*
+         * A connection starts with a full allowance, then gets the whole rate
+         * while it's alone.
+         */
+
+        share.advance (0, rate);
+        CHECK (share.credit (first, 4000) == 4000);
+        CHECK (share.active () == 1);
+
+        share.consume (first, 4000);
+        CHECK (share.wait (first, 1000, rate) == 100);
+
+        share.advance (100, rate);
+        CHECK (share.credit (first, 4000) == 1000);
+        CHECK (share.wait (first, 1000, rate) == 0);
+
+        /*
+         * Once another joins, each gets half.
+         */
+
+        CHECK (share.credit (second, 4000) == 4000);
+        share.consume (second, 4000);
+        CHECK (share.active () == 2);
+
+        share.advance (200, rate);
+        CHECK (share.credit (first, 4000) == 1500);
+        CHECK (share.credit (second, 4000) == 500);
+        CHECK (share.wait (second, 1000, rate) == 100);
+
+        /*
+         * Taking more than was credited is paid back before anything more is
+         * allowed, and what was taken and not used can be put back.
+         */
+
+        share.consume (first, 3500);
+        CHECK (share.credit (first, 4000) == 0);
+        CHECK (share.wait (first, 1000, rate) == 600);
+        share.refund (first, 2500);
+        CHECK (share.credit (first, 4000) == 500);
+
+        /*
+         * However long a connection waits, it can only save up so much.
+         */
+
+        share.advance (10000, rate);
+        CHECK (share.credit (first, 4000) == 4000);
+
+        /*
+         * A connection that stops asking stops counting after an epoch or
+         * two, and one with twice the weight gets twice as much.
+         */
+
+        share.advance (10000 + 2 * SHARE_EPOCH, rate);
+        share.credit (first, 4000);
+        share.advance (10000 + 3 * SHARE_EPOCH, rate);
+        CHECK (share.active () == 1);
+
+        ShareState      heavy;
+        heavy.m_weight = 2;
+        CHECK (share.credit (first, 4000) == 4000);
+        share.consume (first, 4000);
+        share.credit (heavy, 4000);
+        share.consume (heavy, 4000);
+        CHECK (share.active () == 3);
+
+        share.advance (10000 + 3 * SHARE_EPOCH + 300, rate);
+        CHECK (share.credit (first, 4000) == 1000);
+        CHECK (share.credit (heavy, 4000) == 2000);
+}
+
+/**
+ * Simulate connections receiving under a limit, as the receive hook has them
+ * do, each asking again as soon as it's allowed; returns the ratio of the
+ * most any connection received to the least.
+ *
+ * Each has a different read size, and with no sharing the one which reads the
+ * most at a time takes most of the rate. The cap on a connection's saved-up
+ * credit follows what the limit code does.
+ */
+
+static double l_simulate (bool fair, const unsigned long * weights,
+                          unsigned long long * received,
+                          unsigned long & total) {
+        unsigned long   rate = 400 * 1024;
+        unsigned long   burst = rate / 4;
+        unsigned long   reads [4] = { 65536, 16384, 4096, 1460 };
+        unsigned long   ready [4] = { 0, 0, 0, 0 };
+        ShareState      flows [4];
+
+        TokenBucket     bucket;
+        FairShare       share;
+        bucket.configure (rate, burst, 0);
+
+        unsigned long   i;
+        for (i = 0 ; i < 4 ; ++ i) {
+                flows [i].m_weight = weights [i];
+                received [i] = 0;
+        }
+
+        for (;;) {
+                unsigned long   which = 0;
+                for (i = 1 ; i < 4 ; ++ i)
+                        if (ready [i] < ready [which])
+                                which = i;
+
+                unsigned long   now = ready [which];
+                if (now >= 60000)
+                        break;
+
+                unsigned long   need = 1024;
+                unsigned long   wait = bucket.wait (now, need);
+                unsigned long   credit = ~ 0UL;
+                ShareState    & flow = flows [which];
+
+                if (fair) {
+                        unsigned long   active = share.active ();
+                        unsigned long   cap = burst;
+                        if (active > 0)
+                                cap = cap / active * flow.m_weight;
+                        if (cap < 1024)
+                                cap = 1024;
+
+                        share.advance (now, rate);
+                        credit = share.credit (flow, cap);
+
+                        unsigned long   shareWait;
+                        shareWait = share.wait (flow, need, rate);
+                        if (shareWait > wait)
+                                wait = shareWait;
+                }
+
+                if (wait != 0) {
+                        ready [which] = now + wait;
+                        continue;
+                }
+
+                unsigned long   allow = bucket.available (now);
+                if (credit < allow)
+                        allow = credit;
+
+                unsigned long   read = reads [which];
+                if (read > allow)
+                        read = allow;
+
+                bucket.consume (read);
+                if (fair)
+                        share.consume (flow, read);
+
+                received [which] += read;
+                ready [which] = now + 1;
+        }
+
+        double          most = 0;
+        double          least = 1e30;
+        total = 0;
+        for (i = 0 ; i < 4 ; ++ i) {
+                double          each = (double) received [i] / weights [i];
+                if (each > most)
+                        most = each;
+                if (each < least)
+                        least = each;
+
+                total += (unsigned long) (received [i] / 60);
+        }
+
+        return least > 0 ? most / least : 1e30;
+}
+
+/**
+ * Check that sharing evens out what each connection gets without costing
+ * anything overall, and show how much difference it makes.
+ */
+
+static void l_checkFairness (void) {
+        unsigned long   even [4] = { 1, 1, 1, 1 };
+        unsigned long   weighted [4] = { 1, 1, 2, 4 };
+        unsigned long long received [4];
+        unsigned long   rate = 400 * 1024;
+        unsigned long   total;
+
+        double          unfair = l_simulate (false, even, received, total);
+        CHECK (total <= rate + rate / 4 / 60 + 1);
+        CHECK (total >= rate - rate / 50);
+
+        double          fair = l_simulate (true, even, received, total);
+        CHECK (total <= rate + rate / 4 / 60 + 1);
+        CHECK (total >= rate - rate / 50);
+        CHECK (fair < 1.05);
+        CHECK (fair < unfair);
+
+        double          shares = l_simulate (true, weighted, received, total);
+        CHECK (shares < 1.05);
+
+        printf ("fair share: spread %.2f unshared, %.2f shared, "
+                "%.2f weighted\n", unfair, fair, shares);
+}
+
+int main (int argc, char ** argv) {
+        l_checkBasics ();
+        l_checkRounding ();
+        l_checkWrap ();
+        l_checkPacing ();
+        l_checkShare ();
+        l_checkFairness ();
+
+        return checkDone ("buckettest");
+}
+
+/**@}*/
@@ -0,0 +1,86 @@
+#ifndef CHECK_H
+#define CHECK_H                 1
+
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This declares the few helpers shared by the tests.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Each test is a small program of its own, which checks what it needs to
+ * with CHECK () and returns the count of failures from main (), so the
+ * makefile can simply run them in turn. Benchmarks print their figures along
+ * with everything else, but don't fail because of them, since the machines
+ * the tests are run on vary too much.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * Count of checks which have failed.
+ */
+
+static  int             l_failures;
+
+#define CHECK(test)     ((test) ? (void) 0 : checkFailed (#test, __FILE__, \
+                                                          __LINE__))
+
+static void checkFailed (const char * test, const char * file, int line) {
+        fprintf (stderr, "%s:%d: check failed: %s\n", file, line, test);
+        ++ l_failures;
+}
+
+/**
+ * Report how the checks went, for returning from main ().
+ */
+
+static int checkDone (const char * name) {
+        if (l_failures == 0)
+                printf ("%s: passed\n", name);
+        else
+                printf ("%s: %d checks failed\n", name, l_failures);
+
+        return l_failures;
+}
+
+/**
+ * Read a monotonic clock in nanoseconds, for benchmarks.
+ */
+
+static double checkNow (void) {
+        timespec        now;
+        clock_gettime (CLOCK_MONOTONIC, & now);
+        return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+/**@}*/
+#endif  /* ! defined (CHECK_H) */
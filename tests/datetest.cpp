@@ -0,0 +1,234 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the cache of formatted Date headers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check the Date and Expires headers made for synthetic responses, and time
+ * the cache which saves formatting them afresh for every response; then time
+ * the whole of serving the responses for the stub rules, which those headers
+ * are part of.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "header.h"
+#include "document.h"
+#include "replace.h"
+#include "stats.h"
+#include "check.h"
+#include "poolstandins.h"
+
+/**
+ * The shared statistics aren't set up here, so nothing is counted.
+ */
+
+volatile FilterStats  * g_stats;
+
+/**
+ * The text of the two stub rules the filter always adds to the rules, as the
+ * hook finds it after the status; the first is "/authdepot/=#200", and the
+ * second is "/initsession/=#200" followed by a canned session.
+ */
+
+static  const char    * l_stubs [] = {
+        "",
+        "\"response\"~{"
+        "\t\"sessionid\"\t\t\"12345678901234567890\"~"
+        "\t\"req-counter\"\t\t\"0\"~"
+        "\t\"csid\"\t\t\"99\"~"
+        "}~"
+};
+
+/**
+ * Set the simulated clock to a time given as seconds since 1970.
+ */
+
+static void l_setTime (ULONGLONG posix) {
+        shimFileTime () = (posix + SHIM_EPOCH_SECONDS) * 10000000;
+}
+
+/**
+ * Check the headers written for the current time against the expected date.
+ */
+
+static void l_expect (const char * date) {
+        char            expect [DATE_HEADERS_MAX + 1];
+        sprintf (expect, "Date: %s\r\nExpires: %s\r\n", date, date);
+
+        char            text [DATE_HEADERS_MAX + 1];
+        unsigned long   length = g_dateHeaders (text);
+        CHECK (length <= DATE_HEADERS_MAX);
+        text [length] = 0;
+
+        CHECK (strcmp (text, expect) == 0);
+        if (strcmp (text, expect) != 0)
+                fprintf (stderr, "got %s", text);
+}
+
+/**
+ * Time some calls, in nanoseconds each.
+ */
+
+static double l_time (unsigned long count, bool tick) {
+        char            text [DATE_HEADERS_MAX];
+        unsigned long   total = 0;
+        ULONGLONG       base = shimFileTime ();
+
+        double          start = checkNow ();
+        unsigned long   i;
+        for (i = 0 ; i < count ; ++ i) {
+                if (tick)
+                        shimFileTime () = base + i * 10000000ULL;
+                total += g_dateHeaders (text);
+        }
+
+        double          elapsed = checkNow () - start;
+        CHECK (total > 0);
+        return elapsed / count;
+}
+
+/**
+ * Serve the response for a stub rule on a socket the way the hooks do, with
+ * the status document found in the cache, a replacement added for it, and
+ * the response then read out by the receive hook, returning its length.
+ */
+
+static unsigned long l_serve (SOCKET handle, const char * text) {
+        if (! g_addReplacement (handle, 0, 200, text))
+                return 0;
+
+        Replacement   * item = g_findReplacement (handle);
+        char            buf [4096];
+        unsigned long   total = 0;
+        while (item != 0) {
+                unsigned long   count = 0;
+                if (! g_consumeReplacement (item, sizeof (buf), buf, & count))
+                        return 0;
+
+                total += count;
+                item = g_findReplacement (handle);
+        }
+
+        return total;
+}
+
+/**
+ * Check the responses for the stub rules, and time serving them.
+ */
+
+static void l_checkStubs (void) {
+        g_setDocumentStore (0);
+
+        char            buf [4096];
+        unsigned long   i;
+        for (i = 0 ; i < 2 ; ++ i) {
+                CHECK (g_addReplacement (4, 0, 200, l_stubs [i]));
+
+                unsigned long   count = 0;
+                Replacement   * item = g_findReplacement (4);
+                CHECK (item != 0);
+                CHECK (g_consumeReplacement (item, sizeof (buf) - 1, buf,
+                                             & count));
+                CHECK (g_findReplacement (4) == 0);
+                buf [count] = 0;
+
+                CHECK (strncmp (buf, "HTTP/1.1 200 OK\r\n", 17) == 0);
+                CHECK (strstr (buf, "\r\nDate: ") != 0);
+                CHECK ((strstr (buf, "\"sessionid\"") != 0) == (i == 1));
+        }
+
+        CHECK (! g_anyReplacement ());
+
+        unsigned long   count = 1000000;
+        unsigned long   total = 0;
+        double          start = checkNow ();
+        for (i = 0 ; i < count ; ++ i)
+                total += l_serve (4 + (i & 7) * 4, l_stubs [i & 1]);
+
+        double          elapsed = checkNow () - start;
+        CHECK (total > count * 17);
+        CHECK (! g_anyReplacement ());
+        printf ("stub responses: %.0f per second, %.1f ns each\n",
+                count / elapsed * 1e9, elapsed / count);
+
+        g_flushDocuments ();
+        CHECK (l_outstanding == 0);
+}
+
+int main (void) {
+        /*
+         * The count of seconds since 1601 doesn't fit in 32 bits, so this
+         * is the case where truncating it gave dates early in the 1600s.
+         */
+
+        l_setTime (1370090096);
+        l_expect ("Sat, 01 Jun 2013 12:34:56 GMT");
+        l_expect ("Sat, 01 Jun 2013 12:34:56 GMT");
+
+        l_setTime (1370090097);
+        l_expect ("Sat, 01 Jun 2013 12:34:57 GMT");
+
+        l_setTime (1370090096);
+        l_expect ("Sat, 01 Jun 2013 12:34:56 GMT");
+
+        l_setTime (1388534399);
+        l_expect ("Tue, 31 Dec 2013 23:59:59 GMT");
+        l_setTime (1388534400);
+        l_expect ("Wed, 01 Jan 2014 00:00:00 GMT");
+
+        /*
+         * Dates parsed out of responses compare with the current second.
+         */
+
+        unsigned long   second = 0;
+        const char      date [] = "Wed, 01 Jan 2014 00:00:00 GMT";
+        CHECK (g_parseHttpDate (date, sizeof (date) - 1, & second));
+        CHECK (second == g_currentSecond ());
+        CHECK (! g_parseHttpDate ("yesterday", 9, & second));
+
+        /*
+         * Time the cache against formatting every time.
+         */
+
+        double          cached = l_time (10000000, false);
+        double          fresh = l_time (1000000, true);
+        printf ("date headers: %.1f ns cached, %.1f ns formatted\n", cached,
+                fresh);
+
+        l_checkStubs ();
+
+        return checkDone ("datetest");
+}
+
+/**@}*/
@@ -0,0 +1,273 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the store of depot chunks.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check the depot chunk store, in a scratch directory, and time the path a
+ * request for a chunk the store already holds takes through it.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+
+#include "steamfilter/depot.h"
+#include "steamfilter/header.h"
+#include "check.h"
+#include "standins.h"
+
+/**
+ * Set the simulated clock to a time given as seconds since 1970.
+ */
+
+static void l_setTime (ULONGLONG posix) {
+        shimFileTime () = (posix + SHIM_EPOCH_SECONDS) * 10000000;
+}
+
+/**
+ * Make the chunk ID for a test chunk, and the URL it would be fetched with.
+ */
+
+static void l_chunk (unsigned long index, char * key, char * url) {
+        sprintf (key, "%02lx%038lx", index & 0xFF, index * 2654435761UL);
+        sprintf (url, "/depot/440/chunk/%s?x=1", key);
+}
+
+/**
+ * Write a chunk into the store, filled with a byte derived from its index.
+ */
+
+static bool l_store (unsigned long index, unsigned long length,
+                     unsigned long limit) {
+        char            key [DEPOT_KEY_LENGTH];
+        char            url [80];
+        l_chunk (index, key, url);
+
+        static  char    buf [64 * 1024];
+        memset (buf, (int) index, sizeof (buf));
+
+        DepotFile     * file = g_depotBegin (key);
+        if (file == 0)
+                return false;
+
+        for (unsigned long done = 0 ; done < length ; ) {
+                unsigned long   part = length - done;
+                if (part > sizeof (buf))
+                        part = sizeof (buf);
+
+                if (! g_depotWrite (file, buf, part)) {
+                        g_depotAbandon (file);
+                        return false;
+                }
+
+                done += part;
+        }
+
+        return g_depotCommit (key, file, length, limit);
+}
+
+/**
+ * Look a chunk up by its URL as the filter does, checking what comes back.
+ */
+
+static bool l_held (unsigned long index, unsigned long length) {
+        char            key [DEPOT_KEY_LENGTH];
+        char            url [80];
+        l_chunk (index, key, url);
+
+        char            found [DEPOT_KEY_LENGTH];
+        if (! g_depotKey (url, found))
+                return false;
+
+        Document      * doc = g_depotLookup (found);
+        if (doc == 0)
+                return false;
+
+        bool            same = doc->m_bodyLength == length;
+        for (unsigned long i = 0 ; same && i < length ; i += 4096)
+                same = doc->m_body [i] == (unsigned char) index;
+
+        g_documentRelease (doc);
+        return same;
+}
+
+/**
+ * Check the chunk IDs picked out of URLs.
+ */
+
+static void l_checkKey (void) {
+        char            key [DEPOT_KEY_LENGTH];
+        static  const char      id [] =
+                "0123456789abcdef0123456789abcdef01234567";
+
+        CHECK (g_depotKey ("/depot/1/chunk/0123456789ABCDEF0123456789abcdef"
+                           "01234567", key));
+        CHECK (strcmp (key, id) == 0);
+        CHECK (g_depotKey ("/depot/1/chunk/0123456789abcdef0123456789abcdef"
+                           "01234567 HTTP/1.1", key));
+        CHECK (! g_depotKey ("/depot/1/chunk/0123456789abcdef0123456789abcdef"
+                             "0123456", key));
+        CHECK (! g_depotKey ("/depot/1/chunk/0123456789abcdef0123456789abcdef"
+                             "012345678", key));
+        CHECK (! g_depotKey ("/depot/1/manifest/0123456789abcdef0123456789"
+                             "abcdef01234567", key));
+}
+
+/**
+ * Check storing, serving and evicting chunks.
+ */
+
+static void l_checkStore (const wchar_t * root) {
+        l_setTime (1370088000);
+
+        CHECK (! l_held (1, 1000));
+        CHECK (l_store (1, 1000, 1));
+        CHECK (l_held (1, 1000));
+        CHECK (! l_held (2, 1000));
+
+        /*
+         * The index survives the store being closed and opened again.
+         */
+
+        g_depotUnload ();
+        g_depotInit (root);
+        CHECK (l_held (1, 1000));
+
+        /*
+         * An abandoned chunk never shows up.
+         */
+
+        char            key [DEPOT_KEY_LENGTH];
+        char            url [80];
+        l_chunk (3, key, url);
+        DepotFile     * file = g_depotBegin (key);
+        CHECK (file != 0);
+        CHECK (g_depotWrite (file, "partial", 7));
+        g_depotAbandon (file);
+        CHECK (! l_held (3, 7));
+
+        /*
+         * With a one megabyte limit, only two of these fit, and the least
+         * recently used goes to make room.
+         */
+
+        unsigned long   size = 400 * 1024;
+        l_setTime (1370088010);
+        CHECK (l_store (10, size, 1));
+        l_setTime (1370088011);
+        CHECK (l_store (11, size, 1));
+
+        l_setTime (1370088012);
+        CHECK (l_held (10, size));
+
+        l_setTime (1370088013);
+        CHECK (l_store (12, size, 1));
+        CHECK (l_held (10, size));
+        CHECK (! l_held (11, size));
+        CHECK (l_held (12, size));
+        CHECK (! l_held (1, 1000));
+
+        /*
+         * A chunk whose file has gone is forgotten rather than served.
+         */
+
+        l_chunk (12, key, url);
+        char            path [MAX_PATH];
+        wchar_t         wide [MAX_PATH];
+        swprintf (wide, MAX_PATH, L"%ls/depot/%.2s/%s", root, key, key);
+        CHECK (shimPath (wide, path) && unlink (path) == 0);
+        CHECK (! l_held (12, size));
+
+        CHECK (l_outstanding == 0);
+}
+
+/**
+ * Time requests for a chunk the store holds, from the URL to the document.
+ */
+
+static void l_benchmark (void) {
+        unsigned long   size = 256 * 1024;
+        CHECK (l_store (20, size, 64));
+
+        char            key [DEPOT_KEY_LENGTH];
+        char            url [80];
+        l_chunk (20, key, url);
+
+        unsigned long   count = 20000;
+        unsigned long   served = 0;
+        double          start = checkNow ();
+
+        for (unsigned long i = 0 ; i < count ; ++ i) {
+                char            found [DEPOT_KEY_LENGTH];
+                if (! g_depotKey (url, found))
+                        continue;
+
+                Document      * doc = g_depotLookup (found);
+                if (doc == 0)
+                        continue;
+
+                served += doc->m_bodyLength == size;
+                g_documentRelease (doc);
+        }
+
+        double          each = (checkNow () - start) / count;
+        CHECK (served == count);
+        CHECK (l_outstanding == 0);
+
+        printf ("depot hits: %.2f us each\n", each / 1000);
+}
+
+int main (int argc, char ** argv) {
+        char            dir [] = "/tmp/depottestXXXXXX";
+        if (mkdtemp (dir) == 0) {
+                perror ("mkdtemp");
+                return 1;
+        }
+
+        wchar_t         root [MAX_PATH];
+        swprintf (root, MAX_PATH, L"%s", dir);
+        g_depotInit (root);
+
+        l_checkKey ();
+        l_checkStore (root);
+        l_benchmark ();
+
+        g_depotUnload ();
+
+        char            command [80];
+        sprintf (command, "rm -rf %s", dir);
+        if (system (command) != 0)
+                perror ("rm");
+
+        return checkDone ("depottest");
+}
+
+/**@}*/
@@ -0,0 +1,297 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the cache of replacement documents and the stores behind it.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The cache is tested with both kinds of store behind it. The registry is
+ * stood in for by a store which keeps each document's text in a file, and
+ * is told by the test when it has changed; the real file store is used as it
+ * is, over a scratch directory, with its change notification and the clock
+ * it polls that by both working as they do on Windows.
+ */
+
+#include <windows.h>
+
+#include "steamfilter/document.h"
+#include "check.h"
+#include "poolstandins.h"
+
+/**
+ * A store holding the text of each document in a file named for it, which is
+ * made into a page the same way as the text of a registry value is.
+ */
+
+class TextStore : public DocumentStore {
+public:
+        char            m_root [MAX_PATH];
+        bool            m_changed;
+        unsigned long   m_loads;
+
+                        TextStore (const char * root) : m_changed (false),
+                                m_loads (0) {
+                strcpy (m_root, root);
+        }
+
+        bool            changed (void);
+        Document      * load (const char * name);
+};
+
+bool TextStore :: changed (void) {
+        bool            result = m_changed;
+        m_changed = false;
+        return result;
+}
+
+Document * TextStore :: load (const char * name) {
+        ++ m_loads;
+
+        char            path [2 * MAX_PATH];
+        snprintf (path, sizeof (path), "%s/%s", m_root, name);
+
+        FILE          * file = fopen (path, "rb");
+        if (file == 0)
+                return 0;
+
+        char            text [4096];
+        size_t          length = fread (text, 1, sizeof (text) - 1, file);
+        fclose (file);
+        text [length] = 0;
+
+        wchar_t         wide [4096];
+        if (MultiByteToWideChar (CP_UTF8, 0, text, -1, wide, 4096) == 0)
+                return 0;
+
+        return g_makeDocument (200, 0, wide);
+}
+
+/**
+ * Replace a file in one go, as an editor saving it would.
+ */
+
+static void l_write (const char * root, const char * name, const char * text) {
+        char            temp [2 * MAX_PATH];
+        char            path [2 * MAX_PATH];
+        snprintf (temp, sizeof (temp), "%s/new", root);
+        snprintf (path, sizeof (path), "%s/%s", root, name);
+
+        FILE          * file = fopen (temp, "wb");
+        fputs (text, file);
+        fclose (file);
+        rename (temp, path);
+}
+
+/**
+ * Check the body of a document, and that its header gives the right length.
+ */
+
+static bool l_body (const Document * doc, const char * text) {
+        if (doc == 0)
+                return false;
+
+        unsigned long   length = strlen (text);
+        char            expect [64];
+        sprintf (expect, "\r\nContent-Length: %lu\r\n", length);
+
+        return doc->m_bodyLength == length &&
+               memcmp (doc->m_body, text, length) == 0 &&
+               memmem (doc->m_head, doc->m_headLength, expect,
+                       strlen (expect)) != 0;
+}
+
+/**
+ * Check the documents made for status rules.
+ */
+
+static void l_checkStatus (void) {
+        Document      * found = g_findDocument (404, 0);
+        CHECK (found != 0 && l_body (found, ""));
+        CHECK (memcmp (found->m_head, "HTTP/1.1 404 ", 13) == 0);
+        CHECK (memcmp (found->m_head + found->m_split - 2, "\r\n", 2) == 0);
+
+        /*
+         * The same rule gets the same document, and another doesn't.
+         */
+
+        Document      * again = g_findDocument (404, 0);
+        Document      * other = g_findDocument (403, 0);
+        CHECK (again == found && other != found);
+        g_documentRelease (found);
+        g_documentRelease (again);
+        g_documentRelease (other);
+
+        found = g_findDocument (200, "one~two");
+        CHECK (l_body (found, "one\ntwo"));
+        g_documentRelease (found);
+
+        static  const char      location [] =
+                "\r\nLocation: http://a.example/\r\n";
+        found = g_findDocument (302, "http://a.example/");
+        CHECK (found != 0 &&
+               memmem (found->m_head, found->m_headLength, location,
+                       sizeof (location) - 1) != 0);
+        g_documentRelease (found);
+
+        CHECK (g_findDocument (302, 0) == 0);
+}
+
+/**
+ * Check named documents being loaded once, and again after a change.
+ */
+
+static void l_checkNamed (TextStore & store) {
+        static  const char      text [] = "h\xC3\xA9llo w\xC3\xB6rld";
+        l_write (store.m_root, "hello", text);
+
+        Document      * found = g_findDocument ("hello");
+        CHECK (l_body (found, text));
+        CHECK (store.m_loads == 1);
+
+        Document      * again = g_findDocument ("hello");
+        CHECK (again == found && store.m_loads == 1);
+        g_documentRelease (again);
+
+        CHECK (g_findDocument ("missing") == 0);
+
+        /*
+         * After a change, the document is loaded afresh; anyone still sending
+         * the old one carries on with it.
+         */
+
+        unsigned long   loads = store.m_loads;
+        l_write (store.m_root, "hello", "goodbye");
+        store.m_changed = true;
+
+        again = g_findDocument ("hello");
+        CHECK (again != found && l_body (again, "goodbye"));
+        CHECK (store.m_loads == loads + 1);
+        CHECK (l_body (found, text));
+        g_documentRelease (found);
+        g_documentRelease (again);
+
+        g_flushDocuments ();
+        again = g_findDocument ("hello");
+        CHECK (l_body (again, "goodbye") && store.m_loads == loads + 2);
+        g_documentRelease (again);
+}
+
+/**
+ * Check documents mapped from files, with the names which would climb out of
+ * the directory refused, and a change to a file being noticed once the store
+ * gets round to looking.
+ */
+
+static void l_checkFiles (const char * root) {
+        l_write (root, "page.html", "<p>first</p>");
+
+        Document      * found = g_findDocument ("file:page.html");
+        CHECK (l_body (found, "<p>first</p>") && found->m_view != 0);
+
+        static  const char    * refused [] = {
+                "file:../page.html", "file:/etc/passwd", "file:c:page.html",
+                "file:a/../../page.html", "file:", 0
+        };
+
+        for (const char ** name = refused ; * name != 0 ; ++ name)
+                CHECK (g_findDocument (* name) == 0);
+
+        l_write (root, "page.html", "<p>second</p>");
+
+        shimTicks () += 500;
+        Document      * again = g_findDocument ("file:page.html");
+        CHECK (again == found);
+        g_documentRelease (again);
+
+        shimTicks () += 600;
+        again = g_findDocument ("file:page.html");
+        CHECK (again != found && l_body (again, "<p>second</p>"));
+        CHECK (l_body (found, "<p>first</p>"));
+        g_documentRelease (found);
+        g_documentRelease (again);
+}
+
+/**
+ * Measure serving a named document from the cache, against loading it for
+ * every response as used to be done.
+ */
+
+static void l_benchmark (TextStore & store) {
+        const int       count = 100000;
+        double          start = checkNow ();
+        for (int i = 0 ; i < count ; ++ i)
+                g_documentRelease (g_findDocument ("hello"));
+        double          cached = (checkNow () - start) / count;
+
+        const int       loads = 10000;
+        start = checkNow ();
+        for (int i = 0 ; i < loads ; ++ i)
+                g_documentRelease (store.load ("hello"));
+        double          loaded = (checkNow () - start) / loads;
+
+        printf ("documents: %.1f ns cached, %.1f ns loaded each time\n",
+                cached, loaded);
+}
+
+int main (void) {
+        char            root [] = "/tmp/documenttest.XXXXXX";
+        if (mkdtemp (root) == 0) {
+                printf ("documenttest: can't make a directory, skipped\n");
+                return 0;
+        }
+
+        wchar_t         wideRoot [MAX_PATH];
+        MultiByteToWideChar (CP_UTF8, 0, root, -1, wideRoot, MAX_PATH);
+
+        shimTicks () = 1000;
+        TextStore     * store = new TextStore (root);
+        g_setDocumentStore (store);
+        g_setFileStore (new FileStore (wideRoot));
+
+        l_checkStatus ();
+        l_checkNamed (* store);
+        l_checkFiles (root);
+        l_benchmark (* store);
+
+        g_setDocumentStore (0);
+        g_setFileStore (0);
+        CHECK (l_outstanding == 0);
+
+        char            path [2 * MAX_PATH];
+        snprintf (path, sizeof (path), "%s/hello", root);
+        unlink (path);
+        snprintf (path, sizeof (path), "%s/page.html", root);
+        unlink (path);
+        rmdir (root);
+
+        return checkDone ("documenttest");
+}
+
+/**@}*/
@@ -0,0 +1,330 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests connect failover between the targets of a rule.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check connect failover and racing against servers on the loopback interface
+ * which answer, refuse, or never answer at all, for both blocking sockets and
+ * ones the client has made non-blocking.
+ *
+ * The health checker, the connection pool, the flow mirror and the ticker
+ * are replaced by stand-ins the test controls; the background thread's calls
+ * are made by the test itself.
+ */
+
+#include "steamfilter/failover.h"
+#include "steamfilter/filterrule.h"
+#include "steamfilter/health.h"
+#include "steamfilter/mirror.h"
+#include "steamfilter/race.h"
+#include "steamfilter/replace.h"
+#include "steamfilter/ticker.h"
+#include "steamfilter/warm.h"
+#include "check.h"
+#include "standins.h"
+#include "netstandins.h"
+
+/**
+ * The servers: one which answers, one which refuses, another which refuses so
+ * that there can be two, and one which never answers.
+ */
+
+enum {
+        ANSWER,
+        REFUSE,
+        REFUSE_TOO,
+        HANG,
+        SERVERS
+};
+
+static  sockaddr_in     l_addr [SERVERS];
+static  int             l_listener [SERVERS];
+static  int             l_filler;
+
+/**
+ * Stand-ins for the modules failover works with.
+ */
+
+static  TickFunc        l_tick;
+static  unsigned short  l_downPort;
+static  unsigned short  l_fastPort;
+static  unsigned short  l_warmPort;
+static  unsigned short  l_givenPort;
+static  unsigned short  l_mirroredPort;
+
+bool g_tickerAdd (TickFunc func, unsigned long interval) {
+        l_tick = func;
+        return true;
+}
+
+bool g_healthDown (unsigned long addr, unsigned short port) {
+        return port == l_downPort;
+}
+
+unsigned long g_healthRtt (unsigned long addr, unsigned short port) {
+        return port == l_fastPort ? 10 : 0;
+}
+
+bool g_warmReady (const sockaddr_in & addr) {
+        return addr.sin_port == l_warmPort;
+}
+
+void g_warmGive (const sockaddr_in & addr, SOCKET s) {
+        if (s == INVALID_SOCKET)
+                return;
+
+        l_givenPort = addr.sin_port;
+        l_closesocket (s);
+}
+
+void g_mirrorConnect (SOCKET handle, unsigned long addr,
+                      unsigned short port) {
+        l_mirroredPort = port;
+}
+
+WSAEVENT g_findEventHandle (SOCKET handle) {
+        return 0;
+}
+
+/**
+ * Set up the servers.
+ */
+
+static bool l_listen (void) {
+        l_listener [ANSWER] = l_server (128, l_addr [ANSWER]);
+        l_listener [REFUSE] = l_server (-1, l_addr [REFUSE]);
+        l_listener [REFUSE_TOO] = l_server (-1, l_addr [REFUSE_TOO]);
+        l_listener [HANG] = l_hungServer (l_addr [HANG], l_filler);
+
+        for (int i = 0 ; i < SERVERS ; ++ i)
+                if (l_listener [i] < 0)
+                        return false;
+
+        return true;
+}
+
+/**
+ * Make up the targets of a rule listing some of the servers, with the first
+ * being the one the rule chose.
+ */
+
+static RuleTargets l_targets (int first, int second, unsigned long failover,
+                              unsigned long race = 0) {
+        RuleTargets     targets;
+        memset (& targets, 0, sizeof (targets));
+        targets.m_count = 2;
+        targets.m_port [0] = l_addr [first].sin_port;
+        targets.m_port [1] = l_addr [second].sin_port;
+        targets.m_options.m_failover = failover;
+        targets.m_options.m_race = race;
+        return targets;
+}
+
+/**
+ * Connect a client socket through failover, returning the result of the
+ * connect, the port it ended up connected to, and how long it took.
+ */
+
+static int l_connectVia (int chosen, const RuleTargets & targets,
+                         unsigned short & port, unsigned long & elapsed) {
+        SOCKET          s = socket (AF_INET, SOCK_STREAM, 0);
+        unsigned long   start = GetTickCount ();
+        int             result = g_failoverConnect (s, l_addr [chosen],
+                                                    l_addr [chosen], targets);
+        elapsed = GetTickCount () - start;
+
+        sockaddr_in     peer;
+        socklen_t       length = sizeof (peer);
+        port = 0;
+        if (getpeername (s, (sockaddr *) & peer, & length) == 0)
+                port = peer.sin_port;
+
+        close (s);
+        return result;
+}
+
+/**
+ * Check a blocking connect being failed over, or not, as the rule says.
+ */
+
+static void l_checkBlocking (void) {
+        unsigned short  port;
+        unsigned long   elapsed;
+        unsigned short  answer = l_addr [ANSWER].sin_port;
+
+        /*
+         * Without the option, a refused connect is the client's problem, but
+         * the flow mirror still hears where the connection went.
+         */
+
+        RuleTargets     targets = l_targets (REFUSE, ANSWER, 0);
+        CHECK (l_connectVia (REFUSE, targets, port, elapsed) == SOCKET_ERROR);
+        CHECK (l_mirroredPort == l_addr [REFUSE].sin_port);
+
+        /*
+         * With it, a refusal moves straight on to the next target, and the
+         * winning probe is handed over rather than thrown away.
+         */
+
+        unsigned long   closed = l_closed;
+        targets = l_targets (REFUSE, ANSWER, 1000);
+        CHECK (l_connectVia (REFUSE, targets, port, elapsed) == 0);
+        CHECK (port == answer && elapsed < 500);
+        CHECK (l_mirroredPort == answer && l_givenPort == answer);
+        CHECK (l_closed == closed + 2);
+
+        /*
+         * A server which doesn't answer at all gets the whole deadline.
+         */
+
+        targets = l_targets (HANG, ANSWER, 200);
+        CHECK (l_connectVia (HANG, targets, port, elapsed) == 0);
+        CHECK (port == answer && elapsed >= 200 && elapsed < 600);
+
+        /*
+         * With nowhere to go, the client gets the error for the target the
+         * rule chose; a target the health checker has marked down isn't
+         * tried.
+         */
+
+        targets = l_targets (REFUSE, REFUSE_TOO, 1000);
+        CHECK (l_connectVia (REFUSE, targets, port, elapsed) == SOCKET_ERROR);
+
+        l_downPort = answer;
+        targets = l_targets (REFUSE, ANSWER, 1000);
+        CHECK (l_connectVia (REFUSE, targets, port, elapsed) == SOCKET_ERROR);
+        l_downPort = 0;
+}
+
+/**
+ * Check a ranked race, and a target with a connection ready in the pool going
+ * ahead without a probe.
+ */
+
+static void l_checkRanked (void) {
+        unsigned short  port;
+        unsigned long   elapsed;
+        unsigned short  answer = l_addr [ANSWER].sin_port;
+
+        /*
+         * The target that has been fastest goes first, even though the rule
+         * chose the other.
+         */
+
+        l_fastPort = answer;
+        RuleTargets     targets = l_targets (HANG, ANSWER, 1000, 2);
+        CHECK (l_connectVia (HANG, targets, port, elapsed) == 0);
+        CHECK (port == answer && elapsed < RACE_STAGGER);
+        l_fastPort = 0;
+
+        l_warmPort = answer;
+        l_givenPort = 0;
+        unsigned long   closed = l_closed;
+        targets = l_targets (ANSWER, HANG, 1000);
+        CHECK (l_connectVia (ANSWER, targets, port, elapsed) == 0);
+        CHECK (port == answer && l_givenPort == 0 && l_closed == closed);
+        l_warmPort = 0;
+}
+
+/**
+ * Check a non-blocking connect, with the race stepped along by the ticker.
+ */
+
+static void l_checkNonBlocking (void) {
+        unsigned short  answer = l_addr [ANSWER].sin_port;
+
+        SOCKET          s = socket (AF_INET, SOCK_STREAM, 0);
+        fcntl (s, F_SETFL, O_NONBLOCK);
+        g_failoverMode (s, true);
+        CHECK (g_failoverNonBlocking (s));
+
+        RuleTargets     targets = l_targets (HANG, ANSWER, 100);
+        int             result = g_failoverConnect (s, l_addr [HANG],
+                                                    l_addr [HANG], targets);
+        CHECK (result == SOCKET_ERROR && GetLastError () == WSAEWOULDBLOCK);
+        CHECK (g_anyFailover () && g_failoverBusy (s));
+
+        for (int i = 0 ; i < 500 && g_anyFailover () ; ++ i) {
+                usleep (2000);
+                (* l_tick) (GetTickCount ());
+        }
+
+        CHECK (! g_failoverBusy (s));
+
+        pollfd          wait = { s, POLLOUT, 0 };
+        CHECK (poll (& wait, 1, 1000) == 1);
+
+        sockaddr_in     peer;
+        socklen_t       length = sizeof (peer);
+        CHECK (getpeername (s, (sockaddr *) & peer, & length) == 0);
+        CHECK (peer.sin_port == answer);
+
+        g_failoverClose (s);
+        CHECK (! g_failoverNonBlocking (s));
+        close (s);
+
+        /*
+         * Closing a socket while its race is going abandons the race.
+         */
+
+        s = socket (AF_INET, SOCK_STREAM, 0);
+        fcntl (s, F_SETFL, O_NONBLOCK);
+        g_failoverMode (s, true);
+
+        unsigned long   closed = l_closed;
+        g_failoverConnect (s, l_addr [HANG], l_addr [HANG], targets);
+        (* l_tick) (GetTickCount ());
+        g_failoverClose (s);
+        CHECK (! g_anyFailover () && l_closed == closed + 1);
+        close (s);
+}
+
+int main (void) {
+        if (! l_listen ()) {
+                printf ("failovertest: can't set up listeners, skipped\n");
+                return 0;
+        }
+
+        l_netStandins ();
+        CHECK (g_failoverInit () && l_tick != 0);
+
+        l_checkBlocking ();
+        l_checkRanked ();
+        l_checkNonBlocking ();
+
+        g_failoverUnload ();
+        CHECK (l_outstanding == 0);
+
+        return checkDone ("failovertest");
+}
+
+/**@}*/
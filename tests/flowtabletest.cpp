@@ -0,0 +1,308 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the table of decisions made for datagram flows, and times the
+ * locked lookups the send hooks make in it.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check the datagram flow table on a simulated clock, and time lookups of
+ * the flows a busy client would have going at once.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "steamfilter/flowtable.h"
+#include "steamfilter/datagram.h"
+#include "check.h"
+
+/**
+ * The tables are too big to want on the stack.
+ */
+
+static  FlowTable       l_table;
+
+/**
+ * Make up a route.
+ */
+
+static FlowRoute l_route (unsigned long action, unsigned long addr = 0,
+                          unsigned short port = 0) {
+        FlowRoute       route;
+        route.m_action = action;
+        route.m_addr = addr;
+        route.m_port = port;
+        return route;
+}
+
+/**
+ * Check the decisions kept for flows, and the way redirected flows map back.
+ */
+
+static void l_checkRoutes (void) {
+        l_table.flush ();
+
+        FlowRoute       route;
+        CHECK (! l_table.lookup (4, 0x0100000A, 27015, 0, route));
+
+        l_table.store (4, 0x0100000A, 27015, l_route (FLOW_DROP), 0);
+        CHECK (l_table.lookup (4, 0x0100000A, 27015, 10, route));
+        CHECK (route.m_action == FLOW_DROP);
+
+        /*
+         * Flows are kept apart by socket as well as destination.
+         */
+
+        CHECK (! l_table.lookup (8, 0x0100000A, 27015, 10, route));
+        CHECK (! l_table.lookup (4, 0x0100000A, 27016, 10, route));
+
+        l_table.store (8, 0x0100000A, 27015,
+                       l_route (FLOW_REDIRECT, 0x0200000A, 27017), 10);
+        CHECK (l_table.lookup (8, 0x0100000A, 27015, 20, route));
+        CHECK (route.m_action == FLOW_REDIRECT);
+        CHECK (route.m_addr == 0x0200000A && route.m_port == 27017);
+        CHECK (l_table.reversing () == 1);
+
+        unsigned long   addr = 0x0200000A;
+        unsigned short  port = 27017;
+        CHECK (l_table.reverse (8, addr, port, 20));
+        CHECK (addr == 0x0100000A && port == 27015);
+
+        addr = 0x0200000A;
+        port = 27017;
+        CHECK (! l_table.reverse (4, addr, port, 20));
+        CHECK (addr == 0x0200000A && port == 27017);
+
+        /*
+         * Once the socket sends to the new destination directly, datagrams
+         * from there are really from there.
+         */
+
+        l_table.store (8, 0x0200000A, 27017, l_route (FLOW_PASS), 30);
+        CHECK (! l_table.reverse (8, addr, port, 30));
+        CHECK (l_table.reversing () == 0);
+
+        CHECK (l_table.hits () == 2);
+        CHECK (l_table.misses () == 3);
+}
+
+/**
+ * Check that decisions are forgotten when a flow goes quiet, when its socket
+ * is closed, and when the table is flushed.
+ */
+
+static void l_checkForget (void) {
+        l_table.flush ();
+
+        FlowRoute       route;
+        l_table.store (4, 0x0100000A, 27015, l_route (FLOW_PASS), 1000);
+        CHECK (l_table.lookup (4, 0x0100000A, 27015, 1000 + FLOW_IDLE,
+                               route));
+        CHECK (l_table.lookup (4, 0x0100000A, 27015, 1000 + 2 * FLOW_IDLE,
+                               route));
+        CHECK (! l_table.lookup (4, 0x0100000A, 27015,
+                                 1001 + 3 * FLOW_IDLE, route));
+
+        l_table.store (4, 0x0100000A, 27015,
+                       l_route (FLOW_REDIRECT, 0x0200000A, 27017), 0);
+        l_table.store (8, 0x0100000A, 27015,
+                       l_route (FLOW_REDIRECT, 0x0200000A, 27017), 0);
+        CHECK (l_table.reversing () == 2);
+
+        l_table.close (4);
+        CHECK (! l_table.lookup (4, 0x0100000A, 27015, 0, route));
+        CHECK (l_table.lookup (8, 0x0100000A, 27015, 0, route));
+        CHECK (l_table.reversing () == 1);
+
+        l_table.flush ();
+        CHECK (! l_table.lookup (8, 0x0100000A, 27015, 0, route));
+        CHECK (l_table.reversing () == 0);
+}
+
+/**
+ * Check that overfilling the table replaces older flows rather than newer
+ * ones, and that the count of reverse mappings stays true throughout.
+ */
+
+static void l_checkFull (void) {
+        l_table.flush ();
+
+        unsigned long   evictions = l_table.evictions ();
+        unsigned long   count = FLOW_TABLE_SIZE * 4;
+        unsigned long   i;
+        for (i = 0 ; i < count ; ++ i)
+                l_table.store (4, 0x0100000A + (i << 8), 27015,
+                               l_route (FLOW_REDIRECT, 0x0200000A + (i << 8),
+                                        27017), i);
+
+        CHECK (l_table.evictions () > evictions);
+
+        unsigned long   found = 0;
+        unsigned long   reversed = 0;
+        unsigned long   recent = 0;
+        FlowRoute       route;
+        for (i = 0 ; i < count ; ++ i) {
+                if (l_table.lookup (4, 0x0100000A + (i << 8), 27015, count,
+                                    route)) {
+                        ++ found;
+                        if (i >= count - FLOW_TABLE_SIZE / 2)
+                                ++ recent;
+                }
+
+                unsigned long   addr = 0x0200000A + (i << 8);
+                unsigned short  port = 27017;
+                if (l_table.reverse (4, addr, port, count))
+                        ++ reversed;
+        }
+
+        CHECK (found <= FLOW_TABLE_SIZE);
+        CHECK (reversed == l_table.reversing ());
+        CHECK (recent > FLOW_TABLE_SIZE / 2 * 9 / 10);
+}
+
+/**
+ * Check that the millisecond tick count wrapping around does no harm, where
+ * "unsigned long" is 32 bits wide as it is for the filter.
+ */
+
+static void l_checkWrap (void) {
+        if (sizeof (unsigned long) != 4)
+                return;
+
+        l_table.flush ();
+
+        FlowRoute       route;
+        unsigned long   start = 0xFFFFF000UL;
+        l_table.store (4, 0x0100000A, 27015, l_route (FLOW_PASS), start);
+        CHECK (l_table.lookup (4, 0x0100000A, 27015, start + FLOW_IDLE,
+                               route));
+        CHECK (! l_table.lookup (4, 0x0100000A, 27015,
+                                 start + 2 * FLOW_IDLE + 1, route));
+}
+
+/**
+ * Time the lookups made for each datagram sent, with as many flows going as a
+ * busy game client might have.
+ */
+
+static void l_time (void) {
+        l_table.flush ();
+
+        unsigned long   flows = 64;
+        unsigned long   i;
+        for (i = 0 ; i < flows ; ++ i)
+                l_table.store (4 + (i & 3) * 4, 0x0100000A + (i << 8),
+                               27015, l_route (FLOW_PASS), 0);
+
+        unsigned long   count = 4000000;
+        unsigned long   hits = 0;
+        FlowRoute       route;
+        double          start = checkNow ();
+        for (i = 0 ; i < count ; ++ i) {
+                unsigned long   flow = i % flows;
+                hits += l_table.lookup (4 + (flow & 3) * 4,
+                                        0x0100000A + (flow << 8), 27015,
+                                        i / 1000, route);
+        }
+
+        double          elapsed = checkNow () - start;
+        CHECK (hits == count);
+        printf ("flow lookups: %.1f ns each\n", elapsed / count);
+}
+
+/**
+ * Time what the send hooks pay for each datagram as they're built, which is a
+ * lookup in the shared table under its lock while the rules have any for
+ * datagrams, and no more than checking a flag when they don't.
+ */
+
+static void l_timeHook (void) {
+        g_datagramInit ();
+        g_datagramFlush (true);
+        CHECK (g_anyDatagramRule ());
+
+        sockaddr_in     to;
+        memset (& to, 0, sizeof (to));
+        to.sin_family = AF_INET;
+        to.sin_port = htons (27015);
+
+        unsigned long   flows = 64;
+        unsigned long   i;
+        for (i = 0 ; i < flows ; ++ i) {
+                to.sin_addr.S_un.S_addr = 0x0100000A + (i << 8);
+                g_datagramStore (4 + (i & 3) * 4, to,
+                                 l_route (FLOW_REDIRECT, 0x0200000A, 27017));
+        }
+
+        unsigned long   count = 4000000;
+        double          elapsed [2];
+        unsigned long   pass;
+        for (pass = 0 ; pass < 2 ; ++ pass) {
+                unsigned long   routed = 0;
+                FlowRoute       route;
+                double          start = checkNow ();
+                for (i = 0 ; i < count ; ++ i) {
+                        unsigned long   flow = i % flows;
+                        to.sin_addr.S_un.S_addr = 0x0100000A + (flow << 8);
+                        if (g_anyDatagramRule () &&
+                            g_datagramFind (4 + (flow & 3) * 4, to, route))
+                                ++ routed;
+                }
+
+                elapsed [pass] = checkNow () - start;
+                CHECK (routed == (pass == 0 ? count : 0));
+
+                g_datagramFlush (false);
+        }
+
+        CHECK (! g_anyDatagramRule ());
+        printf ("datagram sends: %.1f ns locked lookup, %.1f ns without udp "
+                "rules\n", elapsed [0] / count, elapsed [1] / count);
+
+        g_datagramUnload ();
+}
+
+int main (void) {
+        l_checkRoutes ();
+        l_checkForget ();
+        l_checkFull ();
+        l_checkWrap ();
+        l_time ();
+        l_timeHook ();
+
+        return checkDone ("flowtabletest");
+}
+
+/**@}*/
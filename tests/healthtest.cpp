@@ -0,0 +1,255 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the health checking of the servers rules redirect to.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check the health checker against servers on the loopback interface which
+ * are started and stopped under it, with the background thread's calls made
+ * by the test on a simulated clock.
+ *
+ * The check of a web server is only exercised where the test can listen on
+ * the HTTP port, since that's the only one it's done for.
+ */
+
+#include "steamfilter/health.h"
+#include "steamfilter/ticker.h"
+#include "check.h"
+#include "netstandins.h"
+
+/**
+ * Stand-in for the ticker.
+ */
+
+static  TickFunc        l_tick;
+
+bool g_tickerAdd (TickFunc func, unsigned long interval) {
+        l_tick = func;
+        return true;
+}
+
+/**
+ * Get the counters for one server.
+ */
+
+static HealthStats l_stats (const sockaddr_in & addr) {
+        HealthStats     stats [HEALTH_TARGETS_MAX];
+        unsigned long   count = g_healthStats (stats, HEALTH_TARGETS_MAX);
+
+        HealthStats     none;
+        memset (& none, 0, sizeof (none));
+        for (unsigned long i = 0 ; i < count ; ++ i)
+                if (stats [i].m_port == addr.sin_port)
+                        return stats [i];
+
+        return none;
+}
+
+/**
+ * Run the background thread's calls until a server's check is over, without
+ * moving the simulated clock.
+ */
+
+static void l_settle (const sockaddr_in & addr) {
+        unsigned long   probes = l_stats (addr).m_probes;
+        for (int i = 0 ; i < 200 ; ++ i) {
+                (* l_tick) (GetTickCount ());
+                if (l_stats (addr).m_probes != probes)
+                        return;
+
+                usleep (500);
+        }
+}
+
+/**
+ * Check a server being marked down and back up as it's stopped and started,
+ * only once checks in a row agree.
+ */
+
+static void l_checkUpDown (void) {
+        sockaddr_in     addr;
+        int             server = l_server (16, addr);
+
+        CHECK (! g_healthDown (addr.sin_addr.S_un.S_addr, addr.sin_port));
+        l_settle (addr);
+
+        HealthStats     stats = l_stats (addr);
+        CHECK (stats.m_probes == 1 && stats.m_failures == 0 && ! stats.m_down);
+
+        /*
+         * Checks are only made every so often.
+         */
+
+        shimTicks () += HEALTH_INTERVAL - 1;
+        (* l_tick) (GetTickCount ());
+        CHECK (l_stats (addr).m_probes == 1);
+
+        close (server);
+        server = l_server (-1, addr, addr.sin_port);
+
+        shimTicks () += 1;
+        l_settle (addr);
+        stats = l_stats (addr);
+        CHECK (stats.m_probes == 2 && stats.m_failures == 1);
+        CHECK (! g_healthDown (addr.sin_addr.S_un.S_addr, addr.sin_port));
+
+        shimTicks () += HEALTH_INTERVAL;
+        l_settle (addr);
+        CHECK (g_healthDown (addr.sin_addr.S_un.S_addr, addr.sin_port));
+        CHECK (l_stats (addr).m_transitions == 1);
+
+        close (server);
+        server = l_server (16, addr, addr.sin_port);
+
+        shimTicks () += HEALTH_INTERVAL;
+        l_settle (addr);
+        CHECK (g_healthDown (addr.sin_addr.S_un.S_addr, addr.sin_port));
+
+        shimTicks () += HEALTH_INTERVAL;
+        l_settle (addr);
+        CHECK (! g_healthDown (addr.sin_addr.S_un.S_addr, addr.sin_port));
+
+        stats = l_stats (addr);
+        CHECK (stats.m_probes == 5 && stats.m_failures == 2);
+        CHECK (stats.m_transitions == 2);
+
+        close (server);
+}
+
+/**
+ * Check a server which never answers being given up on, and servers the
+ * rules have stopped asking about being dropped.
+ */
+
+static void l_checkTimeout (void) {
+        sockaddr_in     addr;
+        int             filler;
+        int             server = l_hungServer (addr, filler);
+
+        g_healthDown (addr.sin_addr.S_un.S_addr, addr.sin_port);
+        (* l_tick) (GetTickCount ());
+        usleep (10000);
+        (* l_tick) (GetTickCount ());
+        CHECK (l_stats (addr).m_probes == 0);
+
+        shimTicks () += HEALTH_TIMEOUT + 1;
+        (* l_tick) (GetTickCount ());
+        CHECK (l_stats (addr).m_failures == 1);
+
+        shimTicks () += HEALTH_IDLE + 1;
+        (* l_tick) (GetTickCount ());
+
+        HealthStats     stats [HEALTH_TARGETS_MAX];
+        CHECK (g_healthStats (stats, HEALTH_TARGETS_MAX) == 0);
+
+        close (filler);
+        close (server);
+}
+
+/**
+ * Check a web server, which has to answer a request as well as accept the
+ * connection; the time it takes to answer is what the ranking goes on.
+ */
+
+static bool l_answer (int server, unsigned long delay, const char * reply) {
+        int             s = -1;
+        char            request [64];
+        int             length = 0;
+
+        for (int i = 0 ; i < 200 && length <= 0 ; ++ i) {
+                (* l_tick) (GetTickCount ());
+                if (s < 0)
+                        s = accept (server, 0, 0);
+                if (s >= 0)
+                        length = recv (s, request, sizeof (request),
+                                       MSG_DONTWAIT);
+
+                usleep (500);
+        }
+
+        if (length <= 0)
+                return false;
+
+        shimTicks () += delay;
+        send (s, reply, strlen (reply), 0);
+        close (s);
+        return true;
+}
+
+static void l_checkWeb (void) {
+        sockaddr_in     addr;
+        int             server = l_server (16, addr, htons (80));
+        if (server < 0) {
+                printf ("healthtest: can't listen on the HTTP port, "
+                        "skipped that\n");
+                return;
+        }
+
+        const char    * ok = "HTTP/1.0 200 OK\r\n\r\n";
+        unsigned long   host = addr.sin_addr.S_un.S_addr;
+        g_healthDown (host, addr.sin_port);
+        CHECK (l_answer (server, 8, ok));
+        l_settle (addr);
+        CHECK (g_healthRtt (host, addr.sin_port) == 8);
+
+        shimTicks () += HEALTH_INTERVAL;
+        CHECK (l_answer (server, 16, ok));
+        l_settle (addr);
+        CHECK (g_healthRtt (host, addr.sin_port) == 9);
+        CHECK (l_stats (addr).m_lastRtt == 16);
+
+        /*
+         * Something other than a web server answering doesn't count.
+         */
+
+        shimTicks () += HEALTH_INTERVAL;
+        CHECK (l_answer (server, 1, "SSH-2.0-OpenSSH\r\n"));
+        l_settle (addr);
+        CHECK (l_stats (addr).m_failures == 1);
+
+        close (server);
+}
+
+int main (void) {
+        l_netStandins ();
+        shimTicks () = 1000;
+        CHECK (g_healthInit () && l_tick != 0);
+
+        l_checkUpDown ();
+        l_checkTimeout ();
+        l_checkWeb ();
+
+        g_healthReport ();
+        g_healthUnload ();
+        return checkDone ("healthtest");
+}
+
+/**@}*/
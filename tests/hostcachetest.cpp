@@ -0,0 +1,332 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the cache of host lookup answers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check the host lookup cache against a stub resolver and a simulated clock.
+ *
+ * The stub knows a few names, fails any others, and counts how often it's
+ * asked; lookups go through the cache the way the hooks use it, going to the
+ * resolver only on a miss, and a background refresher is simulated the same
+ * way the filter's ticker drives it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "steamfilter/hostcache.h"
+#include "check.h"
+
+/**
+ * Count of the times the stub resolver was asked.
+ */
+
+static  unsigned long   l_resolved;
+
+/**
+ * The stub resolver; a name of the form "hostN.example" resolves to 10.0.0.N,
+ * anything else fails.
+ */
+
+static void l_resolve (const char * name, HostAnswer & answer) {
+        ++ l_resolved;
+        memset (& answer, 0, sizeof (answer));
+
+        unsigned int    index;
+        char            end;
+        if (sscanf (name, "host%u.exampl%c", & index, & end) != 2 ||
+            end != 'e') {
+                answer.m_error = 11001;
+                return;
+        }
+
+        answer.m_count = 1;
+        answer.m_addrs [0] = 10 | index << 24;
+        sprintf (answer.m_name, "host%u.example", index);
+}
+
+/**
+ * Look a name up as the hooks do, through the cache.
+ */
+
+static HostAnswer l_lookup (HostCache & cache, const char * name,
+                            unsigned long now) {
+        HostAnswer      answer;
+        if (! cache.lookup (name, now, answer)) {
+                l_resolve (name, answer);
+                cache.store (name, answer, now);
+        }
+
+        return answer;
+}
+
+/**
+ * Run the background refresh, as the ticker does.
+ */
+
+static void l_refresh (HostCache & cache, unsigned long now) {
+        char            name [HOST_CACHE_NAME_MAX];
+        while (cache.refreshDue (now, name, sizeof (name))) {
+                HostAnswer      answer;
+                l_resolve (name, answer);
+                cache.store (name, answer, now);
+        }
+}
+
+/**
+ * Check that answers are kept for as long as they should be, and no longer.
+ */
+
+static void l_checkLifetime (void) {
+        HostCache       cache;
+        CHECK (! cache.active ());
+
+        l_resolved = 0;
+        l_lookup (cache, "host1.example", 0);
+        l_lookup (cache, "host1.example", 0);
+        CHECK (l_resolved == 2);
+
+        cache.configure (60000, 10000);
+        CHECK (cache.active ());
+
+        l_resolved = 0;
+        HostAnswer      answer = l_lookup (cache, "host1.example", 1000);
+        CHECK (answer.m_error == 0 && answer.m_count == 1);
+        CHECK (answer.m_addrs [0] == (10 | 1UL << 24));
+
+        answer = l_lookup (cache, "HOST1.Example", 60999);
+        CHECK (l_resolved == 1);
+        CHECK (answer.m_addrs [0] == (10 | 1UL << 24));
+        CHECK (strcmp (answer.m_name, "host1.example") == 0);
+
+        l_lookup (cache, "host1.example", 61000);
+        CHECK (l_resolved == 2);
+
+        /*
+         * A name that doesn't exist is remembered, but not for as long.
+         */
+
+        answer = l_lookup (cache, "nowhere.example", 100000);
+        CHECK (answer.m_error != 0 && answer.m_count == 0);
+        l_lookup (cache, "nowhere.example", 109999);
+        CHECK (l_resolved == 3);
+        l_lookup (cache, "nowhere.example", 110000);
+        CHECK (l_resolved == 4);
+
+        CHECK (cache.hits () == 2);
+        CHECK (cache.misses () == 4);
+
+        /*
+         * Changing the lifetimes starts afresh.
+         */
+
+        cache.configure (30000, 5000);
+        l_lookup (cache, "host1.example", 110001);
+        CHECK (l_resolved == 5);
+}
+
+/**
+ * Check the limits on what's kept: names too long to keep, and the table
+ * being full.
+ */
+
+static void l_checkLimits (void) {
+        HostCache       cache;
+        cache.configure (60000, 10000);
+
+        char            name [HOST_CACHE_NAME_MAX + 20];
+        memset (name, 'a', sizeof (name) - 1);
+        name [sizeof (name) - 1] = 0;
+
+        l_resolved = 0;
+        l_lookup (cache, name, 0);
+        l_lookup (cache, name, 0);
+        CHECK (l_resolved == 2);
+
+        /*
+         * Fill the table, using every name but the first again so that the
+         * first is the one that goes when another name is added.
+         */
+
+        unsigned long   i;
+        for (i = 0 ; i < HOST_CACHE_SIZE ; ++ i) {
+                sprintf (name, "host%lu.example", i);
+                l_lookup (cache, name, i);
+        }
+
+        for (i = 1 ; i < HOST_CACHE_SIZE ; ++ i) {
+                sprintf (name, "host%lu.example", i);
+                l_lookup (cache, name, 1000 + i);
+        }
+
+        l_resolved = 0;
+        l_lookup (cache, "host999.example", 2000);
+        CHECK (l_resolved == 1);
+
+        for (i = 1 ; i < HOST_CACHE_SIZE ; ++ i) {
+                sprintf (name, "host%lu.example", i);
+                l_lookup (cache, name, 3000);
+        }
+
+        CHECK (l_resolved == 1);
+        l_lookup (cache, "host0.example", 3000);
+        CHECK (l_resolved == 2);
+}
+
+/**
+ * Check which entries are refreshed ahead of time, and when.
+ */
+
+static void l_checkRefresh (void) {
+        HostCache       cache;
+        cache.configure (60000, 10000);
+
+        char            name [HOST_CACHE_NAME_MAX];
+        l_lookup (cache, "host1.example", 0);
+        l_lookup (cache, "host2.example", 0);
+        l_lookup (cache, "nowhere.example", 0);
+
+        for (int i = 0 ; i < HOST_CACHE_POPULAR ; ++ i) {
+                l_lookup (cache, "host1.example", 1000);
+                l_lookup (cache, "nowhere.example", 1000);
+        }
+
+        l_lookup (cache, "host2.example", 1000);
+
+        /*
+         * Nothing is due until the last quarter of its life, and only a
+         * popular answer is refreshed; failures never are.
+         */
+
+        CHECK (! cache.refreshDue (44999, name, sizeof (name)));
+        CHECK (cache.refreshDue (45000, name, sizeof (name)));
+        CHECK (strcmp (name, "host1.example") == 0);
+        CHECK (! cache.refreshDue (45000, name, sizeof (name)));
+
+        /*
+         * Until the new answer arrives the old one is still served, and the
+         * new one is good for a full lifetime.
+         */
+
+        l_resolved = 0;
+        l_lookup (cache, "host1.example", 50000);
+        CHECK (l_resolved == 0);
+
+        HostAnswer      answer;
+        l_resolve (name, answer);
+        cache.store (name, answer, 50000);
+        l_lookup (cache, "host1.example", 109999);
+        CHECK (l_resolved == 1);
+
+        /*
+         * A name whose buffer is too small is skipped.
+         */
+
+        l_lookup (cache, "host1.example", 110000);
+        l_lookup (cache, "host1.example", 110000);
+        l_lookup (cache, "host1.example", 110000);
+        CHECK (! cache.refreshDue (155000, name, 5));
+        CHECK (cache.refreshDue (155000, name, sizeof (name)));
+        CHECK (cache.refreshes () == 2);
+}
+
+/**
+ * Run a simulated hour of a client looking up the same few names every tenth
+ * of a second, with the refresher running every second, and check that after
+ * the first lookups the client never has to wait for the resolver.
+ */
+
+static void l_checkWorkload (void) {
+        HostCache       cache;
+        cache.configure (HOST_CACHE_TTL, HOST_CACHE_NEGATIVE);
+
+        unsigned long   waited = 0;
+        unsigned long   misses = 0;
+        char            name [HOST_CACHE_NAME_MAX];
+        l_resolved = 0;
+
+        for (unsigned long now = 0 ; now < 3600000 ; now += 100) {
+                sprintf (name, "host%lu.example", now / 100 % 5);
+
+                unsigned long   before = l_resolved;
+                l_lookup (cache, name, now);
+                if (l_resolved != before) {
+                        ++ misses;
+                        if (now >= 1000)
+                                ++ waited;
+                }
+
+                if (now % 1000 == 0)
+                        l_refresh (cache, now);
+        }
+
+        CHECK (misses == 5);
+        CHECK (waited == 0);
+        CHECK (l_resolved < 5 + 5 * 3600 / (HOST_CACHE_TTL / 1000 * 3 / 4) + 5);
+
+        printf ("hostcache: %lu lookups, %lu resolved, %lu refreshed\n",
+                cache.hits () + cache.misses (), l_resolved,
+                cache.refreshes ());
+}
+
+/**
+ * Check that the millisecond tick count wrapping around does no harm, where
+ * "unsigned long" is 32 bits wide as it is for the filter.
+ */
+
+static void l_checkWrap (void) {
+        if (sizeof (unsigned long) != 4)
+                return;
+
+        HostCache       cache;
+        cache.configure (60000, 10000);
+
+        unsigned long   start = 0xFFFFF000UL;
+        l_resolved = 0;
+        l_lookup (cache, "host1.example", start);
+        l_lookup (cache, "host1.example", start + 50000);
+        CHECK (l_resolved == 1);
+        l_lookup (cache, "host1.example", start + 60000);
+        CHECK (l_resolved == 2);
+}
+
+int main (int argc, char ** argv) {
+        l_checkLifetime ();
+        l_checkLimits ();
+        l_checkRefresh ();
+        l_checkWorkload ();
+        l_checkWrap ();
+
+        return checkDone ("hostcachetest");
+}
+
+/**@}*/
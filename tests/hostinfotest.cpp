@@ -0,0 +1,214 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the answers made up for getaddrinfo () style lookups.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check the answers the filter makes up for getaddrinfo () style lookups.
+ *
+ * The answers are built the same way for each of the three flavours of the
+ * structure, so besides the system's own addrinfo, this uses stand-ins laid
+ * out like ADDRINFOW and ADDRINFOEXW, with their wide canonical names and the
+ * extra fields on the end of the last.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include "hostinfo.h"
+#include "check.h"
+
+struct WideInfo {
+        int             ai_flags;
+        int             ai_family;
+        int             ai_socktype;
+        int             ai_protocol;
+        size_t          ai_addrlen;
+        wchar_t       * ai_canonname;
+        sockaddr      * ai_addr;
+        WideInfo      * ai_next;
+};
+
+struct WideInfoEx {
+        int             ai_flags;
+        int             ai_family;
+        int             ai_socktype;
+        int             ai_protocol;
+        size_t          ai_addrlen;
+        wchar_t       * ai_canonname;
+        sockaddr      * ai_addr;
+        void          * ai_blob;
+        size_t          ai_bloblen;
+        void          * ai_provider;
+        WideInfoEx    * ai_next;
+};
+
+/**
+ * Build an answer in a block of exactly the size asked for, and check that
+ * it lists the addresses in order with everything the request asked for.
+ */
+
+template <class Info, class Char>
+void l_build (const Char * name) {
+        unsigned long   addrs [3];
+        addrs [0] = inet_addr ("10.0.0.1");
+        addrs [1] = inet_addr ("10.0.0.2");
+        addrs [2] = inet_addr ("192.168.1.77");
+
+        HostInfoRequest request;
+        hostInfoRequest<Info> (0, request);
+        CHECK (request.m_family == AF_UNSPEC);
+
+        Info            hints;
+        memset (& hints, 0, sizeof (hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        hostInfoRequest (& hints, request);
+        request.m_port = htons (27030);
+
+        size_t          size = hostInfoSize<Info> (3, name);
+        void          * mem = malloc (size);
+        Info          * info = hostInfoBuild<Info> (mem, addrs, 3, request,
+                                                    name);
+        CHECK (info == mem);
+
+        unsigned long   i = 0;
+        for (Info * scan = info ; scan != 0 ; scan = scan->ai_next, ++ i) {
+                CHECK (i < 3);
+                CHECK (scan->ai_family == AF_INET);
+                CHECK (scan->ai_socktype == SOCK_STREAM);
+                CHECK (scan->ai_protocol == IPPROTO_TCP);
+                CHECK (scan->ai_addrlen == sizeof (sockaddr_in));
+                CHECK ((char *) scan->ai_addr >= (char *) mem &&
+                       (char *) (scan->ai_addr) + sizeof (sockaddr_in) <=
+                               (char *) mem + size);
+
+                const sockaddr_in * addr = (const sockaddr_in *) scan->ai_addr;
+                CHECK (addr->sin_family == AF_INET);
+                CHECK (addr->sin_port == htons (27030));
+                CHECK (addr->sin_addr.s_addr == addrs [i]);
+                CHECK (i == 0 || scan->ai_canonname == 0);
+        }
+
+        CHECK (i == 3);
+
+        if (name != 0) {
+                const Char    * copy = info->ai_canonname;
+                CHECK (copy != 0);
+                size_t          length = 0;
+                for (; name [length] != 0 ; ++ length)
+                        CHECK (copy [length] == name [length]);
+
+                CHECK (copy [length] == 0);
+                CHECK ((char *) (copy + length + 1) == (char *) mem + size);
+        } else
+                CHECK (info->ai_canonname == 0);
+
+        unsigned long   found [8];
+        CHECK (hostInfoAddrs (info, found, 8) == 3);
+        CHECK (found [2] == addrs [2]);
+        CHECK (hostInfoAddrs (info, found, 2) == 2);
+
+        CHECK (hostInfoBuild<Info> (mem, addrs, 0, request, name) == 0);
+        free (mem);
+}
+
+/**
+ * Check an answer made up by the filter against one from the system for the
+ * same address, which the resolver answers without going to the network.
+ */
+
+static void l_system (void) {
+        addrinfo        hints;
+        memset (& hints, 0, sizeof (hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICHOST;
+
+        addrinfo      * system = 0;
+        if (getaddrinfo ("127.0.0.1", "53", & hints, & system) != 0) {
+                printf ("hostinfotest: no resolver, skipping comparison\n");
+                return;
+        }
+
+        HostInfoRequest request;
+        hostInfoRequest (& hints, request);
+        unsigned short  port;
+        CHECK (hostInfoPort ("53", port));
+        request.m_port = htons (port);
+
+        unsigned long   addr = inet_addr ("127.0.0.1");
+        char            mem [256];
+        CHECK (hostInfoSize<addrinfo> (1, (const char *) 0) <= sizeof (mem));
+        addrinfo      * ours = hostInfoBuild<addrinfo> (mem, & addr, 1,
+                                                        request,
+                                                        (const char *) 0);
+
+        CHECK (ours->ai_family == system->ai_family);
+        CHECK (ours->ai_socktype == system->ai_socktype);
+        CHECK (ours->ai_addrlen == system->ai_addrlen);
+        CHECK (memcmp (ours->ai_addr, system->ai_addr,
+                       sizeof (sockaddr_in)) == 0);
+
+        freeaddrinfo (system);
+}
+
+int main (void) {
+        l_build<addrinfo, char> ("steam.example.com");
+        l_build<addrinfo, char> ((const char *) 0);
+        l_build<WideInfo, wchar_t> (L"steam.example.com");
+        l_build<WideInfoEx, wchar_t> (L"x");
+        l_build<WideInfoEx, wchar_t> ((const wchar_t *) 0);
+
+        l_system ();
+
+        char            narrow [8];
+        CHECK (hostInfoNarrow (L"abc.de", narrow, sizeof (narrow)));
+        CHECK (strcmp (narrow, "abc.de") == 0);
+        CHECK (! hostInfoNarrow (L"abcdefgh", narrow, sizeof (narrow)));
+        CHECK (! hostInfoNarrow (L"caf\u00e9", narrow, sizeof (narrow)));
+
+        unsigned short  port = 1;
+        CHECK (hostInfoPort ((const char *) 0, port) && port == 0);
+        CHECK (hostInfoPort (L"65535", port) && port == 65535);
+        CHECK (! hostInfoPort (L"65536", port));
+        CHECK (! hostInfoPort ("http", port));
+
+        return checkDone ("hostinfotest");
+}
+
+/**@}*/
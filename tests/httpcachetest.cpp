@@ -0,0 +1,294 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the cache of HTTP responses.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check the HTTP response cache on its own: which responses it accepts, what
+ * it replays, and that entries are let go when they expire, are replaced or
+ * are flushed.
+ *
+ * The cache builds its entries with the document and pool modules, which are
+ * replaced by the stand-ins in standins.h; those count what's outstanding, so
+ * that a leaked entry shows up.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+
+#include "steamfilter/httpcache.h"
+#include "steamfilter/document.h"
+#include "steamfilter/header.h"
+#include "check.h"
+#include "standins.h"
+
+/**
+ * Set the simulated clock to a time given as seconds since 1970.
+ */
+
+static void l_setTime (ULONGLONG posix) {
+        shimFileTime () = (posix + SHIM_EPOCH_SECONDS) * 10000000;
+}
+
+/**
+ * A response the cache should accept.
+ */
+
+static const char       l_response [] =
+        "HTTP/1.1 200 OK\r\n"
+        "Date: Sat, 01 Jun 2013 12:00:00 GMT\r\n"
+        "Content-Type: text/plain\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 5\r\n"
+        "\r\n"
+        "hello";
+
+static const unsigned long l_responseLength = sizeof (l_response) - 1;
+
+/**
+ * Check how much of a response the cache asks to see.
+ */
+
+static void l_checkLength (void) {
+        unsigned long   header = 0;
+        unsigned long   total = 0;
+
+        CHECK (g_cacheResponseLength (l_response, l_responseLength,
+                                      CACHE_ENTRY_MAX, & header, & total));
+        CHECK (total == l_responseLength);
+        CHECK (header == l_responseLength - 5);
+
+        /*
+         * Until the headers are complete the answer is "maybe".
+         */
+
+        CHECK (g_cacheResponseLength (l_response, 20, CACHE_ENTRY_MAX,
+                                      & header, & total));
+        CHECK (total == 0);
+
+        static const char       missing [] =
+                "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        CHECK (! g_cacheResponseLength (missing, sizeof (missing) - 1,
+                                        CACHE_ENTRY_MAX, & header, & total));
+
+        static const char       chunked [] =
+                "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+        CHECK (! g_cacheResponseLength (chunked, sizeof (chunked) - 1,
+                                        CACHE_ENTRY_MAX, & header, & total));
+
+        CHECK (! g_cacheResponseLength (l_response, l_responseLength, 4,
+                                        & header, & total));
+}
+
+/**
+ * Check that a stored response is replayed as it should be.
+ */
+
+static void l_checkHit (void) {
+        l_setTime (1370088000);
+
+        CHECK (g_cacheLookup ("/hit") == 0);
+        CHECK (g_cacheStore ("/hit", 60, l_response, l_responseLength));
+
+        Document      * doc = g_cacheLookup ("/hit");
+        CHECK (doc != 0);
+        if (doc == 0)
+                return;
+
+        CHECK (doc->m_bodyLength == 5);
+        CHECK (memcmp (doc->m_body, "hello", 5) == 0);
+
+        const char    * head = (const char *) doc->m_head;
+        CHECK (doc->m_split == 17);
+        CHECK (memcmp (head, "HTTP/1.1 200 OK\r\n", 17) == 0);
+
+        char            text [200];
+        CHECK (doc->m_headLength < sizeof (text));
+        memcpy (text, head, doc->m_headLength);
+        text [doc->m_headLength] = 0;
+
+        static const char       tail [] = "Connection: Keep-Alive\r\n\r\n";
+        CHECK (strstr (text, "Content-Type: text/plain\r\n") != 0);
+        CHECK (strstr (text, "Date:") == 0);
+        CHECK (strstr (text, "Connection: close") == 0);
+        CHECK (strstr (text, tail) ==
+               text + doc->m_headLength - (sizeof (tail) - 1));
+
+        /*
+         * The reference handed out outlives the entry it came from.
+         */
+
+        g_cacheFlush ();
+        CHECK (l_outstanding == 1);
+        CHECK (g_cacheLookup ("/hit") == 0);
+
+        g_documentRelease (doc);
+        CHECK (l_outstanding == 0);
+}
+
+/**
+ * Check that entries lapse when they should, and are freed when they do.
+ */
+
+static void l_checkExpiry (void) {
+        l_setTime (1370088000);
+        CHECK (g_cacheStore ("/expire", 30, l_response, l_responseLength));
+
+        l_setTime (1370088029);
+        Document      * doc = g_cacheLookup ("/expire");
+        CHECK (doc != 0);
+        g_documentRelease (doc);
+
+        l_setTime (1370088030);
+        CHECK (g_cacheLookup ("/expire") == 0);
+        CHECK (l_outstanding == 0);
+
+        /*
+         * The server's own max-age shortens the rule's lifetime.
+         */
+
+        static const char       aged [] =
+                "HTTP/1.1 200 OK\r\n"
+                "Cache-Control: public, max-age=10\r\n"
+                "Content-Length: 2\r\n"
+                "\r\n"
+                "ok";
+
+        l_setTime (1370088000);
+        CHECK (g_cacheStore ("/aged", 60, aged, sizeof (aged) - 1));
+        l_setTime (1370088010);
+        CHECK (g_cacheLookup ("/aged") == 0);
+        CHECK (l_outstanding == 0);
+}
+
+/**
+ * Check the responses which must never be cached.
+ */
+
+static void l_checkRefused (void) {
+        static const char     * refused [] = {
+                "HTTP/1.1 200 OK\r\nCache-Control: no-store\r\n"
+                "Content-Length: 0\r\n\r\n",
+                "HTTP/1.1 200 OK\r\nCache-Control: private\r\n"
+                "Content-Length: 0\r\n\r\n",
+                "HTTP/1.1 200 OK\r\nSet-Cookie: a=b\r\n"
+                "Content-Length: 0\r\n\r\n",
+                "HTTP/1.1 200 OK\r\nPragma: no-cache\r\n"
+                "Content-Length: 0\r\n\r\n",
+                "HTTP/1.1 200 OK\r\nVary: *\r\n"
+                "Content-Length: 0\r\n\r\n",
+                "HTTP/1.1 200 OK\r\nDate: Sat, 01 Jun 2013 12:00:00 GMT\r\n"
+                "Expires: Sat, 01 Jun 2013 11:00:00 GMT\r\n"
+                "Content-Length: 0\r\n\r\n",
+                0
+        };
+
+        for (const char ** scan = refused ; * scan != 0 ; ++ scan) {
+                CHECK (! g_cacheStore ("/refused", 60, * scan,
+                                       strlen (* scan)));
+                CHECK (g_cacheLookup ("/refused") == 0);
+        }
+
+        CHECK (l_outstanding == 0);
+}
+
+/**
+ * Check that storing over an entry replaces it rather than adding to it.
+ */
+
+static void l_checkReplace (void) {
+        l_setTime (1370088000);
+
+        for (int i = 0 ; i < 100 ; ++ i)
+                CHECK (g_cacheStore ("/same", 60, l_response,
+                                     l_responseLength));
+
+        CHECK (l_outstanding == 2);
+
+        g_cacheFlush ();
+        CHECK (l_outstanding == 0);
+}
+
+/**
+ * Check that the budget is kept to, with the least recently used entries
+ * going first.
+ */
+
+static void l_checkBudget (void) {
+        l_setTime (1370088000);
+
+        static char     big [CACHE_ENTRY_MAX + 100];
+        int             head;
+        head = sprintf (big, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n",
+                        CACHE_ENTRY_MAX);
+        memset (big + head, 'x', CACHE_ENTRY_MAX);
+
+        unsigned long   count = CACHE_BUDGET / CACHE_ENTRY_MAX;
+        char            key [20];
+        for (unsigned long i = 0 ; i < count + 4 ; ++ i) {
+                sprintf (key, "/big%lu", i);
+                CHECK (g_cacheStore (key, 60, big, head + CACHE_ENTRY_MAX));
+
+                /*
+                 * Keep the first entry in use, so it should survive.
+                 */
+
+                Document      * doc = g_cacheLookup ("/big0");
+                CHECK (doc != 0);
+                g_documentRelease (doc);
+        }
+
+        CHECK ((unsigned long) l_outstanding < 2 * count);
+
+        CHECK (g_cacheLookup ("/big1") == 0);
+        Document      * last = g_cacheLookup (key);
+        CHECK (last != 0);
+        g_documentRelease (last);
+
+        g_cacheFlush ();
+        CHECK (l_outstanding == 0);
+}
+
+int main (int argc, char ** argv) {
+        g_cacheInit ();
+
+        l_checkLength ();
+        l_checkHit ();
+        l_checkExpiry ();
+        l_checkRefused ();
+        l_checkReplace ();
+        l_checkBudget ();
+
+        g_cacheUnload ();
+        return checkDone ("httpcachetest");
+}
+
+/**@}*/
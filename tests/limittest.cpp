@@ -0,0 +1,245 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the bandwidth limits applied to the receive hooks.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check how the receive hooks are paced under a bandwidth limit, against the
+ * simulated tick count; the sockets here are just numbers, since the limits
+ * never touch the sockets themselves.
+ */
+
+#define WIN32_LEAN_AND_MEAN     1
+#include <windows.h>
+#include <winsock2.h>
+
+#include "steamfilter/limit.h"
+#include "check.h"
+#include "standins.h"
+
+/**
+ * The burst allowance for a rate in kilobytes per second, which is what a new
+ * connection can take at once.
+ */
+
+static unsigned long l_burst (unsigned long rate) {
+        return rate * 1024 / 1000 * LIMIT_BURST_TIME;
+}
+
+/**
+ * Check that only a blocking receive is held up, and that an overlapped one is
+ * never refused.
+ */
+
+static void l_checkBlocking (void) {
+        g_limitGlobal (100);
+
+        SOCKET          handle = 5;
+        unsigned long   allow = g_limitAllow (handle, 65536, LIMIT_REFUSE);
+        CHECK (allow == l_burst (100));
+        g_limitReceived (handle, allow);
+
+        /*
+         * With the bucket empty, a non-blocking receive is turned away at
+         * once, without the clock moving.
+         */
+
+        unsigned long   start = shimTicks ();
+        CHECK (g_limitAllow (handle, 65536, LIMIT_REFUSE) == 0);
+        CHECK (shimTicks () == start);
+
+        /*
+         * An overlapped one still goes ahead at once, for the smallest slice,
+         * and that is charged in advance like any other.
+         */
+
+        OVERLAPPED      overlapped;
+        allow = g_limitAllow (handle, 65536, LIMIT_SLICE);
+        CHECK (allow == LIMIT_SLICE_MIN);
+        CHECK (shimTicks () == start);
+        g_limitDeferred (handle, & overlapped, allow);
+        g_limitCompleted (handle, & overlapped, allow);
+
+        /*
+         * A blocking one waits until the debt is paid off and there's enough
+         * for a worthwhile read, which at 100 KB/s is 20 ms.
+         */
+
+        allow = g_limitAllow (handle, 65536, LIMIT_BLOCK);
+        CHECK (allow >= LIMIT_SLICE_MIN);
+        CHECK (shimTicks () - start == 20);
+        g_limitReceived (handle, allow);
+
+        g_limitClose (handle);
+        g_limitGlobal (0);
+}
+
+/**
+ * Check that overlapped receives charged in advance are each refunded what
+ * didn't arrive, however many are outstanding and whatever order they
+ * complete in.
+ */
+
+static void l_checkDeferred (void) {
+        g_limitGlobal (100);
+        shimTicks () += 10000;
+
+        SOCKET          handle = 6;
+        OVERLAPPED      first;
+        OVERLAPPED      second;
+
+        unsigned long   full = g_limitAllow (handle, 65536, LIMIT_REFUSE);
+        CHECK (full == l_burst (100));
+
+        g_limitDeferred (handle, & first, 1000);
+        g_limitDeferred (handle, & second, 2000);
+        CHECK (g_limitAllow (handle, 65536, LIMIT_REFUSE) == full - 3000);
+
+        g_limitCompleted (handle, & second, 0);
+        CHECK (g_limitAllow (handle, 65536, LIMIT_REFUSE) == full - 1000);
+
+        g_limitCompleted (handle, & first, 1000);
+        CHECK (g_limitAllow (handle, 65536, LIMIT_REFUSE) == full - 1000);
+
+        /*
+         * A completion collected twice, or one never charged, changes nothing.
+         */
+
+        g_limitCompleted (handle, & second, 0);
+        g_limitCompleted (handle, & first, 0);
+        CHECK (g_limitAllow (handle, 65536, LIMIT_REFUSE) == full - 1000);
+
+        /*
+         * An OVERLAPPED used again replaces its earlier charge.
+         */
+
+        g_limitDeferred (handle, & first, 500);
+        g_limitDeferred (handle, & first, 700);
+        CHECK (g_limitAllow (handle, 65536, LIMIT_REFUSE) == full - 2200);
+        g_limitCompleted (handle, & first, 0);
+        CHECK (g_limitAllow (handle, 65536, LIMIT_REFUSE) == full - 1500);
+
+        g_limitClose (handle);
+        g_limitGlobal (0);
+}
+
+/**
+ * Check that new connections bind to the limits of the current rules, while
+ * those made before the rules changed keep the limit they were made under.
+ */
+
+static void l_checkRules (void) {
+        g_limitGlobal (0);
+        shimTicks () += 10000;
+
+        g_limitConnect (7, 1, 50, 1);
+        unsigned long   allow = g_limitAllow (7, 65536, LIMIT_REFUSE);
+        CHECK (allow == l_burst (50));
+        g_limitReceived (7, allow);
+
+        g_limitConnect (8, 1, 50, 1);
+        CHECK (g_limitAllow (8, 65536, LIMIT_REFUSE) == 0);
+
+        g_limitFlush ();
+
+        g_limitConnect (9, 1, 50, 1);
+        CHECK (g_limitAllow (9, 65536, LIMIT_REFUSE) == l_burst (50));
+        CHECK (g_limitAllow (7, 65536, LIMIT_REFUSE) == 0);
+
+        g_limitClose (7);
+        g_limitClose (8);
+        g_limitClose (9);
+}
+
+/**
+ * Check that the limits stop costing anything once no bucket applies; records
+ * are only made while one does, and the shares of the global limit go when it
+ * is turned off or the rules are replaced.
+ */
+
+static void l_checkIdle (void) {
+        long            before = l_outstanding;
+
+        g_limitConnect (20, 2, 0, 2);
+        CHECK (g_limitAllow (21, 65536, LIMIT_REFUSE) == 65536);
+        g_limitReceived (21, 65536);
+        CHECK (! g_anyLimit ());
+        CHECK (l_outstanding == before);
+
+        g_limitGlobal (100);
+        shimTicks () += 10000;
+
+        g_limitConnect (20, 2, 0, 2);
+        g_limitAllow (20, 4096, LIMIT_REFUSE);
+        g_limitAllow (21, 4096, LIMIT_REFUSE);
+        CHECK (l_outstanding == before + 2);
+
+        g_limitGlobal (0);
+        CHECK (! g_anyLimit ());
+        CHECK (l_outstanding == before);
+
+        /*
+         * A connection bound to a rule's limit keeps it through the rules
+         * being replaced, and the limits stay active until it's closed.
+         */
+
+        g_limitGlobal (100);
+        g_limitConnect (22, 3, 50, 1);
+        g_limitAllow (23, 4096, LIMIT_REFUSE);
+        CHECK (l_outstanding == before + 2);
+
+        g_limitFlush ();
+        g_limitGlobal (0);
+        CHECK (g_anyLimit ());
+        CHECK (l_outstanding == before + 1);
+
+        g_limitClose (22);
+        CHECK (! g_anyLimit ());
+        CHECK (l_outstanding == before);
+}
+
+int main (int argc, char ** argv) {
+        shimTicks () = 1000;
+
+        l_checkBlocking ();
+        l_checkDeferred ();
+        l_checkRules ();
+        l_checkIdle ();
+
+        CHECK (! g_anyLimit ());
+
+        g_limitUnload ();
+        CHECK (l_outstanding == 0);
+
+        return checkDone ("limittest");
+}
+
+/**@}*/
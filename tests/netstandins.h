@@ -0,0 +1,278 @@
+#ifndef NETSTANDINS_H
+#define NETSTANDINS_H           1
+
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This supplies stand-ins for the socket functions the filter calls.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The filter makes its own connections through a table of entry points to
+ * the socket functions, which these stand-ins fill in from the POSIX ones so
+ * that the code using it can be run against real sockets on the loopback
+ * interface. They behave as Winsock's do where the filter cares about the
+ * difference, and count the sockets closed so that tests can check nothing
+ * has leaked.
+ *
+ * Only one source file in each test program should include this.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <mstcpip.h>
+
+#include "steamfilter/netapi.h"
+
+/**
+ * Count of sockets the filter has closed.
+ */
+
+static  unsigned long   l_closed;
+
+/**
+ * The socket functions, as the filter expects them to behave.
+ */
+
+static SOCKET WSAAPI l_socket (int family, int type, int protocol) {
+        return socket (family, type, protocol);
+}
+
+static int WSAAPI l_connect (SOCKET s, const sockaddr * name, int length) {
+        if (connect (s, name, length) == 0)
+                return 0;
+
+        SetLastError (errno == EINPROGRESS ? WSAEWOULDBLOCK : errno);
+        return SOCKET_ERROR;
+}
+
+static int WSAAPI l_send (SOCKET s, const char * buf, int length,
+                          int flags) {
+        return send (s, buf, length, flags | MSG_NOSIGNAL);
+}
+
+static int WSAAPI l_recv (SOCKET s, char * buf, int length, int flags) {
+        return recv (s, buf, length, flags);
+}
+
+static int WSAAPI l_closesocket (SOCKET s) {
+        ++ l_closed;
+        return close (s);
+}
+
+static int WSAAPI l_ioctlsocket (SOCKET s, long command,
+                                 unsigned long * arg) {
+        if (command != FIONBIO)
+                return SOCKET_ERROR;
+
+        int             flags = fcntl (s, F_GETFL);
+        flags = * arg != 0 ? flags | O_NONBLOCK : flags & ~ O_NONBLOCK;
+        return fcntl (s, F_SETFL, flags);
+}
+
+static int WSAAPI l_getsockopt (SOCKET s, int level, int name, char * value,
+                                int * length) {
+        socklen_t       size = * length;
+        int             result = getsockopt (s, level, name, value, & size);
+        * length = (int) size;
+        return result;
+}
+
+static int WSAAPI l_setsockopt (SOCKET s, int level, int name,
+                                const char * value, int length) {
+        return setsockopt (s, level, name, value, length);
+}
+
+/**
+ * WSAIoctl (), for the one thing the filter uses it for, which is setting the
+ * keepalive times; those are in milliseconds, where the POSIX options are in
+ * seconds.
+ */
+
+static int WSAAPI l_wsaIoctl (SOCKET s, unsigned long code, void * in,
+                              unsigned long inLength, void * out,
+                              unsigned long outLength,
+                              unsigned long * returned,
+                              OVERLAPPED * overlapped,
+                              LPWSAOVERLAPPED_COMPLETION_ROUTINE handler) {
+        if (code != SIO_KEEPALIVE_VALS || inLength < sizeof (tcp_keepalive))
+                return SOCKET_ERROR;
+
+        tcp_keepalive * values = (tcp_keepalive *) in;
+        int             on = values->onoff != 0;
+        int             idle = (int) (values->keepalivetime / 1000);
+        int             interval = (int) (values->keepaliveinterval / 1000);
+
+        * returned = 0;
+        return setsockopt (s, SOL_SOCKET, SO_KEEPALIVE, & on,
+                           sizeof (on)) != 0 ||
+               setsockopt (s, IPPROTO_TCP, TCP_KEEPIDLE, & idle,
+                           sizeof (idle)) != 0 ||
+               setsockopt (s, IPPROTO_TCP, TCP_KEEPINTVL, & interval,
+                           sizeof (interval)) != 0 ? SOCKET_ERROR : 0;
+}
+
+/**
+ * Winsock's select (), on poll (); as for Winsock, a connect which fails
+ * shows up only in the error set.
+ */
+
+static void l_watch (pollfd * polls, int & count, fd_set * set, short events) {
+        for (unsigned int i = 0 ; set != 0 && i < set->fd_count ; ++ i) {
+                int             j = 0;
+                while (j < count && polls [j].fd != set->fd_array [i])
+                        ++ j;
+
+                if (j == count) {
+                        polls [count].fd = set->fd_array [i];
+                        polls [count].events = 0;
+                        polls [count].revents = 0;
+                        ++ count;
+                }
+
+                polls [j].events |= events;
+        }
+}
+
+static int l_keep (pollfd * polls, int count, fd_set * set, short wanted,
+                   short unwanted) {
+        if (set == 0)
+                return 0;
+
+        unsigned int    kept = 0;
+        for (unsigned int i = 0 ; i < set->fd_count ; ++ i) {
+                int             j = 0;
+                while (polls [j].fd != set->fd_array [i])
+                        ++ j;
+
+                if ((polls [j].revents & wanted) != 0 &&
+                    (polls [j].revents & unwanted) == 0)
+                        set->fd_array [kept ++] = set->fd_array [i];
+        }
+
+        set->fd_count = kept;
+        return kept;
+}
+
+static int WSAAPI l_select (int, fd_set * read, fd_set * write,
+                            fd_set * error, const timeval * timeout) {
+        pollfd          polls [3 * FD_SETSIZE];
+        int             count = 0;
+        l_watch (polls, count, read, POLLIN);
+        l_watch (polls, count, write, POLLOUT);
+        l_watch (polls, count, error, 0);
+
+        int             wait = -1;
+        if (timeout != 0)
+                wait = timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+
+        if (poll (polls, count, wait) < 0)
+                return SOCKET_ERROR;
+
+        return l_keep (polls, count, read, POLLIN | POLLHUP | POLLERR, 0) +
+               l_keep (polls, count, write, POLLOUT, POLLERR) +
+               l_keep (polls, count, error, POLLERR, 0);
+}
+
+/**
+ * Fill in the table of socket functions.
+ */
+
+static void l_netStandins (void) {
+        g_net.m_socket = l_socket;
+        g_net.m_connect = l_connect;
+        g_net.m_send = l_send;
+        g_net.m_recv = l_recv;
+        g_net.m_select = l_select;
+        g_net.m_closesocket = l_closesocket;
+        g_net.m_ioctlsocket = l_ioctlsocket;
+        g_net.m_getsockopt = l_getsockopt;
+        g_net.m_setsockopt = l_setsockopt;
+        g_net.m_wsaIoctl = l_wsaIoctl;
+}
+
+/**
+ * Make a server on the loopback interface, given the backlog for it to listen
+ * with, or a negative one for it to refuse connections instead, and the port
+ * in network order if it has to be a particular one; the result is the
+ * listening socket, which is non-blocking, or -1.
+ */
+
+static int l_server (int backlog, sockaddr_in & addr,
+                     unsigned short port = 0) {
+        int             s = socket (AF_INET, SOCK_STREAM, 0);
+        memset (& addr, 0, sizeof (addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = port;
+        addr.sin_addr.S_un.S_addr = htonl (INADDR_LOOPBACK);
+
+        int             reuse = 1;
+        setsockopt (s, SOL_SOCKET, SO_REUSEADDR, & reuse, sizeof (reuse));
+
+        socklen_t       length = sizeof (addr);
+        if (s < 0 || bind (s, (sockaddr *) & addr, length) != 0 ||
+            getsockname (s, (sockaddr *) & addr, & length) != 0 ||
+            (backlog >= 0 && listen (s, backlog) != 0)) {
+                if (s >= 0)
+                        close (s);
+
+                return -1;
+        }
+
+        fcntl (s, F_SETFL, O_NONBLOCK);
+        return s;
+}
+
+/**
+ * Make a server which never answers, by filling the backlog of one nothing
+ * accepts from so that further connection attempts are ignored; the socket
+ * that fills it is returned through the last parameter.
+ */
+
+static int l_hungServer (sockaddr_in & addr, int & filler) {
+        int             s = l_server (0, addr);
+        if (s < 0)
+                return s;
+
+        filler = socket (AF_INET, SOCK_STREAM, 0);
+        pollfd          wait = { filler, POLLOUT, 0 };
+        fcntl (filler, F_SETFL, O_NONBLOCK);
+        connect (filler, (const sockaddr *) & addr, sizeof (addr));
+        if (poll (& wait, 1, 1000) == 1)
+                return s;
+
+        close (filler);
+        close (s);
+        return -1;
+}
+
+/**@}*/
+#endif  /* ! defined (NETSTANDINS_H) */
@@ -0,0 +1,68 @@
+#ifndef POOLSTANDINS_H
+#define POOLSTANDINS_H          1
+
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This supplies stand-ins for the pool functions.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The slab pools lean on thread-local storage, so the modules built on them
+ * are tested without them. These stand-ins do the same job with the plain
+ * heap, and count the blocks outstanding so that tests can check nothing has
+ * leaked.
+ *
+ * Only one source file in each test program should include this.
+ */
+
+#include "steamfilter/pool.h"
+
+/**
+ * Count of blocks allocated and not yet freed.
+ */
+
+static  long            l_outstanding;
+
+void * g_poolAlloc (size_t length) {
+        ++ l_outstanding;
+        return HeapAlloc (GetProcessHeap (), 0, length);
+}
+
+void g_poolFree (void * mem) {
+        if (mem == 0)
+                return;
+
+        -- l_outstanding;
+        HeapFree (GetProcessHeap (), 0, mem);
+}
+
+/**@}*/
+#endif  /* ! defined (POOLSTANDINS_H) */
@@ -0,0 +1,354 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the schedule for racing connects to several servers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Run the connect race schedule against real listeners on the loopback
+ * interface, in the same way the failover code runs it against servers.
+ *
+ * Three kinds of server stand in for what the filter meets: one which answers
+ * at once, one which refuses connections, and one which never answers, made
+ * by filling the backlog of a listener nothing accepts from, so that further
+ * connection attempts are ignored. Loopback connects complete far faster than
+ * real ones, so servers which answer are given an injected delay, with the
+ * driver only reporting a connection once its delay has passed.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "steamfilter/race.h"
+#include "check.h"
+
+/**
+ * The kinds of server a candidate can be.
+ */
+
+enum ServerKind {
+        ANSWER,
+        REFUSE,
+        HANG
+};
+
+/**
+ * A candidate server, with its injected delay and the connect time history
+ * the ranking goes on, both in milliseconds.
+ */
+
+struct Server {
+        ServerKind      m_kind;
+        unsigned long   m_delay;
+        unsigned long   m_expected;
+};
+
+/**
+ * The listeners standing in for each kind of server.
+ */
+
+static  sockaddr_in     l_addr [3];
+static  int             l_listener [3];
+
+/**
+ * The current time in milliseconds.
+ */
+
+static unsigned long l_now (void) {
+        return (unsigned long) (checkNow () / 1e6);
+}
+
+/**
+ * Start a non-blocking connect.
+ */
+
+static int l_connect (const sockaddr_in & addr) {
+        int             s = socket (AF_INET, SOCK_STREAM, 0);
+        if (s < 0)
+                return s;
+
+        fcntl (s, F_SETFL, O_NONBLOCK);
+        connect (s, (const sockaddr *) & addr, sizeof (addr));
+        return s;
+}
+
+/**
+ * Set up a listener of each kind on the loopback interface.
+ */
+
+static bool l_listen (void) {
+        for (int i = 0 ; i < 3 ; ++ i) {
+                int             s = socket (AF_INET, SOCK_STREAM, 0);
+                sockaddr_in   & addr = l_addr [i];
+                memset (& addr, 0, sizeof (addr));
+                addr.sin_family = AF_INET;
+                addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+                socklen_t       length = sizeof (addr);
+                if (s < 0 || bind (s, (sockaddr *) & addr, length) != 0 ||
+                    getsockname (s, (sockaddr *) & addr, & length) != 0)
+                        return false;
+
+                l_listener [i] = s;
+                if (i == REFUSE)
+                        continue;
+
+                if (listen (s, i == ANSWER ? 64 : 0) != 0)
+                        return false;
+        }
+
+        /*
+         * A backlog of zero still takes one connection, so fill that and
+         * check that the next attempt is left hanging.
+         */
+
+        int             filler = l_connect (l_addr [HANG]);
+        pollfd          wait = { filler, POLLOUT, 0 };
+        if (poll (& wait, 1, 1000) != 1)
+                return false;
+
+        int             test = l_connect (l_addr [HANG]);
+        wait.fd = test;
+        bool            hangs = poll (& wait, 1, 200) == 0;
+        close (test);
+        return hangs;
+}
+
+/**
+ * Run a race between some servers, returning the result of the schedule and
+ * how long it took to decide.
+ *
+ * This steps the schedule along as the failover code does: start whatever is
+ * due, wait for probes to answer for as long as the schedule allows, and tell
+ * it how each one went.
+ */
+
+static int l_race (const Server * servers, unsigned long count,
+                   unsigned long stagger, unsigned long deadline,
+                   unsigned long limit, bool ranked,
+                   unsigned long & elapsed) {
+        unsigned long   begin = l_now ();
+        int             probe [RACE_CANDIDATES_MAX];
+        unsigned long   started [RACE_CANDIDATES_MAX];
+        bool            connected [RACE_CANDIDATES_MAX];
+
+        ConnectRace     race;
+        race.reset (begin, stagger, deadline, limit);
+        for (unsigned long i = 0 ; i < count ; ++ i) {
+                race.add (ranked ? servers [i].m_expected : 0);
+                probe [i] = -1;
+                connected [i] = false;
+        }
+
+        if (ranked)
+                race.rank ();
+
+        int             result;
+        for (;;) {
+                unsigned long   now = l_now ();
+                int             index;
+                while ((index = race.start (now)) >= 0) {
+                        started [index] = now;
+                        probe [index] = l_connect (l_addr [servers [index].
+                                                           m_kind]);
+                        if (probe [index] < 0)
+                                race.failed (index);
+                }
+
+                /*
+                 * A probe that has connected wins once its delay is up.
+                 */
+
+                for (unsigned long i = 0 ; i < count ; ++ i)
+                        if (race.live (i) && connected [i] &&
+                            now - started [i] >= servers [i].m_delay)
+                                race.won (i);
+
+                result = race.result (now);
+                if (result != RACE_PENDING)
+                        break;
+
+                pollfd          wait [RACE_CANDIDATES_MAX];
+                int             waiting = 0;
+                unsigned long   due = race.wait (now);
+                if (due > 5)
+                        due = 5;
+
+                for (unsigned long i = 0 ; i < count ; ++ i) {
+                        if (! race.live (i) || connected [i])
+                                continue;
+
+                        wait [waiting].fd = probe [i];
+                        wait [waiting].events = POLLOUT;
+                        wait [waiting].revents = 0;
+                        ++ waiting;
+                }
+
+                if (poll (wait, waiting, due) <= 0)
+                        continue;
+
+                for (unsigned long i = 0 ; i < count ; ++ i) {
+                        if (! race.live (i) || connected [i])
+                                continue;
+
+                        for (int j = 0 ; j < waiting ; ++ j) {
+                                if (wait [j].fd != probe [i] ||
+                                    wait [j].revents == 0)
+                                        continue;
+
+                                int             error = 0;
+                                socklen_t       length = sizeof (error);
+                                getsockopt (probe [i], SOL_SOCKET, SO_ERROR,
+                                            & error, & length);
+                                if (error == 0)
+                                        connected [i] = true;
+                                else
+                                        race.failed (i);
+                        }
+                }
+        }
+
+        elapsed = l_now () - begin;
+        for (unsigned long i = 0 ; i < count ; ++ i)
+                if (probe [i] >= 0)
+                        close (probe [i]);
+
+        return result;
+}
+
+/**
+ * Check plain failover, where each server is given the whole deadline before
+ * the next is tried as well.
+ */
+
+static void l_checkFailover (void) {
+        unsigned long   elapsed;
+
+        Server          hung [] = {
+                { HANG, 0, 0 },
+                { ANSWER, 20, 0 }
+        };
+        CHECK (l_race (hung, 2, 300, 300, 0, false, elapsed) == 1);
+        CHECK (elapsed >= 320 && elapsed < 600);
+
+        /*
+         * A server which refuses outright lets the next start at once.
+         */
+
+        Server          refused [] = {
+                { REFUSE, 0, 0 },
+                { ANSWER, 20, 0 }
+        };
+        CHECK (l_race (refused, 2, 300, 300, 0, false, elapsed) == 1);
+        CHECK (elapsed >= 20 && elapsed < 200);
+
+        /*
+         * The first server keeps its chance to answer after the next one has
+         * been started.
+         */
+
+        Server          slow [] = {
+                { ANSWER, 350, 0 },
+                { ANSWER, 400, 0 }
+        };
+        CHECK (l_race (slow, 2, 300, 1000, 0, false, elapsed) == 0);
+        CHECK (elapsed >= 350 && elapsed < 600);
+
+        Server          none [] = {
+                { HANG, 0, 0 },
+                { HANG, 0, 0 }
+        };
+        CHECK (l_race (none, 2, 200, 200, 0, false, elapsed) == RACE_FAILED);
+        CHECK (elapsed >= 400 && elapsed < 700);
+}
+
+/**
+ * Check a ranked race, where the servers which have been fastest go first, a
+ * short stagger apart, and only so many of them are tried.
+ */
+
+static void l_checkRanked (void) {
+        unsigned long   elapsed;
+
+        /*
+         * The one with no history goes last, but is still tried in time to
+         * beat the others, which are slow today.
+         */
+
+        Server          servers [] = {
+                { ANSWER, 20, 0 },
+                { ANSWER, 400, 30 },
+                { ANSWER, 400, 10 }
+        };
+        CHECK (l_race (servers, 3, 50, 1000, 0, true, elapsed) == 0);
+        CHECK (elapsed >= 120 && elapsed < 300);
+
+        /*
+         * Limited to the fastest two, it isn't tried at all.
+         */
+
+        CHECK (l_race (servers, 3, 50, 1000, 2, true, elapsed) == 2);
+        CHECK (elapsed >= 400 && elapsed < 650);
+
+        /*
+         * A hung favourite costs only the stagger.
+         */
+
+        Server          hung [] = {
+                { HANG, 0, 10 },
+                { ANSWER, 20, 30 }
+        };
+        CHECK (l_race (hung, 2, 50, 1000, 0, true, elapsed) == 1);
+        CHECK (elapsed >= 70 && elapsed < 250);
+}
+
+int main (void) {
+        if (! l_listen ()) {
+                printf ("racetest: can't set up listeners, skipped\n");
+                return 0;
+        }
+
+        l_checkFailover ();
+        l_checkRanked ();
+
+        for (int i = 0 ; i < 3 ; ++ i)
+                close (l_listener [i]);
+
+        return checkDone ("racetest");
+}
+
+/**@}*/
@@ -0,0 +1,523 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests downloads split across several servers with range requests.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The servers here are real ones on the loopback interface, each a thread
+ * serving the same made-up document, at a limited rate where that matters;
+ * one can be made to ignore ranges, or to drop a connection part way through
+ * a response. The client's side is played by the test, reading the download
+ * just as the receive hooks would.
+ *
+ * The health checker and the connection pool are replaced by stand-ins which
+ * have nothing to say, so every part is fetched over a connection the worker
+ * makes for itself.
+ */
+
+#include <windows.h>
+#include <winsock2.h>
+
+#include "steamfilter/filterrule.h"
+#include "steamfilter/header.h"
+#include "steamfilter/health.h"
+#include "steamfilter/replace.h"
+#include "steamfilter/segment.h"
+#include "steamfilter/warm.h"
+#include "check.h"
+#include "standins.h"
+#include "netstandins.h"
+
+/**
+ * A server, which serves one connection at a time.
+ *
+ * The rate is in bytes per second, or zero for as fast as it can; a server
+ * which is to drop a connection does so once, as soon as it has sent that
+ * much of the document in all.
+ */
+
+struct Server {
+        int             m_listen;
+        sockaddr_in     m_addr;
+        pthread_t       m_thread;
+        bool            m_running;
+
+        bool            m_ranges;
+        unsigned long   m_rate;
+        unsigned long   m_dropAfter;
+        unsigned long   m_sent;
+        volatile LONG   m_requests;
+        volatile LONG   m_stop;
+};
+
+/**
+ * The request the client makes, the length of the document, and what the
+ * client was last sent as the response header.
+ */
+
+static  const char      l_request [] = "GET /depot/7/chunk/ab HTTP/1.1\r\n"
+                                       "Host: content.example\r\n\r\n";
+static  unsigned long   l_size;
+static  char            l_head [1024];
+
+/**
+ * Stand-ins for the modules the downloads work with.
+ */
+
+bool g_healthDown (unsigned long addr, unsigned short port) {
+        return false;
+}
+
+SOCKET g_warmTake (const sockaddr_in & addr) {
+        return INVALID_SOCKET;
+}
+
+WSAEVENT g_findEventHandle (SOCKET handle) {
+        return 0;
+}
+
+/**
+ * The content of the document, which doesn't repeat at any likely part size
+ * so that a part put in the wrong place shows up.
+ */
+
+static unsigned char l_byte (unsigned long offset) {
+        return (unsigned char) (offset * 7 + (offset >> 13));
+}
+
+/**
+ * Send part of the document, keeping to the server's rate.
+ */
+
+static bool l_body (Server & server, int s, unsigned long first,
+                    unsigned long end) {
+        char            buf [16 * 1024];
+        double          start = checkNow ();
+        unsigned long   done = 0;
+
+        while (first + done < end) {
+                unsigned long   length = end - first - done;
+                if (length > sizeof (buf))
+                        length = sizeof (buf);
+
+                for (unsigned long i = 0 ; i < length ; ++ i)
+                        buf [i] = l_byte (first + done + i);
+
+                if (server.m_dropAfter != 0 &&
+                    server.m_sent + length >= server.m_dropAfter) {
+                        server.m_dropAfter = 0;
+                        return false;
+                }
+
+                if (send (s, buf, length, MSG_NOSIGNAL) != (int) length)
+                        return false;
+
+                done += length;
+                server.m_sent += length;
+
+                if (server.m_rate == 0)
+                        continue;
+
+                double          due = done * 1e9 / server.m_rate;
+                double          spent = checkNow () - start;
+                if (spent < due)
+                        usleep ((useconds_t) ((due - spent) / 1000));
+        }
+
+        return true;
+}
+
+/**
+ * Answer a request, with the part it asks for if the server does ranges or
+ * the whole thing otherwise.
+ */
+
+static bool l_respond (Server & server, int s, const char * request) {
+        unsigned long   first = 0;
+        unsigned long   last = l_size - 1;
+        const char    * range = strstr (request, "\r\nRange: bytes=");
+        bool            ranged = server.m_ranges && range != 0 &&
+                                 sscanf (range + 15, "%lu-%lu", & first,
+                                         & last) == 2 &&
+                                 first <= last && first < l_size;
+        if (ranged && last >= l_size)
+                last = l_size - 1;
+
+        InterlockedIncrement (& server.m_requests);
+
+        char            head [256];
+        int             length;
+        if (ranged) {
+                length = sprintf (head, "HTTP/1.1 206 Partial Content\r\n"
+                                  "Content-Type: application/octet-stream\r\n"
+                                  "Content-Range: bytes %lu-%lu/%lu\r\n"
+                                  "Content-Length: %lu\r\n\r\n",
+                                  first, last, l_size, last + 1 - first);
+        } else {
+                first = 0;
+                last = l_size - 1;
+                length = sprintf (head, "HTTP/1.1 200 OK\r\n"
+                                  "Content-Type: application/octet-stream\r\n"
+                                  "Content-Length: %lu\r\n\r\n", l_size);
+        }
+
+        return send (s, head, length, MSG_NOSIGNAL) == length &&
+               l_body (server, s, first, last + 1);
+}
+
+/**
+ * Deal with the requests on a connection until the client closes it.
+ */
+
+static void l_connection (Server & server, int s) {
+        char            request [4096];
+        unsigned long   length = 0;
+
+        for (;;) {
+                const char    * end;
+                while ((end = g_headerEnd (request, length)) == 0) {
+                        if (server.m_stop != 0 ||
+                            length == sizeof (request) - 1)
+                                return;
+
+                        pollfd          wait = { s, POLLIN, 0 };
+                        if (poll (& wait, 1, 20) != 1)
+                                continue;
+
+                        int             result;
+                        result = recv (s, request + length,
+                                       sizeof (request) - 1 - length, 0);
+                        if (result <= 0)
+                                return;
+
+                        length += result;
+                }
+
+                unsigned long   used = end - request;
+                char            save = request [used];
+                request [used] = 0;
+                if (! l_respond (server, s, request))
+                        return;
+
+                request [used] = save;
+                memmove (request, end, length - used);
+                length -= used;
+        }
+}
+
+static void * l_serve (void * param) {
+        Server        & server = * (Server *) param;
+        while (server.m_stop == 0) {
+                pollfd          wait = { server.m_listen, POLLIN, 0 };
+                if (poll (& wait, 1, 20) != 1)
+                        continue;
+
+                int             s = accept (server.m_listen, 0, 0);
+                if (s < 0)
+                        continue;
+
+                l_connection (server, s);
+                close (s);
+        }
+
+        return 0;
+}
+
+/**
+ * Start a server, or with a negative backlog make one which refuses all
+ * connections.
+ */
+
+static bool l_start (Server & server, bool ranges = true,
+                     unsigned long rate = 0, int backlog = 16) {
+        memset (& server, 0, sizeof (server));
+        server.m_ranges = ranges;
+        server.m_rate = rate;
+        server.m_listen = l_server (backlog, server.m_addr);
+        if (server.m_listen < 0)
+                return false;
+
+        if (backlog < 0)
+                return true;
+
+        server.m_running = pthread_create (& server.m_thread, 0, l_serve,
+                                           & server) == 0;
+        return server.m_running;
+}
+
+static void l_stop (Server * servers, int count) {
+        for (int i = 0 ; i < count ; ++ i) {
+                Server        & server = servers [i];
+                server.m_stop = 1;
+                if (server.m_running)
+                        pthread_join (server.m_thread, 0);
+                if (server.m_listen >= 0)
+                        close (server.m_listen);
+        }
+}
+
+/**
+ * Download the document split across some servers, checking every byte of
+ * it, and say how long that took in milliseconds.
+ */
+
+static bool l_download (Server * servers, int count, double & elapsed) {
+static  SOCKET          handle = 1000;
+        ++ handle;
+
+        RuleTargets     targets;
+        memset (& targets, 0, sizeof (targets));
+        targets.m_count = count;
+        for (int i = 0 ; i < count ; ++ i) {
+                targets.m_addr [i] = servers [i].m_addr.sin_addr.S_un.S_addr;
+                targets.m_port [i] = servers [i].m_addr.sin_port;
+        }
+
+        sockaddr_in     original;
+        memset (& original, 0, sizeof (original));
+        original.sin_family = AF_INET;
+        original.sin_port = htons (80);
+        g_addRedirect (handle, original, targets);
+
+        double          start = checkNow ();
+        if (! g_segmentStart (handle, l_request, sizeof (l_request) - 1,
+                              64 * 1024)) {
+                g_removeSegmented (handle);
+                return false;
+        }
+
+        static  char    buf [64 * 1024];
+        unsigned long   headLength = 0;
+        bool            headDone = false;
+        unsigned long   offset = 0;
+        bool            intact = true;
+
+        Segmented     * item;
+        while ((item = g_findSegmented (handle)) != 0) {
+                unsigned long   copied;
+                if (g_segmentRead (item, buf, sizeof (buf), false,
+                                   & copied) != ERROR_SUCCESS)
+                        break;
+
+                unsigned long   i = 0;
+                for (; ! headDone && i < copied ; ++ i) {
+                        if (headLength < sizeof (l_head) - 1)
+                                l_head [headLength ++] = buf [i];
+
+                        headDone = headLength >= 4 &&
+                                   memcmp (l_head + headLength - 4,
+                                           "\r\n\r\n", 4) == 0;
+                }
+
+                for (; i < copied ; ++ i, ++ offset)
+                        if ((unsigned char) buf [i] != l_byte (offset))
+                                intact = false;
+        }
+
+        elapsed = (checkNow () - start) / 1e6;
+        l_head [headLength] = 0;
+
+        bool            finished = item == 0;
+        g_removeSegmented (handle);
+        return finished && intact && offset == l_size;
+}
+
+/**
+ * Download the document straight from one server, for comparison.
+ */
+
+static bool l_direct (Server & server, double & elapsed) {
+        int             s = socket (AF_INET, SOCK_STREAM, 0);
+        double          start = checkNow ();
+        if (connect (s, (sockaddr *) & server.m_addr,
+                     sizeof (server.m_addr)) != 0) {
+                close (s);
+                return false;
+        }
+
+        send (s, l_request, sizeof (l_request) - 1, MSG_NOSIGNAL);
+
+        static  char    buf [64 * 1024];
+        unsigned long   length = 0;
+        const char    * end = 0;
+        unsigned long   body = 0;
+        int             result;
+        while ((result = recv (s, buf + length, sizeof (buf) - length,
+                               0)) > 0) {
+                length += result;
+                if (end == 0 && (end = g_headerEnd (buf, length)) == 0)
+                        continue;
+
+                body += length - (end - buf);
+                end = buf;
+                length = 0;
+                if (body >= l_size)
+                        break;
+        }
+
+        elapsed = (checkNow () - start) / 1e6;
+        close (s);
+        return body == l_size;
+}
+
+/**
+ * Check a download split across servers which all do ranges, bigger than the
+ * window so that it wraps around.
+ */
+
+static void l_checkRanged (void) {
+        Server          servers [3];
+        l_size = SEGMENT_WINDOW + 2 * 1024 * 1024 + 1234;
+        for (int i = 0 ; i < 3 ; ++ i)
+                CHECK (l_start (servers [i]));
+
+        double          elapsed;
+        CHECK (l_download (servers, 3, elapsed));
+
+        /*
+         * The client sees a plain response for the whole document.
+         */
+
+        char            length [64];
+        sprintf (length, "\r\nContent-Length: %lu\r\n", l_size);
+        CHECK (strncmp (l_head, "HTTP/1.1 200 OK\r\n", 17) == 0);
+        CHECK (strstr (l_head, length) != 0);
+        CHECK (strstr (l_head, "Content-Range") == 0);
+
+        /*
+         * Every server did its share.
+         */
+
+        LONG            requests = 0;
+        for (int i = 0 ; i < 3 ; ++ i) {
+                CHECK (servers [i].m_requests > 0);
+                requests += servers [i].m_requests;
+        }
+
+        CHECK (requests >= (LONG) (l_size / (64 * 1024)));
+        l_stop (servers, 3);
+}
+
+/**
+ * Check a server which doesn't do ranges having its response passed through
+ * as it is, with no other server being asked for anything.
+ */
+
+static void l_checkPassThrough (void) {
+        Server          servers [2];
+        l_size = 1024 * 1024 + 17;
+        CHECK (l_start (servers [0], false));
+        CHECK (l_start (servers [1], false));
+
+        double          elapsed;
+        CHECK (l_download (servers, 2, elapsed));
+        CHECK (strncmp (l_head, "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: application/octet-stream\r\n", 57) == 0);
+        CHECK (servers [0].m_requests == 1 && servers [1].m_requests == 0);
+
+        l_stop (servers, 2);
+}
+
+/**
+ * Check the download surviving one server dropping a connection part way
+ * through a part and another refusing to talk at all; with no servers left,
+ * the client gets an error instead.
+ */
+
+static void l_checkFailures (void) {
+        Server          servers [3];
+        l_size = 3 * 1024 * 1024;
+        CHECK (l_start (servers [0]));
+        CHECK (l_start (servers [1]));
+        CHECK (l_start (servers [2], true, 0, -1));
+        servers [1].m_dropAfter = 100 * 1024;
+
+        unsigned long   closed = l_closed;
+        double          elapsed;
+        CHECK (l_download (servers, 3, elapsed));
+        CHECK (servers [1].m_dropAfter == 0);
+        CHECK (l_closed > closed);
+
+        l_stop (servers, 3);
+
+        CHECK (l_start (servers [0], true, 0, -1));
+        CHECK (l_start (servers [1], true, 0, -1));
+        CHECK (! l_download (servers, 2, elapsed));
+
+        l_stop (servers, 2);
+}
+
+/**
+ * Measure the point of the whole thing: servers which each limit how fast
+ * they send, as mirrors do, giving more together than one alone.
+ */
+
+static void l_benchmark (void) {
+        const unsigned long     rate = 4 * 1024 * 1024;
+        Server          servers [3];
+        l_size = 4 * 1024 * 1024;
+        for (int i = 0 ; i < 3 ; ++ i)
+                CHECK (l_start (servers [i], true, rate));
+
+        double          single;
+        double          split;
+        CHECK (l_direct (servers [0], single));
+        CHECK (l_download (servers, 3, split));
+
+        printf ("segmenttest: %lu MB at %lu MB/s per server, one server "
+                "%.0f ms, three %.0f ms, %.1f times the throughput\n",
+                l_size >> 20, rate >> 20, single, split, single / split);
+
+        l_stop (servers, 3);
+}
+
+int main (void) {
+        Server          probe;
+        if (! l_start (probe, true, 0, -1)) {
+                printf ("segmenttest: can't set up servers, skipped\n");
+                return 0;
+        }
+
+        l_stop (& probe, 1);
+        l_netStandins ();
+
+        l_checkRanged ();
+        l_checkPassThrough ();
+        l_checkFailures ();
+        l_benchmark ();
+
+        g_segmentUnload ();
+        CHECK (l_outstanding == 0);
+
+        return checkDone ("segmenttest");
+}
+
+/**@}*/
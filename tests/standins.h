@@ -0,0 +1,129 @@
+#ifndef STANDINS_H
+#define STANDINS_H              1
+
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This supplies stand-ins for the document functions.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The modules built on documents are mostly tested without them, since the
+ * real ones lean on the registry; these stand-ins build documents on the
+ * pool stand-ins, so that what they allocate is counted along with the rest.
+ *
+ * Only one source file in each test program should include this.
+ */
+
+#include "steamfilter/document.h"
+#include "poolstandins.h"
+
+Document * g_newDocument (unsigned long headLength, unsigned long split,
+                          unsigned long bodyLength, unsigned long bodySpace) {
+        Document      * doc;
+        doc = (Document *) g_poolAlloc (sizeof (Document) + headLength +
+                                        bodySpace);
+        if (doc == 0)
+                return 0;
+
+        unsigned char * head = (unsigned char *) (doc + 1);
+
+        doc->m_refs = 1;
+        doc->m_head = head;
+        doc->m_headLength = headLength;
+        doc->m_split = split;
+        doc->m_body = head + headLength;
+        doc->m_bodyLength = bodyLength;
+        doc->m_view = 0;
+        return doc;
+}
+
+void g_documentAddRef (Document * doc) {
+        InterlockedIncrement (& doc->m_refs);
+}
+
+void g_documentRelease (Document * doc) {
+        if (doc == 0 || InterlockedDecrement (& doc->m_refs) > 0)
+                return;
+
+        if (doc->m_view != 0)
+                UnmapViewOfFile (doc->m_view);
+
+        g_poolFree (doc);
+}
+
+/**
+ * Serve a file as a document, mapping it just as the real one does but with
+ * a bare status line for the headers.
+ */
+
+Document * g_mapDocument (const wchar_t * path, const char * type) {
+        HANDLE          file;
+        file = CreateFileW (path, GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE |
+                            FILE_SHARE_DELETE, 0, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, 0);
+        if (file == INVALID_HANDLE_VALUE)
+                return 0;
+
+        unsigned long   high = 0;
+        unsigned long   length = GetFileSize (file, & high);
+        const void    * view = 0;
+        if (length > 0 && length != INVALID_FILE_SIZE && high == 0) {
+                HANDLE          mapping;
+                mapping = CreateFileMappingW (file, 0, PAGE_READONLY, 0, 0, 0);
+                if (mapping != 0) {
+                        view = MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+                        CloseHandle (mapping);
+                }
+        }
+
+        CloseHandle (file);
+        if (length == INVALID_FILE_SIZE || high != 0 ||
+            (length > 0 && view == 0))
+                return 0;
+
+        static  const char      status [] = "HTTP/1.1 200 OK\r\n\r\n";
+        Document      * doc;
+        doc = g_newDocument (sizeof (status) - 1, 17, length, 0);
+        if (doc == 0) {
+                if (view != 0)
+                        UnmapViewOfFile (view);
+                return 0;
+        }
+
+        memcpy ((void *) doc->m_head, status, sizeof (status) - 1);
+        doc->m_body = (const unsigned char *) view;
+        doc->m_view = view;
+        return doc;
+}
+
+/**@}*/
+#endif  /* ! defined (STANDINS_H) */
@@ -0,0 +1,275 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the layout of the shared statistics and their sequence lock.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check the layout of the filter's shared statistics and its sequence lock,
+ * with the block in POSIX shared memory mapped twice over, once for a writer
+ * and once for a reader, just as the filter and the monitor see it.
+ *
+ * The layout header is included first and on its own, since it's meant to be
+ * usable anywhere without anything from Windows.
+ */
+
+#include "filterstats.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "check.h"
+
+/**
+ * Check that the fields are where every reader expects them to be.
+ */
+
+static void l_checkLayout (void) {
+        CHECK (sizeof (FilterStatsMeter) == 24);
+        CHECK (sizeof (FilterStatsLatency) == 32);
+
+        CHECK (offsetof (FilterStats, m_sequence) == 16);
+        CHECK (offsetof (FilterStats, m_meter) == 24);
+        CHECK (offsetof (FilterStats, m_counters) == 48);
+        CHECK (offsetof (FilterStats, m_ruleHits) ==
+               48 + 4 * FILTER_STATS_COUNTERS);
+        CHECK (offsetof (FilterStats, m_latency) ==
+               48 + 4 * (FILTER_STATS_COUNTERS + FILTER_STATS_RULES));
+        CHECK (sizeof (FilterStats) ==
+               offsetof (FilterStats, m_latency) + 32 * FILTER_STATS_HOOKS);
+
+        CHECK (offsetof (FilterStats, m_meter) % 8 == 0);
+        CHECK (HOOK_COUNT <= FILTER_STATS_HOOKS);
+        CHECK (STAT_DATAGRAM_BLOCKS < FILTER_STATS_COUNTERS);
+}
+
+/**
+ * Publish a header into a block, as the filter does.
+ */
+
+static void l_publish (volatile FilterStats * stats) {
+        stats->m_version = FILTER_STATS_VERSION;
+        stats->m_size = sizeof (FilterStats);
+        stats->m_rules = FILTER_STATS_RULES;
+        FILTER_STATS_BARRIER ();
+        stats->m_magic = FILTER_STATS_MAGIC;
+}
+
+/**
+ * Check the tests readers make of a block before trusting it.
+ */
+
+static void l_checkValid (volatile FilterStats * stats) {
+        CHECK (! filterStatsValid (stats));
+
+        l_publish (stats);
+        CHECK (filterStatsValid (stats));
+
+        stats->m_version = FILTER_STATS_VERSION + 1;
+        stats->m_size = sizeof (FilterStats) + 64;
+        CHECK (filterStatsValid (stats));
+
+        stats->m_size = sizeof (FilterStats) - 4;
+        CHECK (! filterStatsValid (stats));
+
+        stats->m_size = sizeof (FilterStats);
+        stats->m_version = FILTER_STATS_VERSION - 1;
+        CHECK (! filterStatsValid (stats));
+
+        l_publish (stats);
+}
+
+/**
+ * The writer's view of the block and how many updates it makes, for the
+ * writer thread.
+ */
+
+static  volatile FilterStats  * l_writer;
+static  const unsigned int      l_updates = 200000;
+
+/**
+ * Update the meter figures over and over, as the filter's background thread
+ * does, so that each update's figures can be recognized as belonging
+ * together.
+ *
+ * The filter only updates them every so often, so there's a pause between
+ * updates here too, albeit a very short one; without any, a reader could
+ * hardly ever get in between them.
+ */
+
+static void * l_write (void *) {
+        volatile FilterStats  * stats = l_writer;
+
+        for (unsigned int i = 1 ; i <= l_updates ; ++ i) {
+                ++ stats->m_sequence;
+                FILTER_STATS_BARRIER ();
+
+                stats->m_meter.m_total = (unsigned long long) i << 32 | i;
+                stats->m_meter.m_rate1 = i;
+                stats->m_meter.m_rate10 = i * 3;
+                stats->m_meter.m_rate60 = i * 5;
+                stats->m_meter.m_updated = ~ i;
+
+                FILTER_STATS_BARRIER ();
+                ++ stats->m_sequence;
+
+                for (volatile unsigned int pause = 0 ; pause < 100 ; ++ pause)
+                        ;
+        }
+
+        return 0;
+}
+
+/**
+ * Read the figures through another mapping while they're being written,
+ * checking that every read is of a single update.
+ */
+
+static void l_checkSequence (volatile FilterStats * writer,
+                             const volatile FilterStats * reader) {
+        l_writer = writer;
+        writer->m_meter.m_updated = ~ 0U;
+
+        pthread_t       thread;
+        CHECK (pthread_create (& thread, 0, l_write, 0) == 0);
+
+        unsigned long   reads = 0;
+        unsigned long   failed = 0;
+        unsigned long   torn = 0;
+        unsigned int    last = 0;
+        unsigned long   backwards = 0;
+
+        for (;;) {
+                FilterStatsMeter meter;
+                if (! filterStatsMeter (reader, meter)) {
+                        ++ failed;
+                        continue;
+                }
+
+                ++ reads;
+
+                unsigned int    i = meter.m_rate1;
+                if (meter.m_total != ((unsigned long long) i << 32 | i) ||
+                    meter.m_rate10 != i * 3 || meter.m_rate60 != i * 5 ||
+                    meter.m_updated != ~ i)
+                        ++ torn;
+
+                if (i < last)
+                        ++ backwards;
+
+                last = i;
+                if (i == l_updates)
+                        break;
+        }
+
+        pthread_join (thread, 0);
+
+        /*
+         * A read can give up if the writer is switched out part way through
+         * an update, which is fine as long as it doesn't happen often; what
+         * must never happen is a read mixing two updates.
+         */
+
+        CHECK (torn == 0);
+        CHECK (backwards == 0);
+        CHECK (reads > 0);
+        printf ("stats: %lu consistent reads, %lu given up, during %u "
+                "updates\n", reads, failed, l_updates);
+}
+
+/**
+ * Check that a reader gives up on a block whose writer went away part way
+ * through an update, rather than waiting on it forever.
+ */
+
+static void l_checkAbandoned (volatile FilterStats * writer,
+                              const volatile FilterStats * reader) {
+        ++ writer->m_sequence;
+
+        FilterStatsMeter meter;
+        CHECK (! filterStatsMeter (reader, meter));
+
+        FilterStatsLatency latency;
+        CHECK (! filterStatsLatency (reader, HOOK_RECV, latency));
+
+        ++ writer->m_sequence;
+        CHECK (filterStatsMeter (reader, meter));
+
+        writer->m_latency [HOOK_RECV].m_calls = 42;
+        CHECK (filterStatsLatency (reader, HOOK_RECV, latency));
+        CHECK (latency.m_calls == 42);
+}
+
+int main (int argc, char ** argv) {
+        l_checkLayout ();
+
+        char            name [40];
+        sprintf (name, "/statstest.%lu", (unsigned long) getpid ());
+
+        int             fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+                perror ("shm_open");
+                return 1;
+        }
+
+        shm_unlink (name);
+        CHECK (ftruncate (fd, sizeof (FilterStats)) == 0);
+
+        void          * write = mmap (0, sizeof (FilterStats),
+                                      PROT_READ | PROT_WRITE, MAP_SHARED,
+                                      fd, 0);
+        void          * read = mmap (0, sizeof (FilterStats), PROT_READ,
+                                     MAP_SHARED, fd, 0);
+        close (fd);
+        if (write == MAP_FAILED || read == MAP_FAILED) {
+                perror ("mmap");
+                return 1;
+        }
+
+        volatile FilterStats  * writer = (volatile FilterStats *) write;
+        const volatile FilterStats * reader;
+        reader = (const volatile FilterStats *) read;
+
+        l_checkValid (writer);
+        CHECK (filterStatsValid (reader));
+
+        l_checkSequence (writer, reader);
+        l_checkAbandoned (writer, reader);
+
+        munmap (write, sizeof (FilterStats));
+        munmap (read, sizeof (FilterStats));
+        return checkDone ("statstest");
+}
+
+/**@}*/
@@ -0,0 +1,345 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the socket options rules can set on their connections.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The options go all the way from the text of a rule to a real socket here:
+ * the rules are parsed and matched by the real rule set, and the options it
+ * hands back are applied to loopback sockets and read back again. Resolving
+ * the rules' targets goes to a stand-in for GetAddrInfoW () which only knows
+ * numeric addresses, and the other modules the rules touch have stand-ins
+ * which do nothing.
+ *
+ * The benchmark shows what the buffer sizes are for. A long path can only
+ * carry as much data per round trip as the receive buffer holds, but there is
+ * no emulating that with a proxy, which would acknowledge everything at once
+ * in the receiver's place; instead, the client only takes what has arrived
+ * once each emulated round trip, so the receive buffer is all that can arrive
+ * in one, just as it would be.
+ */
+
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include "steamfilter/filterrule.h"
+#include "steamfilter/health.h"
+#include "steamfilter/mirror.h"
+#include "steamfilter/resolve.h"
+#include "steamfilter/stats.h"
+#include "steamfilter/trace.h"
+#include "steamfilter/tune.h"
+#include "check.h"
+#include "netstandins.h"
+
+/**
+ * Stand-ins for the modules the rule set works with.
+ */
+
+volatile FilterStats  * g_stats;
+
+bool g_healthDown (unsigned long addr, unsigned short port) {
+        return false;
+}
+
+unsigned long g_mirrorPick (const unsigned long * addr,
+                            const unsigned short * port,
+                            unsigned long count) {
+        return 0;
+}
+
+bool g_resolveFind (const wchar_t * name, HostAnswer & answer) {
+        return false;
+}
+
+void g_resolveStore (const wchar_t * name, HostAnswer & answer) {
+}
+
+void g_traceWide (TraceEvent event, const wchar_t * text,
+                  unsigned long value, unsigned long addr) {
+}
+
+static int WSAAPI l_getAddrInfo (const wchar_t * node,
+                                 const wchar_t * service,
+                                 const ADDRINFOW * hints,
+                                 ADDRINFOW ** result) {
+        char            name [64];
+        size_t          i = 0;
+        for (; node [i] != 0 && i < sizeof (name) - 1 ; ++ i)
+                name [i] = (char) node [i];
+        name [i] = 0;
+
+        * result = 0;
+        unsigned long   addr = inet_addr (name);
+        if (addr == INADDR_NONE)
+                return WSANO_DATA;
+
+        ADDRINFOW     * info;
+        info = (ADDRINFOW *) calloc (1, sizeof (ADDRINFOW) +
+                                        sizeof (sockaddr_in));
+        sockaddr_in   * found = (sockaddr_in *) (info + 1);
+        found->sin_family = AF_INET;
+        found->sin_addr.S_un.S_addr = addr;
+
+        info->ai_family = AF_INET;
+        info->ai_addr = (sockaddr *) found;
+        info->ai_addrlen = sizeof (* found);
+        * result = info;
+        return 0;
+}
+
+static void WSAAPI l_freeAddrInfo (ADDRINFOW * info) {
+        free (info);
+}
+
+/**
+ * The rules, which send connections for each of three addresses to the same
+ * place with different options.
+ */
+
+static  const wchar_t   l_rules [] =
+        L"10.0.0.1:27030=127.0.0.1"
+                L"{rcvbuf=256,sndbuf=32,nodelay,keepalive=30,dscp=46};"
+        L"10.0.0.2:27030=127.0.0.1{nodelay=0,tos=16,keepalive};"
+        L"10.0.0.3:27030=127.0.0.1{limit=100};"
+        L"10.0.0.4:27030=127.0.0.1{rcvbuf=16};"
+        L"10.0.0.5:27030=127.0.0.1{rcvbuf=1024}";
+
+/**
+ * Match a connection to one of the addresses against the rules, for the
+ * options of the rule it matches.
+ */
+
+static RuleOptions l_options (FilterRules & rules, const char * addr) {
+        sockaddr_in     name;
+        memset (& name, 0, sizeof (name));
+        name.sin_family = AF_INET;
+        name.sin_port = htons (27030);
+        name.sin_addr.S_un.S_addr = inet_addr (addr);
+
+        sockaddr_in   * replace = 0;
+        RuleTargets     targets;
+        memset (& targets, 0, sizeof (targets));
+        CHECK (rules.matchIp (& name, 0, & replace, & targets));
+        CHECK (replace != 0 &&
+               replace->sin_addr.S_un.S_addr == htonl (INADDR_LOOPBACK));
+        return targets.m_options;
+}
+
+/**
+ * Read back a socket option which is a plain number.
+ */
+
+static int l_option (SOCKET s, int level, int name) {
+        int             value = -1;
+        socklen_t       length = sizeof (value);
+        getsockopt (s, level, name, & value, & length);
+        return value;
+}
+
+/**
+ * Check the options being parsed from the rules.
+ */
+
+static void l_checkParse (FilterRules & rules) {
+        RuleOptions     options = l_options (rules, "10.0.0.1");
+        CHECK (options.m_rcvbuf == 256 && options.m_sndbuf == 32);
+        CHECK (options.m_nodelay == 2 && options.m_keepalive == 31);
+        CHECK (options.m_tos == (46 << 2) + 1);
+        CHECK (g_tuneWanted (options));
+
+        options = l_options (rules, "10.0.0.2");
+        CHECK (options.m_rcvbuf == 0 && options.m_nodelay == 1);
+        CHECK (options.m_keepalive == RULE_KEEPALIVE_DEFAULT + 1);
+        CHECK (options.m_tos == 17);
+
+        options = l_options (rules, "10.0.0.3");
+        CHECK (options.m_limit == 100 && ! g_tuneWanted (options));
+}
+
+/**
+ * Check the options being applied to real sockets.
+ */
+
+static void l_checkApply (FilterRules & rules) {
+        SOCKET          s = socket (AF_INET, SOCK_STREAM, 0);
+        g_tuneConnect (s, l_options (rules, "10.0.0.1"));
+
+        CHECK (l_option (s, SOL_SOCKET, SO_RCVBUF) >= 256 * 1024);
+        CHECK (l_option (s, SOL_SOCKET, SO_SNDBUF) >= 32 * 1024);
+        CHECK (l_option (s, IPPROTO_TCP, TCP_NODELAY) != 0);
+        CHECK (l_option (s, SOL_SOCKET, SO_KEEPALIVE) != 0);
+        CHECK (l_option (s, IPPROTO_TCP, TCP_KEEPIDLE) == 30);
+        CHECK (l_option (s, IPPROTO_TCP, TCP_KEEPINTVL) == 1);
+        CHECK (l_option (s, IPPROTO_IP, IP_TOS) == 46 << 2);
+        close (s);
+
+        /*
+         * Turning no-delay off is a setting as much as turning it on is; and
+         * without WSAIoctl () keepalive is still turned on, just with the
+         * system's own times.
+         */
+
+        s = socket (AF_INET, SOCK_STREAM, 0);
+        int             on = 1;
+        setsockopt (s, IPPROTO_TCP, TCP_NODELAY, & on, sizeof (on));
+        int             idle = l_option (s, IPPROTO_TCP, TCP_KEEPIDLE);
+
+        g_net.m_wsaIoctl = 0;
+        g_tuneConnect (s, l_options (rules, "10.0.0.2"));
+        g_net.m_wsaIoctl = l_wsaIoctl;
+
+        CHECK (l_option (s, IPPROTO_TCP, TCP_NODELAY) == 0);
+        CHECK (l_option (s, SOL_SOCKET, SO_KEEPALIVE) != 0);
+        CHECK (l_option (s, IPPROTO_TCP, TCP_KEEPIDLE) == idle);
+        CHECK (l_option (s, IPPROTO_IP, IP_TOS) == 16);
+        close (s);
+
+        /*
+         * A rule without any tuning leaves the socket alone.
+         */
+
+        s = socket (AF_INET, SOCK_STREAM, 0);
+        g_tuneConnect (s, l_options (rules, "10.0.0.3"));
+        CHECK (l_option (s, SOL_SOCKET, SO_KEEPALIVE) == 0);
+        CHECK (l_option (s, IPPROTO_IP, IP_TOS) == 0);
+        close (s);
+}
+
+/**
+ * A server which sends as fast as it's allowed to, to one connection.
+ */
+
+struct Sender {
+        int             m_listen;
+        sockaddr_in     m_addr;
+        pthread_t       m_thread;
+};
+
+static void * l_send (void * param) {
+        Sender        & sender = * (Sender *) param;
+        pollfd          wait = { sender.m_listen, POLLIN, 0 };
+        if (poll (& wait, 1, 1000) != 1)
+                return 0;
+
+        int             s = accept (sender.m_listen, 0, 0);
+        if (s < 0)
+                return 0;
+
+        static  char    buf [16 * 1024];
+        while (send (s, buf, sizeof (buf), MSG_NOSIGNAL) > 0)
+                ;
+
+        close (s);
+        return 0;
+}
+
+/**
+ * Measure how fast data arrives over a connection tuned by a rule, with the
+ * client taking what has arrived once each round trip, in megabytes a second.
+ */
+
+static double l_throughput (FilterRules & rules, const char * addr,
+                            unsigned long roundTrip, unsigned long rounds) {
+        Sender          sender;
+        sender.m_listen = l_server (1, sender.m_addr);
+        if (sender.m_listen < 0 ||
+            pthread_create (& sender.m_thread, 0, l_send, & sender) != 0)
+                return 0;
+
+        SOCKET          s = socket (AF_INET, SOCK_STREAM, 0);
+        g_tuneConnect (s, l_options (rules, addr));
+
+        double          received = 0;
+        double          start = checkNow ();
+        if (connect (s, (sockaddr *) & sender.m_addr,
+                     sizeof (sender.m_addr)) == 0) {
+                fcntl (s, F_SETFL, O_NONBLOCK);
+
+                static  char    buf [64 * 1024];
+                for (unsigned long i = 0 ; i < rounds ; ++ i) {
+                        usleep (roundTrip * 1000);
+
+                        int             queued = 0;
+                        ioctl (s, FIONREAD, & queued);
+                        while (queued > 0) {
+                                int             length = queued;
+                                if (length > (int) sizeof (buf))
+                                        length = sizeof (buf);
+
+                                int             result;
+                                result = recv (s, buf, length, 0);
+                                if (result <= 0)
+                                        break;
+
+                                received += result;
+                                queued -= result;
+                        }
+                }
+        }
+
+        double          elapsed = (checkNow () - start) / 1e9;
+        close (s);
+        pthread_join (sender.m_thread, 0);
+        close (sender.m_listen);
+
+        return received / elapsed / (1024 * 1024);
+}
+
+static void l_benchmark (FilterRules & rules) {
+        const unsigned long     roundTrip = 20;
+        double          small = l_throughput (rules, "10.0.0.4", roundTrip,
+                                              25);
+        double          large = l_throughput (rules, "10.0.0.5", roundTrip,
+                                              25);
+
+        printf ("tune: %lu ms round trips, rcvbuf=16 %.1f MB/s, "
+                "rcvbuf=1024 %.1f MB/s\n", roundTrip, small, large);
+}
+
+int main (void) {
+        shimExport ("GetAddrInfoW", (FARPROC) l_getAddrInfo);
+        shimExport ("FreeAddrInfoW", (FARPROC) l_freeAddrInfo);
+        l_netStandins ();
+
+        FilterRules     rules;
+        CHECK (rules.install (l_rules));
+
+        l_checkParse (rules);
+        l_checkApply (rules);
+        l_benchmark (rules);
+
+        g_tuneReport ();
+        return checkDone ("tunetest");
+}
+
+/**@}*/
@@ -0,0 +1,302 @@
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This tests the pool of connections kept open ahead of time to servers.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Check the pool of ready connections against a listener on the loopback
+ * interface, with the background thread's calls made by the test on a
+ * simulated clock, and time how long it takes to get a connection with and
+ * without the pool.
+ *
+ * The health checker and the ticker are replaced by stand-ins the test
+ * controls.
+ */
+
+#include "steamfilter/warm.h"
+#include "steamfilter/health.h"
+#include "steamfilter/ticker.h"
+#include "check.h"
+#include "netstandins.h"
+
+/**
+ * Stand-ins for the health checker and the ticker.
+ */
+
+static  bool            l_down;
+static  TickFunc        l_tick;
+
+bool g_healthDown (unsigned long addr, unsigned short port) {
+        return l_down;
+}
+
+bool g_tickerAdd (TickFunc func, unsigned long interval) {
+        l_tick = func;
+        return true;
+}
+
+/**
+ * The listeners standing in for servers, and their addresses.
+ */
+
+static  int             l_listener [2];
+static  sockaddr_in     l_addr [2];
+
+static bool l_listen (void) {
+        for (int i = 0 ; i < 2 ; ++ i)
+                if ((l_listener [i] = l_server (128, l_addr [i])) < 0)
+                        return false;
+
+        return true;
+}
+
+/**
+ * Have the servers close every connection made to them so far.
+ */
+
+static void l_hangUp (void) {
+        for (int i = 0 ; i < 2 ; ++ i) {
+                int             s;
+                while ((s = accept (l_listener [i], 0, 0)) >= 0)
+                        close (s);
+        }
+}
+
+/**
+ * Run the background thread's calls until a server has a connection ready,
+ * or it's clear none is coming.
+ */
+
+static bool l_settle (const sockaddr_in & addr) {
+        for (int i = 0 ; i < 200 ; ++ i) {
+                (* l_tick) (GetTickCount ());
+                if (g_warmReady (addr))
+                        return true;
+
+                usleep (500);
+        }
+
+        return false;
+}
+
+/**
+ * Check that a socket from the pool is connected to the right place.
+ */
+
+static bool l_connectedTo (SOCKET s, const sockaddr_in & addr) {
+        sockaddr_in     peer;
+        socklen_t       length = sizeof (peer);
+        return s != INVALID_SOCKET &&
+               getpeername (s, (sockaddr *) & peer, & length) == 0 &&
+               peer.sin_port == addr.sin_port;
+}
+
+/**
+ * Check taking connections, and the pool noticing when they've gone bad.
+ */
+
+static void l_checkTake (void) {
+        const sockaddr_in & addr = l_addr [0];
+
+        /*
+         * The first ask only makes the server known.
+         */
+
+        CHECK (g_warmTake (addr) == INVALID_SOCKET);
+        CHECK (l_settle (addr));
+        (* l_tick) (GetTickCount ());
+
+        SOCKET          first = g_warmTake (addr);
+        SOCKET          second = g_warmTake (addr);
+        CHECK (l_connectedTo (first, addr));
+        CHECK (l_connectedTo (second, addr));
+        CHECK (g_warmTake (addr) == INVALID_SOCKET);
+        close (first);
+        close (second);
+
+        /*
+         * Connections the server has closed aren't handed out.
+         */
+
+        CHECK (l_settle (addr));
+        (* l_tick) (GetTickCount ());
+        l_hangUp ();
+        usleep (10000);
+
+        unsigned long   closed = l_closed;
+        CHECK (g_warmTake (addr) == INVALID_SOCKET);
+        CHECK (l_closed == closed + 2);
+}
+
+/**
+ * Check the pool replacing connections as they age, and dropping them for a
+ * server the health checker says is down.
+ */
+
+static void l_checkUpkeep (void) {
+        const sockaddr_in & addr = l_addr [0];
+
+        CHECK (l_settle (addr));
+        (* l_tick) (GetTickCount ());
+
+        unsigned long   closed = l_closed;
+        shimTicks () += WARM_AGE + 1;
+        (* l_tick) (GetTickCount ());
+        CHECK (l_closed == closed + 2);
+        CHECK (l_settle (addr));
+
+        l_down = true;
+        (* l_tick) (GetTickCount ());
+        CHECK (! l_settle (addr));
+        l_down = false;
+        CHECK (l_settle (addr));
+
+        /*
+         * Nobody asking about a server for long enough drops it, after which
+         * asking whether it's ready doesn't add it again.
+         */
+
+        shimTicks () += WARM_IDLE + 1;
+        (* l_tick) (GetTickCount ());
+        CHECK (! l_settle (addr));
+}
+
+/**
+ * Check connections handed over to the pool, as from the connect race.
+ */
+
+static void l_checkGive (void) {
+        const sockaddr_in & addr = l_addr [1];
+
+        /*
+         * An unknown server is added, with the connection ready to go.
+         */
+
+        SOCKET          probe = g_netConnect (addr);
+        pollfd          wait = { probe, POLLOUT, 0 };
+        CHECK (poll (& wait, 1, 1000) == 1 && g_netConnected (probe));
+
+        g_warmGive (addr, probe);
+        CHECK (g_warmReady (addr));
+
+        SOCKET          taken = g_warmTake (addr);
+        CHECK (taken == probe);
+        close (taken);
+
+        /*
+         * Once the server's connections are all ready, there's no room for
+         * any more.
+         */
+
+        CHECK (l_settle (addr));
+        for (int i = 0 ; i < 10 ; ++ i) {
+                (* l_tick) (GetTickCount ());
+                usleep (500);
+        }
+
+        probe = g_netConnect (addr);
+        wait.fd = probe;
+        CHECK (poll (& wait, 1, 1000) == 1);
+
+        unsigned long   closed = l_closed;
+        g_warmGive (addr, probe);
+        CHECK (l_closed == closed + 1);
+}
+
+/**
+ * Time getting a connected socket by connecting, against taking one from the
+ * pool. Over the loopback interface a handshake costs next to nothing, so the
+ * saving with real servers is a whole round trip more than this shows.
+ */
+
+static void l_time (void) {
+        const sockaddr_in & addr = l_addr [0];
+        unsigned long   count = 2000;
+        double          cold = 0;
+        double          warm = 0;
+        unsigned long   taken = 0;
+
+        for (unsigned long i = 0 ; i < count ; ++ i) {
+                l_hangUp ();
+
+                double          start = checkNow ();
+                SOCKET          s = g_netConnect (addr);
+                pollfd          wait = { s, POLLOUT, 0 };
+                poll (& wait, 1, 1000);
+                CHECK (g_netConnected (s));
+                cold += checkNow () - start;
+                close (s);
+        }
+
+        /*
+         * The server was dropped as idle earlier, so make it known again.
+         */
+
+        g_warmTake (addr);
+        for (unsigned long i = 0 ; i < count ; ++ i) {
+                l_hangUp ();
+                l_settle (addr);
+
+                double          start = checkNow ();
+                SOCKET          s = g_warmTake (addr);
+                warm += checkNow () - start;
+
+                if (s != INVALID_SOCKET) {
+                        ++ taken;
+                        close (s);
+                }
+        }
+
+        CHECK (taken == count);
+        printf ("connect: %.1f us cold, %.1f us from the pool\n",
+                cold / count / 1000, warm / count / 1000);
+}
+
+int main (void) {
+        if (! l_listen ()) {
+                printf ("warmtest: can't set up listeners, skipped\n");
+                return 0;
+        }
+
+        l_netStandins ();
+        shimTicks () = 1000;
+        CHECK (g_warmInit () && l_tick != 0);
+
+        l_checkTake ();
+        l_checkUpkeep ();
+        l_checkGive ();
+        l_time ();
+
+        g_warmUnload ();
+        return checkDone ("warmtest");
+}
+
+/**@}*/
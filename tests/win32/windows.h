@@ -0,0 +1,939 @@
+#ifndef WINDOWS_H
+#define WINDOWS_H               1
+
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This supplies just enough of the Win32 API to build parts of the filter
+ * with a POSIX toolchain for testing.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The filter is written against Win32, but a good deal of it doesn't really
+ * need Windows, just the odd type and function; this supplies those, built on
+ * POSIX, so that those parts can be exercised on any build machine.
+ *
+ * Only what the sources under test actually use is here. The clocks can be
+ * set by a test, so that anything which reads the time can be driven through
+ * a simulated day in an instant; while they're not set, they follow the real
+ * time.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <wchar.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define WINAPI
+#define WSAAPI
+#define CALLBACK
+#define __stdcall
+
+typedef int             BOOL;
+typedef int             LONG;
+typedef unsigned char   BYTE;
+typedef BYTE          * LPBYTE;
+typedef char          * LPSTR;
+typedef unsigned short  WORD;
+typedef unsigned int    DWORD;
+typedef unsigned long long ULONGLONG;
+typedef void          * HANDLE;
+typedef void          * HKEY;
+typedef void          * HMODULE;
+typedef int          (* FARPROC) (void);
+
+#define TRUE            1
+#define FALSE           0
+#define INFINITE        0xFFFFFFFFUL
+
+typedef union _ULARGE_INTEGER {
+        struct {
+                DWORD           LowPart;
+                DWORD           HighPart;
+        };
+        ULONGLONG       QuadPart;
+} ULARGE_INTEGER;
+
+typedef struct _FILETIME {
+        DWORD           dwLowDateTime;
+        DWORD           dwHighDateTime;
+} FILETIME;
+
+typedef struct _SYSTEMTIME {
+        WORD            wYear;
+        WORD            wMonth;
+        WORD            wDayOfWeek;
+        WORD            wDay;
+        WORD            wHour;
+        WORD            wMinute;
+        WORD            wSecond;
+        WORD            wMilliseconds;
+} SYSTEMTIME;
+
+/**
+ * Seconds between the Windows epoch of 1601 and the UNIX one of 1970.
+ */
+
+#define SHIM_EPOCH_SECONDS      11644473600ULL
+
+/**
+ * The simulated clocks; zero means the real time is used.
+ */
+
+inline  ULONGLONG     & shimFileTime (void) {
+        static  ULONGLONG       time;
+        return time;
+}
+
+inline  unsigned long & shimTicks (void) {
+        static  unsigned long   ticks;
+        return ticks;
+}
+
+inline  void            GetSystemTimeAsFileTime (FILETIME * time) {
+        ULONGLONG       ticks = shimFileTime ();
+        if (ticks == 0) {
+                timespec        now;
+                clock_gettime (CLOCK_REALTIME, & now);
+                ticks = ((ULONGLONG) now.tv_sec + SHIM_EPOCH_SECONDS) *
+                        10000000 + now.tv_nsec / 100;
+        }
+
+        time->dwLowDateTime = (DWORD) ticks;
+        time->dwHighDateTime = (DWORD) (ticks >> 32);
+}
+
+inline  DWORD           GetTickCount (void) {
+        if (shimTicks () != 0)
+                return (DWORD) shimTicks ();
+
+        timespec        now;
+        clock_gettime (CLOCK_MONOTONIC, & now);
+        return (DWORD) (now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+inline  BOOL            FileTimeToSystemTime (const FILETIME * time,
+                                              SYSTEMTIME * out) {
+        ULONGLONG       ticks = ((ULONGLONG) time->dwHighDateTime << 32) +
+                                time->dwLowDateTime;
+        ULONGLONG       seconds = ticks / 10000000;
+        if (seconds < SHIM_EPOCH_SECONDS)
+                return FALSE;
+
+        time_t          posix = (time_t) (seconds - SHIM_EPOCH_SECONDS);
+        struct tm       parts;
+        gmtime_r (& posix, & parts);
+
+        out->wYear = (WORD) (parts.tm_year + 1900);
+        out->wMonth = (WORD) (parts.tm_mon + 1);
+        out->wDayOfWeek = (WORD) parts.tm_wday;
+        out->wDay = (WORD) parts.tm_mday;
+        out->wHour = (WORD) parts.tm_hour;
+        out->wMinute = (WORD) parts.tm_min;
+        out->wSecond = (WORD) parts.tm_sec;
+        out->wMilliseconds = (WORD) (ticks / 10000 % 1000);
+        return TRUE;
+}
+
+inline  BOOL            SystemTimeToFileTime (const SYSTEMTIME * in,
+                                              FILETIME * time) {
+        struct tm       parts;
+        memset (& parts, 0, sizeof (parts));
+        parts.tm_year = in->wYear - 1900;
+        parts.tm_mon = in->wMonth - 1;
+        parts.tm_mday = in->wDay;
+        parts.tm_hour = in->wHour;
+        parts.tm_min = in->wMinute;
+        parts.tm_sec = in->wSecond;
+
+        if (in->wMonth < 1 || in->wMonth > 12 || in->wDay < 1 ||
+            in->wDay > 31 || in->wHour > 23 || in->wMinute > 59 ||
+            in->wSecond > 59)
+                return FALSE;
+
+        ULONGLONG       ticks = ((ULONGLONG) timegm (& parts) +
+                                 SHIM_EPOCH_SECONDS) * 10000000 +
+                                in->wMilliseconds * 10000ULL;
+        time->dwLowDateTime = (DWORD) ticks;
+        time->dwHighDateTime = (DWORD) (ticks >> 32);
+        return TRUE;
+}
+
+/**
+ * Sleeping moves the simulated tick count on instead, when it's in use.
+ */
+
+inline  void            Sleep (DWORD milliseconds) {
+        if (shimTicks () != 0) {
+                shimTicks () += milliseconds;
+                return;
+        }
+
+        usleep (milliseconds * 1000);
+}
+
+/**
+ * Atomic operations, as full barriers, as they are on x86.
+ */
+
+inline  void            MemoryBarrier (void) {
+        __sync_synchronize ();
+}
+
+inline  LONG            InterlockedIncrement (volatile LONG * value) {
+        return __sync_add_and_fetch (value, 1);
+}
+
+inline  LONG            InterlockedDecrement (volatile LONG * value) {
+        return __sync_sub_and_fetch (value, 1);
+}
+
+inline  LONG            InterlockedExchangeAdd (volatile LONG * value,
+                                                LONG add) {
+        return __sync_fetch_and_add (value, add);
+}
+
+inline  LONG            InterlockedExchange (volatile LONG * value,
+                                             LONG replace) {
+        __sync_synchronize ();
+        return __sync_lock_test_and_set (value, replace);
+}
+
+inline  LONG            InterlockedCompareExchange (volatile LONG * value,
+                                                    LONG replace,
+                                                    LONG compare) {
+        return __sync_val_compare_and_swap (value, compare, replace);
+}
+
+/**
+ * Critical sections, as recursive mutexes.
+ */
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+inline  void            InitializeCriticalSection (CRITICAL_SECTION * lock) {
+        pthread_mutexattr_t     attr;
+        pthread_mutexattr_init (& attr);
+        pthread_mutexattr_settype (& attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init (lock, & attr);
+        pthread_mutexattr_destroy (& attr);
+}
+
+inline  void            DeleteCriticalSection (CRITICAL_SECTION * lock) {
+        pthread_mutex_destroy (lock);
+}
+
+inline  void            EnterCriticalSection (CRITICAL_SECTION * lock) {
+        pthread_mutex_lock (lock);
+}
+
+inline  void            LeaveCriticalSection (CRITICAL_SECTION * lock) {
+        pthread_mutex_unlock (lock);
+}
+
+/**
+ * The thread's last error, which the filter's socket code reads back after a
+ * call fails.
+ */
+
+inline  DWORD         & shimLastError (void) {
+        static  __thread DWORD  error;
+        return error;
+}
+
+inline  DWORD           GetLastError (void) {
+        return shimLastError ();
+}
+
+inline  void            SetLastError (DWORD error) {
+        shimLastError () = error;
+}
+
+/**
+ * There are no DLLs to look functions up in; a test fills in whatever table
+ * of entry points the code under test uses for itself, or for code which
+ * looks its functions up by name, exports its stand-ins for them here. Every
+ * module finds the same exports.
+ */
+
+struct ShimExport {
+        const char    * m_name;
+        FARPROC         m_func;
+};
+
+inline  ShimExport    * shimExports (void) {
+        static  ShimExport      exports [16];
+        return exports;
+}
+
+inline  void            shimExport (const char * name, FARPROC func) {
+        ShimExport    * scan = shimExports ();
+        for (; scan != shimExports () + 16 ; ++ scan)
+                if (scan->m_name == 0 || strcmp (scan->m_name, name) == 0) {
+                        scan->m_name = name;
+                        scan->m_func = func;
+                        return;
+                }
+}
+
+inline  FARPROC         GetProcAddress (HMODULE, const char * name) {
+        ShimExport    * scan = shimExports ();
+        for (; scan != shimExports () + 16 && scan->m_name != 0 ; ++ scan)
+                if (strcmp (scan->m_name, name) == 0)
+                        return scan->m_func;
+
+        return 0;
+}
+
+inline  HMODULE         GetModuleHandleW (const wchar_t *) {
+        return (HMODULE) 1;
+}
+
+#define GetModuleHandle GetModuleHandleW
+
+inline  DWORD           GetModuleFileNameA (HMODULE, char * name,
+                                            DWORD length) {
+        if (length > 0)
+                * name = 0;
+        return 0;
+}
+
+/**
+ * The process heap, as the C library heap.
+ */
+
+#define HEAP_ZERO_MEMORY        0x00000008
+
+inline  HANDLE          GetProcessHeap (void) {
+        return (HANDLE) 1;
+}
+
+inline  void          * HeapAlloc (HANDLE, DWORD flags, size_t length) {
+        return (flags & HEAP_ZERO_MEMORY) != 0 ? calloc (1, length) :
+               malloc (length);
+}
+
+inline  BOOL            HeapFree (HANDLE, DWORD, void * mem) {
+        free (mem);
+        return TRUE;
+}
+
+/**
+ * Debug output goes to the standard error when SHIM_DEBUG is set in the
+ * environment, and the formatting done by the filter for it works the same
+ * way with the C library.
+ */
+
+inline  void            OutputDebugStringA (const char * text) {
+        static  int     enabled = getenv ("SHIM_DEBUG") != 0 ? 1 : -1;
+        if (enabled > 0)
+                fputs (text, stderr);
+}
+
+#define wsprintfA       sprintf
+
+/**
+ * Files, named with wide-character paths using either separator, and held as
+ * descriptors; a handle is the descriptor plus one, so that zero is never a
+ * valid handle, as for Windows. The filter passes "unsigned long" for the
+ * sizes these return, which is what DWORD is on Windows, so that's what these
+ * take.
+ */
+
+#define MAX_PATH                260
+#define INVALID_HANDLE_VALUE    ((HANDLE) -1)
+#define INVALID_FILE_SIZE       0xFFFFFFFFUL
+
+#define GENERIC_READ            0x80000000UL
+#define GENERIC_WRITE           0x40000000UL
+#define FILE_SHARE_READ         0x00000001
+#define FILE_SHARE_WRITE        0x00000002
+#define FILE_SHARE_DELETE       0x00000004
+#define CREATE_ALWAYS           2
+#define OPEN_EXISTING           3
+#define OPEN_ALWAYS             4
+#define FILE_ATTRIBUTE_NORMAL   0x00000080
+#define FILE_FLAG_SEQUENTIAL_SCAN 0x08000000
+#define MOVEFILE_REPLACE_EXISTING 0x00000001
+
+inline  bool            shimPath (const wchar_t * path, char * out) {
+        for (size_t i = 0 ; i < MAX_PATH ; ++ i) {
+                wchar_t         ch = path [i];
+                if (ch > 127)
+                        return false;
+
+                out [i] = ch == '\\' ? '/' : (char) ch;
+                if (ch == 0)
+                        return true;
+        }
+
+        return false;
+}
+
+inline  int             shimDescriptor (HANDLE handle) {
+        return (int) (size_t) handle - 1;
+}
+
+inline  HANDLE          CreateFileW (const wchar_t * path, DWORD access,
+                                     DWORD, void *, DWORD disposition,
+                                     DWORD, HANDLE) {
+        char            name [MAX_PATH];
+        if (! shimPath (path, name))
+                return INVALID_HANDLE_VALUE;
+
+        int             flags = (access & GENERIC_WRITE) == 0 ? O_RDONLY :
+                                (access & GENERIC_READ) == 0 ? O_WRONLY :
+                                O_RDWR;
+        if (disposition == CREATE_ALWAYS)
+                flags |= O_CREAT | O_TRUNC;
+        if (disposition == OPEN_ALWAYS)
+                flags |= O_CREAT;
+
+        int             fd = open (name, flags, 0666);
+        return fd < 0 ? INVALID_HANDLE_VALUE : (HANDLE) (size_t) (fd + 1);
+}
+
+inline  DWORD           GetFileSize (HANDLE file, unsigned long * high) {
+        struct stat     info;
+        if (fstat (shimDescriptor (file), & info) != 0)
+                return INVALID_FILE_SIZE;
+
+        if (high != 0)
+                * high = (unsigned long) ((ULONGLONG) info.st_size >> 32);
+        return (DWORD) info.st_size;
+}
+
+inline  BOOL            WriteFile (HANDLE file, const void * buf,
+                                   DWORD length, unsigned long * written,
+                                   void *) {
+        ssize_t         result = write (shimDescriptor (file), buf, length);
+        * written = result < 0 ? 0 : (unsigned long) result;
+        return result >= 0;
+}
+
+inline  BOOL            DeleteFileW (const wchar_t * path) {
+        char            name [MAX_PATH];
+        return shimPath (path, name) && unlink (name) == 0;
+}
+
+inline  BOOL            MoveFileExW (const wchar_t * from, const wchar_t * to,
+                                     DWORD) {
+        char            source [MAX_PATH];
+        char            dest [MAX_PATH];
+        return shimPath (from, source) && shimPath (to, dest) &&
+               rename (source, dest) == 0;
+}
+
+inline  BOOL            CreateDirectoryW (const wchar_t * path, void *) {
+        char            name [MAX_PATH];
+        return shimPath (path, name) && mkdir (name, 0777) == 0;
+}
+
+inline  DWORD           GetCurrentProcessId (void) {
+        return (DWORD) getpid ();
+}
+
+inline  int             wsprintfW (wchar_t * out, const wchar_t * format,
+                                   ...) {
+        va_list         args;
+        va_start (args, format);
+        int             length = vswprintf (out, 1024, format, args);
+        va_end (args);
+        return length;
+}
+
+/**
+ * Conversions between UTF-8 and wide characters, which are UTF-32 here rather
+ * than UTF-16. As for Windows, an input length of -1 means the input and the
+ * result include the terminator, and an output length of zero asks for the
+ * length needed; only UTF-8 is supported.
+ */
+
+#define CP_UTF8                 65001
+
+inline  int             WideCharToMultiByte (unsigned int, DWORD,
+                                             const wchar_t * in,
+                                             int inLength, char * out,
+                                             int outLength, const char *,
+                                             BOOL *) {
+        if (inLength < 0)
+                inLength = (int) wcslen (in) + 1;
+
+        int             length = 0;
+        for (int i = 0 ; i < inLength ; ++ i) {
+                unsigned long   ch = (unsigned long) in [i];
+                int             extra = ch < 0x80 ? 0 : ch < 0x800 ? 1 :
+                                        ch < 0x10000 ? 2 : 3;
+                if (outLength > 0 && length + extra + 1 > outLength)
+                        return 0;
+
+                if (outLength > 0) {
+                        static  const unsigned char     lead [] = {
+                                0, 0xC0, 0xE0, 0xF0
+                        };
+
+                        out [length] = (char) (lead [extra] |
+                                               ch >> (6 * extra));
+                        for (int j = 1 ; j <= extra ; ++ j)
+                                out [length + j] = (char) (0x80 |
+                                        ((ch >> (6 * (extra - j))) & 0x3F));
+                }
+
+                length += extra + 1;
+        }
+
+        return length;
+}
+
+inline  int             MultiByteToWideChar (unsigned int, DWORD,
+                                             const char * in, int inLength,
+                                             wchar_t * out, int outLength) {
+        if (inLength < 0)
+                inLength = (int) strlen (in) + 1;
+
+        int             length = 0;
+        for (int i = 0 ; i < inLength ; ++ length) {
+                unsigned char   ch = (unsigned char) in [i ++];
+                int             extra = ch >= 0xF0 ? 3 : ch >= 0xE0 ? 2 :
+                                        ch >= 0xC0 ? 1 : 0;
+                unsigned long   value = extra == 0 ? ch : ch & (0x3F >> extra);
+                for (; extra > 0 && i < inLength ; -- extra)
+                        value = value << 6 | (in [i ++] & 0x3F);
+
+                if (outLength > 0) {
+                        if (length == outLength)
+                                return 0;
+
+                        out [length] = (wchar_t) value;
+                }
+        }
+
+        return length;
+}
+
+/**
+ * File mappings. A mapping handle is a duplicate of the file's descriptor,
+ * and the mapped views are remembered so they can be unmapped by address.
+ */
+
+#define PAGE_READONLY           0x02
+#define PAGE_READWRITE          0x04
+#define FILE_MAP_WRITE          0x0002
+#define FILE_MAP_READ           0x0004
+
+struct ShimView {
+        void          * m_base;
+        size_t          m_length;
+};
+
+inline  ShimView      * shimViews (void) {
+        static  ShimView        views [64];
+        return views;
+}
+
+inline  HANDLE          CreateFileMappingW (HANDLE file, void *,
+                                            DWORD protect, DWORD high,
+                                            DWORD low, const wchar_t *) {
+        int             fd = shimDescriptor (file);
+        ULONGLONG       size = ((ULONGLONG) high << 32) + low;
+        struct stat     info;
+        if (fstat (fd, & info) != 0)
+                return 0;
+
+        if (size > (ULONGLONG) info.st_size &&
+            (protect != PAGE_READWRITE || ftruncate (fd, size) != 0))
+                return 0;
+
+        fd = dup (fd);
+        return fd < 0 ? 0 : (HANDLE) (size_t) (fd + 1);
+}
+
+inline  void          * MapViewOfFile (HANDLE mapping, DWORD access, DWORD,
+                                       DWORD, size_t length) {
+        int             fd = shimDescriptor (mapping);
+        struct stat     info;
+        if (length == 0 && fstat (fd, & info) == 0)
+                length = info.st_size;
+
+        int             protect = PROT_READ;
+        if ((access & FILE_MAP_WRITE) != 0)
+                protect |= PROT_WRITE;
+
+        void          * base = mmap (0, length, protect, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+                return 0;
+
+        ShimView      * view = shimViews ();
+        for (; view != shimViews () + 64 ; ++ view)
+                if (__sync_bool_compare_and_swap (& view->m_base, (void *) 0,
+                                                  base)) {
+                        view->m_length = length;
+                        return base;
+                }
+
+        munmap (base, length);
+        return 0;
+}
+
+inline  BOOL            UnmapViewOfFile (const void * base) {
+        ShimView      * view = shimViews ();
+        for (; view != shimViews () + 64 ; ++ view)
+                if (view->m_base == base) {
+                        munmap (view->m_base, view->m_length);
+                        view->m_base = 0;
+                        return TRUE;
+                }
+
+        return FALSE;
+}
+
+inline  BOOL            FlushViewOfFile (const void *, size_t) {
+        return TRUE;
+}
+
+/**
+ * Memory the filter reserves for itself, which comes zeroed as it does from
+ * Windows.
+ */
+
+#define MEM_COMMIT              0x00001000
+#define MEM_RELEASE             0x00008000
+
+inline  void          * VirtualAlloc (void *, size_t length, DWORD, DWORD) {
+        return calloc (1, length);
+}
+
+inline  BOOL            VirtualFree (void * mem, size_t, DWORD) {
+        free (mem);
+        return TRUE;
+}
+
+/**
+ * Events and threads, as counted objects with a condition variable to wait
+ * on; a thread's becomes signalled when the thread finishes. Their handles
+ * point at the objects, so they can never be mistaken for the small numbers
+ * used as file handles.
+ */
+
+#define ERROR_SUCCESS           0
+#define WAIT_OBJECT_0           0
+#define WAIT_TIMEOUT            258
+#define MAXIMUM_WAIT_OBJECTS    64
+#define SYNCHRONIZE             0x00100000UL
+
+typedef unsigned long (__stdcall * LPTHREAD_START_ROUTINE) (void * param);
+
+struct ShimObject {
+        pthread_mutex_t m_lock;
+        pthread_cond_t  m_signal;
+        volatile LONG   m_refs;
+        bool            m_manual;
+        bool            m_signalled;
+
+        LPTHREAD_START_ROUTINE m_func;
+        void          * m_param;
+        int             m_poll;
+};
+
+inline  bool            shimIsObject (HANDLE handle) {
+        return (size_t) handle > 0xFFFF &&
+               handle != INVALID_HANDLE_VALUE;
+}
+
+inline  ShimObject    * shimNewObject (bool manual, bool signalled) {
+        ShimObject    * object = new ShimObject;
+        pthread_mutex_init (& object->m_lock, 0);
+        pthread_cond_init (& object->m_signal, 0);
+        object->m_refs = 1;
+        object->m_manual = manual;
+        object->m_signalled = signalled;
+        object->m_func = 0;
+        object->m_param = 0;
+        object->m_poll = -1;
+        return object;
+}
+
+inline  void            shimRelease (ShimObject * object) {
+        if (__sync_sub_and_fetch (& object->m_refs, 1) > 0)
+                return;
+
+        if (object->m_poll >= 0)
+                close (object->m_poll);
+
+        pthread_cond_destroy (& object->m_signal);
+        pthread_mutex_destroy (& object->m_lock);
+        delete object;
+}
+
+inline  HANDLE          CreateEventW (void *, BOOL manual, BOOL signalled,
+                                      const wchar_t *) {
+        return shimNewObject (manual != 0, signalled != 0);
+}
+
+inline  BOOL            SetEvent (HANDLE handle) {
+        ShimObject    * object = (ShimObject *) handle;
+        pthread_mutex_lock (& object->m_lock);
+        object->m_signalled = true;
+        pthread_cond_broadcast (& object->m_signal);
+        pthread_mutex_unlock (& object->m_lock);
+        return TRUE;
+}
+
+inline  BOOL            ResetEvent (HANDLE handle) {
+        ShimObject    * object = (ShimObject *) handle;
+        pthread_mutex_lock (& object->m_lock);
+        object->m_signalled = false;
+        pthread_mutex_unlock (& object->m_lock);
+        return TRUE;
+}
+
+/**
+ * Wait for an object until a deadline on the real-time clock, or for ever
+ * given no deadline; an auto-reset event is reset by the wait it satisfies.
+ */
+
+inline  bool            shimWait (ShimObject * object,
+                                  const timespec * deadline) {
+        pthread_mutex_lock (& object->m_lock);
+        while (! object->m_signalled)
+                if (deadline == 0) {
+                        pthread_cond_wait (& object->m_signal,
+                                           & object->m_lock);
+                } else if (pthread_cond_timedwait (& object->m_signal,
+                                                   & object->m_lock,
+                                                   deadline) != 0)
+                        break;
+
+        bool            signalled = object->m_signalled;
+        if (! object->m_manual)
+                object->m_signalled = false;
+
+        pthread_mutex_unlock (& object->m_lock);
+        return signalled;
+}
+
+inline  timespec      * shimDeadline (timespec & deadline, DWORD wait) {
+        if (wait == INFINITE)
+                return 0;
+
+        clock_gettime (CLOCK_REALTIME, & deadline);
+        deadline.tv_sec += wait / 1000;
+        deadline.tv_nsec += (wait % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+                ++ deadline.tv_sec;
+                deadline.tv_nsec -= 1000000000L;
+        }
+
+        return & deadline;
+}
+
+inline  DWORD           WaitForSingleObject (HANDLE handle, DWORD wait) {
+        ShimObject    * object = (ShimObject *) handle;
+        if (object->m_poll >= 0) {
+                pollfd          ready = { object->m_poll, POLLIN, 0 };
+                return poll (& ready, 1, wait == INFINITE ? -1 : (int) wait) ==
+                       1 ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+        }
+
+        timespec        deadline;
+        return shimWait ((ShimObject *) handle,
+                         shimDeadline (deadline, wait)) ? WAIT_OBJECT_0 :
+               WAIT_TIMEOUT;
+}
+
+/**
+ * Only waiting for all of several objects is supported.
+ */
+
+inline  DWORD           WaitForMultipleObjects (DWORD count,
+                                                const HANDLE * handles,
+                                                BOOL, DWORD wait) {
+        timespec        deadline;
+        timespec      * until = shimDeadline (deadline, wait);
+        for (DWORD i = 0 ; i < count ; ++ i)
+                if (! shimWait ((ShimObject *) handles [i], until))
+                        return WAIT_TIMEOUT;
+
+        return WAIT_OBJECT_0;
+}
+
+inline  void          * shimThread (void * param) {
+        ShimObject    * object = (ShimObject *) param;
+        (* object->m_func) (object->m_param);
+        SetEvent (object);
+        shimRelease (object);
+        return 0;
+}
+
+inline  HANDLE          CreateThread (void *, size_t,
+                                      LPTHREAD_START_ROUTINE func,
+                                      void * param, DWORD,
+                                      unsigned long * id) {
+        ShimObject    * object = shimNewObject (true, false);
+        object->m_func = func;
+        object->m_param = param;
+        object->m_refs = 2;
+
+        pthread_t       thread;
+        if (pthread_create (& thread, 0, shimThread, object) != 0) {
+                object->m_refs = 1;
+                shimRelease (object);
+                return 0;
+        }
+
+        pthread_detach (thread);
+        if (id != 0)
+                * id = (unsigned long) thread;
+        return object;
+}
+
+/**
+ * Duplicating a handle to an object just counts another reference to it.
+ */
+
+inline  HANDLE          GetCurrentProcess (void) {
+        return (HANDLE) 1;
+}
+
+inline  BOOL            DuplicateHandle (HANDLE, HANDLE handle, HANDLE,
+                                         HANDLE * copy, DWORD, BOOL, DWORD) {
+        __sync_add_and_fetch (& ((ShimObject *) handle)->m_refs, 1);
+        * copy = handle;
+        return TRUE;
+}
+
+inline  BOOL            CloseHandle (HANDLE handle) {
+        if (shimIsObject (handle)) {
+                shimRelease ((ShimObject *) handle);
+                return TRUE;
+        }
+
+        return close (shimDescriptor (handle)) == 0;
+}
+
+/**
+ * Directory change notifications, as objects which are signalled while there
+ * are inotify events waiting to be read. Only changes to the directory itself
+ * are seen, not to those under it.
+ */
+
+#define FILE_NOTIFY_CHANGE_FILE_NAME    0x00000001
+#define FILE_NOTIFY_CHANGE_SIZE         0x00000008
+#define FILE_NOTIFY_CHANGE_LAST_WRITE   0x00000010
+
+inline  HANDLE          FindFirstChangeNotificationW (const wchar_t * path,
+                                                      BOOL, DWORD filter) {
+        char            name [MAX_PATH];
+        if (! shimPath (path, name))
+                return INVALID_HANDLE_VALUE;
+
+        uint32_t        events = 0;
+        if ((filter & FILE_NOTIFY_CHANGE_FILE_NAME) != 0)
+                events |= IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+        if ((filter & (FILE_NOTIFY_CHANGE_SIZE |
+                       FILE_NOTIFY_CHANGE_LAST_WRITE)) != 0)
+                events |= IN_MODIFY;
+
+        int             fd = inotify_init1 (IN_NONBLOCK);
+        if (fd < 0)
+                return INVALID_HANDLE_VALUE;
+
+        if (inotify_add_watch (fd, name, events) < 0) {
+                close (fd);
+                return INVALID_HANDLE_VALUE;
+        }
+
+        ShimObject    * object = shimNewObject (true, false);
+        object->m_poll = fd;
+        return object;
+}
+
+inline  BOOL            FindNextChangeNotification (HANDLE handle) {
+        char            events [4096];
+        while (read (((ShimObject *) handle)->m_poll, events,
+                     sizeof (events)) > 0)
+                ;
+
+        return TRUE;
+}
+
+inline  BOOL            FindCloseChangeNotification (HANDLE handle) {
+        shimRelease ((ShimObject *) handle);
+        return TRUE;
+}
+
+/**
+ * There is no registry; it simply has nothing in it.
+ */
+
+typedef long            LSTATUS;
+
+#define ERROR_FILE_NOT_FOUND    2
+#define ERROR_NOT_FOUND         1168
+#define KEY_READ                0x20019
+#define REG_SZ                  1
+#define REG_EXPAND_SZ           2
+#define REG_MULTI_SZ            7
+#define REG_NOTIFY_CHANGE_NAME  0x00000001
+#define REG_NOTIFY_CHANGE_LAST_SET 0x00000004
+
+inline  LSTATUS         RegOpenKeyExW (HKEY, const wchar_t *, DWORD, DWORD,
+                                       HKEY * result) {
+        * result = 0;
+        return ERROR_FILE_NOT_FOUND;
+}
+
+inline  LSTATUS         RegQueryValueExW (HKEY, const wchar_t *, DWORD *,
+                                          unsigned long *, LPBYTE,
+                                          unsigned long *) {
+        return ERROR_FILE_NOT_FOUND;
+}
+
+inline  LSTATUS         RegNotifyChangeKeyValue (HKEY, BOOL, DWORD, HANDLE,
+                                                 BOOL) {
+        return ERROR_FILE_NOT_FOUND;
+}
+
+inline  LSTATUS         RegCloseKey (HKEY) {
+        return ERROR_SUCCESS;
+}
+
+/**@}*/
+#endif  /* ! defined (WINDOWS_H) */
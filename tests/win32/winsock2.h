@@ -0,0 +1,140 @@
+#ifndef WINSOCK2_H
+#define WINSOCK2_H              1
+
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This is a stand-in for the parts of Winsock the tests need.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Winsock is close enough to the BSD socket API that the filter's portable
+ * sources only need it to exist, with the few names which differ mapped onto
+ * their POSIX equivalents.
+ *
+ * The two structures whose layout the filter relies on are replaced by their
+ * Winsock equivalents: the IPv4 address, which the filter picks apart through
+ * its union, and the descriptor set for select (), which Winsock holds as a
+ * counted array rather than a bitmap. The address has the same layout as the
+ * POSIX one, so can be passed straight to the socket functions; descriptor
+ * sets aren't, so a test supplies its own select () for the filter to call.
+ */
+
+#include <windows.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+/**
+ * The byte order conversions are functions in Winsock, which the filter
+ * replaces with macros of its own in places, so the C library's macros for
+ * them are set aside.
+ */
+
+#undef  htons
+#undef  ntohs
+#undef  htonl
+#undef  ntohl
+
+typedef struct {
+        union {
+                struct {
+                        unsigned char   s_b1, s_b2, s_b3, s_b4;
+                } S_un_b;
+                struct {
+                        unsigned short  s_w1, s_w2;
+                } S_un_w;
+                unsigned int    S_addr;
+        } S_un;
+} ShimInAddr;
+
+struct ShimSockaddrIn {
+        short           sin_family;
+        unsigned short  sin_port;
+        ShimInAddr      sin_addr;
+        char            sin_zero [8];
+};
+
+#define sockaddr_in     ShimSockaddrIn
+
+#undef  FD_SETSIZE
+#undef  FD_ZERO
+#undef  FD_SET
+#undef  FD_CLR
+#undef  FD_ISSET
+
+#define FD_SETSIZE      64
+
+typedef struct {
+        unsigned int    fd_count;
+        int             fd_array [FD_SETSIZE];
+} ShimFdSet;
+
+#define fd_set          ShimFdSet
+
+#define FD_ZERO(set)    ((set)->fd_count = 0)
+#define FD_SET(s, set)  ((set)->fd_count < FD_SETSIZE ? \
+                         (void) ((set)->fd_array [(set)->fd_count ++] = (s)) : \
+                         (void) 0)
+
+typedef int             SOCKET;
+
+#define INVALID_SOCKET  (-1)
+#define SOCKET_ERROR    (-1)
+
+#define WSAEWOULDBLOCK  10035
+#define WSAECONNRESET   10054
+
+typedef HANDLE          WSAEVENT;
+
+typedef struct _WSABUF {
+        unsigned long   len;
+        char          * buf;
+} WSABUF;
+
+typedef struct _OVERLAPPED {
+        size_t          Internal;
+        size_t          InternalHigh;
+        DWORD           Offset;
+        DWORD           OffsetHigh;
+        HANDLE          hEvent;
+} OVERLAPPED;
+
+typedef void     (WSAAPI * LPWSAOVERLAPPED_COMPLETION_ROUTINE)
+                        (DWORD error, DWORD transferred,
+                         OVERLAPPED * overlapped, DWORD flags);
+
+/**@}*/
+#endif  /* ! defined (WINSOCK2_H) */
@@ -0,0 +1,61 @@
+#ifndef WS2TCPIP_H
+#define WS2TCPIP_H              1
+
+/**@addtogroup Tests Tests for the portable parts of the filter.
+ * @{@file
+ *
+ * This is a stand-in for the parts of the Winsock TCP/IP extensions the tests
+ * need.
+ *
+ * @author Nigel Bree <nigel.bree@gmail.com>
+ *
+ * Copyright (C) 2013 Nigel Bree; All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The wide-character address lookup the filter's rules resolve their targets
+ * with; there's no such thing in POSIX, so a test supplies its own through
+ * GetProcAddress (), and the structure it returns mirrors the narrow one.
+ */
+
+#include <winsock2.h>
+#include <netinet/tcp.h>
+
+#define WSANO_DATA      11004
+
+typedef struct addrinfoW {
+        int             ai_flags;
+        int             ai_family;
+        int             ai_socktype;
+        int             ai_protocol;
+        size_t          ai_addrlen;
+        wchar_t       * ai_canonname;
+        sockaddr      * ai_addr;
+        addrinfoW     * ai_next;
+} ADDRINFOW;
+
+/**@}*/
+#endif  /* ! defined (WS2TCPIP_H) */